@@ -17,6 +17,7 @@
 #include "fields.h"
 #include "output.h"
 #include "wildmatch/wildmatch.h"
+#include "wildmatch/wildmatch.hpp"
 
 #include <math.h>
 #include <unordered_map>
@@ -1481,9 +1482,11 @@ static bool GetSpacedToken(const WCHAR*& in, StrW& out, bool& quoted)
     return !out.Empty();
 }
 
+static const int c_wildmatch_flags = WM_CASEFOLD|WM_SLASHFOLD|WM_WILDSTAR;
+
 struct ColorPattern
 {
-    StrW m_pattern;                         // Wildmatch pattern to compare.
+    wild::program m_program;                // Compiled wildmatch pattern to compare.
     bool m_not;                             // Use the inverse of whether it matches.
 };
 
@@ -1620,7 +1623,7 @@ static int ParseColorRule(const WCHAR* in, StrW& value, ColorRule& rule, int lev
         {
             ColorPattern pat;
             pat.m_not = not;
-            pat.m_pattern = std::move(token);
+            pat.m_program.compile(token.Text(), c_wildmatch_flags);
             rule.m_patterns.emplace_back(std::move(pat));
         }
 
@@ -1960,7 +1963,6 @@ const WCHAR* LookupColor(const WCHAR* name, DWORD attr, unsigned short mode)
     }
 
     // Look for a matching rule.  First match wins.
-    const int bits = WM_CASEFOLD|WM_SLASHFOLD|WM_WILDSTAR;
     StrW no_trailing_sep;
     StrW only_name;
     for (const auto& rule : s_color_rules)
@@ -1996,7 +1998,7 @@ const WCHAR* LookupColor(const WCHAR* name, DWORD attr, unsigned short mode)
                 only_name.Set(FindName(n));
             n = only_name.Text();
 
-            if (wildmatch(pat.m_pattern.Text(), n, bits) != (pat.m_not ? WM_NOMATCH : WM_MATCH))
+            if (pat.m_program.match(n) == pat.m_not)
                 goto next_rule;
         }
 
@@ -0,0 +1,26 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+
+// DirEntry is a compact, non-owning view of one directory entry.  The names
+// point into buffers owned by whatever produced the entry (an enumerator or a
+// DirListing), and are only valid as long as the entry itself.
+
+struct DirEntry
+{
+    const WCHAR*        name;               // NUL terminated.
+    const WCHAR*        short_name;         // NUL terminated; empty if none.
+    unsigned            name_len;
+    unsigned            short_name_len;
+    DWORD               attributes;
+    DWORD               reparse_tag;        // Only meaningful for reparse points.
+    ULONGLONG           size;
+    FILETIME            created;
+    FILETIME            accessed;
+    FILETIME            modified;
+};
@@ -0,0 +1,551 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "enumdir.h"
+#include "filesys.h"
+#include "patterns.h"
+
+#include <atomic>
+
+#include <winternl.h>
+
+static const unsigned c_batch_entries = 32;
+static const unsigned c_default_buffer_kb = 64;
+static const unsigned c_min_buffer_kb = 64;
+static const unsigned c_max_buffer_kb = 1024;
+
+static std::atomic<unsigned> s_count_opens(0);
+static std::atomic<unsigned> s_count_reads(0);
+
+static size_t GetBufferBytes(unsigned buffer_kb)
+{
+    if (!buffer_kb)
+        buffer_kb = c_default_buffer_kb;
+    return size_t(clamp(buffer_kb, c_min_buffer_kb, c_max_buffer_kb)) * 1024;
+}
+
+DirEnumCounters GetDirEnumCounters()
+{
+    DirEnumCounters counters;
+    counters.opens = s_count_opens.load();
+    counters.reads = s_count_reads.load();
+    return counters;
+}
+
+/*
+ * Win32DirEnumerator.
+ *
+ * Wraps FindFirstFileEx/FindNextFile, and returns entries in batches.
+ */
+
+class Win32DirEnumerator : public DirEnumerator
+{
+public:
+                        Win32DirEnumerator() = default;
+                        ~Win32DirEnumerator() = default;
+
+    bool                Open(const StrW& spec, bool short_names) override;
+    unsigned            Next(const DirEntry*& entries) override;
+    void                Close() override;
+
+private:
+    SHFind              m_shFind;
+    DWORD               m_dwErr = ERROR_NO_MORE_FILES;
+    bool                m_have_first = false;
+    WIN32_FIND_DATA     m_batch[c_batch_entries];
+    DirEntry            m_entries[c_batch_entries];
+};
+
+static void FindDataToEntry(const WIN32_FIND_DATA& fd, DirEntry& entry)
+{
+    entry.name = fd.cFileName;
+    entry.name_len = unsigned(wcslen(fd.cFileName));
+    entry.short_name = fd.cAlternateFileName;
+    entry.short_name_len = unsigned(wcslen(fd.cAlternateFileName));
+    entry.attributes = fd.dwFileAttributes;
+    entry.reparse_tag = (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ? fd.dwReserved0 : 0;
+    entry.size = (ULONGLONG(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
+    entry.created = fd.ftCreationTime;
+    entry.accessed = fd.ftLastAccessTime;
+    entry.modified = fd.ftLastWriteTime;
+}
+
+bool Win32DirEnumerator::Open(const StrW& spec, bool short_names)
+{
+    Close();
+
+    ++s_count_opens;
+    m_shFind = __FindFirstFile(spec, short_names, &m_batch[0]);
+    if (m_shFind.Empty())
+        return false;
+
+    m_have_first = true;
+    m_dwErr = 0;
+    return true;
+}
+
+unsigned Win32DirEnumerator::Next(const DirEntry*& entries)
+{
+    unsigned count = 0;
+
+    if (m_have_first)
+    {
+        m_have_first = false;
+        count++;
+    }
+
+    while (!m_dwErr && count < _countof(m_batch))
+    {
+        ++s_count_reads;
+        if (!FindNextFile(m_shFind, &m_batch[count]))
+        {
+            m_dwErr = GetLastError();
+            break;
+        }
+        count++;
+    }
+
+    for (unsigned ii = 0; ii < count; ++ii)
+        FindDataToEntry(m_batch[ii], m_entries[ii]);
+
+    entries = m_entries;
+    if (!count)
+        SetLastError(m_dwErr);
+    return count;
+}
+
+void Win32DirEnumerator::Close()
+{
+    m_shFind.Close();
+    m_have_first = false;
+    m_dwErr = ERROR_NO_MORE_FILES;
+}
+
+/*
+ * NtDirEnumerator.
+ *
+ * Calls NtQueryDirectoryFile directly, so that each call returns as many
+ * entries as fit in a large buffer (64 KB to 1 MB) instead of however many
+ * FindNextFile happens to buffer internally.  That matters most on network
+ * volumes, where each call is a round trip to the server.
+ */
+
+#ifndef STATUS_NO_MORE_FILES
+#define STATUS_NO_MORE_FILES            NTSTATUS(0x80000006L)
+#endif
+#ifndef STATUS_NO_SUCH_FILE
+#define STATUS_NO_SUCH_FILE             NTSTATUS(0xC000000FL)
+#endif
+
+#define FileFullDirectoryInformation    FILE_INFORMATION_CLASS(2)
+#define FileBothDirectoryInformation    FILE_INFORMATION_CLASS(3)
+
+struct NtFullDirInfo
+{
+    ULONG               NextEntryOffset;
+    ULONG               FileIndex;
+    LARGE_INTEGER       CreationTime;
+    LARGE_INTEGER       LastAccessTime;
+    LARGE_INTEGER       LastWriteTime;
+    LARGE_INTEGER       ChangeTime;
+    LARGE_INTEGER       EndOfFile;
+    LARGE_INTEGER       AllocationSize;
+    ULONG               FileAttributes;
+    ULONG               FileNameLength;
+    ULONG               EaSize;         // Reparse tag, for reparse points.
+    WCHAR               FileName[1];
+};
+
+struct NtBothDirInfo
+{
+    ULONG               NextEntryOffset;
+    ULONG               FileIndex;
+    LARGE_INTEGER       CreationTime;
+    LARGE_INTEGER       LastAccessTime;
+    LARGE_INTEGER       LastWriteTime;
+    LARGE_INTEGER       ChangeTime;
+    LARGE_INTEGER       EndOfFile;
+    LARGE_INTEGER       AllocationSize;
+    ULONG               FileAttributes;
+    ULONG               FileNameLength;
+    ULONG               EaSize;         // Reparse tag, for reparse points.
+    CCHAR               ShortNameLength;
+    WCHAR               ShortName[12];
+    WCHAR               FileName[1];
+};
+
+struct DelayLoadNtdll
+{
+    NTSTATUS (NTAPI* NtQueryDirectoryFile)(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID FileInformation, ULONG Length, FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry, PUNICODE_STRING FileName, BOOLEAN RestartScan) = nullptr;
+    ULONG (NTAPI* RtlNtStatusToDosError)(NTSTATUS Status) = nullptr;
+
+    DelayLoadNtdll()
+    {
+        HMODULE hLib = GetModuleHandle(L"ntdll.dll");
+        if (hLib)
+        {
+            NtQueryDirectoryFile = reinterpret_cast<decltype(NtQueryDirectoryFile)>(GetProcAddress(hLib, "NtQueryDirectoryFile"));
+            RtlNtStatusToDosError = reinterpret_cast<decltype(RtlNtStatusToDosError)>(GetProcAddress(hLib, "RtlNtStatusToDosError"));
+        }
+    }
+
+    bool                IsLoaded() const { return NtQueryDirectoryFile && RtlNtStatusToDosError; }
+};
+
+static const DelayLoadNtdll& GetNtdll()
+{
+    // Initializing a function-local static is thread safe.
+    static const DelayLoadNtdll s_ntdll;
+    return s_ntdll;
+}
+
+static void LargeIntegerToFileTime(const LARGE_INTEGER& li, FILETIME& ft)
+{
+    ft.dwLowDateTime = li.LowPart;
+    ft.dwHighDateTime = DWORD(li.HighPart);
+}
+
+template <class T>
+static void FillEntry(const T& info, NameArena& names, DirEntry& entry)
+{
+    const size_t len = info.FileNameLength / sizeof(WCHAR);
+    entry.name = names.Add(info.FileName, len);
+    entry.name_len = unsigned(len);
+    entry.attributes = info.FileAttributes;
+    entry.reparse_tag = (info.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ? info.EaSize : 0;
+    entry.size = ULONGLONG(info.EndOfFile.QuadPart);
+    LargeIntegerToFileTime(info.CreationTime, entry.created);
+    LargeIntegerToFileTime(info.LastAccessTime, entry.accessed);
+    LargeIntegerToFileTime(info.LastWriteTime, entry.modified);
+}
+
+class NtDirEnumerator : public DirEnumerator
+{
+public:
+                        NtDirEnumerator(size_t buffer_bytes);
+                        ~NtDirEnumerator() = default;
+
+    bool                Open(const StrW& spec, bool short_names) override;
+    unsigned            Next(const DirEntry*& entries) override;
+    void                Close() override;
+
+private:
+    unsigned            Query(bool restart);
+
+    SHFile              m_shDir;
+    FILE_INFORMATION_CLASS m_class = FileFullDirectoryInformation;
+    DWORD               m_dwErr = ERROR_NO_MORE_FILES;
+    unsigned            m_count = 0;
+    StrW                m_expr;
+    std::vector<ULONGLONG> m_buffer;    // ULONGLONG for alignment.
+    std::vector<DirEntry> m_batch;
+    NameArena           m_names;
+};
+
+NtDirEnumerator::NtDirEnumerator(size_t buffer_bytes)
+: m_buffer(buffer_bytes / sizeof(ULONGLONG))
+{
+}
+
+bool NtDirEnumerator::Open(const StrW& spec, bool short_names)
+{
+    Close();
+
+    const WCHAR* name = FindName(spec.Text());
+    StrW dir;
+    dir.Set(spec.Text(), name - spec.Text());
+    if (dir.Empty())
+        dir.Set(L".");
+    FindPattern::Translate(name, m_expr);
+
+    ++s_count_opens;
+    m_shDir = CreateFile(dir.Text(), FILE_LIST_DIRECTORY, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+                         nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if (m_shDir.Empty())
+    {
+        // Like FindFirstFile, a missing directory is "path not found";
+        // "file not found" only means nothing matched the pattern.
+        const DWORD dwErr = GetLastError();
+        SetLastError(dwErr == ERROR_FILE_NOT_FOUND ? ERROR_PATH_NOT_FOUND : dwErr);
+        return false;
+    }
+
+    m_class = short_names ? FileBothDirectoryInformation : FileFullDirectoryInformation;
+    m_dwErr = 0;
+    m_count = Query(true);
+    if (!m_count)
+    {
+        const DWORD dwErr = m_dwErr;
+        Close();
+        SetLastError(dwErr == ERROR_NO_MORE_FILES ? ERROR_FILE_NOT_FOUND : dwErr);
+        return false;
+    }
+
+    return true;
+}
+
+unsigned NtDirEnumerator::Next(const DirEntry*& entries)
+{
+    unsigned count = m_count;
+    m_count = 0;
+
+    if (!count && !m_dwErr)
+        count = Query(false);
+
+    entries = m_batch.data();
+    if (!count)
+        SetLastError(m_dwErr);
+    return count;
+}
+
+void NtDirEnumerator::Close()
+{
+    m_shDir.Close();
+    m_dwErr = ERROR_NO_MORE_FILES;
+    m_count = 0;
+}
+
+unsigned NtDirEnumerator::Query(bool restart)
+{
+    const DelayLoadNtdll& ntdll = GetNtdll();
+
+    UNICODE_STRING expr;
+    expr.Buffer = const_cast<WCHAR*>(m_expr.Text());
+    expr.Length = USHORT(m_expr.Length() * sizeof(WCHAR));
+    expr.MaximumLength = expr.Length;
+
+    IO_STATUS_BLOCK iosb;
+    ++s_count_reads;
+    const NTSTATUS status = ntdll.NtQueryDirectoryFile(m_shDir, nullptr, nullptr, nullptr, &iosb,
+                                                       m_buffer.data(), ULONG(m_buffer.size() * sizeof(m_buffer[0])),
+                                                       m_class, false, (restart && expr.Length) ? &expr : nullptr, restart);
+    if (status == STATUS_NO_MORE_FILES || status == STATUS_NO_SUCH_FILE)
+    {
+        m_dwErr = ERROR_NO_MORE_FILES;
+        return 0;
+    }
+    if (status < 0)
+    {
+        m_dwErr = ntdll.RtlNtStatusToDosError(status);
+        return 0;
+    }
+
+    // The names in the buffer aren't NUL terminated, so they're copied into
+    // the arena; everything else is parsed straight into the entries.
+    m_batch.clear();
+    m_names.Clear();
+    for (const BYTE* p = reinterpret_cast<const BYTE*>(m_buffer.data()); true;)
+    {
+        m_batch.emplace_back();
+        DirEntry& entry = m_batch.back();
+
+        ULONG next;
+        if (m_class == FileBothDirectoryInformation)
+        {
+            const NtBothDirInfo& info = *reinterpret_cast<const NtBothDirInfo*>(p);
+            const size_t short_len = min<size_t>(info.ShortNameLength / sizeof(WCHAR), _countof(info.ShortName));
+            FillEntry(info, m_names, entry);
+            entry.short_name = m_names.Add(info.ShortName, short_len);
+            entry.short_name_len = unsigned(short_len);
+            next = info.NextEntryOffset;
+        }
+        else
+        {
+            const NtFullDirInfo& info = *reinterpret_cast<const NtFullDirInfo*>(p);
+            FillEntry(info, m_names, entry);
+            entry.short_name = L"";
+            entry.short_name_len = 0;
+            next = info.NextEntryOffset;
+        }
+
+        if (!next)
+            break;
+        p += next;
+    }
+
+    return unsigned(m_batch.size());
+}
+
+std::unique_ptr<DirEnumerator> MakeDirEnumerator(unsigned buffer_kb)
+{
+    if (GetNtdll().IsLoaded())
+        return std::make_unique<NtDirEnumerator>(GetBufferBytes(buffer_kb));
+    return std::make_unique<Win32DirEnumerator>();
+}
+
+/*
+ * NameArena.
+ */
+
+static const size_t c_arena_chunk = 16384;
+
+const WCHAR* NameArena::Add(const WCHAR* name, size_t len)
+{
+    if (!len)
+        return L"";
+
+    WCHAR* p = Alloc(len);
+    memcpy(p, name, len * sizeof(*p));
+    p[len] = '\0';
+    return p;
+}
+
+WCHAR* NameArena::Alloc(size_t len)
+{
+    const size_t needed = len + 1;
+    while (m_current < m_chunks.size() && m_used + needed > m_chunks[m_current].capacity)
+    {
+        ++m_current;
+        m_used = 0;
+    }
+
+    if (m_current >= m_chunks.size())
+    {
+        Chunk chunk;
+        chunk.capacity = max(needed, c_arena_chunk);
+        chunk.text = std::make_unique<WCHAR[]>(chunk.capacity);
+        m_chunks.emplace_back(std::move(chunk));
+        m_current = m_chunks.size() - 1;
+        m_used = 0;
+    }
+
+    WCHAR* p = m_chunks[m_current].text.get() + m_used;
+    m_used += needed;
+    return p;
+}
+
+void NameArena::Clear()
+{
+    m_current = 0;
+    m_used = 0;
+}
+
+/*
+ * DirListing.
+ */
+
+void DirListing::Enumerate(DirEnumerator& enumerator, bool short_names)
+{
+    entries.clear();
+    names.Clear();
+    this->short_names = short_names;
+
+    if (!enumerator.Open(spec, short_names))
+    {
+        open_err = GetLastError();
+        return;
+    }
+
+    // The enumerator's names only live until its next batch, so the listing
+    // keeps its own copies.
+    const DirEntry* batch;
+    while (const unsigned count = enumerator.Next(batch))
+    {
+        for (const DirEntry* pe = batch; pe < batch + count; ++pe)
+        {
+            entries.emplace_back(*pe);
+            DirEntry& entry = entries.back();
+            entry.name = names.Add(pe->name, pe->name_len);
+            entry.short_name = names.Add(pe->short_name, pe->short_name_len);
+        }
+    }
+
+    open_err = 0;
+    end_err = GetLastError();
+    enumerator.Close();
+}
+
+// Finds an entry by name (case insensitive).  This is a linear search; it's
+// meant for checking a listing for one particular name.
+const DirEntry* DirListing::Lookup(const WCHAR* name) const
+{
+    for (const DirEntry& entry : entries)
+    {
+        if (_wcsicmp(entry.name, name) == 0)
+            return &entry;
+    }
+    return nullptr;
+}
+
+/*
+ * ListingEnumerator.
+ */
+
+ListingEnumerator::ListingEnumerator(DirEnumerator& fallback, const DirListing* listing)
+: m_fallback(fallback)
+, m_listing(listing)
+{
+}
+
+bool ListingEnumerator::Open(const StrW& spec, bool short_names)
+{
+    Close();
+
+    if (!m_listing)
+        return m_fallback.Open(spec, short_names);
+
+    if (m_listing->open_err)
+    {
+        SetLastError(m_listing->open_err);
+        return false;
+    }
+
+    // Like FindFirstFile, fail with ERROR_FILE_NOT_FOUND when nothing
+    // matches the filter.
+    while (m_index < m_listing->entries.size() && !IsMatch(m_index))
+        ++m_index;
+    if (m_index >= m_listing->entries.size() && m_listing->end_err == ERROR_NO_MORE_FILES)
+    {
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return false;
+    }
+
+    m_open = true;
+    return true;
+}
+
+unsigned ListingEnumerator::Next(const DirEntry*& entries)
+{
+    if (!m_listing)
+        return m_fallback.Next(entries);
+
+    if (!m_open)
+    {
+        SetLastError(ERROR_NO_MORE_FILES);
+        return 0;
+    }
+
+    // Return the next run of consecutive matching entries, directly from
+    // the listing.
+    while (m_index < m_listing->entries.size() && !IsMatch(m_index))
+        ++m_index;
+
+    const size_t begin = m_index;
+    while (m_index < m_listing->entries.size() && IsMatch(m_index))
+        ++m_index;
+
+    if (m_index == begin)
+    {
+        SetLastError(m_listing->end_err);
+        return 0;
+    }
+
+    entries = m_listing->entries.data() + begin;
+    return unsigned(m_index - begin);
+}
+
+void ListingEnumerator::Close()
+{
+    m_index = 0;
+    m_open = false;
+    if (!m_listing)
+        m_fallback.Close();
+}
+
+bool ListingEnumerator::IsMatch(size_t index) const
+{
+    return !m_filter || m_filter->IsMatch(m_listing->entries[index]);
+}
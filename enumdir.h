@@ -0,0 +1,113 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+#include "direntry.h"
+
+#include <memory>
+#include <vector>
+
+class FindPattern;
+
+// DirEnumerator abstracts the OS directory enumeration APIs.
+//
+// Open() takes a search spec in the same form as FindFirstFile (a directory
+// followed by a name pattern).  Next() returns a batch of entries; the
+// entries (including their names) remain valid until the next call to Next()
+// or Close().  Errors are
+// reported the same way as FindFirstFile and FindNextFile:  Open() returns
+// false and Next() returns 0, and GetLastError() has the reason (Next()
+// reports ERROR_NO_MORE_FILES at the end of the enumeration).
+
+class DirEnumerator
+{
+public:
+    virtual             ~DirEnumerator() = default;
+
+    virtual bool        Open(const StrW& spec, bool short_names) = 0;
+    virtual unsigned    Next(const DirEntry*& entries) = 0;
+    virtual void        Close() = 0;
+};
+
+// The buffer size (in KB) is clamped to 64 KB .. 1 MB; 0 means the default.
+// It only applies when NtQueryDirectoryFile is available.
+std::unique_ptr<DirEnumerator> MakeDirEnumerator(unsigned buffer_kb=0);
+
+// NameArena holds copies of names for DirEntry to point at.  Names are
+// allocated from large chunks, so pointers stay valid until Clear(), and
+// Clear() keeps the chunks for reuse.
+class NameArena
+{
+public:
+                        NameArena() = default;
+                        ~NameArena() = default;
+
+    const WCHAR*        Add(const WCHAR* name, size_t len);
+    WCHAR*              Alloc(size_t len);  // Room for len characters plus a NUL.
+    void                Clear();
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<WCHAR[]> text;
+        size_t          capacity;
+    };
+
+    std::vector<Chunk>  m_chunks;
+    size_t              m_current = 0;
+    size_t              m_used = 0;
+};
+
+// The complete result of enumerating one search spec.
+struct DirListing
+{
+    StrW                spec;
+    DWORD               open_err = 0;
+    DWORD               end_err = ERROR_NO_MORE_FILES;
+    bool                short_names = false;
+    std::vector<DirEntry> entries;
+    NameArena           names;
+
+    void                Enumerate(DirEnumerator& enumerator, bool short_names);
+    const DirEntry*     Lookup(const WCHAR* name) const;
+};
+
+// ListingEnumerator replays a DirListing, returning only the entries that
+// match the filter, as though the filter had been the search pattern.  The
+// search spec passed to Open() is ignored in that case.  Without a listing,
+// it passes everything through to the fallback enumerator.
+class ListingEnumerator : public DirEnumerator
+{
+public:
+                        ListingEnumerator(DirEnumerator& fallback, const DirListing* listing);
+                        ~ListingEnumerator() = default;
+
+    void                SetFilter(const FindPattern* filter) { m_filter = filter; }
+
+    bool                Open(const StrW& spec, bool short_names) override;
+    unsigned            Next(const DirEntry*& entries) override;
+    void                Close() override;
+
+private:
+    bool                IsMatch(size_t index) const;
+
+    DirEnumerator&      m_fallback;
+    const DirListing* const m_listing;
+    const FindPattern*  m_filter = nullptr;
+    size_t              m_index = 0;
+    bool                m_open = false;
+};
+
+// Counts the calls into the OS enumeration APIs, across all threads.
+struct DirEnumCounters
+{
+    unsigned            opens = 0;
+    unsigned            reads = 0;
+};
+
+DirEnumCounters GetDirEnumCounters();
@@ -1629,56 +1629,34 @@ static void FormatGitFile(StrW& s, const FileInfo* pfi, const WCHAR* dir, const
     GitFileState staged;
     GitFileState working;
 
-    StrW full;
-    PathJoin(full, dir, pfi->GetLongName());
-
-    // An exact lookup is needed for files, but also for directories since
-    // ignored and untracked folders are reported at the folder level.
-    const auto& status = repo->status.find(full.Text());
-    if (status == repo->status.end())
+    // Directories show the summary of their own status plus everything
+    // under them.
+    const ChildStatus* child = repo->FindChild(dir, pfi->GetLongName().Text());
+    if (!child)
     {
         staged = GitFileState::NONE;
         working = GitFileState::NONE;
     }
+    else if (pfi->GetAttributes() & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        staged = child->summary.staged;
+        working = child->summary.working;
+    }
     else
     {
-        staged = status->second.staged;
-        working = status->second.working;
+        staged = child->own.staged;
+        working = child->own.working;
     }
 
-    if (pfi->GetAttributes() & FILE_ATTRIBUTE_DIRECTORY)
+    // Ignored files and directories aren't in the status, so anything with
+    // no status is classified against the ignore patterns.  A file that
+    // matches a pattern but is tracked (or a directory that contains tracked
+    // files) isn't ignored.
+    if (staged == GitFileState::NONE && working == GitFileState::NONE &&
+        repo->IsIgnored(dir, pfi->GetLongName().Text(), !!(pfi->GetAttributes() & FILE_ATTRIBUTE_DIRECTORY)) &&
+        !repo->IsTracked(dir, pfi->GetLongName().Text()))
     {
-        // For directories, also summarize status of files within using
-        // priority order (as defined by the order of GitFileState).
-
-        // Determine the range to summarize:
-        // From first name > full (e.g. > "dirname\"),
-        // To first name >= next (e.g. >= "dirname]").
-        EnsureTrailingSlash(full);
-        StrW next(full);
-        const WCHAR* const last = next.Text() + next.Length() - 1;
-        next.SetAt(last, (*last) + 1);
-
-        // The lower bound of the loop must start with the first entry greater
-        // than full, so use upper_bound().
-        auto lower_bound = repo->status.upper_bound(full.Text());
-        if (lower_bound != repo->status.end())
-        {
-            // The upper bound of the loop must end with the first entry
-            // greater than or equal to next, so use lower_bound().
-            auto upper_bound = repo->status.lower_bound(next.Text());
-
-            // Loop over files in the range and keep the highest priority
-            // symbol (corresponding to the lowest value from GitFileState,
-            // not counting NONE).
-            for (auto iter = lower_bound; iter != upper_bound; ++iter)
-            {
-                if (staged > iter->second.staged || staged == GitFileState::NONE)
-                    staged = iter->second.staged;
-                if (working > iter->second.working || working == GitFileState::NONE)
-                    working = iter->second.working;
-            }
-        }
+        working = GitFileState::IGNORED;
     }
 
     const WCHAR* color1;
@@ -2381,7 +2359,7 @@ void PictureFormatter::SetDirContext(const std::shared_ptr<const DirContext>& di
     // for tree mode because all directories need to share a single picture
     // formatter so that field widths are computed across all files and
     // directories, instead of per-directory.
-    assert(implies(m_dir && !(m_settings.IsSet(FMT_TREE)), m_dir == dir));
+    assert(implies(m_dir && !(m_settings.IsSet(FMT_TREE|FMT_FLAT)), m_dir == dir));
     m_dir = dir;
 }
 
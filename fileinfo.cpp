@@ -5,25 +5,25 @@
 
 #include "pch.h"
 #include "fileinfo.h"
+#include "direntry.h"
 
 #include <lmcons.h>
 
-void FileInfo::Init(const WCHAR* dir, DWORD granularity, const WIN32_FIND_DATA* pfd, const DirFormatSettings& settings)
+void FileInfo::Init(const WCHAR* dir, DWORD granularity, const DirEntry* pe, const DirFormatSettings& settings)
 {
     assert(dir);
 
     StrW full;
 
-    m_long.Set(pfd->cFileName);
-    m_short.Set(pfd->cAlternateFileName);
+    m_long.Set(pe->name, pe->name_len);
+    m_short.Set(pe->short_name, pe->short_name_len);
 
-    m_dwAttr = pfd->dwFileAttributes;
-    m_ftAccess = pfd->ftLastAccessTime;
-    m_ftCreated = pfd->ftCreationTime;
-    m_ftModified = pfd->ftLastWriteTime;
+    m_dwAttr = pe->attributes;
+    m_ftAccess = pe->accessed;
+    m_ftCreated = pe->created;
+    m_ftModified = pe->modified;
 
-    m_ulFile.LowPart = pfd->nFileSizeLow;
-    m_ulFile.HighPart = pfd->nFileSizeHigh;
+    m_ulFile.QuadPart = pe->size;
 
     const bool get_compressed_size = ((GetAttributes() & FILE_ATTRIBUTE_COMPRESSED) &&
                                       settings.m_need_compressed_size);
@@ -40,15 +40,9 @@ void FileInfo::Init(const WCHAR* dir, DWORD granularity, const WIN32_FIND_DATA*
 #endif
 
     if (granularity)
-    {
-        const ULONGLONG ull = m_ulCompressed.QuadPart ? m_ulCompressed.QuadPart : m_ulFile.QuadPart;
-        m_ulAllocation.QuadPart = ull;
-        m_ulAllocation.QuadPart += (granularity - (ull % granularity)) % granularity;
-    }
+        m_ulAllocation.QuadPart = RoundUpToGranularity(m_ulCompressed.QuadPart ? m_ulCompressed.QuadPart : m_ulFile.QuadPart, granularity);
     else
-    {
         m_ulAllocation = m_ulFile;
-    }
 
     if (settings.IsSet(FMT_SHOWOWNER))
     {
@@ -81,10 +75,11 @@ void FileInfo::Init(const WCHAR* dir, DWORD granularity, const WIN32_FIND_DATA*
     }
 
     if (GetAttributes() & FILE_ATTRIBUTE_REPARSE_POINT)
-        m_dwReserved0 = pfd->dwReserved0;
+        m_dwReserved0 = pe->reparse_tag;
     else
         m_dwReserved0 = 0;
 
+    m_broken = false;
     if (IsReparseTag())
     {
         if (dir) // Invalid...but don't crash if bug gets accidentally released.
@@ -119,6 +114,107 @@ void FileInfo::InitStreams(std::vector<std::unique_ptr<FileInfo>>& streams)
     assert(!m_streams[streams.size()]);
 }
 
+struct FileInfoRecord
+{
+    DWORD               attr;
+    DWORD               reserved0;
+    FILETIME            access;
+    FILETIME            created;
+    FILETIME            modified;
+    ULONGLONG           allocation;
+    ULONGLONG           compressed;
+    ULONGLONG           file;
+    DWORD               flags;
+    DWORD               long_len;
+    DWORD               short_len;
+    DWORD               owner_len;
+};
+
+enum : DWORD
+{
+    FIR_ALTDATASTREAMS  = 0x01,
+    FIR_BROKEN          = 0x02,
+    FIR_GOTCOMPRESSED   = 0x04,
+};
+
+static void AppendBytes(std::vector<BYTE>& out, const void* p, size_t len)
+{
+    const BYTE* const bytes = static_cast<const BYTE*>(p);
+    out.insert(out.end(), bytes, bytes + len);
+}
+
+void FileInfo::Save(std::vector<BYTE>& out) const
+{
+    assert(!m_streams);
+    assert(!m_is_alt_data_stream);
+
+    FileInfoRecord rec;
+    rec.attr = m_dwAttr;
+    rec.reserved0 = m_dwReserved0;
+    rec.access = m_ftAccess;
+    rec.created = m_ftCreated;
+    rec.modified = m_ftModified;
+    rec.allocation = m_ulAllocation.QuadPart;
+    rec.compressed = m_ulCompressed.QuadPart;
+    rec.file = m_ulFile.QuadPart;
+    rec.flags = 0;
+    if (m_has_alt_data_streams)
+        rec.flags |= FIR_ALTDATASTREAMS;
+    if (m_broken)
+        rec.flags |= FIR_BROKEN;
+#ifdef DEBUG
+    if (m_fGotCompressedSize)
+        rec.flags |= FIR_GOTCOMPRESSED;
+#endif
+    rec.long_len = m_long.Length();
+    rec.short_len = m_short.Length();
+    rec.owner_len = m_owner.Length();
+
+    AppendBytes(out, &rec, sizeof(rec));
+    AppendBytes(out, m_long.Text(), rec.long_len * sizeof(WCHAR));
+    AppendBytes(out, m_short.Text(), rec.short_len * sizeof(WCHAR));
+    AppendBytes(out, m_owner.Text(), rec.owner_len * sizeof(WCHAR));
+}
+
+bool FileInfo::Load(const BYTE*& p, const BYTE* end)
+{
+    FileInfoRecord rec;
+    if (size_t(end - p) < sizeof(rec))
+        return false;
+    memcpy(&rec, p, sizeof(rec));
+
+    const size_t cb = (size_t(rec.long_len) + rec.short_len + rec.owner_len) * sizeof(WCHAR);
+    if (size_t(end - p) - sizeof(rec) < cb)
+        return false;
+    p += sizeof(rec);
+
+    m_dwAttr = rec.attr;
+    m_dwReserved0 = rec.reserved0;
+    m_ftAccess = rec.access;
+    m_ftCreated = rec.created;
+    m_ftModified = rec.modified;
+    m_ulAllocation.QuadPart = rec.allocation;
+    m_ulCompressed.QuadPart = rec.compressed;
+    m_ulFile.QuadPart = rec.file;
+    m_has_alt_data_streams = !!(rec.flags & FIR_ALTDATASTREAMS);
+    m_broken = !!(rec.flags & FIR_BROKEN);
+#ifdef DEBUG
+    m_fGotCompressedSize = !!(rec.flags & FIR_GOTCOMPRESSED);
+#endif
+
+    // Everything in a record is a multiple of sizeof(WCHAR), so the names
+    // are suitably aligned.
+    const WCHAR* names = reinterpret_cast<const WCHAR*>(p);
+    m_long.Set(names, rec.long_len);
+    names += rec.long_len;
+    m_short.Set(names, rec.short_len);
+    names += rec.short_len;
+    m_owner.Set(names, rec.owner_len);
+    p += cb;
+
+    return true;
+}
+
 const FILETIME& FileInfo::GetFileTime(const WhichTimeStamp timestamp) const
 {
     switch (timestamp)
@@ -13,6 +13,16 @@
 #include <vector>
 
 struct DirFormatSettings;
+struct DirEntry;
+
+// Rounds a size up to a multiple of the allocation granularity (the cluster
+// size).  A granularity of 0 means unknown, and returns the size unchanged.
+inline ULONGLONG RoundUpToGranularity(ULONGLONG size, DWORD granularity)
+{
+    if (!granularity)
+        return size;
+    return size + (granularity - (size % granularity)) % granularity;
+}
 
 class FileInfo
 {
@@ -20,10 +30,15 @@ public:
                         FileInfo() {}
                         ~FileInfo() { delete [] m_streams; }
 
-    void                Init(const WCHAR* dir, DWORD granularity, const WIN32_FIND_DATA* pfd, const DirFormatSettings& settings);
+    void                Init(const WCHAR* dir, DWORD granularity, const DirEntry* pe, const DirFormatSettings& settings);
     void                InitStream(const WIN32_FIND_STREAM_DATA& fsd);
     void                InitStreams(std::vector<std::unique_ptr<FileInfo>>& streams);
 
+    // Save() and Load() serialize a FileInfo so it can be spilled to a
+    // temporary file.  Alternate data streams are not included.
+    void                Save(std::vector<BYTE>& out) const;
+    bool                Load(const BYTE*& p, const BYTE* end);
+
     DWORD               GetAttributes() const { return m_dwAttr; }
     const FILETIME&     GetAccessTime() const { return m_ftAccess; }
     const FILETIME&     GetCreatedTime() const { return m_ftCreated; }
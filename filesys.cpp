@@ -5,9 +5,14 @@
 
 #include "pch.h"
 #include "filesys.h"
+#include "direntry.h"
+#include "volume.h"
 #include "output.h"
 
+#include <atomic>
+
 static int s_hide_dot_files = 0;
+static std::atomic<unsigned> s_count_file_types(0);
 
 // -1 = Disable hiding dot files; show dot files, and ignore HideDotFiles(0) and HideDotFiles(1).
 //  0 = Show dot files.
@@ -150,31 +155,25 @@ bool GetDrive(const WCHAR* pattern, StrW& drive, Error& e)
 
 bool IsFATDrive(const WCHAR* path, Error& e)
 {
-    StrW drive;
-    DWORD cbComponentMax;
-    WCHAR name[MAX_PATH + 1];
-
-    if (!GetDrive(path, drive, e))
+    const VolumeInfo* volume = GetVolumeInfo(path, e);
+    if (!volume)
         return false;
 
-    EnsureTrailingSlash(drive);
-
-    if (!GetVolumeInformation(drive.Text(), 0, 0, 0, &cbComponentMax, 0, name, _countof(name)))
+    if (volume->info_err)
     {
         // Ignore ERROR_DIR_NOT_ROOT; consider SUBST drives as not FAT.
-        const DWORD dwErr = GetLastError();
-        if (dwErr != ERROR_DIR_NOT_ROOT)
-            e.Sys(dwErr);
+        if (volume->info_err != ERROR_DIR_NOT_ROOT)
+            e.Sys(volume->info_err);
         return false;
     }
 
-    return (!wcsicmp(name, L"FAT") && cbComponentMax == 12); // 12 == 8.3
+    return volume->fat;
 }
 
-bool IsHidden(const WIN32_FIND_DATA& fd)
+bool IsHidden(const DirEntry& entry)
 {
-    return ((fd.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) ||
-            IsHiddenName(fd.cFileName));
+    return ((entry.attributes & FILE_ATTRIBUTE_HIDDEN) ||
+            IsHiddenName(entry.name));
 }
 
 bool IsHiddenName(const WCHAR* p)
@@ -183,8 +182,15 @@ bool IsHiddenName(const WCHAR* p)
             (p[0] == '.' || p[0] == '_'));
 }
 
+unsigned GetFileTypeCount()
+{
+    return s_count_file_types.load();
+}
+
 FileType GetFileType(const WCHAR* p)
 {
+    ++s_count_file_types;
+
     WIN32_FIND_DATA fd;
     SHFind h = FindFirstFile(p, &fd);
     if (h.Empty())
@@ -198,10 +204,10 @@ FileType GetFileType(const WCHAR* p)
     return FileType::File;
 }
 
-bool IsTraversableReparse(const WIN32_FIND_DATA& fd)
+bool IsTraversableReparse(const DirEntry& entry)
 {
-    return ((fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
-            (IsReparseTagNameSurrogate(fd.dwReserved0) || fd.dwReserved0 == IO_REPARSE_TAG_DFS));
+    return ((entry.attributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+            (IsReparseTagNameSurrogate(entry.reparse_tag) || entry.reparse_tag == IO_REPARSE_TAG_DFS));
 }
 
 struct DelayLoadKernel32
@@ -243,9 +249,17 @@ private:
 
 DelayLoadKernel32 s_kernel32;
 
+static bool EnsureKernel32()
+{
+    // Directories may be enumerated on multiple threads, and initializing a
+    // function-local static is thread safe.
+    static const bool s_loaded = s_kernel32.EnsureLoaded();
+    return s_loaded;
+}
+
 bool EnsureFileStreamFunctions()
 {
-    return (s_kernel32.EnsureLoaded() &&
+    return (EnsureKernel32() &&
             s_kernel32.FindFirstStreamW &&
             s_kernel32.FindNextStreamW);
 }
@@ -266,7 +280,7 @@ bool __FindNextStreamW(HANDLE hFindStream, LPVOID lpFindStreamData)
 
 HANDLE __FindFirstFile(const StrW& s, bool short_names, WIN32_FIND_DATA* pfd)
 {
-    if (s_kernel32.FindFirstFileExW)
+    if (EnsureKernel32() && s_kernel32.FindFirstFileExW)
     {
         const FINDEX_INFO_LEVELS FindExInfoBasic = FINDEX_INFO_LEVELS(FindExInfoStandard + 1);
         #define FIND_FIRST_EX_CASE_SENSITIVE    0x00000001
@@ -7,6 +7,8 @@
 
 #include "str.h"
 
+struct DirEntry;
+
 void HideDotFiles(int hide_dot_files);
 void DebugPrintHideDotFilesMode();
 
@@ -15,12 +17,13 @@ unsigned IsExtendedPath(const WCHAR* p);
 void GetCwd(StrW& dir, WCHAR chDrive='\0');
 bool GetDrive(const WCHAR* pattern, StrW& drive, Error& e);
 bool IsFATDrive(const WCHAR* path, Error& e);
-bool IsHidden(const WIN32_FIND_DATA& fd);
+bool IsHidden(const DirEntry& entry);
 bool IsHiddenName(const WCHAR* p);
-bool IsTraversableReparse(const WIN32_FIND_DATA& fd);
+bool IsTraversableReparse(const DirEntry& entry);
 
 enum class FileType { Invalid, Device, Dir, File };
 FileType GetFileType(const WCHAR* p);
+unsigned GetFileTypeCount();    // Calls to GetFileType, across all threads.
 
 bool EnsureFileStreamFunctions();
 HANDLE __FindFirstStreamW(LPCWSTR lpFileName, STREAM_INFO_LEVELS InfoLevel, LPVOID lpFindStreamData, DWORD dwFlags);
@@ -54,7 +54,7 @@ enum FormatFlags : ULONGLONG
     FMT_NOSUMMARY               = 0x0000010000000000,
     FMT_MINIHEADER              = 0x0000020000000000,   // Show single line header per directory.
     FMT_MAYBEMINIHEADER         = 0x0000040000000000,   // Don't show single line header per directory if only 0 or 1 directory.
-    //                          = 0x0000080000000000,
+    FMT_FLAT                    = 0x0000080000000000,   // List all files from a recursive scan as one list, sorted across directories.
     FMT_LONGNODATE              = 0x0000100000000000,   // Omit date in long mode.
     FMT_LONGNOSIZE              = 0x0000200000000000,   // Omit size in long mode.
     FMT_LONGNOATTRIBUTES        = 0x0000400000000000,   // Omit attributes in long mode.
@@ -125,6 +125,11 @@ struct DirFormatSettings
     DWORD               m_dwAttrExcludeAny = 0;
     bool                m_need_compressed_size = false;
     bool                m_need_short_filenames = false;
+    unsigned            m_threads = 0;              // 0 means enumerate inline.
+    unsigned            m_enum_buffer_kb = 0;       // 0 means the default.
+    unsigned            m_max_memory_mb = 0;        // 0 means the default.
+    unsigned            m_top = 0;                  // 0 means no limit.
+    StrW                m_index_path;               // Empty means no index.
 
     ULONGLONG           m_min_time[TIMESTAMP_ARRAY_SIZE];
     ULONGLONG           m_max_time[TIMESTAMP_ARRAY_SIZE];
@@ -0,0 +1,413 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "flatsort.h"
+#include "sorting.h"
+#include "output.h"
+
+#include <algorithm>
+
+static const size_t c_io_bytes = 256 * 1024;
+
+static size_t EstimateMemory(const FileInfo& fi)
+{
+    // Only needs to be roughly proportional to the real usage:  the object,
+    // plus the heap blocks for its names.
+    const size_t c_heap_overhead = 16;
+    const size_t c_short_name = 14;
+    return (sizeof(FileInfo) +
+            (fi.GetLongName().Length() + 1 + fi.GetOwner().Length() + 1 + c_short_name) * sizeof(WCHAR) +
+            3 * c_heap_overhead);
+}
+
+/*
+ * FlatSorter::Run.
+ *
+ * A sorted run of records in a temporary file.  Each record is a DWORD
+ * length, followed by the directory index, sequence number, and FileInfo.
+ */
+
+class FlatSorter::Run
+{
+public:
+                        Run() = default;
+                        ~Run() = default;
+
+    bool                Create(Error& e);
+    bool                Write(const Record& rec, Error& e);
+    bool                Rewind(Error& e);
+    bool                Read(Record& rec, Error& e);
+
+private:
+    bool                Flush(Error& e);
+    bool                Fill(size_t needed, Error& e);
+
+    SHFile              m_file;
+    std::vector<BYTE>   m_buffer;
+    size_t              m_begin = 0;
+    size_t              m_end = 0;
+    bool                m_eof = false;
+};
+
+bool FlatSorter::Run::Create(Error& e)
+{
+    WCHAR dir[MAX_PATH + 1];
+    WCHAR name[MAX_PATH + 1];
+    if (!GetTempPath(_countof(dir), dir) ||
+        !GetTempFileName(dir, L"drx", 0, name))
+    {
+        e.Sys();
+        return false;
+    }
+
+    // The file is deleted automatically when the handle is closed.
+    m_file = CreateFile(name, GENERIC_READ|GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE, 0);
+    if (m_file.Empty())
+    {
+        e.Sys();
+        DeleteFile(name);
+        return false;
+    }
+
+    m_buffer.reserve(c_io_bytes);
+    return true;
+}
+
+bool FlatSorter::Run::Write(const Record& rec, Error& e)
+{
+    const size_t begin = m_buffer.size();
+    const DWORD dir = rec.dir;
+    DWORD len = 0;
+
+    m_buffer.resize(begin + sizeof(len) + sizeof(dir) + sizeof(rec.seq));
+    BYTE* p = m_buffer.data() + begin + sizeof(len);
+    memcpy(p, &dir, sizeof(dir));
+    memcpy(p + sizeof(dir), &rec.seq, sizeof(rec.seq));
+    rec.pfi->Save(m_buffer);
+
+    len = DWORD(m_buffer.size() - begin - sizeof(len));
+    memcpy(m_buffer.data() + begin, &len, sizeof(len));
+
+    if (m_buffer.size() >= c_io_bytes)
+        return Flush(e);
+    return true;
+}
+
+bool FlatSorter::Run::Flush(Error& e)
+{
+    const BYTE* p = m_buffer.data();
+    size_t remaining = m_buffer.size();
+    while (remaining)
+    {
+        DWORD written;
+        if (!WriteFile(m_file, p, DWORD(min(remaining, c_io_bytes)), &written, nullptr))
+        {
+            e.Sys();
+            return false;
+        }
+        p += written;
+        remaining -= written;
+    }
+    m_buffer.clear();
+    return true;
+}
+
+bool FlatSorter::Run::Rewind(Error& e)
+{
+    if (!Flush(e))
+        return false;
+
+    LARGE_INTEGER zero;
+    zero.QuadPart = 0;
+    if (!SetFilePointerEx(m_file, zero, nullptr, FILE_BEGIN))
+    {
+        e.Sys();
+        return false;
+    }
+
+    m_buffer.resize(c_io_bytes);
+    m_begin = 0;
+    m_end = 0;
+    m_eof = false;
+    return true;
+}
+
+bool FlatSorter::Run::Fill(size_t needed, Error& e)
+{
+    if (m_end - m_begin >= needed)
+        return true;
+
+    // Records are multiples of sizeof(WCHAR) and always start at an even
+    // offset, so moving them to the front keeps the names aligned.
+    memmove(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+    m_end -= m_begin;
+    m_begin = 0;
+    if (m_buffer.size() < needed)
+        m_buffer.resize(needed);
+
+    while (m_end < needed && !m_eof)
+    {
+        DWORD got;
+        if (!ReadFile(m_file, m_buffer.data() + m_end, DWORD(m_buffer.size() - m_end), &got, nullptr))
+        {
+            e.Sys();
+            return false;
+        }
+        if (!got)
+            m_eof = true;
+        m_end += got;
+    }
+
+    return m_end >= needed;
+}
+
+bool FlatSorter::Run::Read(Record& rec, Error& e)
+{
+    DWORD len;
+    if (!Fill(sizeof(len), e))
+    {
+        if (!e.Test() && m_end != m_begin)
+            e.Set(L"Temporary file is corrupt.");
+        return false;
+    }
+    memcpy(&len, m_buffer.data() + m_begin, sizeof(len));
+
+    if (!Fill(sizeof(len) + len, e))
+    {
+        if (!e.Test())
+            e.Set(L"Temporary file is corrupt.");
+        return false;
+    }
+
+    const BYTE* p = m_buffer.data() + m_begin + sizeof(len);
+    const BYTE* const end = p + len;
+    DWORD dir;
+    if (len < sizeof(dir) + sizeof(rec.seq))
+    {
+        e.Set(L"Temporary file is corrupt.");
+        return false;
+    }
+    memcpy(&dir, p, sizeof(dir));
+    memcpy(&rec.seq, p + sizeof(dir), sizeof(rec.seq));
+    p += sizeof(dir) + sizeof(rec.seq);
+    rec.dir = dir;
+
+    rec.pfi = std::make_unique<FileInfo>();
+    if (!rec.pfi->Load(p, end))
+    {
+        e.Set(L"Temporary file is corrupt.");
+        return false;
+    }
+
+    m_begin += sizeof(len) + len;
+    return true;
+}
+
+/*
+ * FlatSorter.
+ */
+
+FlatSorter::FlatSorter(size_t max_memory, size_t limit)
+: m_max_memory(max_memory)
+, m_limit(limit)
+{
+}
+
+FlatSorter::~FlatSorter()
+{
+}
+
+bool FlatSorter::IsLess(const Record& a, const Record& b)
+{
+    // A reversed sort reverses the whole list, including the order of files
+    // that compare equal.  Otherwise files that compare equal stay in the
+    // order they were found.
+    const bool reverse = IsReversedSort();
+    const Record& x = reverse ? b : a;
+    const Record& y = reverse ? a : b;
+    if (CmpFileInfo(x.pfi, y.pfi))
+        return true;
+    if (CmpFileInfo(y.pfi, x.pfi))
+        return false;
+    return x.seq < y.seq;
+}
+
+void FlatSorter::Add(const StrW& dir, std::vector<std::unique_ptr<FileInfo>>& files)
+{
+    if (files.empty())
+        return;
+
+    if (m_spill_error.Length())
+    {
+        files.clear();
+        return;
+    }
+
+    const unsigned index = unsigned(m_dirs.size());
+    m_dirs.emplace_back();
+    m_dirs.back().Set(dir);
+
+    if (m_limit)
+    {
+        for (auto& pfi : files)
+        {
+            Record rec;
+            rec.pfi = std::move(pfi);
+            rec.dir = index;
+            rec.seq = m_seq++;
+            AddLimited(std::move(rec));
+        }
+        files.clear();
+        return;
+    }
+
+    for (auto& pfi : files)
+    {
+        m_memory += sizeof(Record) + EstimateMemory(*pfi);
+        m_records.emplace_back();
+        Record& rec = m_records.back();
+        rec.pfi = std::move(pfi);
+        rec.dir = index;
+        rec.seq = m_seq++;
+    }
+    m_count += files.size();
+    files.clear();
+
+    if (m_memory > m_max_memory)
+    {
+        Error e;
+        if (!Spill(e))
+        {
+            // The list can't be completed within the budget, so free what
+            // was collected, and let Enumerate() report the error.
+            e.Format(m_spill_error);
+            m_records.clear();
+            m_runs.clear();
+            m_memory = 0;
+        }
+    }
+}
+
+void FlatSorter::AddLimited(Record&& rec)
+{
+    // m_records is a heap with the last record kept at the front.
+    if (m_records.size() >= m_limit)
+    {
+        if (!IsLess(rec, m_records.front()))
+            return;
+        std::pop_heap(m_records.begin(), m_records.end(), IsLess);
+        m_records.pop_back();
+    }
+    else
+    {
+        ++m_count;
+    }
+
+    m_records.emplace_back(std::move(rec));
+    std::push_heap(m_records.begin(), m_records.end(), IsLess);
+}
+
+bool FlatSorter::Spill(Error& e)
+{
+    std::sort(m_records.begin(), m_records.end(), IsLess);
+
+    std::unique_ptr<Run> run = std::make_unique<Run>();
+    if (!run->Create(e))
+        return false;
+    for (const auto& rec : m_records)
+    {
+        if (!run->Write(rec, e))
+            return false;
+    }
+    if (!run->Rewind(e))
+        return false;
+
+    if (g_debug)
+        Printf(L"debug: flat sort: spilled run %zu, %zu file(s)\n", m_runs.size() + 1, m_records.size());
+
+    m_runs.emplace_back(std::move(run));
+    m_records.clear();
+    m_memory = 0;
+    return true;
+}
+
+bool FlatSorter::Enumerate(const std::function<void(const WCHAR* dir, const FileInfo* pfi)>& func, Error& e)
+{
+    if (m_spill_error.Length())
+    {
+        e.Set(L"Unable to write a temporary file to sort the files.\n%1") << m_spill_error.Text();
+        return false;
+    }
+
+    std::sort(m_records.begin(), m_records.end(), IsLess);
+
+    if (m_runs.empty())
+    {
+        for (const auto& rec : m_records)
+            func(m_dirs[rec.dir].Text(), rec.pfi.get());
+        return true;
+    }
+
+    // K-way merge of the spilled runs plus the records still in memory.
+
+    struct Head
+    {
+        Record          rec;
+        size_t          source;
+    };
+
+    const size_t mem_source = m_runs.size();
+    size_t mem_index = 0;
+    auto next = [&](size_t source, Record& rec)
+    {
+        if (source < mem_source)
+            return m_runs[source]->Read(rec, e);
+        if (mem_index >= m_records.size())
+            return false;
+        rec = std::move(m_records[mem_index++]);
+        return true;
+    };
+    auto cmp = [](const Head& a, const Head& b)
+    {
+        return IsLess(b.rec, a.rec);
+    };
+
+    std::vector<Head> heap;
+    heap.reserve(mem_source + 1);
+    for (size_t ii = 0; ii <= mem_source; ++ii)
+    {
+        heap.emplace_back();
+        heap.back().source = ii;
+        if (!next(ii, heap.back().rec))
+        {
+            if (e.Test())
+                return false;
+            heap.pop_back();
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), cmp);
+
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), cmp);
+        Head& head = heap.back();
+        func(m_dirs[head.rec.dir].Text(), head.rec.pfi.get());
+
+        if (next(head.source, head.rec))
+        {
+            std::push_heap(heap.begin(), heap.end(), cmp);
+        }
+        else
+        {
+            if (e.Test())
+                return false;
+            heap.pop_back();
+        }
+    }
+
+    return true;
+}
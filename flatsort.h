@@ -0,0 +1,62 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+#include "fileinfo.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+// FlatSorter collects the files from a recursive scan into one list, sorted
+// across all directories by g_sort_order (with the same semantics as sorting
+// a single directory).
+//
+// Files accumulate in memory until they exceed the memory budget.  Then the
+// run is sorted and spilled to a temporary file, and Enumerate() merges the
+// runs.  So the memory needed is bounded by the budget plus the directory
+// names, no matter how many files there are.  If a run can't be spilled,
+// the rest of the files are dropped and Enumerate() fails with the error,
+// rather than letting the list grow past the budget.
+//
+// When a limit is given, only the first N files in the sort order are kept,
+// in a bounded heap, and nothing is spilled.
+class FlatSorter
+{
+public:
+                        FlatSorter(size_t max_memory, size_t limit);
+                        ~FlatSorter();
+
+    bool                Empty() const { return !m_count; }
+    void                Add(const StrW& dir, std::vector<std::unique_ptr<FileInfo>>& files);
+    bool                Enumerate(const std::function<void(const WCHAR* dir, const FileInfo* pfi)>& func, Error& e);
+
+private:
+    struct Record
+    {
+        std::unique_ptr<FileInfo> pfi;
+        unsigned        dir;
+        ULONGLONG       seq;
+    };
+
+    class Run;
+
+    static bool         IsLess(const Record& a, const Record& b);
+    bool                Spill(Error& e);
+    void                AddLimited(Record&& rec);
+
+    const size_t        m_max_memory;
+    const size_t        m_limit;
+    size_t              m_memory = 0;
+    size_t              m_count = 0;
+    ULONGLONG           m_seq = 0;
+    std::vector<StrW>   m_dirs;
+    std::vector<Record> m_records;
+    std::vector<std::unique_ptr<Run>> m_runs;
+    StrW                m_spill_error;
+};
@@ -7,12 +7,16 @@
 #include "formatter.h"
 #include "sorting.h"
 #include "filesys.h"
+#include "direntry.h"
+#include "volume.h"
+#include "flatsort.h"
 #include "colors.h"
 #include "output.h"
 #include "ecma48.h"
 #include "wcwidth.h"
 #include "wcwidth_iter.h"
 #include "columns.h"
+#include "enumdir.h"
 #include "str.h"
 
 #include <algorithm>
@@ -20,11 +24,39 @@
 
 static RepoMap s_repo_map;
 
+static const unsigned c_default_max_memory_mb = 256;
+
 std::shared_ptr<const RepoStatus> FindRepo(const WCHAR* dir)
 {
     return s_repo_map.Find(dir);
 }
 
+// When the repo field isn't shown, a recursive listing only needs a repo's
+// status once traversal reaches the repo root, and by then the root's own
+// listing shows whether it has .git (see OnListing).
+static bool FindReposFromListings(const DirFormatSettings& settings)
+{
+    return ((settings.m_flags & (FMT_GIT|FMT_GITREPOS|FMT_SUBDIRECTORIES)) == (FMT_GIT|FMT_SUBDIRECTORIES));
+}
+
+static void UpdateRepoStatus(const WCHAR* dir, const DirEntry* pe, const DirFormatSettings& settings)
+{
+    // Only directories can be repo roots.  The repo field is shown for a
+    // subdirectory before its own listing is available, so it has to probe.
+    if (!(pe->attributes & FILE_ATTRIBUTE_DIRECTORY) || IsPseudoDirectory(pe->name))
+        return;
+
+    if (settings.IsSet(FMT_GITREPOS))
+    {
+        // Only listing the files in the repo needs the status of each file;
+        // the repo field only needs the branch and whether the repo is clean.
+        const bool files = ((settings.m_flags & (FMT_GIT|FMT_SUBDIRECTORIES)) == (FMT_GIT|FMT_SUBDIRECTORIES));
+        StrW full;
+        PathJoin(full, dir, pe->name);
+        s_repo_map.Queue(full.Text(), files);
+    }
+}
+
 struct TreeFiles
 {
     size_t              cursor = 0;
@@ -228,6 +260,8 @@ void DirEntryFormatter::Initialize(unsigned num_columns, const FormatFlags flags
 
     if (flags & FMT_TREE)
         m_tree_picture = std::make_shared<PictureFormatter>(*m_picture_template);
+    if (flags & FMT_FLAT)
+        m_flat_picture = std::make_shared<PictureFormatter>(*m_picture_template);
 
     if (g_debug)
     {
@@ -321,8 +355,6 @@ void DirEntryFormatter::UpdateRootGroup(const WCHAR* dir)
 bool DirEntryFormatter::OnVolumeBegin(const WCHAR* dir, Error& e)
 {
     StrW root;
-    WCHAR volume_name[MAX_PATH];
-    DWORD dwSerialNumber;
     const bool line_break_before_volume = m_line_break_before_volume;
 
 #ifdef DEBUG
@@ -357,21 +389,22 @@ bool DirEntryFormatter::OnVolumeBegin(const WCHAR* dir, Error& e)
     if (Settings().IsSet(FMT_BARE))
         return false;
 
-    if (!GetDrive(dir, root, e))
+    const VolumeInfo* volume = GetVolumeInfo(dir, e);
+    if (!volume)
     {
         e.Clear();
         return false;
     }
 
-    EnsureTrailingSlash(root);
-    if (!GetVolumeInformation(root.Text(), volume_name, _countof(volume_name), &dwSerialNumber, 0, 0, 0, 0))
+    if (volume->info_err)
     {
-        const DWORD dwErr = GetLastError();
-        if (dwErr != ERROR_DIR_NOT_ROOT)   // Don't fail on subst'd drives.
-            e.Set(dwErr);
+        if (volume->info_err != ERROR_DIR_NOT_ROOT)   // Don't fail on subst'd drives.
+            e.Set(volume->info_err);
         return false;
     }
 
+    root.Set(volume->drive);
+    EnsureTrailingSlash(root);
     if (*root.Text() == '\\')
         StripTrailingSlashes(root);
     else
@@ -380,12 +413,12 @@ bool DirEntryFormatter::OnVolumeBegin(const WCHAR* dir, Error& e)
     StrW s;
     if (line_break_before_volume)
         s.Append('\n');
-    if (volume_name[0])
-        s.Printf(L" Volume in drive %s is %s\n", root.Text(), volume_name);
+    if (volume->volume_name.Length())
+        s.Printf(L" Volume in drive %s is %s\n", root.Text(), volume->volume_name.Text());
     else
         s.Printf(L" Volume in drive %s has no label.\n", root.Text());
     s.Printf(L" Volume Serial Number is %04X-%04X\n",
-             HIWORD(dwSerialNumber), LOWORD(dwSerialNumber));
+             HIWORD(volume->serial_number), LOWORD(volume->serial_number));
     Render(new OutputText(std::move(s)));
 
     m_line_break_before_miniheader = true;
@@ -409,6 +442,42 @@ void DirEntryFormatter::OnScanFiles(const WCHAR* dir, bool implicit, bool root_p
     }
 }
 
+void DirEntryFormatter::OnRepoRoot(const WCHAR* dir)
+{
+    // The scan pool found the repo root ahead of the traversal, so start
+    // getting its status now; NextSubDir() or OnListing() picks it up.  The
+    // pool only enumerates subdirectories that the traversal will visit
+    // (within --levels), and OnPatternEnd() drops any that it didn't reach.
+    NoteRepoRoot(dir, true);
+    if (FindReposFromListings(Settings()))
+        s_repo_map.Prefetch(dir);
+}
+
+void DirEntryFormatter::OnListing(const WCHAR* dir, const DirListing* listing, std::shared_ptr<const RepoStatus>& repo)
+{
+    if (listing)
+        NoteRepoRoot(dir, !!listing->Lookup(L".git"));
+
+    if (!FindReposFromListings(Settings()))
+        return;
+
+    // The repo may already be this directory's own, from NextSubDir() or
+    // from the patterns.
+    StrW root(dir);
+    StripTrailingSlashes(root);
+    if (!(repo && repo->root.EqualI(root)) && IsRepoRoot(root.Text()))
+    {
+        s_repo_map.Queue(root.Text());
+        std::shared_ptr<const RepoStatus> sub_repo = s_repo_map.Find(root.Text());
+        if (sub_repo)
+            repo = std::move(sub_repo);
+    }
+
+    // Either way, once traversal reaches the directory the map doesn't need
+    // to hold its status anymore (see NextSubDir()).
+    s_repo_map.Remove(root.Text());
+}
+
 void DirEntryFormatter::OnDirectoryBegin(const WCHAR* const dir, const WCHAR* const dir_rel, const std::shared_ptr<const RepoStatus>& repo)
 {
 #ifdef DEBUG
@@ -447,17 +516,19 @@ void DirEntryFormatter::OnDirectoryBegin(const WCHAR* const dir, const WCHAR* co
     m_longest_dir_width = 0;
     m_granularity = 0;
 
-    DWORD dwSectorsPerCluster;
-    DWORD dwBytesPerSector;
-    DWORD dwFreeClusters;
-    DWORD dwTotalClusters;
-    if (GetDiskFreeSpace(dir, &dwSectorsPerCluster, &dwBytesPerSector, &dwFreeClusters, &dwTotalClusters))
-        m_granularity = dwSectorsPerCluster * dwBytesPerSector;
+    {
+        Error e;
+        const VolumeInfo* volume = GetVolumeInfo(dir, e);
+        if (volume)
+            m_granularity = volume->granularity;
+    }
 
     {
         std::shared_ptr<PictureFormatter> picture;
         if (Settings().IsSet(FMT_TREE))
             picture = m_tree_picture;
+        else if (Settings().IsSet(FMT_FLAT))
+            picture = m_flat_picture;
         else
             picture = std::make_shared<PictureFormatter>(*m_picture_template);
 
@@ -555,74 +626,9 @@ static void DisplayOne(HANDLE h, const FileInfo* const pfi, const FileInfo* cons
     }
 }
 
-void DirEntryFormatter::OnFile(const WCHAR* const dir, const WIN32_FIND_DATA* const pfd)
+void DirEntryFormatter::UpdateStatistics(const WCHAR* const dir, const FileInfo* const pfi)
 {
-    std::unique_ptr<FileInfo> pfi;
     const auto picture = m_dir->picture.get();
-    const bool fUsage = Settings().IsSet(FMT_USAGE);
-    const bool fImmediate = (m_fImmediate &&
-                             picture->IsImmediate() &&
-                             !m_grouped_patterns);
-
-    pfi = std::make_unique<FileInfo>();
-    pfi->Init(dir, m_granularity, pfd, Settings());
-
-    // Skip the file if filtering out files without alternate data streams.
-
-    if (Settings().IsSet(FMT_ALTDATASTEAMS|FMT_ONLYALTDATASTREAMS))
-    {
-        assert(implies(Settings().IsSet(FMT_ALTDATASTEAMS), !(Settings().IsSet(FMT_FAT|FMT_BARE))));
-
-        StrW tmp;
-        PathJoin(tmp, dir, pfi->GetLongName());
-
-        StrW full;
-        full.Set(tmp);
-
-        bool fAnyAltDataStreams = false;
-        WIN32_FIND_STREAM_DATA fsd;
-        SHFind shFind = __FindFirstStreamW(full.Text(), FindStreamInfoStandard, &fsd, 0);
-        if (!shFind.Empty())
-        {
-            std::unique_ptr<std::vector<std::unique_ptr<FileInfo>>> streams;
-
-            do
-            {
-                if (!wcsicmp(fsd.cStreamName, L"::$DATA"))
-                    continue;
-                fAnyAltDataStreams = true;
-                if (!Settings().IsSet(FMT_ALTDATASTEAMS))
-                    break;
-                if (!streams)
-                    streams = std::make_unique<std::vector<std::unique_ptr<FileInfo>>>();
-                streams->emplace_back(std::make_unique<FileInfo>());
-                streams->back()->InitStream(fsd);
-            }
-            while (__FindNextStreamW(shFind, &fsd));
-
-            if (streams && streams->size())
-                pfi->InitStreams(*streams);
-        }
-
-        if (fAnyAltDataStreams)
-            pfi->SetAltDataStreams();
-        else if (Settings().IsSet(FMT_ONLYALTDATASTREAMS))
-            return;
-    }
-
-    // Get git status if needed.
-
-    if ((Settings().m_flags & (FMT_GIT|FMT_SUBDIRECTORIES)) == (FMT_GIT|FMT_SUBDIRECTORIES) ||
-        (Settings().IsSet(FMT_GITREPOS)))
-    {
-        StrW full;
-        PathJoin(full, dir, pfd->cFileName);
-        auto repo = GitStatus(full.Text(), Settings().IsSet(FMT_SUBDIRECTORIES));
-        s_repo_map.Add(repo);
-    }
-
-    // Update statistics.
-
     const FormatFlags flags = Settings().m_flags;
     const unsigned num_columns = Settings().m_num_columns;
 
@@ -707,41 +713,166 @@ void DirEntryFormatter::OnFile(const WCHAR* const dir, const WIN32_FIND_DATA* co
 
     // Update the picture formatter.
 
-    picture->OnFile(pfi.get());
+    picture->OnFile(pfi);
+}
 
-    // The file might get displayed now, or might get deferred.
+void DirEntryFormatter::AddUsage(const WCHAR* const dir, const DirEntry& entry)
+{
+    // Usage mode only reports totals, so it takes the sizes straight from the
+    // entry instead of constructing a FileInfo.  Keep in sync with
+    // FileInfo::Init() and UpdateStatistics().
 
-    if (!fUsage)
+    if (entry.attributes & FILE_ATTRIBUTE_DIRECTORY)
     {
-        if (g_debug)
+        m_cDirs++;
+        return;
+    }
+
+    ULONGLONG compressed = 0;
+    if ((entry.attributes & FILE_ATTRIBUTE_COMPRESSED) && Settings().m_need_compressed_size)
+    {
+        StrW full;
+        PathJoin(full, dir, entry.name);
+        ULARGE_INTEGER ul;
+        ul.LowPart = GetCompressedFileSize(full.Text(), &ul.HighPart);
+        compressed = ul.QuadPart;
+    }
+
+    m_cFiles++;
+    m_cbTotal += entry.size;
+    m_cbAllocated += RoundUpToGranularity(compressed ? compressed : entry.size, m_granularity);
+    if (Settings().IsSet(FMT_COMPRESSED))
+        m_cbCompressed += compressed ? compressed : entry.size;
+}
+
+void DirEntryFormatter::OnFile(const WCHAR* const dir, const DirEntry* const pe)
+{
+    if (Settings().IsSet(FMT_USAGE))
+    {
+        AddUsage(dir, *pe);
+        return;
+    }
+
+    std::unique_ptr<FileInfo> pfi;
+    const auto picture = m_dir->picture.get();
+    const bool fImmediate = (m_fImmediate &&
+                             picture->IsImmediate() &&
+                             !m_grouped_patterns);
+
+    if (Settings().m_top)
+    {
+        if (!m_top)
+            m_top = std::make_unique<TopFiles>(Settings().m_top, m_grouped_patterns);
+
+        // Reuse the same FileInfo until one is kept.
+        pfi = std::move(m_top_spare);
+        if (!pfi)
+            pfi = std::make_unique<FileInfo>();
+        pfi->Init(dir, m_granularity, pe, Settings());
+        if (!m_top->WouldKeep(pfi))
         {
-            const bool is_dir = !!(pfi->GetAttributes() & FILE_ATTRIBUTE_DIRECTORY);
-            Printf(L"debug: OnFile %s '%s'\n", is_dir ? L"DIR " : L"file", pfi->GetLongName().Text());
+            // Subdirectories still need their repo status even if they
+            // aren't listed.
+            UpdateRepoStatus(dir, pe, Settings());
+            m_top_spare = std::move(pfi);
+            return;
         }
+    }
+    else
+    {
+        pfi = std::make_unique<FileInfo>();
+        pfi->Init(dir, m_granularity, pe, Settings());
+    }
+
+    // Skip the file if filtering out files without alternate data streams.
+
+    if (Settings().IsSet(FMT_ALTDATASTEAMS|FMT_ONLYALTDATASTREAMS))
+    {
+        assert(implies(Settings().IsSet(FMT_ALTDATASTEAMS), !(Settings().IsSet(FMT_FAT|FMT_BARE))));
 
-        if (fImmediate)
+        StrW tmp;
+        PathJoin(tmp, dir, pfi->GetLongName());
+
+        StrW full;
+        full.Set(tmp);
+
+        bool fAnyAltDataStreams = false;
+        WIN32_FIND_STREAM_DATA fsd;
+        SHFind shFind = __FindFirstStreamW(full.Text(), FindStreamInfoStandard, &fsd, 0);
+        if (!shFind.Empty())
         {
-            class OutputDisplayOne : public OutputOperation
+            std::unique_ptr<std::vector<std::unique_ptr<FileInfo>>> streams;
+
+            do
             {
-            public:
-                OutputDisplayOne(std::unique_ptr<FileInfo>&& pfi)
-                : m_pfi(std::move(pfi)) {}
+                if (!wcsicmp(fsd.cStreamName, L"::$DATA"))
+                    continue;
+                fAnyAltDataStreams = true;
+                if (!Settings().IsSet(FMT_ALTDATASTEAMS))
+                    break;
+                if (!streams)
+                    streams = std::make_unique<std::vector<std::unique_ptr<FileInfo>>>();
+                streams->emplace_back(std::make_unique<FileInfo>());
+                streams->back()->InitStream(fsd);
+            }
+            while (__FindNextStreamW(shFind, &fsd));
 
-                void Render(HANDLE h, const DirContext* dir) override
-                {
-                    DisplayOne(h, m_pfi.get(), nullptr, dir);
-                }
+            if (streams && streams->size())
+                pfi->InitStreams(*streams);
+        }
 
-            private:
-                std::unique_ptr<FileInfo> m_pfi;
-            };
+        if (fAnyAltDataStreams)
+            pfi->SetAltDataStreams();
+        else if (Settings().IsSet(FMT_ONLYALTDATASTREAMS))
+            return;
+    }
 
-            Render(new OutputDisplayOne(std::move(pfi)));
-        }
-        else
+    // Get git status if needed.
+
+    UpdateRepoStatus(dir, pe, Settings());
+
+    // In --top mode, only the first N files in the sort order are kept, and
+    // files that can't make the cut are discarded before allocating anything
+    // for them.  Statistics are gathered later, for the files that are kept.
+
+    if (Settings().m_top)
+    {
+        m_top->Add(std::move(pfi));
+        return;
+    }
+
+    UpdateStatistics(dir, pfi.get());
+
+    // The file might get displayed now, or might get deferred.
+
+    if (g_debug)
+    {
+        const bool is_dir = !!(pfi->GetAttributes() & FILE_ATTRIBUTE_DIRECTORY);
+        Printf(L"debug: OnFile %s '%s'\n", is_dir ? L"DIR " : L"file", pfi->GetLongName().Text());
+    }
+
+    if (fImmediate)
+    {
+        class OutputDisplayOne : public OutputOperation
         {
-            m_files.emplace_back(std::move(pfi));
-        }
+        public:
+            OutputDisplayOne(std::unique_ptr<FileInfo>&& pfi)
+            : m_pfi(std::move(pfi)) {}
+
+            void Render(HANDLE h, const DirContext* dir) override
+            {
+                DisplayOne(h, m_pfi.get(), nullptr, dir);
+            }
+
+        private:
+            std::unique_ptr<FileInfo> m_pfi;
+        };
+
+        Render(new OutputDisplayOne(std::move(pfi)));
+    }
+    else
+    {
+        m_files.emplace_back(std::move(pfi));
     }
 }
 
@@ -784,6 +915,14 @@ void DirEntryFormatter::OnDirectoryEnd(const WCHAR* dir, bool next_dir_is_differ
 
     bool do_end = next_dir_is_different;
 
+    if (m_top)
+    {
+        m_top->Take(m_files);
+        m_top.reset();
+        for (const auto& pfi : m_files)
+            UpdateStatistics(dir, pfi.get());
+    }
+
     if (Settings().IsSet(FMT_USAGEGROUPED))
         do_end = (m_subdirs.empty() ||
                   IsNewRootGroup(m_subdirs.front()->dir.Text()));
@@ -809,13 +948,15 @@ void DirEntryFormatter::OnDirectoryEnd(const WCHAR* dir, bool next_dir_is_differ
             wcscpy_s(g_sort_order, L"n");
         }
 
-        if (*g_sort_order)
+        // In flat mode the files are sorted globally later, so they only need
+        // to be sorted here for removing duplicates.
+        if (*g_sort_order && (m_grouped_patterns || !Settings().IsSet(FMT_FLAT)))
         {
             UINT tick_begin;
             if (g_debug)
                 tick_begin = GetTickCount();
 
-            std::stable_sort(m_files.begin(), m_files.end(), CmpFileInfo);
+            SortFiles(m_files);
             if (g_debug)
             {
                 const UINT elapsed = GetTickCount() - tick_begin;
@@ -848,7 +989,7 @@ void DirEntryFormatter::OnDirectoryEnd(const WCHAR* dir, bool next_dir_is_differ
             m_files.swap(files);
         }
 
-        if (IsReversedSort())
+        if (IsReversedSort() && !Settings().IsSet(FMT_FLAT))
         {
             std::vector<std::unique_ptr<FileInfo>> files;
             files.reserve(m_files.size());
@@ -1023,7 +1164,16 @@ void DirEntryFormatter::OnDirectoryEnd(const WCHAR* dir, bool next_dir_is_differ
             const unsigned m_longest_dir_width;
         };
 
-        if (Settings().IsSet(FMT_TREE))
+        if (Settings().IsSet(FMT_FLAT))
+        {
+            if (!m_flat)
+            {
+                const unsigned mb = Settings().m_max_memory_mb ? Settings().m_max_memory_mb : c_default_max_memory_mb;
+                m_flat = std::make_unique<FlatSorter>(size_t(mb) * 1024 * 1024, Settings().m_top);
+            }
+            m_flat->Add(m_dir->dir, m_files);
+        }
+        else if (Settings().IsSet(FMT_TREE))
         {
             auto& find = s_tree_map.find(m_dir->dir.Text());
             if (find == s_tree_map.end())
@@ -1091,7 +1241,7 @@ void DirEntryFormatter::OnDirectoryEnd(const WCHAR* dir, bool next_dir_is_differ
             Render(new OutputUsage(*this, m_cbTotal, m_cbAllocated, CountFiles(), dir.Text()));
             m_count_usage_dirs++;
         }
-        else if (!Settings().IsSet(FMT_BARE|FMT_NOSUMMARY))
+        else if (!Settings().IsSet(FMT_BARE|FMT_NOSUMMARY|FMT_FLAT))
         {
             StrW s;
             FormatFileTotals(s, CountFiles(), m_cbTotal, m_cbAllocated, m_cbCompressed, Settings());
@@ -1116,12 +1266,16 @@ void DirEntryFormatter::OnDirectoryEnd(const WCHAR* dir, bool next_dir_is_differ
 
 void DirEntryFormatter::OnPatternEnd(const DirPattern* pattern)
 {
+    // Repo roots prefetched for directories the traversal never reached
+    // (for example, after an error) won't be needed.
+    s_repo_map.DropPrefetched();
+
     if (Settings().IsSet(FMT_TREE))
     {
         assert(s_tree_stack.empty());
 
         bool got_info = false;
-        WIN32_FIND_DATAW fd = { 0 };
+        DirEntry entry = {};
         {
             SHFile h = CreateFile(pattern->m_dir.Text(), FILE_READ_ATTRIBUTES|SYNCHRONIZE,
                                 FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, nullptr,
@@ -1133,17 +1287,16 @@ void DirEntryFormatter::OnPatternEnd(const DirPattern* pattern)
                 h.Close();
                 if (got_info)
                 {
-                    fd.dwFileAttributes = bhfi.dwFileAttributes;
-                    fd.ftCreationTime = bhfi.ftCreationTime;
-                    fd.ftLastAccessTime = bhfi.ftLastAccessTime;
-                    fd.ftLastWriteTime = bhfi.ftLastWriteTime;
-                    // fd.nFileSizeHigh = bhfi.nFileSizeHigh;
-                    // fd.nFileSizeLow = bhfi.nFileSizeLow;
+                    entry.attributes = bhfi.dwFileAttributes;
+                    entry.created = bhfi.ftCreationTime;
+                    entry.accessed = bhfi.ftLastAccessTime;
+                    entry.modified = bhfi.ftLastWriteTime;
+                    // entry.size = (ULONGLONG(bhfi.nFileSizeHigh) << 32) | bhfi.nFileSizeLow;
                 }
             }
 
             if (!got_info)
-                fd.dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY;
+                entry.attributes = FILE_ATTRIBUTE_DIRECTORY;
         }
 
         StrW rel_str;
@@ -1152,10 +1305,12 @@ void DirEntryFormatter::OnPatternEnd(const DirPattern* pattern)
         if (rel_str.Empty())
             rel_str.Set(pattern->m_dir);
         StripTrailingSlashes(rel_str);
-        wcscpy_s(fd.cFileName, rel_str.Text());
+        entry.name = rel_str.Text();
+        entry.name_len = rel_str.Length();
+        entry.short_name = L"";
 
         std::unique_ptr<FileInfo> info = std::make_unique<FileInfo>();
-        info->Init(pattern->m_dir.Text(), 0, &fd, Settings());
+        info->Init(pattern->m_dir.Text(), 0, &entry, Settings());
         SetAttrsForColors(~(FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_SYSTEM));
         if (got_info)
         {
@@ -1210,12 +1365,14 @@ void DirEntryFormatter::OnPatternEnd(const DirPattern* pattern)
 
 void DirEntryFormatter::OnVolumeEnd(const WCHAR* dir)
 {
+    RenderFlatList();
+
     if (Settings().IsSet(FMT_NOSUMMARY))
         return;
 
     Error e;
-    StrW root;
-    if (!GetDrive(dir, root, e))
+    const VolumeInfo* volume = GetVolumeInfo(dir, e);
+    if (!volume)
         return;
 
     if (Settings().IsSet(FMT_USAGE))
@@ -1229,13 +1386,11 @@ void DirEntryFormatter::OnVolumeEnd(const WCHAR* dir)
             FormatSize(s, m_cbAllocatedTotal, nullptr, Settings(), 0);
             s.Printf(L"  %7u  Total\n", m_cFilesTotal);
 
-            ULARGE_INTEGER ulFreeToCaller;
-            ULARGE_INTEGER ulTotalSize;
-            ULARGE_INTEGER ulTotalFree;
-            if (SHGetDiskFreeSpace(root.Text(), &ulFreeToCaller, &ulTotalSize, &ulTotalFree))
+            if (volume->have_free_space)
             {
+                ULARGE_INTEGER ulTotalSize = volume->total_size;
                 ULARGE_INTEGER ulTotalUsed;
-                ulTotalUsed.QuadPart = ulTotalSize.QuadPart - ulTotalFree.QuadPart;
+                ulTotalUsed.QuadPart = ulTotalSize.QuadPart - volume->total_free.QuadPart;
 
                 FormatSizeForReading(s, *reinterpret_cast<unsigned __int64*>(&ulTotalUsed), 0, Settings());
                 s.Append('/');
@@ -1272,14 +1427,11 @@ void DirEntryFormatter::OnVolumeEnd(const WCHAR* dir)
     // similarity with CMD the count of directories includes the "." and
     // ".." pseudo-directories, even though it is a bit inaccurate.
 
-    ULARGE_INTEGER ulFreeToCaller;
-    ULARGE_INTEGER ulTotalSize;
-    ULARGE_INTEGER ulTotalFree;
-
     FormatTotalCount(s, CountDirs(), Settings());
     s.Append(L" Dir(s)  ");
-    if (SHGetDiskFreeSpace(root.Text(), &ulFreeToCaller, &ulTotalSize, &ulTotalFree))
+    if (volume->have_free_space)
     {
+        ULARGE_INTEGER ulFreeToCaller = volume->free_to_caller;
         FormatSizeForReading(s, *reinterpret_cast<unsigned __int64*>(&ulFreeToCaller), 15, Settings());
         s.Printf(L" bytes free");
     }
@@ -1289,6 +1441,8 @@ void DirEntryFormatter::OnVolumeEnd(const WCHAR* dir)
 
 void DirEntryFormatter::Finalize()
 {
+    RenderFlatList();
+
     m_dir.reset();
 
     for (auto& o : m_outputs)
@@ -1341,6 +1495,29 @@ void DirEntryFormatter::ReportError(Error& e)
     Render(new OutputErrorMessage(std::move(s)));
 }
 
+static std::shared_ptr<const GlobPatterns> LoadGitIgnore(const StrW& dir)
+{
+    StrW file(dir);
+    EnsureTrailingSlash(file);
+    file.Append(L".gitignore");
+    SHFile h = CreateFile(file.Text(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE|FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, 0);
+    if (h.Empty())
+        return nullptr;
+
+    std::shared_ptr<GlobPatterns> globs = std::make_shared<GlobPatterns>();
+    globs->SetRoot(dir.Text());
+    if (!globs->Load(h))
+        return nullptr;
+
+    if (g_debug && globs->Count())
+    {
+        Printf(L"debug: .gitignore for '%s'\n", dir.Text());
+        globs->Dump();
+    }
+
+    return globs;
+}
+
 void DirEntryFormatter::AddSubDir(const StrW& dir, const StrW& dir_rel, unsigned depth, const std::shared_ptr<const GlobPatterns>& git_ignore, const std::shared_ptr<const RepoStatus>& repo)
 {
     assert(Settings().IsSet(FMT_SUBDIRECTORIES));
@@ -1352,34 +1529,10 @@ void DirEntryFormatter::AddSubDir(const StrW& dir, const StrW& dir_rel, unsigned
     subdir->depth = depth;
     subdir->git_ignore = git_ignore;
 
-    if (Settings().IsSet(FMT_GITIGNORE))
-    {
-        StrW file(dir);
-        EnsureTrailingSlash(file);
-        file.Append(L".gitignore");
-        SHFile h = CreateFile(file.Text(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE|FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, 0);
-        if (!h.Empty())
-        {
-            std::shared_ptr<GlobPatterns> globs = std::make_shared<GlobPatterns>();
-            if (globs && globs->Load(h))
-            {
-                if (globs->Count())
-                {
-                    Printf(L"debug: .gitignore for '%s'\n", dir.Text());
-                    globs->Dump();
-                }
-
-                subdir->git_ignore = globs;
-            }
-        }
-    }
-
+    // If the subdirectory is a repo itself, NextSubDir() picks up its status
+    // once traversal gets there; the status may still be in progress now.
     if (Settings().IsSet(FMT_GIT|FMT_GITREPOS))
-    {
-        subdir->repo = s_repo_map.Find(dir.Text());
-        if (!subdir->repo)
-            subdir->repo = repo;
-    }
+        subdir->repo = repo;
 
     m_pending_subdirs.emplace_back(std::move(subdir));
 }
@@ -1460,12 +1613,28 @@ bool DirEntryFormatter::NextSubDir(StrW& dir, StrW& dir_rel, unsigned& depth, st
     repo = std::move(front->repo);
     m_subdirs.pop_front();
 
-    // The only thing that needs the map is FormatGitRepo(), to avoid running
-    // "git status" twice for the same repo.  So, once traversal dives into a
-    // directory, nothing will try to print that directory entry again, so the
-    // map doesn't need to hold a reference anymore.  Removing it from the map
-    // ensures the data structures can be freed once traversal through that
-    // repo tree finishes.
+    // The .gitignore is loaded only once the directory is about to be
+    // scanned, so queued subdirectories that are never reached cost nothing.
+    if (Settings().IsSet(FMT_GITIGNORE))
+    {
+        std::shared_ptr<const GlobPatterns> globs = LoadGitIgnore(dir);
+        if (globs)
+            git_ignore = std::move(globs);
+    }
+
+    if (Settings().IsSet(FMT_GIT|FMT_GITREPOS))
+    {
+        std::shared_ptr<const RepoStatus> sub_repo = s_repo_map.Find(dir.Text());
+        if (sub_repo)
+            repo = std::move(sub_repo);
+    }
+
+    // Otherwise the only thing that needs the map is FormatGitRepo(), to
+    // avoid running "git status" twice for the same repo.  So, once traversal
+    // dives into a directory, nothing will try to print that directory entry
+    // again, so the map doesn't need to hold a reference anymore.  Removing it
+    // from the map ensures the data structures can be freed once traversal
+    // through that repo tree finishes.
     s_repo_map.Remove(dir.Text());
 
     return true;
@@ -1489,6 +1658,59 @@ void DirEntryFormatter::Render(OutputOperation* o)
     }
 }
 
+void DirEntryFormatter::RenderFlatList()
+{
+    if (!m_flat)
+        return;
+
+    class OutputFlatList : public OutputOperation
+    {
+    public:
+        OutputFlatList(std::unique_ptr<FlatSorter>&& flat, const std::shared_ptr<DirContext>& context)
+        : m_flat(std::move(flat)), m_context(context) {}
+
+        void Render(HANDLE h, const DirContext* dir) override
+        {
+            // The files come from many directories, so one context is
+            // updated as the directory changes.
+            m_context->picture->SetDirContext(m_context);
+
+            UINT tick_begin;
+            if (g_debug)
+                tick_begin = GetTickCount();
+
+            Error e;
+            const bool git = !!(m_context->flags & (FMT_GIT|FMT_GITREPOS));
+            m_flat->Enumerate([&](const WCHAR* dir, const FileInfo* pfi)
+            {
+                if (!m_context->dir.Equal(dir))
+                {
+                    m_context->dir.Set(dir);
+                    if (git)
+                        m_context->repo = FindRepo(dir);
+                }
+                DisplayOne(h, pfi, nullptr, m_context.get());
+            }, e);
+
+            if (g_debug)
+            {
+                const UINT elapsed = GetTickCount() - tick_begin;
+                Printf(L"debug: flat list rendered in %u ms\n", elapsed);
+            }
+
+            m_flat.reset();
+            e.Report();
+        }
+
+    private:
+        std::unique_ptr<FlatSorter> m_flat;
+        const std::shared_ptr<DirContext> m_context;
+    };
+
+    std::shared_ptr<DirContext> context = std::make_shared<DirContext>(Settings().m_flags, m_flat_picture);
+    Render(new OutputFlatList(std::move(m_flat), context));
+}
+
 void AppendTreeLines(StrW& s, const FormatFlags flags)
 {
     const bool ascii = IsAsciiLineCharMode();
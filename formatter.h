@@ -16,6 +16,8 @@
 #include <unordered_set>
 
 struct SubDir;
+class FlatSorter;
+class TopFiles;
 
 struct DirContext
 {
@@ -55,8 +57,10 @@ public:
     bool                OnVolumeBegin(const WCHAR* dir, Error& e) override;
     void                OnPatterns(bool grouped) override;
     void                OnScanFiles(const WCHAR* dir, bool implicit, bool root_pass) override;
+    void                OnRepoRoot(const WCHAR* dir) override;
+    void                OnListing(const WCHAR* dir, const DirListing* listing, std::shared_ptr<const RepoStatus>& repo) override;
     void                OnDirectoryBegin(const WCHAR* dir, const WCHAR* dir_rel, const std::shared_ptr<const RepoStatus>& repo) override;
-    void                OnFile(const WCHAR* dir, const WIN32_FIND_DATA* pfd) override;
+    void                OnFile(const WCHAR* dir, const DirEntry* pe) override;
     void                OnDirectoryEnd(const WCHAR* dir, bool next_dir_is_different) override;
     void                OnPatternEnd(const DirPattern* pattern) override;
     void                OnVolumeEnd(const WCHAR* dir) override;
@@ -79,6 +83,9 @@ public:
 private:
     bool                IsDelayedRender() const { return m_delayed_render; }
     void                Render(OutputOperation* o);
+    void                RenderFlatList();
+    void                UpdateStatistics(const WCHAR* dir, const FileInfo* pfi);
+    void                AddUsage(const WCHAR* dir, const DirEntry& entry);
 
 private:
     HANDLE              m_hout = 0;
@@ -117,6 +124,10 @@ private:
 
     std::shared_ptr<DirContext> m_dir;
     std::shared_ptr<PictureFormatter> m_tree_picture;
+    std::shared_ptr<PictureFormatter> m_flat_picture;
+    std::unique_ptr<FlatSorter> m_flat;
+    std::unique_ptr<TopFiles> m_top;
+    std::unique_ptr<FileInfo> m_top_spare;
 
     std::vector<std::unique_ptr<OutputOperation>> m_outputs;
 
@@ -5,15 +5,19 @@
 
 #include "pch.h"
 #include "git.h"
+#include "gitindex.h"
+#include "gitcache.h"
 #include "filesys.h"
 #include "output.h"
 #include "colors.h"
+#include "patterns.h"
+#include "handle.h"
+#include "spawn.h"
 
-RepoStatus::~RepoStatus()
-{
-    for (const auto& s : status)
-        free(const_cast<WCHAR*>(s.first));
-}
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 
 static bool IsUncPath(const WCHAR* p, const WCHAR** past_unc)
 {
@@ -134,16 +138,81 @@ static bool PathToParent(StrW& out, StrW* child=nullptr)
     return (out.Length() != orig_len);
 }
 
+// Returns whether dir is base or is under base.
+static bool IsUnderDir(const WCHAR* dir, const StrW& base)
+{
+    const unsigned len = base.Length();
+    if (_wcsnicmp(dir, base.Text(), len) != 0)
+        return false;
+    if (dir[len] && !IsPathSeparator(dir[len]) && !(len && IsPathSeparator(base.Text()[len - 1])))
+        return false;
+    return true;
+}
+
+/*
+ * Repo roots.
+ */
+
+// Remembers which directories are repo roots (have a .git entry), whether
+// that was seen in a listing of the directory or found by probing for .git.
+// Looking upward for the repo containing a directory checks each ancestor
+// here first, so ancestors shared by many directories are probed at most
+// once, and directories that were already listed are never probed.
+static std::mutex s_roots_mutex;
+static std::unordered_map<const WCHAR*, bool, HashCaseless, EqualCaseless> s_roots;
+static NameArena s_root_names;
+static std::atomic<unsigned> s_count_noted(0);
+static std::atomic<unsigned> s_count_probed(0);
+
+static bool RememberRepoRoot(const StrW& dir, bool is_root)
+{
+    std::lock_guard<std::mutex> lock(s_roots_mutex);
+    if (s_roots.find(dir.Text()) != s_roots.end())
+        return false;
+    s_roots.emplace(s_root_names.Add(dir.Text(), dir.Length()), is_root);
+    return true;
+}
+
+void NoteRepoRoot(const WCHAR* _dir, bool is_root)
+{
+    StrW dir(_dir);
+    StripTrailingSlashes(dir);
+    if (RememberRepoRoot(dir, is_root))
+        ++s_count_noted;
+}
+
+bool IsRepoRoot(const WCHAR* _dir)
+{
+    StrW dir(_dir);
+    StripTrailingSlashes(dir);
+
+    {
+        std::lock_guard<std::mutex> lock(s_roots_mutex);
+        const auto& iter = s_roots.find(dir.Text());
+        if (iter != s_roots.end())
+            return iter->second;
+    }
+
+    StrW git_dir;
+    PathJoin(git_dir, dir.Text(), L".git");
+    const bool is_root = (GetFileType(git_dir.Text()) >= FileType::Dir);
+    RememberRepoRoot(dir, is_root);
+    ++s_count_probed;
+    return is_root;
+}
+
+void DebugPrintRepoRootCounters()
+{
+    if (g_debug)
+        Printf(L"debug: repo roots: %u dir(s) noted from listings, %u probed for .git\n", s_count_noted.load(), s_count_probed.load());
+}
+
 bool IsUnderRepo(const WCHAR* _dir, StrW& root)
 {
     StrW dir(_dir);
-    StrW git_dir(_dir);
     while (true)
     {
-        git_dir.SetLength(dir.Length());
-        EnsureTrailingSlash(git_dir);
-        git_dir.Append(L".git");
-        if (GetFileType(git_dir.Text()) >= FileType::Dir)
+        if (IsRepoRoot(dir.Text()))
         {
             root.Set(dir);
             return true;
@@ -172,186 +241,966 @@ GitFileState CharToState(char ch)
 
 }
 
-std::shared_ptr<RepoStatus> GitStatus(const WCHAR* _dir, bool need_ignored, bool walk_up)
+/*
+ * Ignored files.
+ */
+
+static bool ReadUtf8File(const WCHAR* path, StrW& out)
 {
-    std::shared_ptr<RepoStatus> status = std::make_shared<RepoStatus>();
+    out.Clear();
 
-    StrW root;
-    StrW git_dir;
-    if (walk_up)
+    SHFile h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE|FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, 0);
+    if (h.Empty())
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(h, &size) || size.QuadPart > 1024 * 1024)
+        return false;
+
+    DWORD bytes;
+    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(size_t(size.QuadPart) + 1);
+    if (!ReadFile(h, buffer.get(), DWORD(size.QuadPart), &bytes, 0))
+        return false;
+
+    if (bytes)
     {
-        if (!IsUnderRepo(_dir, root))
+        const int needed = MultiByteToWideChar(CP_UTF8, 0, buffer.get(), int(bytes), nullptr, 0);
+        if (needed > 0)
         {
-failed:
-            return status;
+            WCHAR* text = out.Reserve(needed + 1);
+            MultiByteToWideChar(CP_UTF8, 0, buffer.get(), int(bytes), text, needed);
+            text[needed] = '\0';
+            out.ResyncLength();
         }
+    }
+    return true;
+}
 
-        need_ignored = true;
-        PathJoin(git_dir, root.Text(), L".git");
+static bool GetHomeDir(StrW& home)
+{
+    // Git for Windows uses HOME if it's set, otherwise USERPROFILE.
+    home.ReserveMaxPath();
+    if (GetEnvironmentVariable(L"HOME", home.Reserve(), home.Capacity()) ||
+        GetEnvironmentVariable(L"USERPROFILE", home.Reserve(), home.Capacity()))
+    {
+        home.ResyncLength();
+        return !home.Empty();
+    }
+    home.Clear();
+    return false;
+}
+
+static bool GetXdgConfigFile(const WCHAR* name, StrW& file)
+{
+    StrW dir;
+    dir.ReserveMaxPath();
+    if (GetEnvironmentVariable(L"XDG_CONFIG_HOME", dir.Reserve(), dir.Capacity()))
+    {
+        dir.ResyncLength();
     }
     else
     {
-        PathJoin(git_dir, _dir, L".git");
-        if (GetFileType(git_dir.Text()) < FileType::Dir)
-            goto failed;
+        dir.Clear();
+        StrW home;
+        if (!GetHomeDir(home))
+            return false;
+        PathJoin(dir, home.Text(), L".config");
+    }
 
-        root.Set(_dir);
+    PathJoin(file, dir.Text(), L"git");
+    EnsureTrailingSlash(file);
+    file.Append(name);
+    return true;
+}
+
+// Reads "value" from a "[section]" in a git config file.  This only handles
+// what's needed for core.excludesFile:  no includes, no subsections, and no
+// line continuations.  Returns false if the key isn't present.
+static bool ReadGitConfig(const WCHAR* path, const WCHAR* section, const WCHAR* key, StrW& value)
+{
+    StrW text;
+    if (!ReadUtf8File(path, text))
+        return false;
+
+    bool found = false;
+    bool in_section = false;
+    const unsigned key_len = unsigned(wcslen(key));
+    for (const WCHAR* line = text.Text(); *line;)
+    {
+        const WCHAR* end = line;
+        while (*end && *end != '\n')
+            ++end;
+        const WCHAR* next = *end ? end + 1 : end;
+
+        while (line < end && iswspace(*line))
+            ++line;
+
+        if (*line == '[')
+        {
+            const WCHAR* close = line + 1;
+            while (close < end && *close != ']')
+                ++close;
+            const unsigned len = unsigned(close - (line + 1));
+            in_section = (len == wcslen(section) && _wcsnicmp(line + 1, section, len) == 0);
+        }
+        else if (in_section && _wcsnicmp(line, key, key_len) == 0)
+        {
+            const WCHAR* p = line + key_len;
+            while (p < end && (*p == ' ' || *p == '\t'))
+                ++p;
+            if (p < end && *p == '=')
+            {
+                ++p;
+                while (p < end && (*p == ' ' || *p == '\t'))
+                    ++p;
+
+                value.Clear();
+                bool quoted = false;
+                for (; p < end; ++p)
+                {
+                    if (*p == '"')
+                        quoted = !quoted;
+                    else if (!quoted && (*p == '#' || *p == ';'))
+                        break;
+                    else if (*p == '\\' && p + 1 < end)
+                        value.Append(*(++p));
+                    else if (*p != '\r')
+                        value.Append(*p);
+                }
+                value.TrimRight();
+                found = true;
+            }
+        }
+
+        line = next;
     }
 
+    return found;
+}
+
+class GitIgnore
+{
+public:
+                        GitIgnore(const WCHAR* root, const WCHAR* git_dir);
+
+    bool                IsIgnored(const WCHAR* dir, const WCHAR* name, bool is_dir);
+
+private:
+    struct DirInfo
+    {
+        StrW            dir;
+        const DirInfo*  parent = nullptr;
+        std::unique_ptr<GlobPatterns> globs;    // The directory's .gitignore, if any.
+        bool            ignored = false;        // The directory or one of its parents is ignored.
+    };
+
+    const DirInfo*      GetDir(const WCHAR* dir);
+    bool                Classify(const DirInfo* info, const WCHAR* name, bool is_dir) const;
+    std::unique_ptr<GlobPatterns> LoadPatterns(const WCHAR* root, const WCHAR* file) const;
+
+    StrW                m_root;
+    std::vector<std::unique_ptr<GlobPatterns>> m_excludes;  // In order of precedence.
+    std::unordered_map<const WCHAR*, std::unique_ptr<DirInfo>, HashCaseless, EqualCaseless> m_dirs;
+};
+
+// Gets the global excludes file.  The repo's config overrides the global
+// configs, and the XDG default is used if none of them set core.excludesFile.
+static void GetExcludesFile(const WCHAR* git_dir, StrW& excludes_file)
+{
+    excludes_file.Clear();
+
+    StrW config;
+    bool found = false;
+    PathJoin(config, git_dir, L"config");
+    found = ReadGitConfig(config.Text(), L"core", L"excludesfile", excludes_file);
+    if (!found)
+    {
+        StrW home;
+        if (GetHomeDir(home))
+        {
+            PathJoin(config, home.Text(), L".gitconfig");
+            found = ReadGitConfig(config.Text(), L"core", L"excludesfile", excludes_file);
+        }
+    }
+    if (!found && GetXdgConfigFile(L"config", config))
+        found = ReadGitConfig(config.Text(), L"core", L"excludesfile", excludes_file);
+    if (!found)
+        GetXdgConfigFile(L"ignore", excludes_file);
+
+    if (excludes_file.Length() >= 2 && excludes_file.Text()[0] == '~' && IsPathSeparator(excludes_file.Text()[1]))
+    {
+        StrW home;
+        if (GetHomeDir(home))
+        {
+            StrW file;
+            PathJoin(file, home.Text(), excludes_file.Text() + 2);
+            excludes_file = std::move(file);
+        }
+    }
+}
+
+void GetStatusConfigFiles(const WCHAR* git_dir, std::vector<StrW>& files)
+{
+    files.clear();
+
+    files.emplace_back();
+    PathJoin(files.back(), git_dir, L"config");
+    files.emplace_back();
+    PathJoin(files.back(), git_dir, L"info\\exclude");
+
+    StrW file;
+    if (GetHomeDir(file))
+    {
+        files.emplace_back();
+        PathJoin(files.back(), file.Text(), L".gitconfig");
+    }
+    if (GetXdgConfigFile(L"config", file))
+        files.emplace_back(std::move(file));
+
+    GetExcludesFile(git_dir, file);
+    if (!file.Empty())
+        files.emplace_back(std::move(file));
+}
+
+GitIgnore::GitIgnore(const WCHAR* root, const WCHAR* git_dir)
+: m_root(root)
+{
+    StripTrailingSlashes(m_root);
+
+    StrW file;
+    PathJoin(file, git_dir, L"info\\exclude");
+    std::unique_ptr<GlobPatterns> exclude = LoadPatterns(m_root.Text(), file.Text());
+    if (exclude)
+        m_excludes.emplace_back(std::move(exclude));
+
+    StrW excludes_file;
+    GetExcludesFile(git_dir, excludes_file);
+    if (!excludes_file.Empty())
+    {
+        std::unique_ptr<GlobPatterns> global = LoadPatterns(m_root.Text(), excludes_file.Text());
+        if (global)
+            m_excludes.emplace_back(std::move(global));
+    }
+}
+
+std::unique_ptr<GlobPatterns> GitIgnore::LoadPatterns(const WCHAR* root, const WCHAR* file) const
+{
+    SHFile h = CreateFile(file, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE|FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, 0);
+    if (h.Empty())
+        return nullptr;
+
+    std::unique_ptr<GlobPatterns> globs = std::make_unique<GlobPatterns>();
+    globs->SetRoot(root);
+    if (!globs->Load(h) || !globs->Count())
+        return nullptr;
+
     if (g_debug)
-        Printf(L"debug: git status in '%s'%s\n", root.Text(), need_ignored ? L", plus ignored files" : L"");
+    {
+        Printf(L"debug: ignore patterns from '%s'\n", file);
+        globs->Dump();
+    }
+    return globs;
+}
 
-    // Prevent GVFS from printing progress gibberish even while output is
-    // redirected to a pipe.
-    SetEnvironmentVariable(L"GVFS_UNATTENDED", L"1");
+const GitIgnore::DirInfo* GitIgnore::GetDir(const WCHAR* dir)
+{
+    StrW key(dir);
+    StripTrailingSlashes(key);
+    const auto& iter = m_dirs.find(key.Text());
+    if (iter != m_dirs.end())
+        return iter->second.get();
 
-    StrW command;
-    command.Printf(L"2>nul git.exe --work-tree=\"%s\" --git-dir=\"%s\" status --porcelain --no-ahead-behind -unormal --branch %s",
-                    root.Text(), git_dir.Text(), need_ignored ? L"--ignored" : L"");
+    std::unique_ptr<DirInfo> info = std::make_unique<DirInfo>();
+    info->dir = std::move(key);
 
-    FILE* pipe = _wpopen(command.Text(), L"rt");
-    if (!pipe)
-        goto failed;
+    // A directory is ignored if its parent is, or if the parent's patterns
+    // ignore it.  Git doesn't look inside ignored directories, so their
+    // .gitignore files don't matter.
+    StrW parent(info->dir);
+    StrW child;
+    if (!info->dir.EqualI(m_root) && PathToParent(parent, &child))
+    {
+        info->parent = GetDir(parent.Text());
+        info->ignored = info->parent->ignored || Classify(info->parent, child.Text(), true);
+    }
 
-    const size_t buffer_size = 8192;
-    char* buffer = new char[buffer_size];
+    if (!info->ignored)
+    {
+        StrW file;
+        PathJoin(file, info->dir.Text(), L".gitignore");
+        info->globs = LoadPatterns(info->dir.Text(), file.Text());
+    }
 
-    StrW wide;
-    wide.Reserve(buffer_size);
+    const DirInfo* ret = info.get();
+    m_dirs.emplace(ret->dir.Text(), std::move(info));
+    return ret;
+}
 
-    while (fgets(buffer, buffer_size, pipe))
+bool GitIgnore::Classify(const DirInfo* info, const WCHAR* name, bool is_dir) const
+{
+    // Patterns in deeper .gitignore files take precedence, then the repo's
+    // info/exclude, then core.excludesFile.  Within each, the last matching
+    // pattern wins.
+    bool ignore;
+    for (const DirInfo* level = info; level; level = level->parent)
     {
-        char* eos = buffer + strlen(buffer);
-        while (--eos >= buffer)
+        if (level->globs && level->globs->FindMatch(info->dir.Text(), name, is_dir, ignore))
+            return ignore;
+    }
+    for (const auto& excludes : m_excludes)
+    {
+        if (excludes->FindMatch(info->dir.Text(), name, is_dir, ignore))
+            return ignore;
+    }
+    return false;
+}
+
+bool GitIgnore::IsIgnored(const WCHAR* dir, const WCHAR* name, bool is_dir)
+{
+    const unsigned len = m_root.Length();
+    if (_wcsnicmp(dir, m_root.Text(), len) != 0)
+        return false;
+    if (dir[len] && !IsPathSeparator(dir[len]) && !IsPathSeparator(m_root.Text()[len - 1]))
+        return false;
+
+    const DirInfo* info = GetDir(dir);
+    return info->ignored || Classify(info, name, is_dir);
+}
+
+/*
+ * TrackedPaths.
+ */
+
+// TrackedPaths holds the full paths of the files in the index, and of the
+// directories that contain them.
+class TrackedPaths
+{
+public:
+    void                Load(const RepoStatus& status);
+    bool                Contains(const WCHAR* path) const { return m_paths.find(path) != m_paths.end(); }
+
+private:
+    void                Add(const StrW& root, const WCHAR* rel);
+
+    std::unordered_set<const WCHAR*, HashCaseless, EqualCaseless> m_paths;
+    NameArena           m_names;
+};
+
+void TrackedPaths::Load(const RepoStatus& status)
+{
+    StrW file;
+    GitIndex index;
+    PathJoin(file, status.git_dir.Text(), L"index");
+    if (index.Load(file.Text()))
+    {
+        for (const auto& entry : index.Entries())
+            Add(status.root, entry.path);
+        return;
+    }
+
+    // Let git read index formats that GitIndex doesn't handle (for example a
+    // split index).
+    StrW git;
+    if (!FindOnPath(L"git.exe", git))
+        return;
+
+    StrW work_tree;
+    StrW git_dir;
+    work_tree.Printf(L"--work-tree=%s", status.root.Text());
+    git_dir.Printf(L"--git-dir=%s", status.git_dir.Text());
+
+    DWORD exit_code;
+    std::vector<char> output;
+    if (!RunProcess(git.Text(), { L"-C", status.root.Text(), work_tree.Text(), git_dir.Text(), L"ls-files", L"-z" }, output, &exit_code))
+        return;
+    if (exit_code)
+        return;
+
+    // Make sure the last path is terminated.
+    output.push_back('\0');
+
+    StrW rel;
+    const char* const end = output.data() + output.size();
+    for (const char* next = output.data(); next < end;)
+    {
+        const char* const path = next;
+        const size_t len = strlen(path);
+        next = path + len + 1;
+        if (!len)
+            continue;
+
+        WCHAR* const p = rel.Reserve(len + 1);
+        const int converted = MultiByteToWideChar(CP_UTF8, 0, path, int(len), p, int(len));
+        p[converted] = '\0';
+        for (WCHAR* walk = p; *walk; ++walk)
+        {
+            if (*walk == '/')
+                *walk = '\\';
+        }
+        rel.ResyncLength();
+
+        Add(status.root, rel.Text());
+    }
+}
+
+void TrackedPaths::Add(const StrW& root, const WCHAR* rel)
+{
+    StrW full;
+    PathJoin(full, root.Text(), rel);
+
+    // Add the file, then its directories up to the root, stopping at one
+    // that's already there.
+    while (full.Length() > root.Length() && !Contains(full.Text()))
+    {
+        m_paths.emplace(m_names.Add(full.Text(), full.Length()));
+
+        const WCHAR* const slash = wcsrchr(full.Text(), '\\');
+        if (!slash)
+            break;
+        full.SetEnd(slash);
+    }
+}
+
+/*
+ * StatusTable.
+ */
+
+void StatusTable::Add(const WCHAR* path, size_t len, FileStatus status)
+{
+    m_entries.push_back({ m_names.Add(path, len), status });
+}
+
+void StatusTable::AddGitPath(const StrW& root, const char* path, size_t len, FileStatus status)
+{
+    // Directories are reported with a trailing slash.
+    while (len && path[len - 1] == '/')
+        --len;
+
+    size_t root_len = root.Length();
+    const bool sep = (root_len && len && !IsPathSeparator(root.Text()[root_len - 1]));
+
+    // UTF8 never converts to more characters than it has bytes, so convert
+    // straight into the arena.  (Multibyte characters leave a little unused
+    // space after the NUL.)
+    WCHAR* const p = m_names.Alloc(root_len + sep + len);
+    memcpy(p, root.Text(), root_len * sizeof(*p));
+    if (sep)
+        p[root_len++] = '\\';
+
+    WCHAR* walk = p + root_len;
+    const int converted = len ? MultiByteToWideChar(CP_UTF8, 0, path, int(len), walk, int(len)) : 0;
+    for (WCHAR* const end = walk + converted; walk < end; ++walk)
+    {
+        if (*walk == '/')
+            *walk = '\\';
+    }
+    *walk = '\0';
+
+    m_entries.push_back({ p, status });
+}
+
+void StatusTable::Sort()
+{
+    // A stable sort keeps duplicates in the order they were added, and
+    // unique() keeps the first of each run.
+    std::stable_sort(m_entries.begin(), m_entries.end(), [](const Entry& a, const Entry& b) {
+        return wcscmp(a.path, b.path) < 0;
+    });
+    m_entries.erase(std::unique(m_entries.begin(), m_entries.end(), [](const Entry& a, const Entry& b) {
+        return wcscmp(a.path, b.path) == 0;
+    }), m_entries.end());
+}
+
+/*
+ * RepoStatus.
+ */
+
+RepoStatus::RepoStatus()
+{
+    // Defined here, where GitIgnore and TrackedPaths are complete types.
+}
+
+RepoStatus::~RepoStatus()
+{
+}
+
+// Keeps the highest priority state, not counting NONE.  Returns true if the
+// state changed.
+static bool MergeState(GitFileState& into, GitFileState state)
+{
+    if (state == GitFileState::NONE || (into != GitFileState::NONE && into <= state))
+        return false;
+    into = state;
+    return true;
+}
+
+void RepoStatus::BuildChildStatus()
+{
+    m_children.clear();
+    m_child_names.Clear();
+
+    // Paths in the status table are the root plus a relative path.
+    const unsigned root_len = root.Length();
+    if (!root_len)
+        return;
+    const unsigned rel_start = root_len + !IsPathSeparator(root.Text()[root_len - 1]);
+
+    StrW root_key(root);
+    StripTrailingSlashes(root_key);
+
+    StrW key;
+    auto get_child = [&](const WCHAR* dir, size_t dir_len, const WCHAR* name, size_t name_len, bool& added) -> ChildStatus&
+    {
+        if (!dir)
+            key.Set(root_key);
+        else
+            key.Set(dir, dir_len);
+        auto children = m_children.find(key.Text());
+        if (children == m_children.end())
+            children = m_children.emplace(m_child_names.Add(key.Text(), key.Length()), ChildMap()).first;
+
+        key.Set(name, name_len);
+        auto child = children->second.find(key.Text());
+        added = (child == children->second.end());
+        if (added)
+            child = children->second.emplace(m_child_names.Add(key.Text(), key.Length()), ChildStatus {}).first;
+        return child->second;
+    };
+
+    for (const auto& entry : status)
+    {
+        const WCHAR* const path = entry.path;
+        if (wcsncmp(path, root.Text(), root_len) != 0)
+            continue;
+        if (rel_start > root_len && path[root_len] != '\\')
+            continue;
+        const WCHAR* const rel = path + rel_start;
+        if (!*rel)
+            continue;
+
+        // Start with the entry itself, then walk up through its parent
+        // directories.  Once a level's summary already includes the state,
+        // the levels above it do too.
+        const WCHAR* end = rel + wcslen(rel);
+        bool own = true;
+        while (end > rel)
         {
-            if (*eos != '\r' && *eos != '\n')
+            const WCHAR* name = end;
+            while (name > rel && name[-1] != '\\')
+                --name;
+
+            bool added;
+            ChildStatus& child = get_child((name > rel) ? path : nullptr, name - 1 - path, name, end - name, added);
+            if (own)
+                child.own = entry.status;
+
+            bool changed = MergeState(child.summary.staged, entry.status.staged);
+            changed = MergeState(child.summary.working, entry.status.working) || changed;
+            if (!added && !changed)
                 break;
-            *eos = '\0';
+
+            own = false;
+            end = name - 1;
         }
+    }
+}
+
+const ChildStatus* RepoStatus::FindChild(const WCHAR* dir, const WCHAR* name) const
+{
+    // Directory keys have no trailing separator (except a drive root).
+    StrW tmp;
+    const size_t len = wcslen(dir);
+    if (len > 1 && IsPathSeparator(dir[len - 1]) && dir[len - 2] != ':')
+    {
+        tmp.Set(dir);
+        StripTrailingSlashes(tmp);
+        dir = tmp.Text();
+    }
+
+    const auto& children = m_children.find(dir);
+    if (children == m_children.end())
+        return nullptr;
+
+    const auto& child = children->second.find(name);
+    if (child == children->second.end())
+        return nullptr;
+
+    return &child->second;
+}
+
+bool RepoStatus::Covers(const WCHAR* dir) const
+{
+    return IsUnderDir(dir, scope.Empty() ? root : scope);
+}
+
+const WCHAR* RepoStatus::RelativeScope() const
+{
+    const unsigned len = root.Length();
+    if (scope.Length() <= len)
+        return L"";
+    const WCHAR* rel = scope.Text() + len;
+    while (IsPathSeparator(*rel))
+        ++rel;
+    return rel;
+}
+
+bool RepoStatus::IsIgnored(const WCHAR* dir, const WCHAR* name, bool is_dir) const
+{
+    if (!repo)
+        return false;
+
+    if (!m_ignore)
+        m_ignore = std::make_unique<GitIgnore>(root.Text(), (common_dir.Empty() ? git_dir : common_dir).Text());
+    return m_ignore->IsIgnored(dir, name, is_dir);
+}
+
+bool RepoStatus::IsTracked(const WCHAR* dir, const WCHAR* name) const
+{
+    if (!repo)
+        return false;
+
+    // The index is only loaded the first time something is ignored, since
+    // this is only checked for names that match an ignore pattern.
+    if (!m_tracked)
+    {
+        m_tracked = std::make_unique<TrackedPaths>();
+        m_tracked->Load(*this);
+    }
+
+    StrW full;
+    PathJoin(full, dir, name);
+    StripTrailingSlashes(full);
+    return m_tracked->Contains(full.Text());
+}
+
+// Skips count space-delimited fields in a porcelain v2 record.  Returns
+// nullptr if the record ends first.
+static const char* SkipFields(const char* p, unsigned count)
+{
+    while (count--)
+    {
+        p = strchr(p, ' ');
+        if (!p)
+            return nullptr;
+        ++p;
+    }
+    return p;
+}
+
+// Runs "git status" and parses its output into status.  Fills in the branch
+// and the status entries.
+//
+// The output is porcelain v2 with NUL terminated records, so paths are never
+// quoted and renames don't need to be split on " -> ".  The records are
+// parsed in place, and the paths are converted straight into the status
+// table's arena.
+static bool RunGitStatus(RepoStatus& status)
+{
+    // Ignored files aren't requested (--ignored makes git enumerate and
+    // report everything under ignored directories, which can be huge).
+    // RepoStatus::IsIgnored() classifies them on demand instead.
+    //
+    // Prevent GVFS from printing progress gibberish even while output is
+    // redirected to a pipe.
+    SetEnvironmentVariable(L"GVFS_UNATTENDED", L"1");
+
+    // Git is run directly, rather than through a command interpreter.
+    StrW git;
+    if (!FindOnPath(L"git.exe", git))
+        return false;
+
+    StrW work_tree;
+    StrW git_dir;
+    work_tree.Printf(L"--work-tree=%s", status.root.Text());
+    git_dir.Printf(L"--git-dir=%s", status.git_dir.Text());
+
+    std::vector<const WCHAR*> args = { work_tree.Text(), git_dir.Text(), L"status", L"--porcelain=v2", L"-z", L"--no-ahead-behind", L"-unormal", L"--branch" };
+
+    // The "top" magic makes the pathspec relative to the root no matter what
+    // the current directory is, and "literal" keeps wildcard characters in
+    // names from being treated as wildcards.
+    StrW pathspec;
+    if (!status.scope.Empty())
+    {
+        pathspec.Set(L":(top,literal)");
+        for (const WCHAR* walk = status.RelativeScope(); *walk; ++walk)
+            pathspec.Append(IsPathSeparator(*walk) ? '/' : *walk);
+        args.push_back(L"--");
+        args.push_back(pathspec.Text());
+    }
+
+    DWORD exit_code;
+    std::vector<char> output;
+    if (!RunProcess(git.Text(), args, output, &exit_code))
+        return false;
+    if (exit_code)
+        return false;
+
+    // Make sure the last record is terminated.
+    output.push_back('\0');
+
+    bool initial = false;
+    const char* const end = output.data() + output.size();
+    for (const char* next = output.data(); next < end;)
+    {
+        const char* const record = next;
+        const size_t len = strlen(record);
+        next = record + len + 1;
+        if (!len)
+            continue;
 
-        if (buffer[0] == '#' && buffer[1] == '#' && buffer[2] == ' ')
+        if (record[0] == '#')
         {
-            if (status->branch.Empty())
+            if (strncmp(record, "# branch.oid ", 13) == 0)
+            {
+                initial = (strcmp(record + 13, "(initial)") == 0);
+            }
+            else if (strncmp(record, "# branch.head ", 14) == 0)
             {
-                MultiByteToWideChar(CP_UTF8, 0, buffer + 3, -1, wide.Reserve(), wide.Capacity());
-                wide.ResyncLength();
-                if (wide.EqualI(L"HEAD (no branch)"))
-                    wide.Set(L"HEAD");
-                else if (wcsncmp(wide.Text(), L"No commits yet on ", 18) == 0)
-                    wide.Clear();
+                const char* head = record + 14;
+                if (strcmp(head, "(detached)") == 0)
+                    status.branch.Set(L"HEAD");
                 else
                 {
-                    const WCHAR* end = wcsstr(wide.Text(), L"...");
-                    if (end)
-                        wide.SetEnd(end);
+                    status.branch.Reserve(len);
+                    MultiByteToWideChar(CP_UTF8, 0, head, -1, status.branch.Reserve(), status.branch.Capacity());
+                    status.branch.ResyncLength();
                 }
-                status->branch.Set(wide.Text());
             }
             continue;
         }
 
-        if (buffer[0] && buffer[1] && buffer[2] == ' ')
+        // Ordinary, renamed or copied, and unmerged records have different
+        // numbers of fields before the path.  A renamed or copied record is
+        // followed by another record with the original path.
+        FileStatus filestatus;
+        const char* path;
+        switch (record[0])
         {
-            StrW name;
-            FileStatus filestatus;
-            filestatus.staged = CharToState(buffer[0]);
-            filestatus.working = CharToState(buffer[1]);
-            switch (filestatus.working)
-            {
-            case GitFileState::NEW:
-                switch (filestatus.staged)
-                {
-                case GitFileState::NEW:
-                    filestatus.staged = GitFileState::NONE;
-                    break;
-                }
-                break;
-            case GitFileState::IGNORED:
-                switch (filestatus.staged)
-                {
-                case GitFileState::IGNORED:
-                    filestatus.staged = GitFileState::NONE;
-                    break;
-                }
-                break;
-            }
+        case '1':
+        case '2':
+        case 'u':
+            if (len < 4 || record[1] != ' ')
+                continue;
+            filestatus.staged = CharToState(record[2]);
+            filestatus.working = CharToState(record[3]);
+            if (filestatus.staged == GitFileState::NEW && filestatus.working == GitFileState::NEW)
+                filestatus.staged = GitFileState::NONE;
+            path = SkipFields(record, (record[0] == '1') ? 8 : (record[0] == '2') ? 9 : 10);
+            if (record[0] == '2' && next < end)
+                next += strlen(next) + 1;
+            break;
+        case '?':
+            filestatus.staged = GitFileState::NONE;
+            filestatus.working = GitFileState::NEW;
+            path = SkipFields(record, 1);
+            break;
+        case '!':
+            filestatus.staged = GitFileState::NONE;
+            filestatus.working = GitFileState::IGNORED;
+            path = SkipFields(record, 1);
+            break;
+        default:
+            continue;
+        }
 
-            const char* parse = buffer + 3;
-            if (filestatus.staged == GitFileState::RENAMED)
-            {
-                const char* arrow = strstr(parse, " -> ");
-                if (arrow)
-                    parse = arrow + 4;
-            }
+        if (!path || !*path)
+            continue;
 
-            const bool quoted = (*parse == '\"');
-            if (quoted)
-                ++parse;
-            MultiByteToWideChar(CP_UTF8, 0, parse, -1, wide.Reserve(), wide.Capacity());
-            name.Set(wide.Text());
-            if (quoted)
-            {
-                const WCHAR* end = wcschr(name.Text(), '\"');
-                if (!end)
-                    continue;
-                name.SetEnd(end);
-            }
-            else
-            {
-                const WCHAR* space = wcschr(name.Text(), ' ');
-                if (space)
-                    name.SetEnd(space);
-            }
+        status.status.AddGitPath(status.root, path, record + len - path, filestatus);
+    }
 
-            StrW full;
-            PathJoin(full, root.Text(), name);
-            for (WCHAR* walk = full.Reserve(); *walk; ++walk)
-                if (*walk == '/')
-                    *walk = '\\';
-            StripTrailingSlashes(full);
+    // Before the first commit there's no branch to show yet (the same as
+    // ReadIndexStatus for an unborn HEAD).
+    if (initial)
+        status.branch.Clear();
 
-            status->status.emplace(full.Detach(), filestatus);
+    return true;
+}
+
+static bool s_use_cache = false;
+
+void SetUseGitCache(bool use)
+{
+    s_use_cache = use;
+}
+
+std::shared_ptr<RepoStatus> GitStatus(const WCHAR* _dir, bool walk_up, const WCHAR* scope)
+{
+    std::shared_ptr<RepoStatus> status = std::make_shared<RepoStatus>();
+
+    StrW root;
+    StrW git_dir;
+    if (walk_up)
+    {
+        if (!IsUnderRepo(_dir, root))
+        {
+failed:
+            return status;
         }
+
+        PathJoin(git_dir, root.Text(), L".git");
     }
+    else
+    {
+        if (!IsRepoRoot(_dir))
+            goto failed;
+        PathJoin(git_dir, _dir, L".git");
 
-    _pclose(pipe);
-    free(buffer);
+        root.Set(_dir);
+    }
 
+    if (g_debug)
+        Printf(L"debug: git status in '%s'\n", root.Text());
+
+    // Try reading the index directly first; that avoids starting git, which
+    // is most of the cost in small repos.  If the index has anything that
+    // needs git to resolve, then run git instead.  The repo flag is set
+    // early so that ignore rules can be used while walking the tree.
+    status->root.Set(root);
+    status->git_dir.Set(git_dir);
+    if (scope && status->Covers(scope))
+    {
+        status->scope.Set(scope);
+        StripTrailingSlashes(status->scope);
+        if (!*status->RelativeScope())
+            status->scope.Clear();
+    }
     status->repo = true;
+    StatusCache cache;
+    if (!s_use_cache || !cache.Begin(*status) || !cache.Load(*status))
+    {
+        if (!ReadIndexStatus(*status))
+        {
+            status->repo = false;
+            if (!RunGitStatus(*status))
+                goto failed;
+            status->repo = true;
+        }
+        if (s_use_cache)
+            cache.Save(*status);
+    }
+
     status->clean = status->status.empty();
     status->main = status->branch.Equal(L"main") || status->branch.Equal(L"master");
-    status->root.Set(root);
 
     // Finally (AFTER setting status->clean), add an implicit ignore entry for
     // the .git directory.
     FileStatus filestatus;
     filestatus.staged = GitFileState::NONE;
     filestatus.working = GitFileState::IGNORED;
-    status->status.emplace(git_dir.Detach(), filestatus);
+    status->status.Add(git_dir.Text(), git_dir.Length(), filestatus);
+    status->status.Sort();
+    status->BuildChildStatus();
 
     if (g_debug)
     {
+        StrW wide;
         Printf(L"debug:   root:    %s\n", status->root.Text());
+        if (!status->scope.Empty())
+            Printf(L"debug:   scope:   %s\n", status->scope.Text());
         Printf(L"debug:   branch:  %s\n", status->branch.Text());
         Printf(L"debug:   main:    %s\n", status->main ? L"yes" : L"no");
         Printf(L"debug:   clean:   %s\n", status->clean ? L"yes" : L"no");
-        for (auto iter : status->status)
+        for (const auto& entry : status->status)
         {
             wide.Clear();
-            const WCHAR* color1 = GetColorByKey(GitSymbol(iter.second.staged).color_key);
-            const WCHAR* color2 = GetColorByKey(GitSymbol(iter.second.working).color_key);
+            const WCHAR* color1 = GetColorByKey(GitSymbol(entry.status.staged).color_key);
+            const WCHAR* color2 = GetColorByKey(GitSymbol(entry.status.working).color_key);
             wide.AppendColor(color1);
-            wide.Append(GitSymbol(iter.second.staged).symbol);
+            wide.Append(GitSymbol(entry.status.staged).symbol);
             wide.AppendColorElseNormalIf(color2, color1);
-            wide.Append(GitSymbol(iter.second.working).symbol);
+            wide.Append(GitSymbol(entry.status.working).symbol);
             wide.AppendNormalIf(color2);
-            Printf(L"debug:   %s  %s\n", wide.Text(), iter.first);
+            Printf(L"debug:   %s  %s\n", wide.Text(), entry.path);
         }
     }
 
     return status;
 }
 
+// Joins a path read from a .git or commondir file onto the directory it's
+// relative to, unless it's absolute.
+static void JoinGitFilePath(StrW& out, const WCHAR* dir, StrW& path)
+{
+    path.TrimRight();
+    if (PastDrive(path.Text()) != path.Text() || IsPathSeparator(path.Text()[0]))
+        out = std::move(path);
+    else
+        PathJoin(out, dir, path);
+}
+
+// Finds the git directory for a repo root.  That's root\.git, unless .git is
+// a file (for a linked worktree or a submodule) that says "gitdir: <path>".
+// A linked worktree also has a commondir file naming the directory that has
+// the shared refs, objects, and config; common_dir is left empty otherwise.
+static bool FindGitDir(const WCHAR* root, StrW& git_dir, StrW& common_dir)
+{
+    common_dir.Clear();
+
+    if (!IsRepoRoot(root))
+        return false;
+
+    // Reading a directory as a file fails, so only a .git file is read.
+    StrW text;
+    PathJoin(git_dir, root, L".git");
+    if (ReadUtf8File(git_dir.Text(), text))
+    {
+        if (wcsncmp(text.Text(), L"gitdir: ", 8) != 0)
+            return false;
+
+        StrW target(text.Text() + 8);
+        JoinGitFilePath(git_dir, root, target);
+    }
+
+    StrW file;
+    PathJoin(file, git_dir.Text(), L"commondir");
+    if (ReadUtf8File(file.Text(), text) && text.Length())
+        JoinGitFilePath(common_dir, git_dir.Text(), text);
+    return true;
+}
+
+std::shared_ptr<RepoStatus> GitRepoSummary(const WCHAR* dir)
+{
+    std::shared_ptr<RepoStatus> status = std::make_shared<RepoStatus>();
+
+    StrW git_dir;
+    StrW common_dir;
+    if (!FindGitDir(dir, git_dir, common_dir))
+        return status;
+
+    if (g_debug)
+        Printf(L"debug: git summary in '%s'\n", dir);
+
+    // Only whether there are any changes is needed, so reading the index can
+    // stop at the first change.  If git is needed after all, then it has to
+    // report everything.
+    status->root.Set(dir);
+    status->git_dir = std::move(git_dir);
+    status->common_dir = std::move(common_dir);
+    status->repo = true;
+    if (!ReadIndexSummary(*status))
+    {
+        status->repo = false;
+        if (!RunGitStatus(*status))
+            return status;
+        status->repo = true;
+        status->clean = status->status.empty();
+    }
+
+    status->main = status->branch.Equal(L"main") || status->branch.Equal(L"master");
+
+    if (g_debug)
+    {
+        Printf(L"debug:   root:    %s\n", status->root.Text());
+        Printf(L"debug:   branch:  %s\n", status->branch.Text());
+        Printf(L"debug:   main:    %s\n", status->main ? L"yes" : L"no");
+        Printf(L"debug:   clean:   %s\n", status->clean ? L"yes" : L"no");
+    }
+
+    return status;
+}
+
 const GitStatusSymbol& GitSymbol(GitFileState state)
 {
     static GitStatusSymbol c_symbols[] =
@@ -373,24 +1222,168 @@ const GitStatusSymbol& GitSymbol(GitFileState state)
     return c_symbols[unsigned(state)];
 }
 
-void RepoMap::Add(std::shared_ptr<const RepoStatus> repo)
+/*
+ * RepoMap.
+ */
+
+// Each status is mostly waiting on git or on the file system, but many at
+// once just contend for the disk.
+static const unsigned c_max_status_threads = 8;
+
+RepoMap::~RepoMap()
 {
-    if (repo)
-        m_map.emplace(repo->root.Text(), repo);
+    // Statuses that haven't started are no longer needed.
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_queue.clear();
+    }
+    m_wake.notify_all();
+
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+void RepoMap::Queue(const WCHAR* dir, bool files)
+{
+    if (m_map.find(dir) != m_map.end())
+        return;
+
+    std::shared_ptr<Slot> slot = std::make_shared<Slot>();
+    slot->dir.Set(dir);
+    slot->task = std::packaged_task<std::shared_ptr<RepoStatus>(const WCHAR*)>([files](const WCHAR* dir) {
+        return files ? GitStatus(dir) : GitRepoSummary(dir);
+    });
+    slot->status = slot->task.get_future().share();
+    m_map.emplace(slot->dir.Text(), slot);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.emplace_back(std::move(slot));
+
+        // Threads are only started as the queue outgrows the idle ones.
+        if (!m_idle && m_threads.size() < clamp<unsigned>(std::thread::hardware_concurrency(), 2, c_max_status_threads))
+            m_threads.emplace_back(&RepoMap::WorkerMain, this);
+    }
+    m_wake.notify_one();
+}
+
+void RepoMap::Prefetch(const WCHAR* dir)
+{
+    if (m_map.find(dir) != m_map.end())
+        return;
+
+    Queue(dir);
+    m_map.find(dir)->second->prefetched = true;
 }
 
 void RepoMap::Remove(const WCHAR* dir)
 {
     const auto& iter = m_map.find(dir);
     if (iter != m_map.end())
+    {
+        // Nothing needs the status anymore, so don't start it.
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            iter->second->started = true;
+        }
         m_map.erase(iter);
+    }
 }
 
-std::shared_ptr<const RepoStatus> RepoMap::Find(const WCHAR* dir) const
+void RepoMap::DropPrefetched()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto iter = m_map.begin(); iter != m_map.end();)
+    {
+        if (iter->second->prefetched)
+        {
+            iter->second->started = true;
+            iter = m_map.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+}
+
+std::shared_ptr<const RepoStatus> RepoMap::Find(const WCHAR* dir)
 {
     const auto& iter = m_map.find(dir);
     if (iter == m_map.end())
         return nullptr;
-    return iter->second;
+
+    Slot& slot = *iter->second;
+    bool run = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!slot.started)
+        {
+            slot.started = true;
+            run = true;
+        }
+    }
+    if (run)
+        slot.task(slot.dir.Text());
+
+    // Waits if a worker is still getting the status.
+    const std::shared_ptr<RepoStatus>& repo = slot.status.get();
+    if (!repo || !repo->repo)
+        return nullptr;
+    return repo;
 }
 
+std::shared_ptr<const RepoStatus> RepoMap::FindScoped(const WCHAR* dir)
+{
+    StrW root;
+    if (!IsUnderRepo(dir, root))
+        return GitStatus(dir, true);
+
+    for (auto& repo : m_scoped)
+    {
+        if (!repo->root.EqualI(root))
+            continue;
+        if (repo->Covers(dir))
+            return repo;
+
+        // Widen the scope to the nearest directory that covers both.
+        StrW scope(dir);
+        while (!IsUnderDir(repo->scope.Text(), scope) && PathToParent(scope))
+        {
+        }
+
+        if (g_debug)
+            Printf(L"debug: widen git status scope from '%s' to '%s'\n", repo->scope.Text(), scope.Text());
+        repo = GitStatus(dir, true, scope.Text());
+        return repo;
+    }
+
+    std::shared_ptr<RepoStatus> repo = GitStatus(dir, true, dir);
+    if (repo->repo)
+        m_scoped.emplace_back(repo);
+    return repo;
+}
+
+void RepoMap::WorkerMain()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        ++m_idle;
+        m_wake.wait(lock, [this]{ return m_stop || !m_queue.empty(); });
+        --m_idle;
+        if (m_stop)
+            return;
+
+        std::shared_ptr<Slot> slot = std::move(m_queue.front());
+        m_queue.pop_front();
+        if (slot->started)
+            continue;
+        slot->started = true;
+
+        lock.unlock();
+        slot->task(slot->dir.Text());
+        lock.lock();
+    }
+}
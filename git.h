@@ -7,9 +7,17 @@
 
 #include <windows.h>
 #include "str.h"
+#include "enumdir.h"
 
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 enum class GitFileState : BYTE
 {
@@ -32,16 +40,95 @@ struct FileStatus
     GitFileState        working;
 };
 
+// StatusTable holds the status entries for a repo, keyed by full path (with
+// backslashes).  The paths live in a NameArena and the entries in a flat
+// vector, so a repo with many changes doesn't need an allocation per entry.
+// Entries may be added in any order; Sort() orders them and removes
+// duplicates (if a path is added more than once, the first one wins).
+class StatusTable
+{
+public:
+    struct Entry
+    {
+        const WCHAR*    path;
+        FileStatus      status;
+    };
+
+    typedef std::vector<Entry>::const_iterator const_iterator;
+
+    void                Add(const WCHAR* path, size_t len, FileStatus status);
+    void                AddGitPath(const StrW& root, const char* path, size_t len, FileStatus status);
+    void                Sort();
+
+    bool                empty() const { return m_entries.empty(); }
+    size_t              size() const { return m_entries.size(); }
+    const_iterator      begin() const { return m_entries.begin(); }
+    const_iterator      end() const { return m_entries.end(); }
+
+private:
+    NameArena           m_names;
+    std::vector<Entry>  m_entries;
+};
+
+// The status of one name within a directory:  its own status, and the
+// summary of its own status plus everything under it (for a directory).  The
+// summary keeps the highest priority state (the lowest GitFileState value,
+// not counting NONE).
+struct ChildStatus
+{
+    FileStatus          own;
+    FileStatus          summary;
+};
+
+class GitIgnore;
+class TrackedPaths;
+
 struct RepoStatus
 {
+                        RepoStatus();
                         ~RepoStatus();
 
+    // Builds the per-directory child status table from the status entries,
+    // in one pass.  GitStatus() calls this once the entries are loaded.
+    void                BuildChildStatus();
+
+    // Returns the status of name in dir, or nullptr if neither it nor
+    // anything under it has a status.
+    const ChildStatus*  FindChild(const WCHAR* dir, const WCHAR* name) const;
+
+    // Ignored files aren't included in status; they're classified on demand
+    // from the .gitignore files, .git/info/exclude, and core.excludesFile.
+    bool                IsIgnored(const WCHAR* dir, const WCHAR* name, bool is_dir) const;
+
+    // Returns whether name in dir is in the index (for a directory, whether
+    // anything under it is).  Tracked files are never ignored, even when they
+    // match an ignore pattern, so check this before showing a file as
+    // ignored.
+    bool                IsTracked(const WCHAR* dir, const WCHAR* name) const;
+
+    // Returns whether the status includes dir and everything under it.
+    bool                Covers(const WCHAR* dir) const;
+
+    // Returns the scope relative to the root, or "" for the whole repo.
+    const WCHAR*        RelativeScope() const;
+
     bool                repo = false;
     bool                main = true;    // Branch is main or master.
-    bool                clean = true;
+    bool                clean = true;   // Within the scope.
     StrW                branch;
     StrW                root;
-    std::map<const WCHAR*, FileStatus, SortCase> status;
+    StrW                git_dir;
+    StrW                common_dir;     // Shared refs, objects, and config for a linked worktree (otherwise empty).
+    StrW                scope;          // Status only covers this directory and below (empty means the whole repo).
+    StatusTable         status;
+
+private:
+    typedef std::unordered_map<const WCHAR*, ChildStatus, HashCase, EqualCase> ChildMap;
+
+    std::unordered_map<const WCHAR*, ChildMap, HashCase, EqualCase> m_children;
+    NameArena           m_child_names;
+    mutable std::unique_ptr<GitIgnore> m_ignore;
+    mutable std::unique_ptr<TrackedPaths> m_tracked;
 };
 
 struct GitStatusSymbol
@@ -51,15 +138,76 @@ struct GitStatusSymbol
 };
 
 bool IsUnderRepo(const WCHAR* dir);
-std::shared_ptr<RepoStatus> GitStatus(const WCHAR* dir, bool need_ignored, bool walk_up=false);
+
+// Records whether dir is a repo root, from a listing of dir that was
+// enumerated anyway, so that IsRepoRoot() doesn't need to probe for .git.
+void NoteRepoRoot(const WCHAR* dir, bool is_root);
+bool IsRepoRoot(const WCHAR* dir);
+void DebugPrintRepoRootCounters();
+
+void SetUseGitCache(bool use);
+std::shared_ptr<RepoStatus> GitStatus(const WCHAR* dir, bool walk_up=false, const WCHAR* scope=nullptr);
+
+// Gets only the branch and whether the repo is clean, for the repo field
+// (--git-repos), without the status entries.  Follows a .git file to the
+// git directory of a linked worktree or a submodule.
+std::shared_ptr<RepoStatus> GitRepoSummary(const WCHAR* dir);
 const GitStatusSymbol& GitSymbol(GitFileState state);
 
+// Gets the files outside the worktree that affect status:  the repo's config
+// and info/exclude, the global configs, and the global excludes file.
+void GetStatusConfigFiles(const WCHAR* git_dir, std::vector<StrW>& files);
+
+// RepoMap collects the status of repos found while listing directories.
+//
+// Queue() starts getting the status for a directory on a small pool of
+// worker threads, so that listing many repos waits on them concurrently
+// instead of one at a time.  Find() only blocks when the status is actually
+// needed; if no worker has started on it yet, Find() gets it inline.  When
+// the file statuses won't be needed, Queue() only gets a GitRepoSummary().
+//
+// Prefetch() is like Queue(), for a repo root found ahead of the traversal.
+// If the traversal never gets there (for example, because it stopped early),
+// DropPrefetched() drops the ones that were never taken.
+//
+// FindScoped() gets the status of the repo containing a directory, scoped to
+// just that directory and below.  It reuses an earlier status whose scope
+// covers the directory, and otherwise widens the scope to cover both.
 class RepoMap
 {
 public:
-    void                Add(std::shared_ptr<const RepoStatus> repo);
+                        RepoMap() = default;
+                        ~RepoMap();
+
+    void                Queue(const WCHAR* dir, bool files=true);
+    void                Prefetch(const WCHAR* dir);
     void                Remove(const WCHAR* dir);
-    std::shared_ptr<const RepoStatus> Find(const WCHAR* dir) const;
+    void                DropPrefetched();
+    std::shared_ptr<const RepoStatus> Find(const WCHAR* dir);
+    std::shared_ptr<const RepoStatus> FindScoped(const WCHAR* dir);
+
 private:
-    std::map<const WCHAR*, std::shared_ptr<const RepoStatus>, SortCaseless> m_map;
+    struct Slot
+    {
+        StrW            dir;
+        std::packaged_task<std::shared_ptr<RepoStatus>(const WCHAR*)> task;
+        std::shared_future<std::shared_ptr<RepoStatus>> status;
+        bool            started = false;    // Guarded by m_mutex.
+        bool            prefetched = false;
+    };
+
+    void                WorkerMain();
+
+    // m_map and m_scoped are only used on the main thread, by Queue(),
+    // Prefetch(), Remove(), DropPrefetched(), Find(), and FindScoped(), so
+    // they aren't guarded by m_mutex.  The workers only see m_queue.
+    std::map<const WCHAR*, std::shared_ptr<Slot>, SortCaseless> m_map; // Keys point into Slot::dir.
+    std::vector<std::shared_ptr<RepoStatus>> m_scoped;  // At most one per repo.
+
+    std::mutex          m_mutex;
+    std::condition_variable m_wake;
+    std::deque<std::shared_ptr<Slot>> m_queue;
+    std::vector<std::thread> m_threads;
+    unsigned            m_idle = 0;
+    bool                m_stop = false;
 };
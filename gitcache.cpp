@@ -0,0 +1,478 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "gitcache.h"
+#include "gitindex.h"
+#include "git.h"
+#include "filesys.h"
+#include "handle.h"
+#include "output.h"
+
+#include <unordered_set>
+
+static const DWORD c_cache_magic = 0x53475844;     // "DXGS"
+static const DWORD c_cache_version = 1;
+static const DWORD c_max_cache_size = 64 * 1024 * 1024;
+
+static const DWORD c_mode_type_mask = 0170000;
+static const DWORD c_mode_gitlink = 0160000;
+
+static const ULONGLONG c_fnv_offset = 0xcbf29ce484222325;
+static const ULONGLONG c_fnv_prime = 0x00000100000001b3;
+
+// The file is the key followed by the status.  Begin() builds the key in
+// memory, and Load() compares it byte for byte with the start of the file,
+// so any difference (including the version) makes the cache stale.
+//
+// Strings are a DWORD length followed by the characters and a NUL.  Every
+// part is a multiple of sizeof(WCHAR), so the strings can be used in place.
+//
+//  Key:        magic, version, root, scope, HEAD branch, HEAD oid, unborn,
+//              and a stamp (name, exists, last write time, size) for each
+//              file the status depends on.
+//  Status:     branch, and the entries (path relative to the root, status).
+//  Listings:   a fingerprint (path relative to the root, count, hash) for
+//              each directory in the scope.
+
+static void Write(std::vector<BYTE>& out, const void* p, size_t len)
+{
+    const BYTE* const bytes = static_cast<const BYTE*>(p);
+    out.insert(out.end(), bytes, bytes + len);
+}
+
+template <class T>
+static void WriteValue(std::vector<BYTE>& out, const T& value)
+{
+    Write(out, &value, sizeof(value));
+}
+
+static void WriteString(std::vector<BYTE>& out, const WCHAR* s, size_t len)
+{
+    const WCHAR nul = '\0';
+    WriteValue(out, DWORD(len));
+    Write(out, s, len * sizeof(WCHAR));
+    WriteValue(out, nul);
+}
+
+static void WriteStamp(std::vector<BYTE>& out, const StrW& file)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    const DWORD exists = !!GetFileAttributesEx(file.Text(), GetFileExInfoStandard, &fad);
+    if (!exists)
+        ZeroMemory(&fad, sizeof(fad));
+
+    WriteString(out, file.Text(), file.Length());
+    WriteValue(out, exists);
+    WriteValue(out, fad.ftLastWriteTime);
+    WriteValue(out, fad.nFileSizeHigh);
+    WriteValue(out, fad.nFileSizeLow);
+}
+
+namespace
+{
+
+class CacheReader
+{
+public:
+                        CacheReader(const BYTE* p, const BYTE* end) : m_p(p), m_end(end) {}
+
+    bool                Read(void* out, size_t len);
+    template <class T>
+    bool                ReadValue(T& value) { return Read(&value, sizeof(value)); }
+    bool                ReadString(const WCHAR*& s, DWORD& len);
+    bool                AtEnd() const { return m_p == m_end; }
+
+private:
+    const BYTE*         m_p;
+    const BYTE* const   m_end;
+};
+
+}; // namespace
+
+bool CacheReader::Read(void* out, size_t len)
+{
+    if (size_t(m_end - m_p) < len)
+        return false;
+    memcpy(out, m_p, len);
+    m_p += len;
+    return true;
+}
+
+bool CacheReader::ReadString(const WCHAR*& s, DWORD& len)
+{
+    if (!ReadValue(len))
+        return false;
+
+    const size_t cb = (size_t(len) + 1) * sizeof(WCHAR);
+    if (size_t(m_end - m_p) < cb)
+        return false;
+
+    WCHAR nul;
+    memcpy(&nul, m_p + len * sizeof(WCHAR), sizeof(nul));
+    if (nul)
+        return false;
+
+    s = reinterpret_cast<const WCHAR*>(m_p);
+    m_p += cb;
+    return true;
+}
+
+static bool Stale(const WCHAR* reason)
+{
+    if (g_debug)
+        Printf(L"debug: git status cache: not used (%s)\n", reason);
+    return false;
+}
+
+static void JoinRel(StrW& full, const StrW& root, const StrW& rel)
+{
+    if (rel.Length())
+        PathJoin(full, root.Text(), rel);
+    else
+        full.Set(root);
+}
+
+static bool IsFingerprinted(const DirEntry& e, bool root)
+{
+    if (IsPseudoDirectory(e.name))
+        return false;
+    if (root && _wcsicmp(e.name, L".git") == 0)
+        return false;
+    return true;
+}
+
+static ULONGLONG HashBytes(ULONGLONG hash, const void* p, size_t len)
+{
+    for (const BYTE* bytes = static_cast<const BYTE*>(p); len--; ++bytes)
+    {
+        hash ^= *bytes;
+        hash *= c_fnv_prime;
+    }
+    return hash;
+}
+
+// The fingerprint doesn't depend on the order of the entries.  Directories
+// only contribute their names, since their own listings have fingerprints.
+static ULONGLONG Fingerprint(const DirListing& listing, bool root, DWORD& count)
+{
+    ULONGLONG fingerprint = 0;
+    count = 0;
+    for (const DirEntry& e : listing.entries)
+    {
+        if (!IsFingerprinted(e, root))
+            continue;
+
+        const DWORD type = e.attributes & (FILE_ATTRIBUTE_DIRECTORY|FILE_ATTRIBUTE_REPARSE_POINT);
+        ULONGLONG hash = HashBytes(c_fnv_offset, e.name, e.name_len * sizeof(WCHAR));
+        hash = HashBytes(hash, &type, sizeof(type));
+        if (!(type & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            hash = HashBytes(hash, &e.size, sizeof(e.size));
+            hash = HashBytes(hash, &e.modified, sizeof(e.modified));
+        }
+
+        fingerprint += hash;
+        ++count;
+    }
+    return fingerprint;
+}
+
+static bool ReadCacheFile(const WCHAR* path, std::vector<BYTE>& data)
+{
+    SHFile h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (h.Empty())
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(h, &size) || size.QuadPart > c_max_cache_size)
+        return false;
+
+    DWORD bytes;
+    data.resize(size_t(size.QuadPart));
+    return ReadFile(h, data.data(), DWORD(data.size()), &bytes, nullptr) && bytes == data.size();
+}
+
+struct StatusCache::Fingerprints
+{
+    std::unordered_set<const WCHAR*, HashCaseless, EqualCaseless> tracked_dirs;
+    NameArena           names;
+    std::vector<BYTE>   data;
+    DWORD               count = 0;
+};
+
+bool StatusCache::Begin(const RepoStatus& status)
+{
+    m_key.clear();
+    GetSystemTimeAsFileTime(&m_started);
+
+    StrW branch;
+    BYTE oid[20] = {};
+    bool unborn;
+    if (!ReadHead(status.git_dir.Text(), branch, oid, unborn))
+        return Stale(L"unable to resolve HEAD");
+
+    PathJoin(m_path, status.git_dir.Text(), L"dirx-status");
+
+    std::vector<StrW> files;
+    GetStatusConfigFiles(status.git_dir.Text(), files);
+    files.emplace_back();
+    PathJoin(files.back(), status.git_dir.Text(), L"index");
+
+    const WCHAR* const scope = status.RelativeScope();
+    WriteValue(m_key, c_cache_magic);
+    WriteValue(m_key, c_cache_version);
+    WriteString(m_key, status.root.Text(), status.root.Length());
+    WriteString(m_key, scope, wcslen(scope));
+    WriteString(m_key, branch.Text(), branch.Length());
+    Write(m_key, oid, sizeof(oid));
+    WriteValue(m_key, DWORD(unborn));
+    WriteValue(m_key, DWORD(files.size()));
+    for (const auto& file : files)
+        WriteStamp(m_key, file);
+    return true;
+}
+
+bool StatusCache::Enumerate(const WCHAR* dir, DirListing& listing)
+{
+    if (!m_enumerator)
+        m_enumerator = MakeDirEnumerator();
+
+    PathJoin(listing.spec, dir, L"*");
+    listing.Enumerate(*m_enumerator, false);
+    return !listing.open_err && listing.end_err == ERROR_NO_MORE_FILES;
+}
+
+bool StatusCache::Load(RepoStatus& status)
+{
+    assert(status.status.empty());
+
+    std::vector<BYTE> data;
+    if (!ReadCacheFile(m_path.Text(), data))
+        return Stale(L"no cache file");
+    if (data.size() < m_key.size() || memcmp(data.data(), m_key.data(), m_key.size()) != 0)
+        return Stale(L"repo changed");
+
+    struct Cached
+    {
+        const WCHAR*    path;
+        DWORD           len;
+        FileStatus      status;
+    };
+
+    CacheReader reader(data.data() + m_key.size(), data.data() + data.size());
+    const WCHAR* branch;
+    DWORD branch_len;
+    DWORD count;
+    if (!reader.ReadString(branch, branch_len) || !reader.ReadValue(count))
+        return Stale(L"not valid");
+
+    std::vector<Cached> entries;
+    entries.reserve(min<size_t>(count, data.size() / sizeof(Cached)));
+    for (DWORD ii = 0; ii < count; ++ii)
+    {
+        Cached cached;
+        if (!reader.ReadString(cached.path, cached.len) || !reader.ReadValue(cached.status) ||
+            cached.status.staged >= GitFileState::COUNT || cached.status.working >= GitFileState::COUNT)
+            return Stale(L"not valid");
+        entries.emplace_back(cached);
+    }
+
+    // Every listing must have the same fingerprint as when the status was
+    // computed.
+    StrW rel;
+    StrW full;
+    if (!reader.ReadValue(count))
+        return Stale(L"not valid");
+    for (DWORD ii = 0; ii < count; ++ii)
+    {
+        const WCHAR* dir;
+        DWORD dir_len;
+        DWORD expected_count;
+        ULONGLONG expected;
+        if (!reader.ReadString(dir, dir_len) || !reader.ReadValue(expected_count) || !reader.ReadValue(expected))
+            return Stale(L"not valid");
+
+        rel.Set(dir, dir_len);
+        JoinRel(full, status.root, rel);
+
+        DWORD actual_count;
+        DirListing listing;
+        if (!Enumerate(full.Text(), listing) ||
+            Fingerprint(listing, rel.Empty(), actual_count) != expected ||
+            actual_count != expected_count)
+        {
+            if (g_debug)
+                Printf(L"debug: git status cache: '%s' changed\n", full.Text());
+            return false;
+        }
+    }
+    if (!reader.AtEnd())
+        return Stale(L"not valid");
+
+    status.branch.Set(branch, branch_len);
+    for (const auto& cached : entries)
+    {
+        rel.Set(cached.path, cached.len);
+        JoinRel(full, status.root, rel);
+        status.status.Add(full.Text(), full.Length(), cached.status);
+    }
+
+    if (g_debug)
+        Printf(L"debug: git status cache: reused (%u entries, %u listings)\n", unsigned(entries.size()), unsigned(count));
+    return true;
+}
+
+bool StatusCache::AddFingerprints(const RepoStatus& status, StrW& rel, bool top, Fingerprints& fingerprints)
+{
+    StrW full;
+    JoinRel(full, status.root, rel);
+
+    DirListing listing;
+    if (!Enumerate(full.Text(), listing))
+        return false;
+
+    const bool root = rel.Empty();
+    const bool tracked = (root || fingerprints.tracked_dirs.find(rel.Text()) != fingerprints.tracked_dirs.end());
+
+    // A nested repo is reported as a whole, so what's in it doesn't matter.
+    if (!top && !tracked)
+    {
+        for (const DirEntry& e : listing.entries)
+        {
+            if (_wcsicmp(e.name, L".git") == 0)
+                return true;
+        }
+    }
+
+    // Anything modified since the status was started might not be reflected
+    // in it.
+    for (const DirEntry& e : listing.entries)
+    {
+        if (IsFingerprinted(e, root) && CompareFileTime(&e.modified, &m_started) >= 0)
+            return false;
+    }
+
+    DWORD count;
+    const ULONGLONG fingerprint = Fingerprint(listing, root, count);
+    WriteString(fingerprints.data, rel.Text(), rel.Length());
+    WriteValue(fingerprints.data, count);
+    WriteValue(fingerprints.data, fingerprint);
+    ++fingerprints.count;
+
+    // Ignored directories can still contain tracked files.  Reparse points
+    // are reported as files, so they aren't followed.
+    const unsigned rel_len = rel.Length();
+    for (const DirEntry& e : listing.entries)
+    {
+        if (!IsFingerprinted(e, root))
+            continue;
+        if (!(e.attributes & FILE_ATTRIBUTE_DIRECTORY) || (e.attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            continue;
+
+        if (rel_len)
+            rel.Append('\\');
+        rel.Append(e.name, e.name_len);
+
+        bool ok = true;
+        if (fingerprints.tracked_dirs.find(rel.Text()) != fingerprints.tracked_dirs.end() ||
+            !status.IsIgnored(full.Text(), e.name, true))
+            ok = AddFingerprints(status, rel, false, fingerprints);
+
+        rel.SetLength(rel_len);
+        if (!ok)
+            return false;
+    }
+
+    return true;
+}
+
+void StatusCache::Save(const RepoStatus& status)
+{
+    if (m_key.empty())
+        return;
+
+    // Git reports changes inside submodules, which the fingerprints can't
+    // see.  Otherwise the index is only needed for the tracked directories.
+    StrW file;
+    GitIndex index;
+    Fingerprints fingerprints;
+    PathJoin(file, status.git_dir.Text(), L"index");
+    if (!index.Load(file.Text()))
+        return;
+    for (const auto& entry : index.Entries())
+    {
+        if ((entry.mode & c_mode_type_mask) == c_mode_gitlink)
+        {
+            if (g_debug)
+                Printf(L"debug: git status cache: not saved (submodules)\n");
+            return;
+        }
+
+        file.Set(entry.path);
+        while (const WCHAR* slash = wcsrchr(file.Text(), '\\'))
+        {
+            file.SetEnd(slash);
+            if (fingerprints.tracked_dirs.find(file.Text()) != fingerprints.tracked_dirs.end())
+                break;
+            fingerprints.tracked_dirs.emplace(fingerprints.names.Add(file.Text(), file.Length()));
+        }
+    }
+
+    StrW rel(status.RelativeScope());
+    for (WCHAR* walk = rel.Reserve(); *walk; ++walk)
+    {
+        if (*walk == '/')
+            *walk = '\\';
+    }
+
+    StrW full;
+    JoinRel(full, status.root, rel);
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesEx(full.Text(), GetFileExInfoStandard, &fad) ||
+        CompareFileTime(&fad.ftLastWriteTime, &m_started) >= 0 ||
+        !AddFingerprints(status, rel, true, fingerprints))
+    {
+        if (g_debug)
+            Printf(L"debug: git status cache: not saved (files changed while getting status)\n");
+        return;
+    }
+
+    std::vector<BYTE> data(m_key);
+    WriteString(data, status.branch.Text(), status.branch.Length());
+    WriteValue(data, DWORD(status.status.size()));
+    for (const auto& entry : status.status)
+    {
+        const WCHAR* path = entry.path + status.root.Length();
+        while (IsPathSeparator(*path))
+            ++path;
+        WriteString(data, path, wcslen(path));
+        WriteValue(data, entry.status);
+    }
+    WriteValue(data, fingerprints.count);
+    Write(data, fingerprints.data.data(), fingerprints.data.size());
+    if (data.size() > c_max_cache_size)
+        return;
+
+    // Write to a temporary file and then replace the cache file, so that
+    // other instances never see a partial file.
+    StrW temp;
+    temp.Printf(L"%s.%u.tmp", m_path.Text(), GetCurrentThreadId());
+    SHFile h = CreateFile(temp.Text(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (h.Empty())
+        return;
+
+    DWORD written;
+    const bool ok = (WriteFile(h, data.data(), DWORD(data.size()), &written, nullptr) && written == data.size());
+    h.Close();
+    if (!ok || !MoveFileEx(temp.Text(), m_path.Text(), MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFile(temp.Text());
+        return;
+    }
+
+    if (g_debug)
+        Printf(L"debug: git status cache: saved (%u entries, %u listings)\n", unsigned(status.status.size()), unsigned(fingerprints.count));
+}
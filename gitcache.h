@@ -0,0 +1,53 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+#include "enumdir.h"
+
+#include <memory>
+#include <vector>
+
+struct RepoStatus;
+
+// StatusCache saves a repo's status in a file in its git directory
+// (--git-cache), so that listing an unchanged repo again doesn't need to
+// compute the status again.
+//
+// The cache is keyed by the root and scope, the commit HEAD points at, and
+// the timestamps and sizes of the index and of the config and exclude files
+// that affect status.  Modifying an existing file doesn't update its
+// directory's last write time, so the cache also has a fingerprint of each
+// directory listing in the scope (the names, plus the sizes and last write
+// times of files), and a changed fingerprint makes the cache stale.  Ignored
+// directories aren't fingerprinted, unless they contain tracked files.
+//
+// Begin() takes the stamps for the key; call it before computing the status,
+// so that anything that changes while the status is being computed makes the
+// cache look stale on the next run.  Save() doesn't save a status that could
+// have raced with changes to the files.
+class StatusCache
+{
+public:
+                        StatusCache() = default;
+                        ~StatusCache() = default;
+
+    bool                Begin(const RepoStatus& status);
+    bool                Load(RepoStatus& status);
+    void                Save(const RepoStatus& status);
+
+private:
+    struct Fingerprints;
+
+    bool                Enumerate(const WCHAR* dir, DirListing& listing);
+    bool                AddFingerprints(const RepoStatus& status, StrW& rel, bool top, Fingerprints& fingerprints);
+
+    StrW                m_path;
+    std::vector<BYTE>   m_key;
+    FILETIME            m_started = {};
+    std::unique_ptr<DirEnumerator> m_enumerator;
+};
@@ -0,0 +1,1563 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "gitindex.h"
+#include "git.h"
+#include "filesys.h"
+#include "handle.h"
+#include "inflate.h"
+#include "output.h"
+#include "sha1.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+static const size_t c_oid_len = 20;
+
+// Unix epoch, in FILETIME units.
+static const ULONGLONG c_unix_epoch = 116444736000000000;
+
+static const DWORD c_mode_type_mask = 0170000;
+static const DWORD c_mode_dir = 0040000;
+static const DWORD c_mode_file = 0100000;
+
+static const WORD c_flag_assume_valid = 0x8000;
+static const WORD c_flag_extended = 0x4000;
+static const WORD c_flag_stage_mask = 0x3000;
+static const WORD c_ext_skip_worktree = 0x4000;
+static const WORD c_ext_intent_to_add = 0x2000;
+
+// Directories nested deeper than this are left to git, rather than risk
+// running out of stack on a corrupt index or tree.
+static const int c_max_tree_depth = 1024;
+
+static inline DWORD ReadBE32(const BYTE* p)
+{
+    return (DWORD(p[0]) << 24) | (DWORD(p[1]) << 16) | (DWORD(p[2]) << 8) | DWORD(p[3]);
+}
+
+static inline WORD ReadBE16(const BYTE* p)
+{
+    return WORD((p[0] << 8) | p[1]);
+}
+
+static bool Unsupported(const WCHAR* reason)
+{
+    if (g_debug)
+        Printf(L"debug: can't use the index (%s); running git\n", reason);
+    return false;
+}
+
+/*
+ * File helpers.
+ */
+
+namespace
+{
+
+class MappedFile
+{
+public:
+                        MappedFile() = default;
+                        ~MappedFile() { if (m_view) UnmapViewOfFile(m_view); }
+
+    bool                Open(const WCHAR* path, FILETIME* modified=nullptr);
+
+    const BYTE*         Data() const { return m_view; }
+    size_t              Size() const { return m_size; }
+
+private:
+    const BYTE*         m_view = nullptr;
+    size_t              m_size = 0;
+};
+
+}; // namespace
+
+bool MappedFile::Open(const WCHAR* path, FILETIME* modified)
+{
+    assert(!m_view);
+
+    SHFile h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE|FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, 0);
+    if (h.Empty())
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(h, &size) || !size.QuadPart || ULONGLONG(size.QuadPart) > size_t(-1))
+        return false;
+    if (modified && !GetFileTime(h, nullptr, nullptr, modified))
+        return false;
+
+    SHBasic mapping = CreateFileMapping(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping.Empty())
+        return false;
+    m_view = static_cast<const BYTE*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_view)
+        return false;
+
+    m_size = size_t(size.QuadPart);
+    return true;
+}
+
+// Reads up to max_len bytes from a file, starting at offset.
+static bool ReadFileBytes(const WCHAR* path, std::vector<BYTE>& out, ULONGLONG offset=0, DWORD max_len=4096)
+{
+    out.clear();
+
+    SHFile h = CreateFile(path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE|FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, 0);
+    if (h.Empty())
+        return false;
+
+    OVERLAPPED ov = {};
+    ov.Offset = DWORD(offset);
+    ov.OffsetHigh = DWORD(offset >> 32);
+
+    DWORD bytes;
+    out.resize(max_len);
+    if (!ReadFile(h, out.data(), max_len, &bytes, &ov))
+        return false;
+
+    out.resize(bytes);
+    return true;
+}
+
+static bool ReadTextFile(const WCHAR* path, StrA& out)
+{
+    std::vector<BYTE> bytes;
+    if (!ReadFileBytes(path, bytes))
+        return false;
+
+    out.Set(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return true;
+}
+
+static void Utf8ToWide(const char* p, size_t len, StrW& out)
+{
+    out.Clear();
+    const int needed = len ? MultiByteToWideChar(CP_UTF8, 0, p, int(len), nullptr, 0) : 0;
+    if (needed > 0)
+    {
+        WCHAR* text = out.Reserve(needed + 1);
+        MultiByteToWideChar(CP_UTF8, 0, p, int(len), text, needed);
+        text[needed] = '\0';
+        out.ResyncLength();
+    }
+}
+
+static int HexValue(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+// Parses a SHA-1 object id in hex.  It must not be followed by another hex
+// digit (which is what a SHA-256 object id looks like).
+static bool ParseOid(const char* hex, BYTE* oid)
+{
+    for (size_t ii = 0; ii < c_oid_len; ++ii)
+    {
+        const int hi = HexValue(hex[ii * 2]);
+        const int lo = (hi >= 0) ? HexValue(hex[ii * 2 + 1]) : -1;
+        if (lo < 0)
+            return false;
+        oid[ii] = BYTE((hi << 4) | lo);
+    }
+    return HexValue(hex[c_oid_len * 2]) < 0;
+}
+
+static void FormatOid(const BYTE* oid, StrW& hex)
+{
+    static const WCHAR c_digits[] = L"0123456789abcdef";
+
+    hex.Clear();
+    for (size_t ii = 0; ii < c_oid_len; ++ii)
+    {
+        hex.Append(c_digits[oid[ii] >> 4]);
+        hex.Append(c_digits[oid[ii] & 0xf]);
+    }
+}
+
+static void ToUnixTime(const FILETIME& ft, DWORD& sec, DWORD& nsec)
+{
+    ULONGLONG t = (ULONGLONG(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    t = (t > c_unix_epoch) ? t - c_unix_epoch : 0;
+    sec = DWORD(t / 10000000);
+    nsec = DWORD(t % 10000000) * 100;       // FILETIME has 100ns resolution.
+}
+
+/*
+ * GitIndex.
+ */
+
+const GitIndex::CacheTree* GitIndex::CacheTree::FindChild(const char* name, size_t len) const
+{
+    for (const auto& child : children)
+    {
+        if (child.name.Length() == len && memcmp(child.name.Text(), name, len) == 0)
+            return &child;
+    }
+    return nullptr;
+}
+
+// Parses a cache tree entry and its subtrees:  the path component (NUL
+// terminated), the entry count (-1 if invalidated), a space, the subtree
+// count, a newline, and then the tree's object id if it's valid.
+static bool ParseCacheTree(const BYTE*& p, const BYTE* end, GitIndex::CacheTree& tree, int depth=0)
+{
+    if (depth > c_max_tree_depth)
+        return false;
+
+    const BYTE* nul = static_cast<const BYTE*>(memchr(p, '\0', end - p));
+    if (!nul)
+        return false;
+    tree.name.Set(reinterpret_cast<const char*>(p), nul - p);
+    p = nul + 1;
+
+    const BYTE* eol = static_cast<const BYTE*>(memchr(p, '\n', end - p));
+    const BYTE* space = eol ? static_cast<const BYTE*>(memchr(p, ' ', eol - p)) : nullptr;
+    if (!space)
+        return false;
+    tree.entry_count = atoi(reinterpret_cast<const char*>(p));
+    const int subtrees = atoi(reinterpret_cast<const char*>(space + 1));
+    p = eol + 1;
+
+    if (tree.entry_count >= 0)
+    {
+        if (size_t(end - p) < c_oid_len)
+            return false;
+        memcpy(tree.oid, p, c_oid_len);
+        p += c_oid_len;
+    }
+
+    if (subtrees < 0 || subtrees > end - p)
+        return false;
+    tree.children.resize(subtrees);
+    for (auto& child : tree.children)
+    {
+        if (!ParseCacheTree(p, end, child, depth + 1))
+            return false;
+    }
+    return true;
+}
+
+bool GitIndex::Load(const WCHAR* file)
+{
+    m_entries.clear();
+    m_git_paths.clear();
+    m_names.Clear();
+    m_has_tree = false;
+
+    MappedFile index;
+    if (!index.Open(file, &m_modified))
+        return false;
+
+    // Header, entries, extensions, and then the checksum.
+    const BYTE* data = index.Data();
+    if (index.Size() < 12 + c_oid_len || memcmp(data, "DIRC", 4) != 0)
+        return false;
+
+    m_version = ReadBE32(data + 4);
+    if (m_version < 2 || m_version > 4)
+        return Unsupported(L"index version");
+
+    // The index ends with a SHA-1 checksum of everything before it, which
+    // catches truncated or corrupt files.  With index.skipHash the checksum
+    // is all zeros, and (like git) isn't verified.
+    const BYTE* const end = data + index.Size() - c_oid_len;
+    static const BYTE c_zero_oid[c_oid_len] = {};
+    if (memcmp(end, c_zero_oid, c_oid_len) != 0)
+    {
+        Sha1 sha1;
+        BYTE checksum[c_oid_len];
+        sha1.Update(data, end - data);
+        sha1.Final(checksum);
+        if (memcmp(checksum, end, c_oid_len) != 0)
+            return false;
+    }
+
+    const BYTE* next;
+    if (!ParseEntries(data, end, next))
+        return false;
+    return ParseExtensions(next, end);
+}
+
+bool GitIndex::ParseEntries(const BYTE* data, const BYTE* end, const BYTE*& next)
+{
+    // Each entry takes at least 62 bytes, so a count that can't fit is
+    // corrupt (and mustn't be used to reserve memory).
+    const DWORD count = ReadBE32(data + 8);
+    if (count > size_t(end - (data + 12)) / 62)
+        return false;
+    m_entries.reserve(count);
+
+    StrA path;
+    StrW wide;
+    const BYTE* p = data + 12;
+    for (DWORD ii = 0; ii < count; ++ii)
+    {
+        if (end - p < 62)
+            return false;
+
+        Entry entry;
+        entry.mtime_sec = ReadBE32(p + 8);
+        entry.mtime_nsec = ReadBE32(p + 12);
+        entry.mode = ReadBE32(p + 24);
+        entry.size = ReadBE32(p + 36);
+        memcpy(entry.oid, p + 40, c_oid_len);
+        entry.flags = ReadBE16(p + 60);
+        entry.ext_flags = 0;
+
+        const BYTE* name = p + 62;
+        if (entry.flags & c_flag_extended)
+        {
+            if (m_version < 3)
+                return false;
+            entry.ext_flags = ReadBE16(name);
+            name += 2;
+        }
+
+        // Version 4 prefix-compresses the path:  a varint says how many bytes
+        // to strip from the end of the previous path, and the rest of the
+        // path follows (NUL terminated).
+        if (m_version >= 4)
+        {
+            if (name >= end)
+                return false;
+            BYTE ch = *(name++);
+            size_t strip = ch & 0x7f;
+            while (ch & 0x80)
+            {
+                if (name >= end)
+                    return false;
+                ch = *(name++);
+                strip = ((strip + 1) << 7) | (ch & 0x7f);
+            }
+            if (strip > path.Length())
+                return false;
+            path.SetLength(path.Length() - unsigned(strip));
+        }
+        else
+        {
+            path.Clear();
+        }
+
+        const BYTE* nul = name;
+        while (nul < end && *nul)
+            ++nul;
+        if (nul >= end)
+            return false;
+        path.Append(reinterpret_cast<const char*>(name), unsigned(nul - name));
+
+        // Versions 2 and 3 pad each entry with 1 to 8 NULs, to a multiple of
+        // 8 bytes.
+        if (m_version >= 4)
+            p = nul + 1;
+        else
+            p += ((name - p) + (nul - name) + 8) & ~7;
+        if (p > end)
+            return false;
+
+        entry.git_path = unsigned(m_git_paths.size());
+        m_git_paths.insert(m_git_paths.end(), path.Text(), path.Text() + path.Length() + 1);
+
+        Utf8ToWide(path.Text(), path.Length(), wide);
+        if (wide.Empty())
+            return false;
+        for (WCHAR* walk = wide.Reserve(); *walk; ++walk)
+        {
+            if (*walk == '/')
+                *walk = '\\';
+        }
+
+        entry.path = m_names.Add(wide.Text(), wide.Length());
+        m_entries.emplace_back(entry);
+    }
+
+    next = p;
+    return true;
+}
+
+bool GitIndex::ParseExtensions(const BYTE* p, const BYTE* end)
+{
+    while (end - p >= 8)
+    {
+        const BYTE* sig = p;
+        const DWORD size = ReadBE32(p + 4);
+        p += 8;
+        if (DWORD(end - p) < size)
+            return false;
+
+        if (memcmp(sig, "TREE", 4) == 0)
+        {
+            const BYTE* tree = p;
+            if (size && !ParseCacheTree(tree, p + size, m_tree))
+                return false;
+            m_has_tree = (size != 0);
+        }
+        else if (sig[0] < 'A' || sig[0] > 'Z')
+        {
+            // Extensions whose names start with a lower case letter are
+            // required to understand the index (for example "link" for a
+            // split index, or "sdir" for a sparse index).
+            return Unsupported(L"required index extension");
+        }
+
+        p += size;
+    }
+
+    // The extensions must end exactly at the checksum.
+    return p == end;
+}
+
+/*
+ * HEAD.
+ */
+
+// Resolves a ref to an object id.  Sets found to false if the ref doesn't
+// exist, which is the case for the branch of a repo with no commits yet.
+static bool ResolveRef(const WCHAR* git_dir, const char* ref, BYTE* oid, bool& found)
+{
+    found = true;
+
+    StrW wide;
+    Utf8ToWide(ref, strlen(ref), wide);
+    for (WCHAR* walk = wide.Reserve(); *walk; ++walk)
+    {
+        if (*walk == '/')
+            *walk = '\\';
+    }
+
+    StrW file;
+    StrA text;
+    PathJoin(file, git_dir, wide);
+    if (ReadTextFile(file.Text(), text))
+        return ParseOid(text.Text(), oid);
+
+    MappedFile packed;
+    PathJoin(file, git_dir, L"packed-refs");
+    if (packed.Open(file.Text()))
+    {
+        // Each line is "<oid> <ref>"; peeled tags ("^<oid>") and comments
+        // don't match.
+        const size_t ref_len = strlen(ref);
+        const char* walk = reinterpret_cast<const char*>(packed.Data());
+        const char* const end = walk + packed.Size();
+        while (walk < end)
+        {
+            const char* eol = static_cast<const char*>(memchr(walk, '\n', end - walk));
+            if (!eol)
+                eol = end;
+
+            const char* name = walk + c_oid_len * 2 + 1;
+            if (name <= eol && name[-1] == ' ' &&
+                size_t(eol - name) >= ref_len && strncmp(name, ref, ref_len) == 0 &&
+                (name + ref_len == eol || name[ref_len] == '\r'))
+            {
+                char hex[c_oid_len * 2 + 1];
+                memcpy(hex, walk, c_oid_len * 2);
+                hex[c_oid_len * 2] = '\0';
+                return ParseOid(hex, oid);
+            }
+
+            walk = eol + 1;
+        }
+    }
+
+    found = false;
+    return true;
+}
+
+// A .git file (for a linked worktree or a submodule) points somewhere else,
+// and a commondir file means refs and objects are shared; those are only
+// supported when the caller has already resolved them into common_dir.  The
+// reftable format for refs isn't supported.
+static bool IsSupportedLayout(const WCHAR* git_dir, const WCHAR* common_dir=nullptr)
+{
+    StrW commondir;
+    StrW reftable;
+    PathJoin(commondir, git_dir, L"commondir");
+    PathJoin(reftable, common_dir ? common_dir : git_dir, L"reftable");
+    return (GetFileType(git_dir) == FileType::Dir &&
+            (common_dir || GetFileType(commondir.Text()) == FileType::Invalid) &&
+            GetFileType(reftable.Text()) == FileType::Invalid);
+}
+
+// HEAD is per worktree, but the branches it refers to are in common_dir.
+static bool ResolveHead(const WCHAR* git_dir, const WCHAR* common_dir, StrW& branch, BYTE* oid, bool& unborn)
+{
+    unborn = false;
+
+    StrW file;
+    StrA head;
+    PathJoin(file, git_dir, L"HEAD");
+    if (!ReadTextFile(file.Text(), head))
+        return false;
+    head.TrimRight();
+
+    if (strncmp(head.Text(), "ref: ", 5) != 0)
+    {
+        branch.Set(L"HEAD");
+        return ParseOid(head.Text(), oid);
+    }
+
+    const char* ref = head.Text() + 5;
+    if (strncmp(ref, "refs/heads/", 11) != 0)
+        return false;
+
+    bool found;
+    Utf8ToWide(ref + 11, strlen(ref + 11), branch);
+    if (!ResolveRef(common_dir, ref, oid, found))
+        return false;
+    unborn = !found;
+    return true;
+}
+
+bool ReadHead(const WCHAR* git_dir, StrW& branch, BYTE* oid, bool& unborn)
+{
+    return IsSupportedLayout(git_dir) && ResolveHead(git_dir, git_dir, branch, oid, unborn);
+}
+
+/*
+ * Objects.
+ */
+
+static const int c_obj_commit = 1;
+static const int c_obj_tree = 2;
+static const int c_obj_blob = 3;
+static const int c_obj_tag = 4;
+static const int c_obj_ofs_delta = 6;
+static const int c_obj_ref_delta = 7;
+
+// Names of the object types, starting with c_obj_commit.
+static const char* const c_obj_names[] = { "commit", "tree", "blob", "tag" };
+
+static const int c_max_delta_depth = 100;
+
+// Looks up an object in a pack index (version 2), and returns its offset in
+// the pack file.
+static bool FindInPackIndex(const MappedFile& idx, const BYTE* oid, ULONGLONG& offset)
+{
+    const BYTE* const data = idx.Data();
+    const size_t size = idx.Size();
+    if (size < 8 + 256 * 4 + c_oid_len * 2 ||
+        memcmp(data, "\377tOc", 4) != 0 ||
+        ReadBE32(data + 4) != 2)
+        return false;
+
+    const BYTE* const fanout = data + 8;
+    const DWORD count = ReadBE32(fanout + 255 * 4);
+    const BYTE* const oids = fanout + 256 * 4;
+    const BYTE* const offsets = oids + size_t(count) * (c_oid_len + 4);
+    const BYTE* const large_offsets = offsets + size_t(count) * 4;
+    if (size_t(large_offsets - data) + c_oid_len * 2 > size)
+        return false;
+
+    // The fanout table gives the range of object ids that start with each
+    // byte value, and the ids are sorted within that range.
+    DWORD lo = oid[0] ? ReadBE32(fanout + (oid[0] - 1) * 4) : 0;
+    DWORD hi = ReadBE32(fanout + oid[0] * 4);
+    while (lo < hi)
+    {
+        const DWORD mid = lo + (hi - lo) / 2;
+        const int cmp = memcmp(oids + size_t(mid) * c_oid_len, oid, c_oid_len);
+        if (cmp == 0)
+        {
+            const DWORD off = ReadBE32(offsets + size_t(mid) * 4);
+            if (!(off & 0x80000000))
+            {
+                offset = off;
+                return true;
+            }
+
+            const BYTE* large = large_offsets + size_t(off & 0x7fffffff) * 8;
+            if (size_t(large - data) + 8 + c_oid_len * 2 > size)
+                return false;
+            offset = (ULONGLONG(ReadBE32(large)) << 32) | ReadBE32(large + 4);
+            return true;
+        }
+
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return false;
+}
+
+namespace
+{
+
+// ObjectStore reads objects from the loose object directories and the pack
+// files.  Deltified objects in packs are resolved against their bases.
+class ObjectStore
+{
+public:
+                        ObjectStore(const WCHAR* git_dir);
+                        ~ObjectStore() = default;
+
+    bool                Read(const BYTE* oid, int& type, std::vector<BYTE>& out);
+
+private:
+    struct Pack
+    {
+        MappedFile      idx;
+        MappedFile      pack;
+    };
+
+    bool                Read(const BYTE* oid, int& type, std::vector<BYTE>& out, int depth);
+    bool                ReadLoose(const BYTE* oid, int& type, std::vector<BYTE>& out);
+    bool                ReadPacked(const Pack& pack, ULONGLONG offset, int& type, std::vector<BYTE>& out, int depth);
+    void                LoadPacks();
+
+    StrW                m_git_dir;
+    std::vector<std::unique_ptr<Pack>> m_packs;
+    bool                m_loaded_packs = false;
+};
+
+}; // namespace
+
+ObjectStore::ObjectStore(const WCHAR* git_dir)
+: m_git_dir(git_dir)
+{
+}
+
+// Objects are named by the SHA-1 of their type, size, and contents, so a
+// corrupt object fails here instead of being misread.
+bool ObjectStore::Read(const BYTE* oid, int& type, std::vector<BYTE>& out)
+{
+    if (!Read(oid, type, out, 0))
+        return false;
+    assert(type >= c_obj_commit && type <= c_obj_tag);
+
+    char header[32];
+    const int header_len = snprintf(header, _countof(header), "%s %zu", c_obj_names[type - c_obj_commit], out.size());
+
+    Sha1 sha1;
+    BYTE check[c_oid_len];
+    sha1.Update(header, header_len + 1);
+    sha1.Update(out.data(), out.size());
+    sha1.Final(check);
+    return memcmp(check, oid, c_oid_len) == 0;
+}
+
+bool ObjectStore::Read(const BYTE* oid, int& type, std::vector<BYTE>& out, int depth)
+{
+    if (ReadLoose(oid, type, out))
+        return true;
+
+    LoadPacks();
+    for (const auto& pack : m_packs)
+    {
+        ULONGLONG offset;
+        if (FindInPackIndex(pack->idx, oid, offset))
+            return ReadPacked(*pack, offset, type, out, depth);
+    }
+
+    return false;
+}
+
+bool ObjectStore::ReadLoose(const BYTE* oid, int& type, std::vector<BYTE>& out)
+{
+    StrW hex;
+    StrW file;
+    FormatOid(oid, hex);
+    PathJoin(file, m_git_dir.Text(), L"objects");
+    EnsureTrailingSlash(file);
+    file.Append(hex.Text(), 2);
+    file.Append('\\');
+    file.Append(hex.Text() + 2);
+
+    MappedFile loose;
+    if (!loose.Open(file.Text()))
+        return false;
+
+    out.clear();
+    if (!InflateZlib(loose.Data(), loose.Size(), out))
+        return false;
+
+    // The header is "<type> <size>\0".
+    const BYTE* nul = static_cast<const BYTE*>(memchr(out.data(), '\0', out.size()));
+    if (!nul)
+        return false;
+
+    type = 0;
+    for (int ii = 0; ii < _countof(c_obj_names); ++ii)
+    {
+        const size_t len = strlen(c_obj_names[ii]);
+        if (out.size() > len && memcmp(out.data(), c_obj_names[ii], len) == 0 && out[len] == ' ')
+        {
+            type = c_obj_commit + ii;
+            break;
+        }
+    }
+    if (!type)
+        return false;
+
+    out.erase(out.begin(), out.begin() + (nul + 1 - out.data()));
+    return true;
+}
+
+void ObjectStore::LoadPacks()
+{
+    if (m_loaded_packs)
+        return;
+    m_loaded_packs = true;
+
+    StrW dir;
+    StrW spec;
+    PathJoin(dir, m_git_dir.Text(), L"objects\\pack");
+    PathJoin(spec, dir.Text(), L"pack-*.idx");
+
+    WIN32_FIND_DATA fd;
+    SHFind shFind = FindFirstFile(spec.Text(), &fd);
+    if (shFind.Empty())
+        return;
+
+    do
+    {
+        StrW file;
+        std::unique_ptr<Pack> pack = std::make_unique<Pack>();
+        PathJoin(file, dir.Text(), fd.cFileName);
+        if (!pack->idx.Open(file.Text()))
+            continue;
+
+        file.SetLength(file.Length() - 4);
+        file.Append(L".pack");
+        if (!pack->pack.Open(file.Text()) ||
+            pack->pack.Size() < 12 + c_oid_len ||
+            memcmp(pack->pack.Data(), "PACK", 4) != 0)
+            continue;
+
+        m_packs.emplace_back(std::move(pack));
+    }
+    while (FindNextFile(shFind, &fd));
+}
+
+static bool ReadDeltaSize(const BYTE*& p, const BYTE* end, size_t& size)
+{
+    size = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (p >= end)
+            return false;
+        const BYTE ch = *(p++);
+        size |= size_t(ch & 0x7f) << shift;
+        if (!(ch & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// A delta is the size of the base, the size of the result, and then a series
+// of instructions that either copy a range from the base or insert literal
+// bytes.
+static bool ApplyDelta(const std::vector<BYTE>& base, const std::vector<BYTE>& delta, std::vector<BYTE>& out)
+{
+    const BYTE* p = delta.data();
+    const BYTE* const end = p + delta.size();
+
+    size_t base_size;
+    size_t result_size;
+    if (!ReadDeltaSize(p, end, base_size) || !ReadDeltaSize(p, end, result_size))
+        return false;
+    if (base_size != base.size())
+        return false;
+
+    out.clear();
+    out.reserve(result_size);
+    while (p < end)
+    {
+        const BYTE cmd = *(p++);
+        if (cmd & 0x80)
+        {
+            size_t offset = 0;
+            size_t len = 0;
+            for (int ii = 0; ii < 4; ++ii)
+            {
+                if (cmd & (0x01 << ii))
+                {
+                    if (p >= end)
+                        return false;
+                    offset |= size_t(*(p++)) << (ii * 8);
+                }
+            }
+            for (int ii = 0; ii < 3; ++ii)
+            {
+                if (cmd & (0x10 << ii))
+                {
+                    if (p >= end)
+                        return false;
+                    len |= size_t(*(p++)) << (ii * 8);
+                }
+            }
+            if (!len)
+                len = 0x10000;
+            if (offset > base.size() || len > base.size() - offset)
+                return false;
+            out.insert(out.end(), base.begin() + offset, base.begin() + offset + len);
+        }
+        else if (cmd)
+        {
+            if (size_t(end - p) < cmd)
+                return false;
+            out.insert(out.end(), p, p + cmd);
+            p += cmd;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return out.size() == result_size;
+}
+
+bool ObjectStore::ReadPacked(const Pack& pack, ULONGLONG offset, int& type, std::vector<BYTE>& out, int depth)
+{
+    if (depth > c_max_delta_depth)
+        return false;
+
+    const BYTE* const data = pack.pack.Data();
+    const BYTE* const end = data + pack.pack.Size() - c_oid_len;
+    if (offset < 12 || offset >= ULONGLONG(end - data))
+        return false;
+
+    // The entry header is the type and the inflated size, as a varint.
+    const BYTE* p = data + offset;
+    BYTE ch = *(p++);
+    type = (ch >> 4) & 7;
+    size_t size = ch & 0x0f;
+    for (int shift = 4; ch & 0x80; shift += 7)
+    {
+        if (p >= end || shift >= 64)
+            return false;
+        ch = *(p++);
+        size |= size_t(ch & 0x7f) << shift;
+    }
+
+    switch (type)
+    {
+    case c_obj_commit:
+    case c_obj_tree:
+    case c_obj_blob:
+    case c_obj_tag:
+        out.clear();
+        out.reserve(size);
+        return InflateZlib(p, end - p, out) && out.size() == size;
+
+    case c_obj_ofs_delta:
+    case c_obj_ref_delta:
+        {
+            std::vector<BYTE> base;
+            if (type == c_obj_ofs_delta)
+            {
+                // The base is at a negative offset, encoded like the index
+                // version 4 path prefix length.
+                if (p >= end)
+                    return false;
+                ch = *(p++);
+                ULONGLONG rel = ch & 0x7f;
+                while (ch & 0x80)
+                {
+                    if (p >= end)
+                        return false;
+                    ch = *(p++);
+                    rel = ((rel + 1) << 7) | (ch & 0x7f);
+                }
+                if (rel > offset)
+                    return false;
+                if (!ReadPacked(pack, offset - rel, type, base, depth + 1))
+                    return false;
+            }
+            else
+            {
+                if (size_t(end - p) < c_oid_len)
+                    return false;
+                const BYTE* base_oid = p;
+                p += c_oid_len;
+                if (!Read(base_oid, type, base, depth + 1))
+                    return false;
+            }
+
+            std::vector<BYTE> delta;
+            delta.reserve(size);
+            if (!InflateZlib(p, end - p, delta) || delta.size() != size)
+                return false;
+            return ApplyDelta(base, delta, out);
+        }
+
+    default:
+        return false;
+    }
+}
+
+/*
+ * Status.
+ */
+
+namespace
+{
+
+class IndexStatus
+{
+public:
+                        IndexStatus(RepoStatus& status, const GitIndex& index, ObjectStore& objects);
+                        ~IndexStatus() = default;
+
+    bool                Build(const BYTE* head_tree);
+    bool                FindChange(const BYTE* head_tree, bool& changed);
+
+private:
+    bool                LoadEntries();
+    bool                DiffHead(const BYTE* head_tree);
+    bool                DiffTree(const BYTE* oid, const GitIndex::CacheTree* cache, StrA& prefix, int depth=0);
+    void                AddedBefore(const char* path);
+    void                AddedUnder(const StrA& prefix);
+    bool                FindRenames();
+    bool                WalkDir(StrW& rel);
+    bool                HasUntracked(const StrW& full);
+    bool                IsRacy(const GitIndex::Entry& entry) const;
+    bool                InScope(const WCHAR* rel) const;
+    bool                StopAtChange();
+    bool                Uncertain(const WCHAR* reason);
+
+    struct Deleted
+    {
+        StrA            path;
+        BYTE            oid[20];
+    };
+
+    RepoStatus&         m_status;
+    const GitIndex&     m_index;
+    ObjectStore&        m_objects;
+    std::unordered_map<const WCHAR*, size_t, HashCaseless, EqualCaseless> m_tracked;
+    std::unordered_set<const WCHAR*, HashCaseless, EqualCaseless> m_tracked_dirs;
+    NameArena           m_dir_names;
+    std::unique_ptr<DirEnumerator> m_enumerator;
+    StrW                m_scope;            // Relative to the root; empty for the whole repo.
+    DWORD               m_index_sec;
+    DWORD               m_index_nsec;
+
+    size_t              m_next = 0;         // Next index entry to compare with HEAD.
+    std::vector<FileStatus> m_entry_status;
+    std::vector<bool>   m_seen;
+    std::vector<Deleted> m_deleted;
+    std::vector<StrW>   m_untracked;
+
+    bool                m_first_change = false; // FindChange() stops at the first change.
+    bool                m_changed = false;
+    const WCHAR*        m_uncertain = nullptr;  // Why a possible change needs git to confirm it.
+};
+
+}; // namespace
+
+IndexStatus::IndexStatus(RepoStatus& status, const GitIndex& index, ObjectStore& objects)
+: m_status(status)
+, m_index(index)
+, m_objects(objects)
+, m_enumerator(MakeDirEnumerator())
+, m_scope(status.RelativeScope())
+{
+    ToUnixTime(index.Modified(), m_index_sec, m_index_nsec);
+
+    for (WCHAR* walk = m_scope.Reserve(); *walk; ++walk)
+    {
+        if (*walk == '/')
+            *walk = '\\';
+    }
+}
+
+bool IndexStatus::LoadEntries()
+{
+    const auto& entries = m_index.Entries();
+    m_tracked.reserve(entries.size());
+    m_entry_status.resize(entries.size(), FileStatus { GitFileState::NONE, GitFileState::NONE });
+    m_seen.resize(entries.size());
+
+    StrW dir;
+    for (size_t ii = 0; ii < entries.size(); ++ii)
+    {
+        const GitIndex::Entry& entry = entries[ii];
+        if (entry.flags & c_flag_stage_mask)
+            return Unsupported(L"conflicts");
+        if (entry.ext_flags & (c_ext_skip_worktree|c_ext_intent_to_add))
+            return Unsupported(L"skip-worktree or intent-to-add");
+        if ((entry.mode & c_mode_type_mask) != c_mode_file)
+            return Unsupported(L"submodules or symlinks");
+
+        m_tracked.emplace(entry.path, ii);
+
+        // Remember the directories that contain tracked files; those are the
+        // directories that get walked.
+        dir.Set(entry.path);
+        while (const WCHAR* slash = wcsrchr(dir.Text(), '\\'))
+        {
+            dir.SetEnd(slash);
+            if (m_tracked_dirs.find(dir.Text()) != m_tracked_dirs.end())
+                break;
+            m_tracked_dirs.emplace(m_dir_names.Add(dir.Text(), dir.Length()));
+        }
+    }
+
+    return true;
+}
+
+bool IndexStatus::Build(const BYTE* head_tree)
+{
+    if (!LoadEntries() || !DiffHead(head_tree))
+        return false;
+
+    // Only the scope is walked.  If it doesn't contain any tracked files,
+    // then git has to decide how to report it.
+    if (!m_scope.Empty() && m_tracked_dirs.find(m_scope.Text()) == m_tracked_dirs.end())
+        return Unsupported(L"scope has no tracked files");
+
+    StrW rel(m_scope);
+    if (!WalkDir(rel))
+        return false;
+
+    // Tracked files that weren't found have been deleted.
+    const auto& entries = m_index.Entries();
+    for (size_t ii = 0; ii < entries.size(); ++ii)
+    {
+        if (!m_seen[ii] && !(entries[ii].flags & c_flag_assume_valid) && InScope(entries[ii].path))
+            m_entry_status[ii].working = GitFileState::DELETED;
+    }
+
+    // Add the entries in the same order as "git status" reports them, since
+    // a path can be both deleted from the index and untracked, and the first
+    // one wins.
+    StrW full;
+    for (size_t ii = 0; ii < entries.size(); ++ii)
+    {
+        const FileStatus& filestatus = m_entry_status[ii];
+        if ((filestatus.staged != GitFileState::NONE || filestatus.working != GitFileState::NONE) && InScope(entries[ii].path))
+        {
+            PathJoin(full, m_status.root.Text(), entries[ii].path);
+            m_status.status.Add(full.Text(), full.Length(), filestatus);
+        }
+    }
+    for (const auto& deleted : m_deleted)
+    {
+        if (!m_scope.Empty())
+        {
+            Utf8ToWide(deleted.path.Text(), deleted.path.Length(), rel);
+            for (WCHAR* walk = rel.Reserve(); *walk; ++walk)
+            {
+                if (*walk == '/')
+                    *walk = '\\';
+            }
+            if (!InScope(rel.Text()))
+                continue;
+        }
+        m_status.status.AddGitPath(m_status.root, deleted.path.Text(), deleted.path.Length(), FileStatus { GitFileState::DELETED, GitFileState::NONE });
+    }
+    for (const auto& untracked : m_untracked)
+    {
+        PathJoin(full, m_status.root.Text(), untracked);
+        m_status.status.Add(full.Text(), full.Length(), FileStatus { GitFileState::NONE, GitFileState::NEW });
+    }
+
+    return true;
+}
+
+// Finds whether the whole repo has any change at all, which is all that the
+// repo field needs.  This stops at the first change that's found.  Changes
+// that only git could confirm (such as a timestamp that changed without the
+// size changing) don't stop it; if nothing else changed, it fails and git
+// decides.
+bool IndexStatus::FindChange(const BYTE* head_tree, bool& changed)
+{
+    assert(m_scope.Empty());
+
+    m_first_change = true;
+    if (!LoadEntries() || !DiffHead(head_tree))
+        return false;
+
+    const auto& entries = m_index.Entries();
+    changed = !m_deleted.empty() || std::any_of(m_entry_status.begin(), m_entry_status.end(), [](const FileStatus& s) {
+        return s.staged != GitFileState::NONE;
+    });
+    if (changed)
+        return true;
+
+    StrW rel;
+    if (!WalkDir(rel))
+        return false;
+    changed = m_changed;
+
+    for (size_t ii = 0; !changed && ii < entries.size(); ++ii)
+    {
+        if (!m_seen[ii] && !(entries[ii].flags & c_flag_assume_valid))
+            changed = true;
+    }
+
+    if (!changed && m_uncertain)
+        return Unsupported(m_uncertain);
+    return true;
+}
+
+// Compares the index with HEAD's tree, like "git diff-index --cached".  The
+// index and tree objects are both sorted by path (with directories sorting
+// as though they end with a slash), so they're compared in one pass.  Where
+// the cache tree says a directory in the index matches a tree in HEAD, that
+// whole directory is skipped.
+bool IndexStatus::DiffHead(const BYTE* head_tree)
+{
+    const auto& entries = m_index.Entries();
+    const GitIndex::CacheTree* root = m_index.RootTree();
+
+    m_next = 0;
+    if (head_tree)
+    {
+        if (root && root->entry_count >= 0 && memcmp(root->oid, head_tree, c_oid_len) == 0)
+            return true;
+
+        StrA prefix;
+        if (!DiffTree(head_tree, root, prefix))
+            return false;
+    }
+
+    AddedUnder(StrA());
+    return FindRenames();
+}
+
+bool IndexStatus::DiffTree(const BYTE* oid, const GitIndex::CacheTree* cache, StrA& prefix, int depth)
+{
+    if (depth > c_max_tree_depth)
+        return Unsupported(L"directories nested too deeply");
+
+    int type;
+    std::vector<BYTE> tree;
+    if (!m_objects.Read(oid, type, tree) || type != c_obj_tree)
+        return Unsupported(L"unable to read tree");
+
+    const auto& entries = m_index.Entries();
+    const unsigned prefix_len = prefix.Length();
+
+    // Each tree entry is "<mode> <name>\0" followed by the object id.
+    const BYTE* p = tree.data();
+    const BYTE* const end = p + tree.size();
+    while (p < end)
+    {
+        DWORD mode = 0;
+        while (p < end && *p >= '0' && *p <= '7')
+            mode = (mode << 3) | (*(p++) - '0');
+        if (p >= end || *(p++) != ' ')
+            return false;
+
+        const char* name = reinterpret_cast<const char*>(p);
+        const BYTE* nul = static_cast<const BYTE*>(memchr(p, '\0', end - p));
+        if (!nul || size_t(end - (nul + 1)) < c_oid_len)
+            return false;
+        const size_t name_len = nul - p;
+        const BYTE* entry_oid = nul + 1;
+        p = entry_oid + c_oid_len;
+
+        prefix.SetLength(prefix_len);
+        prefix.Append(name, name_len);
+
+        if ((mode & c_mode_type_mask) == c_mode_dir)
+        {
+            prefix.Append('/');
+            AddedBefore(prefix.Text());
+
+            const GitIndex::CacheTree* child = cache ? cache->FindChild(name, name_len) : nullptr;
+            if (child && child->entry_count >= 0 && memcmp(child->oid, entry_oid, c_oid_len) == 0)
+            {
+                m_next += child->entry_count;
+                if (m_next > entries.size())
+                    return false;
+                continue;
+            }
+
+            if (!DiffTree(entry_oid, child, prefix, depth + 1))
+                return false;
+        }
+        else if ((mode & c_mode_type_mask) == c_mode_file)
+        {
+            AddedBefore(prefix.Text());
+
+            if (m_next < entries.size() && strcmp(m_index.GitPath(entries[m_next]), prefix.Text()) == 0)
+            {
+                const GitIndex::Entry& entry = entries[m_next];
+                if (entry.mode != mode || memcmp(entry.oid, entry_oid, c_oid_len) != 0)
+                    m_entry_status[m_next].staged = GitFileState::MODIFIED;
+                ++m_next;
+            }
+            else
+            {
+                m_deleted.emplace_back();
+                m_deleted.back().path.Set(prefix);
+                memcpy(m_deleted.back().oid, entry_oid, c_oid_len);
+            }
+        }
+        else
+        {
+            return Unsupported(L"submodules or symlinks");
+        }
+    }
+
+    // Anything else in the index under this directory was added.
+    prefix.SetLength(prefix_len);
+    AddedUnder(prefix);
+    return true;
+}
+
+// Marks index entries as added, up to the entry for path.
+void IndexStatus::AddedBefore(const char* path)
+{
+    const auto& entries = m_index.Entries();
+    while (m_next < entries.size() && strcmp(m_index.GitPath(entries[m_next]), path) < 0)
+        m_entry_status[m_next++].staged = GitFileState::NEW;
+}
+
+// Marks index entries as added, through the end of the directory prefix.
+void IndexStatus::AddedUnder(const StrA& prefix)
+{
+    const auto& entries = m_index.Entries();
+    while (m_next < entries.size() && strncmp(m_index.GitPath(entries[m_next]), prefix.Text(), prefix.Length()) == 0)
+        m_entry_status[m_next++].staged = GitFileState::NEW;
+}
+
+// Git reports a deleted file and an added file with the same contents as a
+// rename.  Renames with changes can only be found by comparing contents, so
+// that's left to git.
+bool IndexStatus::FindRenames()
+{
+    if (m_deleted.empty() || m_first_change)
+        return true;
+
+    const auto& entries = m_index.Entries();
+    bool any_added = false;
+    for (size_t ii = 0; ii < entries.size(); ++ii)
+    {
+        if (m_entry_status[ii].staged != GitFileState::NEW)
+            continue;
+
+        const auto deleted = std::find_if(m_deleted.begin(), m_deleted.end(), [&](const Deleted& d) {
+            return memcmp(d.oid, entries[ii].oid, c_oid_len) == 0;
+        });
+        if (deleted != m_deleted.end())
+        {
+            m_entry_status[ii].staged = GitFileState::RENAMED;
+            m_deleted.erase(deleted);
+        }
+        else
+        {
+            any_added = true;
+        }
+    }
+
+    if (any_added && !m_deleted.empty())
+        return Unsupported(L"possible rename");
+    return true;
+}
+
+// A file modified in the same second that the index was written might have
+// been modified again after the index was written, without changing its size
+// or timestamp.  Git has to compare the contents to be sure.
+bool IndexStatus::IsRacy(const GitIndex::Entry& entry) const
+{
+    if (entry.mtime_sec != m_index_sec)
+        return entry.mtime_sec > m_index_sec;
+    return !entry.mtime_nsec || !m_index_nsec || entry.mtime_nsec >= m_index_nsec;
+}
+
+bool IndexStatus::InScope(const WCHAR* rel) const
+{
+    const unsigned len = m_scope.Length();
+    if (!len)
+        return true;
+    return _wcsnicmp(rel, m_scope.Text(), len) == 0 && (!rel[len] || rel[len] == '\\');
+}
+
+// Returns true if FindChange() should stop walking because of a change.
+bool IndexStatus::StopAtChange()
+{
+    if (!m_first_change)
+        return false;
+    m_changed = true;
+    return true;
+}
+
+// Build() gives up on a possible change that only git can confirm, but
+// FindChange() keeps looking for a definite change first.  Returns false to
+// give up.
+bool IndexStatus::Uncertain(const WCHAR* reason)
+{
+    if (!m_first_change)
+        return Unsupported(reason);
+    if (!m_uncertain)
+        m_uncertain = reason;
+    return true;
+}
+
+bool IndexStatus::WalkDir(StrW& rel)
+{
+    StrW full;
+    if (rel.Length())
+        PathJoin(full, m_status.root.Text(), rel);
+    else
+        full.Set(m_status.root);
+
+    DirListing listing;
+    PathJoin(listing.spec, full.Text(), L"*");
+
+    listing.Enumerate(*m_enumerator, false);
+    if (listing.open_err || listing.end_err != ERROR_NO_MORE_FILES)
+        return Unsupported(L"directory enumeration failed");
+
+    const unsigned rel_len = rel.Length();
+    for (const DirEntry& e : listing.entries)
+    {
+        if (IsPseudoDirectory(e.name))
+            continue;
+        if (!rel_len && _wcsicmp(e.name, L".git") == 0)
+            continue;
+
+        if (rel_len)
+            rel.Append('\\');
+        rel.Append(e.name, e.name_len);
+
+        const bool is_dir = !!(e.attributes & FILE_ATTRIBUTE_DIRECTORY);
+        const auto tracked = m_tracked.find(rel.Text());
+        if (tracked != m_tracked.end())
+        {
+            const GitIndex::Entry& entry = m_index.Entries()[tracked->second];
+            m_seen[tracked->second] = true;
+
+            if (is_dir || (e.attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            {
+                if (StopAtChange())
+                    return true;
+                return Unsupported(L"tracked file changed type");
+            }
+
+            if (!(entry.flags & c_flag_assume_valid))
+            {
+                DWORD sec;
+                DWORD nsec;
+                ToUnixTime(e.modified, sec, nsec);
+
+                // A different size means the file is modified.  (The index
+                // records the size of the file as checked out, so line
+                // ending conversions don't affect this.)  But a zero size
+                // in the index may mean git "smudged" a racily clean entry.
+                if (entry.size != DWORD(e.size))
+                {
+                    if (!entry.size)
+                    {
+                        if (!Uncertain(L"smudged entry"))
+                            return false;
+                    }
+                    else
+                    {
+                        m_entry_status[tracked->second].working = GitFileState::MODIFIED;
+                        if (StopAtChange())
+                            return true;
+                    }
+                }
+                else if (sec != entry.mtime_sec || (entry.mtime_nsec && nsec != entry.mtime_nsec / 100 * 100))
+                {
+                    if (!Uncertain(L"timestamp changed"))
+                        return false;
+                }
+                else if (IsRacy(entry))
+                {
+                    if (!Uncertain(L"racily clean entry"))
+                        return false;
+                }
+            }
+        }
+        else if (!m_status.IsIgnored(full.Text(), e.name, is_dir))
+        {
+            if (e.attributes & FILE_ATTRIBUTE_REPARSE_POINT)
+            {
+                if (StopAtChange())
+                    return true;
+                return Unsupported(L"untracked reparse point");
+            }
+
+            if (!is_dir)
+            {
+                m_untracked.emplace_back(rel);
+                if (StopAtChange())
+                    return true;
+            }
+            else if (m_tracked_dirs.find(rel.Text()) != m_tracked_dirs.end())
+            {
+                if (!WalkDir(rel))
+                    return false;
+                if (m_changed)
+                    return true;
+            }
+            else
+            {
+                // Like "git status -unormal", an untracked directory is
+                // reported as a whole, if it contains anything that isn't
+                // ignored.
+                StrW sub;
+                PathJoin(sub, full.Text(), e.name);
+                if (HasUntracked(sub))
+                {
+                    m_untracked.emplace_back(rel);
+                    if (StopAtChange())
+                        return true;
+                }
+            }
+        }
+        else if (is_dir && m_tracked_dirs.find(rel.Text()) != m_tracked_dirs.end())
+        {
+            // An ignored directory can still contain tracked files.
+            if (!WalkDir(rel))
+                return false;
+            if (m_changed)
+                return true;
+        }
+
+        rel.SetLength(rel_len);
+    }
+
+    return true;
+}
+
+bool IndexStatus::HasUntracked(const StrW& full)
+{
+    DirListing listing;
+    PathJoin(listing.spec, full.Text(), L"*");
+
+    listing.Enumerate(*m_enumerator, false);
+    if (listing.open_err)
+        return false;
+
+    // A nested repo counts as untracked, even if it's otherwise empty.
+    for (const DirEntry& e : listing.entries)
+    {
+        if (_wcsicmp(e.name, L".git") == 0)
+            return true;
+    }
+
+    for (const DirEntry& e : listing.entries)
+    {
+        if (IsPseudoDirectory(e.name))
+            continue;
+
+        const bool is_dir = !!(e.attributes & FILE_ATTRIBUTE_DIRECTORY);
+        if (m_status.IsIgnored(full.Text(), e.name, is_dir))
+            continue;
+        if (!is_dir || (e.attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            return true;
+
+        StrW sub;
+        PathJoin(sub, full.Text(), e.name);
+        if (HasUntracked(sub))
+            return true;
+    }
+
+    return false;
+}
+
+// Reads HEAD's tree and the index; unborn is set if HEAD has no commits yet
+// (and then tree isn't set).
+static bool ReadHeadAndIndex(const WCHAR* git_dir, const WCHAR* common_dir, ObjectStore& objects, GitIndex& index, StrW& branch, BYTE* tree, bool& unborn)
+{
+    BYTE commit[c_oid_len];
+    if (!ResolveHead(git_dir, common_dir, branch, commit, unborn))
+        return Unsupported(L"unable to resolve HEAD");
+
+    if (!unborn)
+    {
+        int type;
+        std::vector<BYTE> data;
+        if (!objects.Read(commit, type, data) || type != c_obj_commit)
+            return Unsupported(L"unable to read HEAD commit");
+
+        data.push_back('\0');
+        const char* text = reinterpret_cast<const char*>(data.data());
+        if (strncmp(text, "tree ", 5) != 0 || !ParseOid(text + 5, tree))
+            return Unsupported(L"unable to read HEAD commit");
+    }
+
+    StrW file;
+    PathJoin(file, git_dir, L"index");
+    if (!index.Load(file.Text()))
+        return Unsupported(L"unable to read index");
+
+    return true;
+}
+
+bool ReadIndexStatus(RepoStatus& status)
+{
+    assert(status.status.empty());
+
+    const WCHAR* const git_dir = status.git_dir.Text();
+
+    if (!IsSupportedLayout(git_dir))
+        return Unsupported(L"unsupported repo layout");
+
+    StrW branch;
+    BYTE tree[c_oid_len];
+    bool unborn;
+    GitIndex index;
+    ObjectStore objects(git_dir);
+    if (!ReadHeadAndIndex(git_dir, git_dir, objects, index, branch, tree, unborn))
+        return false;
+
+    IndexStatus builder(status, index, objects);
+    if (!builder.Build(unborn ? nullptr : tree))
+        return false;
+
+    // Git reports "No commits yet on <branch>", which GitStatus() treats as
+    // no branch.
+    if (unborn)
+        branch.Clear();
+    status.branch = std::move(branch);
+
+    if (g_debug)
+        Printf(L"debug: read status from index (%u entries)\n", unsigned(index.Entries().size()));
+    return true;
+}
+
+bool ReadIndexSummary(RepoStatus& status)
+{
+    assert(status.status.empty());
+    assert(status.scope.Empty());
+
+    const WCHAR* const git_dir = status.git_dir.Text();
+    const WCHAR* const common_dir = status.common_dir.Empty() ? nullptr : status.common_dir.Text();
+
+    if (!IsSupportedLayout(git_dir, common_dir))
+        return Unsupported(L"unsupported repo layout");
+
+    StrW branch;
+    BYTE tree[c_oid_len];
+    bool unborn;
+    GitIndex index;
+    ObjectStore objects(common_dir ? common_dir : git_dir);
+    if (!ReadHeadAndIndex(git_dir, common_dir ? common_dir : git_dir, objects, index, branch, tree, unborn))
+        return false;
+
+    bool changed;
+    IndexStatus builder(status, index, objects);
+    if (!builder.FindChange(unborn ? nullptr : tree, changed))
+        return false;
+
+    if (unborn)
+        branch.Clear();
+    status.branch = std::move(branch);
+    status.clean = !changed;
+
+    if (g_debug)
+        Printf(L"debug: read summary from index (%s)\n", changed ? L"changed" : L"clean");
+    return true;
+}
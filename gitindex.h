@@ -0,0 +1,93 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+#include "enumdir.h"
+
+#include <vector>
+
+struct RepoStatus;
+
+// GitIndex reads a git index file (.git/index), versions 2 through 4.
+//
+// Load() fails if the index uses anything that can't be represented here,
+// such as a split index or a sparse index.  Entries that need special
+// handling (conflicts, submodules, symlinks, skip-worktree, intent-to-add)
+// are loaded as-is; it's up to the caller to decide what to do with them.
+class GitIndex
+{
+public:
+    struct Entry
+    {
+        const WCHAR*    path;           // Relative to the root, with backslashes.
+        unsigned        git_path;       // Offset of the path as stored in the index (UTF8, with slashes).
+        DWORD           mtime_sec;
+        DWORD           mtime_nsec;
+        DWORD           size;           // Truncated to 32 bits, like git does.
+        DWORD           mode;
+        WORD            flags;
+        WORD            ext_flags;
+        BYTE            oid[20];
+    };
+
+    // The cache tree (the "TREE" extension) records the tree object id for
+    // each directory in the index, unless it has been invalidated by changes
+    // to the index.
+    struct CacheTree
+    {
+        StrA            name;
+        int             entry_count;    // Negative if invalidated.
+        BYTE            oid[20];
+        std::vector<CacheTree> children;
+
+        const CacheTree* FindChild(const char* name, size_t len) const;
+    };
+
+                        GitIndex() = default;
+                        ~GitIndex() = default;
+
+    bool                Load(const WCHAR* file);
+
+    const std::vector<Entry>& Entries() const { return m_entries; }
+    const char*         GitPath(const Entry& entry) const { return m_git_paths.data() + entry.git_path; }
+    const CacheTree*    RootTree() const { return m_has_tree ? &m_tree : nullptr; }
+    const FILETIME&     Modified() const { return m_modified; }
+
+private:
+    bool                ParseEntries(const BYTE* data, const BYTE* end, const BYTE*& next);
+    bool                ParseExtensions(const BYTE* data, const BYTE* end);
+
+    std::vector<Entry>  m_entries;
+    std::vector<char>   m_git_paths;
+    NameArena           m_names;
+    DWORD               m_version = 0;
+    CacheTree           m_tree;
+    bool                m_has_tree = false;
+    FILETIME            m_modified = {};
+};
+
+// Reads HEAD.  Sets branch to the branch name (or "HEAD" when detached), and
+// oid (20 bytes) to the commit it points at; unborn is set if the branch has
+// no commits yet.  Returns false if HEAD can't be resolved, such as a
+// symbolic ref outside refs/heads, a linked worktree, or refs in the reftable
+// format.
+bool ReadHead(const WCHAR* git_dir, StrW& branch, BYTE* oid, bool& unborn);
+
+// Computes the status of status.root (or only status.scope, if set) from
+// HEAD, the index, and the file system, without running git.  Returns false
+// (leaving the status entries empty) when something would need git to resolve
+// it, such as conflicts, renames that aren't exact, or files whose timestamps
+// changed but not their sizes.
+bool ReadIndexStatus(RepoStatus& status);
+
+// Sets status.branch and status.clean for the whole repo, from HEAD, the
+// index, and the file system, without running git.  Unlike ReadIndexStatus(),
+// this stops at the first change and leaves the status entries empty.  If
+// status.common_dir is set (for a linked worktree), refs and objects are read
+// from there.  Returns false when something would need git to resolve it.
+bool ReadIndexSummary(RepoStatus& status);
@@ -0,0 +1,362 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// A small DEFLATE decoder, in the style of zlib's contrib/puff.  It favors
+// simplicity over speed; it only needs to decode the headers of a few git
+// objects.
+
+#include "pch.h"
+#include "inflate.h"
+
+static const int c_max_bits = 15;
+static const int c_max_lcodes = 286;
+static const int c_max_dcodes = 30;
+static const int c_fix_lcodes = 288;
+
+namespace
+{
+
+struct Huffman
+{
+    short               count[c_max_bits + 1];
+    short               symbol[c_fix_lcodes];
+};
+
+struct InflateState
+{
+                        InflateState(const BYTE* in, size_t in_len, std::vector<BYTE>& out, size_t max_out);
+
+    int                 Bits(int need);
+    int                 Decode(const Huffman& h);
+    bool                Stored();
+    bool                Codes(const Huffman& lencode, const Huffman& distcode);
+    bool                Fixed();
+    bool                Dynamic();
+
+    bool                Full() const { return m_out.size() >= m_max_out; }
+
+    const BYTE* const   m_in;
+    const size_t        m_in_len;
+    size_t              m_in_pos = 0;
+    unsigned            m_bitbuf = 0;
+    int                 m_bitcnt = 0;
+    bool                m_error = false;
+
+    std::vector<BYTE>&  m_out;
+    const size_t        m_max_out;
+};
+
+}; // namespace
+
+InflateState::InflateState(const BYTE* in, size_t in_len, std::vector<BYTE>& out, size_t max_out)
+: m_in(in)
+, m_in_len(in_len)
+, m_out(out)
+, m_max_out(max_out)
+{
+}
+
+int InflateState::Bits(int need)
+{
+    unsigned val = m_bitbuf;
+    while (m_bitcnt < need)
+    {
+        if (m_in_pos >= m_in_len)
+        {
+            m_error = true;
+            return 0;
+        }
+        val |= unsigned(m_in[m_in_pos++]) << m_bitcnt;
+        m_bitcnt += 8;
+    }
+
+    m_bitbuf = val >> need;
+    m_bitcnt -= need;
+    return int(val & ((1u << need) - 1));
+}
+
+int InflateState::Decode(const Huffman& h)
+{
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len <= c_max_bits; ++len)
+    {
+        code |= Bits(1);
+        if (m_error)
+            return -1;
+        const int count = h.count[len];
+        if (code - count < first)
+            return h.symbol[index + (code - first)];
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+// Builds the decoding tables from a list of code lengths.  Returns 0 for a
+// complete code, a positive number for an incomplete code, or a negative
+// number for an over-subscribed code.
+static int Construct(Huffman& h, const short* length, int n)
+{
+    ZeroMemory(h.count, sizeof(h.count));
+    for (int symbol = 0; symbol < n; ++symbol)
+        h.count[length[symbol]]++;
+    if (h.count[0] == n)
+        return 0;
+
+    int left = 1;
+    for (int len = 1; len <= c_max_bits; ++len)
+    {
+        left <<= 1;
+        left -= h.count[len];
+        if (left < 0)
+            return left;
+    }
+
+    short offs[c_max_bits + 1];
+    offs[1] = 0;
+    for (int len = 1; len < c_max_bits; ++len)
+        offs[len + 1] = offs[len] + h.count[len];
+
+    for (int symbol = 0; symbol < n; ++symbol)
+    {
+        if (length[symbol])
+            h.symbol[offs[length[symbol]]++] = short(symbol);
+    }
+
+    return left;
+}
+
+bool InflateState::Stored()
+{
+    m_bitbuf = 0;
+    m_bitcnt = 0;
+
+    if (m_in_pos + 4 > m_in_len)
+        return false;
+    const unsigned len = m_in[m_in_pos] | (m_in[m_in_pos + 1] << 8);
+    const unsigned nlen = m_in[m_in_pos + 2] | (m_in[m_in_pos + 3] << 8);
+    m_in_pos += 4;
+    if (len != (~nlen & 0xffff))
+        return false;
+    if (m_in_pos + len > m_in_len)
+        return false;
+
+    m_out.insert(m_out.end(), m_in + m_in_pos, m_in + m_in_pos + len);
+    m_in_pos += len;
+    return true;
+}
+
+bool InflateState::Codes(const Huffman& lencode, const Huffman& distcode)
+{
+    static const short c_lbase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const short c_lext[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const short c_dbase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+        8193, 12289, 16385, 24577 };
+    static const short c_dext[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+        12, 12, 13, 13 };
+
+    while (true)
+    {
+        int symbol = Decode(lencode);
+        if (symbol < 0)
+            return false;
+
+        if (symbol < 256)
+        {
+            m_out.push_back(BYTE(symbol));
+        }
+        else if (symbol == 256)
+        {
+            return true;
+        }
+        else
+        {
+            symbol -= 257;
+            if (symbol >= 29)
+                return false;
+            const size_t len = c_lbase[symbol] + Bits(c_lext[symbol]);
+
+            symbol = Decode(distcode);
+            if (symbol < 0 || symbol >= 30)
+                return false;
+            const size_t dist = c_dbase[symbol] + Bits(c_dext[symbol]);
+            if (m_error || dist > m_out.size())
+                return false;
+
+            // The source and destination may overlap, so copy one byte at
+            // a time (and index, since push_back may reallocate).
+            size_t from = m_out.size() - dist;
+            for (size_t n = len; n--;)
+                m_out.push_back(m_out[from++]);
+        }
+
+        if (Full())
+            return true;
+    }
+}
+
+bool InflateState::Fixed()
+{
+    struct FixedCodes
+    {
+        FixedCodes()
+        {
+            short lengths[c_fix_lcodes];
+            int symbol = 0;
+            for (; symbol < 144; ++symbol)
+                lengths[symbol] = 8;
+            for (; symbol < 256; ++symbol)
+                lengths[symbol] = 9;
+            for (; symbol < 280; ++symbol)
+                lengths[symbol] = 7;
+            for (; symbol < c_fix_lcodes; ++symbol)
+                lengths[symbol] = 8;
+            Construct(lencode, lengths, c_fix_lcodes);
+
+            for (symbol = 0; symbol < c_max_dcodes; ++symbol)
+                lengths[symbol] = 5;
+            Construct(distcode, lengths, c_max_dcodes);
+        }
+
+        Huffman         lencode;
+        Huffman         distcode;
+    };
+
+    static const FixedCodes s_fixed;
+    return Codes(s_fixed.lencode, s_fixed.distcode);
+}
+
+bool InflateState::Dynamic()
+{
+    static const short c_order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    const int nlen = Bits(5) + 257;
+    const int ndist = Bits(5) + 1;
+    const int ncode = Bits(4) + 4;
+    if (m_error || nlen > c_max_lcodes || ndist > c_max_dcodes)
+        return false;
+
+    short lengths[c_max_lcodes + c_max_dcodes];
+    int index = 0;
+    for (; index < ncode; ++index)
+        lengths[c_order[index]] = short(Bits(3));
+    for (; index < 19; ++index)
+        lengths[c_order[index]] = 0;
+    if (m_error)
+        return false;
+
+    Huffman lencode;
+    Huffman distcode;
+    if (Construct(lencode, lengths, 19) != 0)
+        return false;
+
+    index = 0;
+    while (index < nlen + ndist)
+    {
+        int symbol = Decode(lencode);
+        if (symbol < 0)
+            return false;
+        if (symbol < 16)
+        {
+            lengths[index++] = short(symbol);
+            continue;
+        }
+
+        short len = 0;
+        if (symbol == 16)
+        {
+            if (index == 0)
+                return false;
+            len = lengths[index - 1];
+            symbol = 3 + Bits(2);
+        }
+        else if (symbol == 17)
+        {
+            symbol = 3 + Bits(3);
+        }
+        else
+        {
+            symbol = 11 + Bits(7);
+        }
+        if (m_error || index + symbol > nlen + ndist)
+            return false;
+        while (symbol--)
+            lengths[index++] = len;
+    }
+
+    // The end-of-block code must be present.
+    if (lengths[256] == 0)
+        return false;
+
+    // Incomplete codes are only allowed when there's a single code.
+    int err = Construct(lencode, lengths, nlen);
+    if (err < 0 || (err > 0 && nlen - lencode.count[0] != 1))
+        return false;
+    err = Construct(distcode, lengths + nlen, ndist);
+    if (err < 0 || (err > 0 && ndist - distcode.count[0] != 1))
+        return false;
+
+    return Codes(lencode, distcode);
+}
+
+bool Inflate(const BYTE* in, size_t in_len, std::vector<BYTE>& out, size_t max_out)
+{
+    InflateState s(in, in_len, out, max_out);
+
+    int last;
+    do
+    {
+        last = s.Bits(1);
+        const int type = s.Bits(2);
+        if (s.m_error)
+            return false;
+
+        bool ok;
+        switch (type)
+        {
+        case 0:     ok = s.Stored(); break;
+        case 1:     ok = s.Fixed(); break;
+        case 2:     ok = s.Dynamic(); break;
+        default:    ok = false; break;
+        }
+
+        if (!ok || s.m_error)
+            return false;
+        if (s.Full())
+            return true;
+    }
+    while (!last);
+
+    return true;
+}
+
+bool InflateZlib(const BYTE* in, size_t in_len, std::vector<BYTE>& out, size_t max_out)
+{
+    // CMF and FLG:  deflate, with a valid header check, and no preset
+    // dictionary.
+    if (in_len < 2)
+        return false;
+    if ((in[0] & 0x0f) != 8 || (in[0] >> 4) > 7)
+        return false;
+    if (((in[0] << 8) | in[1]) % 31 != 0)
+        return false;
+    if (in[1] & 0x20)
+        return false;
+
+    return Inflate(in + 2, in_len - 2, out, max_out);
+}
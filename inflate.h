@@ -0,0 +1,19 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+
+#include <vector>
+
+// Decompresses a raw DEFLATE stream (RFC 1951) into out.  Decoding stops at
+// the end of the stream, or once out holds at least max_out bytes, whichever
+// comes first.  Returns false if the stream is invalid or truncated.
+bool Inflate(const BYTE* in, size_t in_len, std::vector<BYTE>& out, size_t max_out=size_t(-1));
+
+// Same as Inflate(), but for a zlib stream (RFC 1950), which is how git
+// stores objects.  The trailing checksum is not verified.
+bool InflateZlib(const BYTE* in, size_t in_len, std::vector<BYTE>& out, size_t max_out=size_t(-1));
@@ -24,6 +24,7 @@
 #include "patterns.h"
 #include "formatter.h"
 #include "fields.h"
+#include "git.h"
 #include "scan.h"
 #include "colors.h"
 #include "samples.h"
@@ -35,6 +36,7 @@
 
 static const WCHAR c_opts[] = L"/:+?V,+1+2+4+a.Ab+Bc+C+f:F+g+G+h+i+I:j+J+k+l+L:n+o.p+q+Q.r+R+s+S.t+T.u+v+w+W:x+X.Y+z+Z+";
 static const WCHAR c_DIRXCMD[] = L"DIRXCMD";
+static const unsigned c_max_threads = 64;
 
 int g_debug = 0;
 int g_nix_defaults = 0;             // By default, behave like CMD DIR.
@@ -149,13 +151,18 @@ int __cdecl _tmain(int argc, const WCHAR** argv)
         LOI_COMPACT_TIME,
         LOI_NO_COMPACT_TIME,
         LOI_DIGIT_SORT,
+        LOI_ENUM_BUFFER,
         LOI_ESCAPE_CODES,
         LOI_NO_FAT,
         LOI_FIT_COLUMNS,
         LOI_NO_FIT_COLUMNS,
+        LOI_FLAT,
+        LOI_NO_FLAT,
         LOI_NO_FULL_PATHS,
         LOI_GIT,
         LOI_NO_GIT,
+        LOI_GIT_CACHE,
+        LOI_NO_GIT_CACHE,
         LOI_GIT_IGNORE,
         LOI_NO_GIT_IGNORE,
         LOI_GIT_REPOS,
@@ -166,11 +173,13 @@ int __cdecl _tmain(int argc, const WCHAR** argv)
         LOI_HYPERLINKS,
         LOI_NO_HYPERLINKS,
         LOI_ICONS,
+        LOI_INDEX,
         LOI_NO_ICONS,
         LOI_JUSTIFY,
         LOI_LEVELS,
         LOI_LOWER,
         LOI_NO_LOWER,
+        LOI_MAX_MEMORY,
         LOI_MINI_BYTES,
         LOI_NO_MINI_BYTES,
         LOI_MINI_DECIMAL,
@@ -199,6 +208,8 @@ int __cdecl _tmain(int argc, const WCHAR** argv)
         LOI_TIME,
         LOI_NO_TIME,
         LOI_TIME_STYLE,
+        LOI_THREADS,
+        LOI_TOP,
         LOI_TREE,
         LOI_NO_TREE,
         LOI_TRUNCATE_CHAR,
@@ -228,15 +239,20 @@ int __cdecl _tmain(int argc, const WCHAR** argv)
         { L"debug",                 &g_debug,           1 },
         { L"no-debug",              &g_debug,           0 },
         { L"digit-sort",            nullptr,            LOI_DIGIT_SORT },
+        { L"enum-buffer",           nullptr,            LOI_ENUM_BUFFER,        LOHA_REQUIRED },
         { L"escape-codes",          nullptr,            LOI_ESCAPE_CODES,       LOHA_OPTIONAL },
         { L"fat",                   nullptr,            'z' },
         { L"no-fat",                nullptr,            LOI_NO_FAT },
         { L"fit-columns",           nullptr,            LOI_FIT_COLUMNS },
         { L"no-fit-columns",        nullptr,            LOI_NO_FIT_COLUMNS },
+        { L"flat",                  nullptr,            LOI_FLAT },
+        { L"no-flat",               nullptr,            LOI_NO_FLAT },
         { L"full-paths",            nullptr,            'F' },
         { L"no-full-paths",         nullptr,            LOI_NO_FULL_PATHS },
         { L"git",                   nullptr,            LOI_GIT },
         { L"no-git",                nullptr,            LOI_NO_GIT },
+        { L"git-cache",             nullptr,            LOI_GIT_CACHE },
+        { L"no-git-cache",          nullptr,            LOI_NO_GIT_CACHE },
         { L"git-ignore",            nullptr,            LOI_GIT_IGNORE },
         { L"no-git-ignore",         nullptr,            LOI_NO_GIT_IGNORE },
         { L"git-repos",             nullptr,            LOI_GIT_REPOS },
@@ -252,12 +268,14 @@ int __cdecl _tmain(int argc, const WCHAR** argv)
         { L"icons",                 nullptr,            LOI_ICONS,              LOHA_OPTIONAL },
         { L"no-icons",              nullptr,            LOI_NO_ICONS },
         { L"ignore-glob",           nullptr,            'I',                    LOHA_REQUIRED },
+        { L"index",                 nullptr,            LOI_INDEX,              LOHA_REQUIRED },
         { L"justify",               nullptr,            LOI_JUSTIFY,            LOHA_OPTIONAL },
         { L"levels",                nullptr,            'L',                    LOHA_REQUIRED },
         { L"long",                  nullptr,            'l' },
         { L"no-long",               nullptr,            '<' },
         { L"lower",                 nullptr,            LOI_LOWER },
         { L"no-lower",              nullptr,            LOI_NO_LOWER },
+        { L"max-memory",            nullptr,            LOI_MAX_MEMORY,         LOHA_REQUIRED },
         { L"mini-bytes",            nullptr,            LOI_MINI_BYTES },
         { L"no-mini-bytes",         nullptr,            LOI_NO_MINI_BYTES },
         { L"mini-decimal",          nullptr,            LOI_MINI_DECIMAL },
@@ -295,6 +313,8 @@ int __cdecl _tmain(int argc, const WCHAR** argv)
         { L"time",                  nullptr,            LOI_TIME,               LOHA_OPTIONAL },
         { L"no-time",               nullptr,            LOI_NO_TIME },
         { L"time-style",            nullptr,            LOI_TIME_STYLE,         LOHA_REQUIRED },
+        { L"threads",               nullptr,            LOI_THREADS,            LOHA_REQUIRED },
+        { L"top",                   nullptr,            LOI_TOP,                LOHA_REQUIRED },
         { L"tree",                  nullptr,            LOI_TREE },
         { L"no-tree",               nullptr,            LOI_NO_TREE },
         { L"truncate-char",         nullptr,            LOI_TRUNCATE_CHAR,      LOHA_REQUIRED },
@@ -450,6 +470,10 @@ int __cdecl _tmain(int argc, const WCHAR** argv)
     DWORD dwAttrMatch = 0;
     DWORD dwAttrExcludeAny = FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_SYSTEM;
     unsigned limit_depth = -1;
+    unsigned threads = 0;
+    unsigned enum_buffer_kb = 0;
+    unsigned max_memory_mb = 0;
+    unsigned top = 0;
     bool fresh_a_flag = true;
     bool used_A_flag = false;
     bool used_B_flag = false;
@@ -457,6 +481,7 @@ int __cdecl _tmain(int argc, const WCHAR** argv)
     const WCHAR* picture = 0;
     const LongOption<WCHAR>* long_opt;
     StrW ignore_globs;
+    StrW index_path;
 
     bool was_g = false;
     bool was_t = false;
@@ -690,6 +715,9 @@ unrecognized_long_opt_value:
                 if (!SetUseIcons(opt_value))
                     goto unrecognized_long_opt_value;
                 break;
+            case LOI_INDEX:
+                index_path.Set(opt_value);
+                break;
             case LOI_JUSTIFY:
                 if (!opt_value) opt_value = L" ";
                 else if (!_wcsicmp(opt_value, L"") || !_wcsicmp(opt_value, L"always"))
@@ -757,12 +785,17 @@ unrecognized_long_opt_value:
             case LOI_NO_COLOR:              flagsOFF = FMT_COLORS; break;
             case LOI_NO_COLOR_SCALE:        SetColorScale(L"none"); break;
             case LOI_DIGIT_SORT:            SetDefaultNumericSort(false); break;
+            case LOI_ENUM_BUFFER:           enum_buffer_kb = wcstoul(opt_value, nullptr, 10); break;
             case LOI_NO_FAT:                flagsOFF = FMT_FAT; break;
             case LOI_FIT_COLUMNS:           SetCanAutoFit(true); break;
             case LOI_NO_FIT_COLUMNS:        SetCanAutoFit(false); break;
+            case LOI_FLAT:                  flagsON = FMT_FLAT|FMT_SUBDIRECTORIES; break;
+            case LOI_NO_FLAT:               flagsOFF = FMT_FLAT; break;
             case LOI_NO_FULL_PATHS:         flagsOFF = FMT_FULLNAME|FMT_FORCENONFAT|FMT_HIDEPSEUDODIRS; break;
             case LOI_GIT:                   flagsON = FMT_GIT; break;
             case LOI_NO_GIT:                flagsOFF = FMT_GIT|FMT_GITREPOS; break;
+            case LOI_GIT_CACHE:             SetUseGitCache(true); break;
+            case LOI_NO_GIT_CACHE:          SetUseGitCache(false); break;
             case LOI_GIT_IGNORE:            flagsON = FMT_GITIGNORE; break;
             case LOI_NO_GIT_IGNORE:         flagsOFF = FMT_GITIGNORE; break;
             case LOI_GIT_REPOS:             flagsON = FMT_GIT|FMT_GITREPOS; break;
@@ -775,6 +808,7 @@ unrecognized_long_opt_value:
             case LOI_NO_ICONS:              SetUseIcons(L"never"); break;
             case LOI_LOWER:                 flagsON = FMT_LOWERCASE; break;
             case LOI_NO_LOWER:              flagsOFF = FMT_LOWERCASE; break;
+            case LOI_MAX_MEMORY:            max_memory_mb = wcstoul(opt_value, nullptr, 10); break;
             case LOI_MINI_BYTES:            SetMiniBytes(true); break;
             case LOI_NO_MINI_BYTES:         SetMiniBytes(false); break;
             case LOI_MINI_DECIMAL:          flagsON = FMT_MINIDECIMAL; break;
@@ -795,6 +829,8 @@ unrecognized_long_opt_value:
             case LOI_NO_SHORT_NAMES:        flagsOFF = FMT_SHORTNAMES; break;
             case LOI_NO_STREAMS:            flagsOFF = FMT_ALTDATASTEAMS|FMT_FORCENONFAT; break;
             case LOI_STRING_SORT:           SetStringSort(true); break;
+            case LOI_THREADS:               threads = unsigned(min<unsigned long>(wcstoul(opt_value, nullptr, 10), c_max_threads)); break;
+            case LOI_TOP:                   top = wcstoul(opt_value, nullptr, 10); break;
             case LOI_TIME:                  flagsON = FMT_DATE; break;
             case LOI_NO_TIME:               flagsON = FMT_LONGNODATE; break;
             case LOI_WORD_SORT:             SetStringSort(false); break;
@@ -918,6 +954,20 @@ unrecognized_long_opt_value:
             return e.Report();
     }
 
+    // With -s, --top=N finds the first N files across all directories, so
+    // it lists them the same way as --flat.
+    if (top && (flags & FMT_SUBDIRECTORIES) && !(flags & (FMT_TREE|FMT_USAGE)))
+        SetFlag(flags, FMT_FLAT);
+
+    if (flags & FMT_FLAT)
+    {
+        // Files from all directories are listed together, so each one needs
+        // its full path, and there are no per-directory headers.  Like
+        // "dir /s /b", subdirectories are listed but . and .. are not.
+        ClearFlag(flags, FMT_TREE|FMT_BARERELATIVE|FMT_ALTDATASTEAMS|FMT_MINIHEADER);
+        SetFlag(flags, FMT_SUBDIRECTORIES|FMT_FULLNAME|FMT_NOHEADER|FMT_HIDEPSEUDODIRS);
+    }
+
     if (flags & FMT_TREE)
     {
         ClearFlag(flags, FMT_BARE|FMT_FULLNAME|FMT_FAT|FMT_JUSTIFY_FAT|FMT_JUSTIFY_NONFAT);
@@ -1060,11 +1110,18 @@ unrecognized_long_opt_value:
     DirEntryFormatter def;
     def.SetFitColumnsToContents(g_nix_defaults || used_B_flag);
     def.Initialize(cColumns, flags, timestamp, filesize, dwAttrIncludeAny, dwAttrMatch, dwAttrExcludeAny, picture);
+    def.Settings().m_threads = threads;
+    def.Settings().m_enum_buffer_kb = enum_buffer_kb;
+    def.Settings().m_max_memory_mb = max_memory_mb;
+    def.Settings().m_top = (flags & FMT_USAGE) ? 0 : top;
+    def.Settings().m_index_path.Set(index_path);
 
     if (g_debug)
     {
         if (limit_depth != unsigned(-1))
             Printf(L"debug: levels: %u\n", limit_depth);
+        if (threads)
+            Printf(L"debug: threads: %u\n", threads);
     }
 
     if (def.Settings().IsSet(FMT_COLORS))
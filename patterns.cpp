@@ -5,6 +5,7 @@
 
 #include "pch.h"
 #include "filesys.h"
+#include "direntry.h"
 #include "fileinfo.h"
 #include "patterns.h"
 #include "handle.h"
@@ -412,6 +413,9 @@ DirPattern* MakePatterns(int argc, const WCHAR** argv, const DirFormatSettings&
         }
     }
 
+    // Each pattern only needs status for its directory and below, so the
+    // status is scoped to that, and shared between patterns in the same repo.
+    RepoMap repos;
     for (DirPattern* p = patterns; p; p = p->m_next)
     {
         p->m_ignore.emplace_back(std::move(MakeGlobs(p->m_dir.Text(), ignore_globs)));
@@ -419,13 +423,13 @@ DirPattern* MakePatterns(int argc, const WCHAR** argv, const DirFormatSettings&
         if (settings.IsSet(FMT_GITIGNORE))
             p->AddGitIgnore(p->m_dir.Text());
         if (settings.IsSet(FMT_GIT|FMT_GITREPOS))
-            p->m_repo = GitStatus(p->m_dir.Text(), true, true);
+            p->m_repo = repos.FindScoped(p->m_dir.Text());
     }
 
     return patterns;
 }
 
-void GlobPatterns::GlobPattern::Set(const WCHAR* p, size_t len)
+void GlobPatterns::GlobPattern::Set(const WCHAR* p, int flags, size_t len)
 {
     if (len == size_t(-1))
         len = wcslen(p);
@@ -436,39 +440,82 @@ void GlobPatterns::GlobPattern::Set(const WCHAR* p, size_t len)
     if (p[0] == '!')
         ++p;
 
-    m_top_level = (p[0] == '/');
+    // A trailing slash means the pattern only matches directories; the rest
+    // of the pattern is matched as usual.  The body is the pattern without
+    // the trailing slash, and is used in place rather than copied.
+    const WCHAR* const body = p;
+    size_t body_len = m_pattern.Length() - (p - m_pattern.Text());
+    m_dir_only = (body_len > 1 && body[body_len - 1] == '/');
+    if (m_dir_only)
+        --body_len;
+    const WCHAR* const end = body + body_len;
+
+    m_top_level = (body_len && body[0] == '/');
     m_any_level = true;
     m_multi_star_prefix_len = 0;
 
     // fnmatch() says "**/foo" matches "x/foo" but not "foo", so "**/" prefix
     // requires an extra call to fnmatch() with the "**/" prefix stripped.
-    while (p[m_multi_star_prefix_len] == '*')
+    while (size_t(m_multi_star_prefix_len) < body_len && body[m_multi_star_prefix_len] == '*')
         m_multi_star_prefix_len++;
-    if (p[m_multi_star_prefix_len] == '/')
+    if (size_t(m_multi_star_prefix_len) < body_len && body[m_multi_star_prefix_len] == '/')
         ++m_multi_star_prefix_len;
     if (m_multi_star_prefix_len < 3)
         m_multi_star_prefix_len = 0;
 
     // "**/foo" needs to use FNM_LEADING_DIR, so skip past the "**/" prefix so
     // m_anyLevel becomes true.
-    p += m_multi_star_prefix_len;
-    while (p[0])
+    for (p = body + m_multi_star_prefix_len; p < end; ++p)
     {
         // This triggers on "foo[!/]bar" BECAUSE empirical testing shows
         // gitignore does as well!  Since git accomplishes the "match at any
         // level" behavior through pre-processing, for compatibility the same
         // approach is used here (which certainly simplifies things).
-        if (p[0] == '/' && p[1])
+        if (p[0] == '/' && p + 1 < end)
         {
             m_any_level = false;
             break;
         }
-
-        ++p;
     }
 
     assert(!(m_top_level && m_any_level));
     assert(!(m_top_level && m_multi_star_prefix_len));
+
+    flags |= Flags();
+    if (m_top_level)
+    {
+        // If it's a top level pattern (starts with a slash) then only
+        // match the beginning.
+        m_program.compile(body + 1, body_len - 1, flags);
+    }
+    else if (m_any_level)
+    {
+        // Patterns without a slash at the beginning or middle can match
+        // any directory level.  The "**/" prefix is superfluous when
+        // IsAnyLevel(), so skip past it if present so its slash doesn't
+        // trigger a false mismatch (e.g. "**/foo" vs "foo").
+        m_program.compile(body + m_multi_star_prefix_len, body_len - m_multi_star_prefix_len, flags|WM_PATHNAME);
+    }
+    else
+    {
+        // Do normal matching.
+        m_program.compile(body, body_len, flags);
+    }
+}
+
+bool GlobPatterns::GlobPattern::IsMatch(const WCHAR* full, const WCHAR* file, bool is_dir) const
+{
+    if (m_dir_only && !is_dir)
+        return false;
+
+    // The implementation makes an optimization that relies on matching while
+    // traversing the directory structure (vs matching against a flat list of
+    // fully qualified file paths):  Any level patterns only match against the
+    // last filename component, and traversing the directory structure ends up
+    // making that have the same effect as comparing to every filename
+    // component without needing to waste computation time on redundant
+    // comparisons.
+    return m_program.match(m_any_level ? file : full);
 }
 
 int GlobPatterns::GlobPattern::Flags() const
@@ -502,101 +549,105 @@ bool GlobPatterns::IsApplicable(const WCHAR* dir) const
     return true;
 }
 
-bool GlobPatterns::IsMatch(const WCHAR* dir, const WCHAR* file) const
+bool GlobPatterns::IsMatch(const WCHAR* dir, const WCHAR* file, bool is_dir) const
 {
-    bool result = false;
-    StrW full;
+    bool ignore;
+    return FindMatch(dir, file, is_dir, ignore) && ignore;
+}
+
+// Returns whether any pattern matches.  If so, ignore is set to whether the
+// last matching pattern ignores the file (false if it's a negation).
+bool GlobPatterns::FindMatch(const WCHAR* dir, const WCHAR* file, bool is_dir, bool& ignore) const
+{
+    StrW full;                          // Only built if a pattern needs it.
 
     assert(dir);
-    assert(wcsncmp(dir, m_root.Text(), m_root.Length()) == 0);
-    if (wcsncmp(dir, m_root.Text(), m_root.Length()) != 0)
+    assert(_wcsnicmp(dir, m_root.Text(), m_root.Length()) == 0);
+    if (_wcsnicmp(dir, m_root.Text(), m_root.Length()) != 0)
         return false;
 
     dir += m_root.Length();
     while (IsPathSeparator(*dir))
         ++dir;
 
-    PathJoin(full, dir, file);
+    // The last pattern that matches decides whether the file is ignored, so
+    // find the highest index among the matching candidates.  Bucketed
+    // patterns only match the file name, but a hash collision can still put
+    // a non-matching pattern in a bucket, so candidates are verified.
+    const unsigned c_none = unsigned(-1);
+    unsigned last = c_none;
 
-    for (const auto& pat : m_patterns)
+    if (!m_names.empty())
     {
-        const WCHAR* pattern = pat.Pattern().Text();
-
-        if (!*pattern || *pattern == '#')
-            continue;
-
-        const bool negate = (*pattern == '!');
-        if (negate)
-            ++pattern;
-
-        // Optimization:  if it's a match so far, only test negations; if it's
-        // not a match so far, don't test negations.
-        if (result == !negate)
-            continue;
-
-        const int flags = pat.Flags() | m_flags;
-
-        // First try the pattern as is.  And if index_to_filename > 0 then
-        // also try the pattern against the filename part, as long as the
-        // pattern doesn't start with "/" or "*/"
-        bool match = false;
-        if (pat.IsTopLevel())
-        {
-            // If it's a top level pattern (starts with a slash) then only
-            // match the beginning.
-            match = (wildmatch(pattern + 1, full.Text(), flags) == 0);
-        }
-        else if (pat.IsAnyLevel())
+        const auto& names = m_names.find(HashName(file));
+        if (names != m_names.end())
         {
-            // Patterns without a slash at the beginning or middle can match
-            // any directory level.  The "**/" prefix is superfluous when
-            // IsAnyLevel(), so skip past it if present so its slash doesn't
-            // trigger a false mismatch (e.g. "**/foo" vs "foo").
-            //
-            // The implementation makes an optimization that relies on
-            // matching while traversing the directory structure (vs matching
-            // against a flat list of fully qualified file paths):  It only
-            // matches against the last filename component, and traversing the
-            // directory structure ends up making that have the same effect as
-            // comparing to every filename component without needing to waste
-            // computation time on redundant comparisons.
-            match = (wildmatch(pattern + pat.MultiStarPrefix(), file, flags|WM_PATHNAME) == 0);
+            for (auto index = names->second.rbegin(); index != names->second.rend(); ++index)
+            {
+                if (m_patterns[*index].IsMatch(nullptr, file, is_dir))
+                {
+                    last = *index;
+                    break;
+                }
+            }
         }
-        else
+    }
+
+    const WCHAR* ext = wcsrchr(file, '.');
+    if (ext && !m_extensions.empty())
+    {
+        const auto& exts = m_extensions.find(HashName(ext));
+        if (exts != m_extensions.end())
         {
-            // Do normal matching.
-            match = (wildmatch(pattern, full.Text(), flags) == 0);
+            for (auto index = exts->second.rbegin(); index != exts->second.rend(); ++index)
+            {
+                if (last != c_none && *index < last)
+                    break;
+                if (m_patterns[*index].IsMatch(nullptr, file, is_dir))
+                {
+                    last = *index;
+                    break;
+                }
+            }
         }
+    }
 
-        if (match)
+    for (auto index = m_residual.rbegin(); index != m_residual.rend(); ++index)
+    {
+        if (last != c_none && *index < last)
+            break;
+
+        const GlobPattern& pat = m_patterns[*index];
+        if (!pat.IsAnyLevel() && full.Empty())
+            PathJoin(full, dir, file);
+
+        if (pat.IsMatch(full.Text(), file, is_dir))
         {
-            result = !negate;
-            if (!m_any_negations)
-                break;
+            last = *index;
+            break;
         }
     }
 
-    if (!result)
+    if (last == c_none)
         return false;
 
+    ignore = !m_patterns[last].IsNegate();
     return true;
 }
 
 void GlobPatterns::SetPattern(size_t index, const WCHAR* p)
 {
-    GlobPattern& pat = m_patterns[index];
-    const bool was_negate = pat.Pattern().Text()[0] == '!';
-    const bool is_negate = p[0] == '!';
-
-    pat.Set(p);
-
-    UpdateAnyNegations(is_negate, was_negate);
+    m_patterns[index].Set(p, m_flags);
+    BuildIndex();
 }
 
 void GlobPatterns::SwapWithNext(size_t index)
 {
     if (index + 1 < m_patterns.size())
+    {
         std::swap(m_patterns[index], m_patterns[index + 1]);
+        BuildIndex();
+    }
 }
 
 void GlobPatterns::Insert(size_t index, const WCHAR* p)
@@ -627,7 +678,7 @@ void GlobPatterns::Insert(size_t index, const WCHAR* p)
         s.Set(p, next - p);
 
         GlobPattern pat;
-        pat.Set(s.Text());
+        pat.Set(s.Text(), m_flags);
         m_patterns.insert(m_patterns.begin() + (index++), std::move(pat));
         s.Clear();
 
@@ -635,6 +686,8 @@ void GlobPatterns::Insert(size_t index, const WCHAR* p)
         if (*p == ';')
             ++p;
     }
+
+    BuildIndex();
 }
 
 bool GlobPatterns::Load(HANDLE h)
@@ -642,39 +695,60 @@ bool GlobPatterns::Load(HANDLE h)
     assert(m_root_initialized);
     assert(m_patterns.empty());
 
-    DWORD bytes;
-    DWORD size = GetFileSize(h, nullptr);
-    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(size);
-    if (!ReadFile(h, buffer.get(), size, &bytes, 0 ) || bytes != size)
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(h, &size) || size.QuadPart > INT_MAX)
+        return false;
+    if (!size.QuadPart)
+        return true;
+
+    // Map the file and convert it to UTF16 in one pass, and then parse the
+    // patterns in place.  Blank lines and comments are skipped.
+    SHBasic mapping = CreateFileMapping(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping.Empty())
+        return false;
+    const char* view = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!view)
         return false;
 
-    StrW line;
-    const char* walk = static_cast<char*>(buffer.get());
-    const char* end = static_cast<char*>(buffer.get()) + bytes;
+    const char* bytes = view;
+    int len = int(size.QuadPart);
+    if (len >= 3 && memcmp(bytes, "\xef\xbb\xbf", 3) == 0)
+    {
+        bytes += 3;
+        len -= 3;
+    }
+
+    std::unique_ptr<WCHAR[]> text;
+    const int needed = len ? MultiByteToWideChar(CP_UTF8, 0, bytes, len, nullptr, 0) : 0;
+    if (needed > 0)
+    {
+        text = std::make_unique<WCHAR[]>(needed);
+        MultiByteToWideChar(CP_UTF8, 0, bytes, len, text.get(), needed);
+    }
+    UnmapViewOfFile(view);
+
+    const WCHAR* walk = text.get();
+    const WCHAR* const end = walk + max(needed, 0);
     while (walk < end)
     {
-        const char* start = walk;
+        const WCHAR* start = walk;
         while (walk < end && *walk != '\r' && *walk != '\n')
             ++walk;
 
-        const int needed = MultiByteToWideChar(CP_UTF8, 0, start, int(walk - start), nullptr, 0);
-        if (needed > 0)
+        if (walk > start && *start != '#')
         {
-            WCHAR* out = line.Reserve(needed + 1);
-            MultiByteToWideChar(CP_UTF8, 0, start, int(walk - start), out, needed);
-            out[needed] = '\0';
-
             GlobPattern glob;
-            glob.Set(out, needed);
+            glob.Set(start, m_flags, walk - start);
             m_patterns.emplace_back(std::move(glob));
         }
 
-        if (*walk == '\r')
+        if (walk < end && *walk == '\r')
             ++walk;
-        if (*walk == '\n')
+        if (walk < end && *walk == '\n')
             ++walk;
     }
 
+    BuildIndex();
     return true;
 }
 
@@ -707,33 +781,191 @@ void GlobPatterns::Trim(StrW& s)
     s.SetEnd(end);
 }
 
-void GlobPatterns::UpdateAnyNegations(bool is_negate, bool was_negate)
+void GlobPatterns::BuildIndex()
 {
-    if (is_negate)
+    m_names.clear();
+    m_extensions.clear();
+    m_residual.clear();
+
+    for (unsigned ii = 0; ii < unsigned(m_patterns.size()); ++ii)
     {
-        m_any_negations = true;
+        const GlobPattern& pat = m_patterns[ii];
+        if (pat.IsComment())
+            continue;
+
+        // Only any level patterns match against just the file name.  The
+        // literal part can't include a slash, since file names don't.
+        const wild::program& program = pat.Program();
+        const WCHAR* text = program.pattern().c_str();
+        if (pat.IsAnyLevel())
+        {
+            if (program.is_literal() && !wcschr(text, '/'))
+            {
+                m_names[HashName(text)].push_back(ii);
+                continue;
+            }
+            if (program.is_suffix() && text[1] == '.' && !wcschr(text + 2, '.'))
+            {
+                m_extensions[HashName(text + 1)].push_back(ii);
+                continue;
+            }
+        }
+
+        m_residual.push_back(ii);
+    }
+}
+
+size_t GlobPatterns::HashName(const WCHAR* name) const
+{
+    // Fold the same way wildmatch does, so names that match hash the same.
+    const bool casefold = !!(m_flags & WM_CASEFOLD);
+    size_t hash = 0;
+    for (; WCHAR ch = *name; ++name)
+    {
+        if (casefold)
+            ch = WCHAR(towlower(ch));
+        hash = hash * 31 + ch;
     }
-    else if (was_negate && m_any_negations)
+    return hash;
+}
+
+// These are the same DOS wildcard characters FindFirstFile translates its
+// search pattern into.
+static const WCHAR c_dos_star = '<';    // Matches zero or more characters up to the last dot.
+static const WCHAR c_dos_qm = '>';      // Matches one character, or zero characters at a dot or the end.
+static const WCHAR c_dos_dot = '"';     // Matches a dot, or zero characters at the end.
+
+static bool MatchDos(const WCHAR* expr, const WCHAR* name, const WCHAR* last_dot)
+{
+    while (*expr)
     {
-        bool any = false;
-        for (const auto& pat : m_patterns)
+        switch (*expr)
         {
-            if (pat.Pattern().Text()[0] == '!')
+        case '*':
+            ++expr;
+            if (!*expr)
+                return true;
+            for (; *name; ++name)
             {
-                any = true;
-                break;
+                if (MatchDos(expr, name, last_dot))
+                    return true;
+            }
+            return MatchDos(expr, name, last_dot);
+
+        case c_dos_star:
+            ++expr;
+            for (;; ++name)
+            {
+                if (MatchDos(expr, name, last_dot))
+                    return true;
+                if (!*name || name == last_dot)
+                    return false;
             }
+
+        case c_dos_qm:
+            if (*name && *name != '.')
+                ++name;
+            ++expr;
+            break;
+
+        case c_dos_dot:
+            if (*name == '.')
+                ++name;
+            else if (*name)
+                return false;
+            ++expr;
+            break;
+
+        default:
+            if (!*name || WCHAR(towupper(*name)) != *expr)
+                return false;
+            ++name;
+            ++expr;
+            break;
+        }
+    }
+
+    return !*name;
+}
+
+void FindPattern::Set(const WCHAR* pattern)
+{
+    m_expr.Clear();
+    m_match_all = false;
+    m_literal = true;
+
+    if (pattern[0] == ':' && pattern[1] == ':')
+    {
+        m_match_all = true;
+        m_literal = false;
+        return;
+    }
+
+    Translate(pattern, m_expr);
+    if (m_expr.Equal(L"*"))
+    {
+        m_match_all = true;
+        m_literal = false;
+        return;
+    }
+
+    for (const WCHAR* p = m_expr.Text(); *p; ++p)
+    {
+        if (*p == '*' || *p == c_dos_star || *p == c_dos_qm || *p == c_dos_dot)
+            m_literal = false;
+        else
+            m_expr.SetAt(p, WCHAR(towupper(*p)));
+    }
+}
+
+void FindPattern::Translate(const WCHAR* pattern, StrW& expr)
+{
+    expr.Clear();
+
+    if (!wcscmp(pattern, L"*.*"))
+    {
+        expr.Set(L"*");
+        return;
+    }
+
+    // Translate the same way FindFirstFile does.
+    for (const WCHAR* p = pattern; *p; ++p)
+    {
+        WCHAR c = *p;
+        if (c == '*')
+        {
+            if (p[1] == '.')
+                c = c_dos_star;
+        }
+        else if (c == '?')
+        {
+            c = c_dos_qm;
         }
-        m_any_negations = any;
+        else if (c == '.' && (p[1] == '?' || p[1] == '*' || !p[1]))
+        {
+            c = c_dos_dot;
+        }
+        expr.Append(&c, 1);
     }
 }
 
-bool DirPattern::IsIgnore(const WCHAR* dir, const WCHAR* file) const
+bool FindPattern::IsMatch(const WCHAR* name) const
+{
+    return m_match_all || MatchDos(m_expr.Text(), name, wcsrchr(name, '.'));
+}
+
+bool FindPattern::IsMatch(const DirEntry& entry) const
+{
+    return (IsMatch(entry.name) ||
+            (entry.short_name_len && IsMatch(entry.short_name)));
+}
+
+bool DirPattern::IsIgnore(const WCHAR* dir, const WCHAR* file, bool is_dir) const
 {
     if (!m_ignore.size())
         return false;
     for (const auto& ignore : m_ignore)
-        if (ignore.IsMatch(dir, file))
+        if (ignore.IsMatch(dir, file, is_dir))
             return true;
     return false;
 }
@@ -9,10 +9,13 @@
 #include "str.h"
 #include "git.h"
 #include "wildmatch/wildmatch.h"
+#include "wildmatch/wildmatch.hpp"
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 struct DirFormatSettings;
+struct DirEntry;
 class Error;
 
 class GlobPatterns
@@ -20,19 +23,25 @@ class GlobPatterns
     struct GlobPattern
     {
     public:
-        void            Set(const WCHAR* p, size_t len=-1);
+        void            Set(const WCHAR* p, int flags, size_t len=-1);
 
         const StrW&     Pattern() const { return m_pattern; }
+        const wild::program& Program() const { return m_program; }
         int             Flags() const;
+        bool            IsMatch(const WCHAR* full, const WCHAR* file, bool is_dir) const;
 
+        bool            IsNegate() const { return m_pattern.Text()[0] == '!'; }
+        bool            IsComment() const { return !m_pattern.Text()[0] || m_pattern.Text()[0] == '#'; }
         bool            IsTopLevel() const { return m_top_level; }
         bool            IsAnyLevel() const { return m_any_level; }
         size_t          MultiStarPrefix() const { return m_multi_star_prefix_len; }
 
     private:
         StrW            m_pattern;
+        wild::program   m_program;      // Compiled from m_pattern, less any prefix that's handled by IsMatch.
         bool            m_top_level;    // Match relative to the start of the compared path.
         bool            m_any_level;    // m_pattern covers only one pathname component, so match with the filename part.
+        bool            m_dir_only;     // m_pattern ends with a slash, so it only matches directories.
         BYTE            m_multi_star_prefix_len;    // If > 0 then m_pattern starts with two or more stars followed by a slash.
                                                     // (Omits any '!' negation character.)
     };
@@ -43,7 +52,8 @@ public:
 
     void                SetRoot(const WCHAR* root);
     bool                IsApplicable(const WCHAR* root) const;
-    bool                IsMatch(const WCHAR* dir, const WCHAR* file) const;
+    bool                IsMatch(const WCHAR* dir, const WCHAR* file, bool is_dir) const;
+    bool                FindMatch(const WCHAR* dir, const WCHAR* file, bool is_dir, bool& ignore) const;
 
     size_t              Count() const { return m_patterns.size(); }
     const StrW&         GetPattern(size_t index) const { return m_patterns[index].Pattern(); }
@@ -58,18 +68,51 @@ public:
     static void         Trim(StrW& s);
 
 private:
-    void                UpdateAnyNegations(bool is_negate, bool was_negate);
+    void                BuildIndex();
+    size_t              HashName(const WCHAR* name) const;
 
 private:
     std::vector<GlobPattern> m_patterns;
     StrW                m_root;
     int                 m_flags;
-    bool                m_any_negations = false;
+
+    // Any level patterns that are a literal name or "*.ext" are bucketed by a
+    // hash of the name or extension, so IsMatch only tests the candidates
+    // plus the residual patterns.  Bucket entries are indices into
+    // m_patterns, in ascending order.
+    std::unordered_map<size_t, std::vector<unsigned>> m_names;
+    std::unordered_map<size_t, std::vector<unsigned>> m_extensions;
+    std::vector<unsigned> m_residual;
 #ifdef DEBUG
     bool                m_root_initialized = false;
 #endif
 };
 
+// FindPattern matches file names the same way FindFirstFile matches its
+// search pattern:  with DOS wildcard semantics, case insensitively, and
+// against both the long and short names.  Regular expression patterns (::)
+// match everything, since the caller applies the regular expression.
+class FindPattern
+{
+public:
+                        FindPattern() = default;
+                        FindPattern(const WCHAR* pattern) { Set(pattern); }
+
+    void                Set(const WCHAR* pattern);
+
+    bool                IsMatchAll() const { return m_match_all; }
+    bool                IsLiteral() const { return m_literal; }
+    bool                IsMatch(const DirEntry& entry) const;
+    bool                IsMatch(const WCHAR* name) const;
+
+    static void         Translate(const WCHAR* pattern, StrW& expr);
+
+private:
+    StrW                m_expr;         // Translated to DOS wildcards, and upper case.
+    bool                m_match_all = true;
+    bool                m_literal = false;
+};
+
 struct SubDir
 {
     StrW                dir;
@@ -83,7 +126,7 @@ struct DirPattern
 {
                         DirPattern() : m_implicit(false), m_next(nullptr) {}
 
-    bool                IsIgnore(const WCHAR* dir, const WCHAR* file) const;
+    bool                IsIgnore(const WCHAR* dir, const WCHAR* file, bool is_dir) const;
     void                AddGitIgnore(const WCHAR* dir);
 
     std::vector<StrW>   m_patterns;
@@ -80,6 +80,24 @@ define_exe("dirx")
         defines("_CRT_SECURE_NO_WARNINGS")
         defines("_CRT_NONSTDC_NO_WARNINGS")
 
+--------------------------------------------------------------------------------
+define_exe("tests")
+    targetname("dirx_tests")
+    links("kernel32")
+    links("user32")
+    links("advapi32")
+    links("shell32")
+
+    includedirs(".")
+    files("*.cpp")
+    files("wildmatch/*.cpp")
+    files("tests/*.cpp")
+    removefiles("main.cpp")
+
+    filter "action:vs*"
+        defines("_CRT_SECURE_NO_WARNINGS")
+        defines("_CRT_NONSTDC_NO_WARNINGS")
+
 
 
 --------------------------------------------------------------------------------
@@ -0,0 +1,989 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "regexp.h"
+#include "output.h"
+
+#include <algorithm>
+
+static const unsigned c_infinite = unsigned(-1);
+static const unsigned c_max_repeat = 1000;
+static const size_t c_max_program = 10000;
+static const size_t c_max_states = 2000;
+
+enum class Op : BYTE { Char, Class, Any, Split, Jmp, Begin, End, Match };
+
+struct RegExp::Inst
+{
+    Op                  op;
+    WCHAR               ch;             // Char:  folded to lower case.
+    unsigned            x;              // Class:  index; Split, Jmp:  target.
+    unsigned            y;              // Split:  second target.
+};
+
+enum
+{
+    NAMED_DIGIT         = 0x01,
+    NAMED_SPACE         = 0x02,
+    NAMED_WORD          = 0x04,
+};
+
+struct RegExp::CharClass
+{
+    bool                Matches(WCHAR c) const;
+    void                Finish();
+
+    std::vector<std::pair<WCHAR, WCHAR>> ranges;
+    BYTE                named = 0;      // \d, \s, \w.
+    BYTE                named_not = 0;  // \D, \S, \W.
+    bool                negated = false;
+    DWORD               ascii[4];       // Precomputed for 0..127.
+};
+
+struct RegExp::DState
+{
+    std::vector<unsigned> pcs;          // Char, Class, Any, End, and Match instructions.
+    bool                match;
+    bool                match_at_end;
+    unsigned            next[128];      // 0 means not computed yet (state 0 is never a successor).
+    std::unordered_map<WCHAR, unsigned> next_other;
+};
+
+static inline WCHAR Fold(WCHAR c)
+{
+    return (c < 128) ? ((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c) : WCHAR(towlower(c));
+}
+
+static inline bool IsLineTerminator(WCHAR c)
+{
+    return c == '\n' || c == '\r' || c == 0x2028 || c == 0x2029;
+}
+
+static bool IsNamed(BYTE named, WCHAR c)
+{
+    if ((named & NAMED_DIGIT) && iswdigit(c))
+        return true;
+    if ((named & NAMED_SPACE) && iswspace(c))
+        return true;
+    if ((named & NAMED_WORD) && (iswalnum(c) || c == '_'))
+        return true;
+    return false;
+}
+
+static bool IsNamedNot(BYTE named_not, WCHAR c)
+{
+    if ((named_not & NAMED_DIGIT) && !iswdigit(c))
+        return true;
+    if ((named_not & NAMED_SPACE) && !iswspace(c))
+        return true;
+    if ((named_not & NAMED_WORD) && !(iswalnum(c) || c == '_'))
+        return true;
+    return false;
+}
+
+bool RegExp::CharClass::Matches(WCHAR c) const
+{
+    if (c < 128)
+        return !!(ascii[c >> 5] & (DWORD(1) << (c & 31)));
+
+    bool match = IsNamed(named, c) || IsNamedNot(named_not, c);
+    if (!match)
+    {
+        // Case insensitive:  match either case against the ranges.
+        const WCHAR lower = WCHAR(towlower(c));
+        const WCHAR upper = WCHAR(towupper(c));
+        for (const auto& range : ranges)
+        {
+            if ((c >= range.first && c <= range.second) ||
+                (lower >= range.first && lower <= range.second) ||
+                (upper >= range.first && upper <= range.second))
+            {
+                match = true;
+                break;
+            }
+        }
+    }
+    return match != negated;
+}
+
+void RegExp::CharClass::Finish()
+{
+    ZeroMemory(ascii, sizeof(ascii));
+    for (WCHAR c = 0; c < 128; ++c)
+    {
+        bool match = IsNamed(named, c) || IsNamedNot(named_not, c);
+        for (const auto& range : ranges)
+        {
+            const WCHAR lower = Fold(c);
+            const WCHAR upper = (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+            if ((c >= range.first && c <= range.second) ||
+                (lower >= range.first && lower <= range.second) ||
+                (upper >= range.first && upper <= range.second))
+            {
+                match = true;
+                break;
+            }
+        }
+        if (match != negated)
+            ascii[c >> 5] |= DWORD(1) << (c & 31);
+    }
+}
+
+/*
+ * Parser and compiler.
+ */
+
+namespace
+{
+
+struct Node
+{
+    enum Type { Empty, Char, Any, Class, Concat, Alt, Repeat, Begin, End };
+
+    Type                type;
+    WCHAR               ch = 0;
+    unsigned            cls = 0;
+    unsigned            min = 0;
+    unsigned            max = 0;
+    std::vector<unsigned> kids;
+};
+
+// Parses the subset of ECMAScript regular expressions that the automaton
+// supports.  Parse() fails for anything else, including syntax errors, so
+// that std::regex can either handle it or report the error.
+class RegExpParser
+{
+public:
+                        RegExpParser(std::vector<RegExp::CharClass>& classes) : m_classes(classes) {}
+
+    bool                Parse(const WCHAR* pattern, unsigned& root);
+    const Node&         GetNode(unsigned index) const { return m_nodes[index]; }
+
+private:
+    bool                ParseAlt(unsigned& index);
+    bool                ParseConcat(unsigned& index);
+    bool                ParseAtom(unsigned& index);
+    bool                ParseQuantifier(unsigned& min, unsigned& max);
+    bool                ParseNumber(unsigned& num);
+    bool                ParseEscape(WCHAR& ch, BYTE& named, BYTE& named_not, bool in_class);
+    bool                ParseClass(unsigned& index);
+    unsigned            NewNode(Node::Type type);
+
+    std::vector<Node>   m_nodes;
+    std::vector<RegExp::CharClass>& m_classes;
+    const WCHAR*        m_p = nullptr;
+};
+
+unsigned RegExpParser::NewNode(Node::Type type)
+{
+    m_nodes.emplace_back();
+    m_nodes.back().type = type;
+    return unsigned(m_nodes.size() - 1);
+}
+
+bool RegExpParser::Parse(const WCHAR* pattern, unsigned& root)
+{
+    m_p = pattern;
+    if (!ParseAlt(root))
+        return false;
+    return !*m_p;
+}
+
+bool RegExpParser::ParseAlt(unsigned& index)
+{
+    unsigned first;
+    if (!ParseConcat(first))
+        return false;
+    if (*m_p != '|')
+    {
+        index = first;
+        return true;
+    }
+
+    index = NewNode(Node::Alt);
+    m_nodes[index].kids.push_back(first);
+    while (*m_p == '|')
+    {
+        ++m_p;
+        unsigned next;
+        if (!ParseConcat(next))
+            return false;
+        m_nodes[index].kids.push_back(next);
+    }
+    return true;
+}
+
+bool RegExpParser::ParseConcat(unsigned& index)
+{
+    index = NewNode(Node::Concat);
+    while (*m_p && *m_p != '|' && *m_p != ')')
+    {
+        unsigned atom;
+        if (!ParseAtom(atom))
+            return false;
+
+        unsigned min, max;
+        if (*m_p == '*' || *m_p == '+' || *m_p == '?' || *m_p == '{')
+        {
+            if (!ParseQuantifier(min, max))
+                return false;
+            // Lazy quantifiers match the same names; only the match
+            // positions differ.
+            if (*m_p == '?')
+                ++m_p;
+            const Node::Type type = m_nodes[atom].type;
+            if (type == Node::Begin || type == Node::End)
+                return false;
+            const unsigned repeat = NewNode(Node::Repeat);
+            m_nodes[repeat].min = min;
+            m_nodes[repeat].max = max;
+            m_nodes[repeat].kids.push_back(atom);
+            atom = repeat;
+        }
+
+        m_nodes[index].kids.push_back(atom);
+    }
+    return true;
+}
+
+bool RegExpParser::ParseNumber(unsigned& num)
+{
+    if (!iswdigit(*m_p))
+        return false;
+    num = 0;
+    while (*m_p >= '0' && *m_p <= '9')
+    {
+        num = num * 10 + (*m_p - '0');
+        if (num > c_max_repeat)
+            return false;
+        ++m_p;
+    }
+    return true;
+}
+
+bool RegExpParser::ParseQuantifier(unsigned& min, unsigned& max)
+{
+    switch (*(m_p++))
+    {
+    case '*':   min = 0; max = c_infinite; return true;
+    case '+':   min = 1; max = c_infinite; return true;
+    case '?':   min = 0; max = 1; return true;
+    }
+
+    if (!ParseNumber(min))
+        return false;
+    max = min;
+    if (*m_p == ',')
+    {
+        ++m_p;
+        if (*m_p == '}')
+            max = c_infinite;
+        else if (!ParseNumber(max) || max < min)
+            return false;
+    }
+    if (*m_p != '}')
+        return false;
+    ++m_p;
+    return true;
+}
+
+static bool ParseHex(const WCHAR*& p, unsigned digits, WCHAR& ch)
+{
+    unsigned value = 0;
+    for (unsigned ii = 0; ii < digits; ++ii)
+    {
+        const WCHAR c = p[ii];
+        if (c >= '0' && c <= '9')
+            value = value * 16 + (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            value = value * 16 + (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            value = value * 16 + (c - 'A' + 10);
+        else
+            return false;
+    }
+    p += digits;
+    ch = WCHAR(value);
+    return true;
+}
+
+bool RegExpParser::ParseEscape(WCHAR& ch, BYTE& named, BYTE& named_not, bool in_class)
+{
+    assert(*m_p == '\\');
+    ++m_p;
+
+    ch = 0;
+    named = 0;
+    named_not = 0;
+
+    const WCHAR c = *(m_p++);
+    switch (c)
+    {
+    case 'd':   named = NAMED_DIGIT; return true;
+    case 's':   named = NAMED_SPACE; return true;
+    case 'w':   named = NAMED_WORD; return true;
+    case 'D':   named_not = NAMED_DIGIT; return true;
+    case 'S':   named_not = NAMED_SPACE; return true;
+    case 'W':   named_not = NAMED_WORD; return true;
+    case 't':   ch = '\t'; return true;
+    case 'n':   ch = '\n'; return true;
+    case 'v':   ch = '\v'; return true;
+    case 'f':   ch = '\f'; return true;
+    case 'r':   ch = '\r'; return true;
+    case 'x':   return ParseHex(m_p, 2, ch);
+    case 'u':   return ParseHex(m_p, 4, ch);
+    case 'b':
+        // Backspace inside a class; a word boundary outside of one.
+        ch = '\b';
+        return in_class;
+    case 'c':
+        if (!iswalpha(*m_p) || *m_p >= 128)
+            return false;
+        ch = WCHAR(*(m_p++) % 32);
+        return true;
+    }
+
+    // Backreferences, \0, \B, and unknown escapes are left to std::regex.
+    if (!c || iswalnum(c) || c == '_')
+        return false;
+
+    ch = c;
+    return true;
+}
+
+bool RegExpParser::ParseClass(unsigned& index)
+{
+    assert(*m_p == '[');
+    ++m_p;
+
+    RegExp::CharClass cls;
+    if (*m_p == '^')
+    {
+        cls.negated = true;
+        ++m_p;
+    }
+    if (*m_p == ']')
+        return false;
+
+    while (*m_p != ']')
+    {
+        if (!*m_p)
+            return false;
+        if (*m_p == '[')
+            return false;           // Avoid [: :], [= =], and [. .].
+
+        WCHAR lo;
+        BYTE named, named_not;
+        if (*m_p == '\\')
+        {
+            if (!ParseEscape(lo, named, named_not, true))
+                return false;
+            if (named || named_not)
+            {
+                if (*m_p == '-' && m_p[1] != ']')
+                    return false;
+                cls.named |= named;
+                cls.named_not |= named_not;
+                continue;
+            }
+        }
+        else
+        {
+            lo = *(m_p++);
+        }
+
+        WCHAR hi = lo;
+        if (*m_p == '-' && m_p[1] != ']' && m_p[1])
+        {
+            ++m_p;
+            if (*m_p == '\\')
+            {
+                if (!ParseEscape(hi, named, named_not, true) || named || named_not)
+                    return false;
+            }
+            else
+            {
+                hi = *(m_p++);
+            }
+            if (hi < lo)
+                return false;
+        }
+
+        cls.ranges.emplace_back(lo, hi);
+    }
+    ++m_p;
+
+    cls.Finish();
+    m_classes.emplace_back(std::move(cls));
+    index = NewNode(Node::Class);
+    m_nodes[index].cls = unsigned(m_classes.size() - 1);
+    return true;
+}
+
+bool RegExpParser::ParseAtom(unsigned& index)
+{
+    switch (*m_p)
+    {
+    case '(':
+        ++m_p;
+        if (*m_p == '?')
+        {
+            // Only non-capturing groups; no lookahead.
+            if (m_p[1] != ':')
+                return false;
+            m_p += 2;
+        }
+        if (!ParseAlt(index) || *m_p != ')')
+            return false;
+        ++m_p;
+        return true;
+
+    case '^':
+        ++m_p;
+        index = NewNode(Node::Begin);
+        return true;
+
+    case '$':
+        ++m_p;
+        index = NewNode(Node::End);
+        return true;
+
+    case '.':
+        ++m_p;
+        index = NewNode(Node::Any);
+        return true;
+
+    case '[':
+        return ParseClass(index);
+
+    case '\\':
+        {
+            WCHAR ch;
+            BYTE named, named_not;
+            if (!ParseEscape(ch, named, named_not, false))
+                return false;
+            if (named || named_not)
+            {
+                RegExp::CharClass cls;
+                cls.named = named;
+                cls.named_not = named_not;
+                cls.Finish();
+                m_classes.emplace_back(std::move(cls));
+                index = NewNode(Node::Class);
+                m_nodes[index].cls = unsigned(m_classes.size() - 1);
+            }
+            else
+            {
+                index = NewNode(Node::Char);
+                m_nodes[index].ch = ch;
+            }
+        }
+        return true;
+
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case '}':
+    case ']':
+    case ')':
+    case '|':
+    case '\0':
+        return false;
+    }
+
+    index = NewNode(Node::Char);
+    m_nodes[index].ch = *(m_p++);
+    return true;
+}
+
+// Compiles the parsed tree into a Thompson NFA.
+class RegExpCompiler
+{
+public:
+                        RegExpCompiler(const RegExpParser& parser, std::vector<RegExp::Inst>& prog) : m_parser(parser), m_prog(prog) {}
+
+    bool                Compile(unsigned root);
+
+private:
+    bool                Emit(unsigned index);
+    unsigned            Add(Op op, unsigned x=0, unsigned y=0);
+
+    const RegExpParser& m_parser;
+    std::vector<RegExp::Inst>& m_prog;
+};
+
+unsigned RegExpCompiler::Add(Op op, unsigned x, unsigned y)
+{
+    RegExp::Inst inst;
+    inst.op = op;
+    inst.ch = 0;
+    inst.x = x;
+    inst.y = y;
+    m_prog.push_back(inst);
+    return unsigned(m_prog.size() - 1);
+}
+
+bool RegExpCompiler::Compile(unsigned root)
+{
+    m_prog.clear();
+    if (!Emit(root))
+        return false;
+    Add(Op::Match);
+    return true;
+}
+
+bool RegExpCompiler::Emit(unsigned index)
+{
+    if (m_prog.size() > c_max_program)
+        return false;
+
+    const Node& node = m_parser.GetNode(index);
+    switch (node.type)
+    {
+    case Node::Empty:
+        break;
+    case Node::Char:
+        m_prog[Add(Op::Char)].ch = Fold(node.ch);
+        break;
+    case Node::Any:
+        Add(Op::Any);
+        break;
+    case Node::Class:
+        Add(Op::Class, node.cls);
+        break;
+    case Node::Begin:
+        Add(Op::Begin);
+        break;
+    case Node::End:
+        Add(Op::End);
+        break;
+
+    case Node::Concat:
+        for (unsigned kid : node.kids)
+        {
+            if (!Emit(kid))
+                return false;
+        }
+        break;
+
+    case Node::Alt:
+        {
+            std::vector<unsigned> jumps;
+            for (size_t ii = 0; ii + 1 < node.kids.size(); ++ii)
+            {
+                const unsigned split = Add(Op::Split);
+                m_prog[split].x = split + 1;
+                if (!Emit(node.kids[ii]))
+                    return false;
+                jumps.push_back(Add(Op::Jmp));
+                m_prog[split].y = unsigned(m_prog.size());
+            }
+            if (!Emit(node.kids.back()))
+                return false;
+            for (unsigned jump : jumps)
+                m_prog[jump].x = unsigned(m_prog.size());
+        }
+        break;
+
+    case Node::Repeat:
+        {
+            const unsigned kid = node.kids[0];
+            for (unsigned ii = 0; ii < node.min; ++ii)
+            {
+                if (!Emit(kid))
+                    return false;
+            }
+
+            if (node.max == c_infinite)
+            {
+                const unsigned split = Add(Op::Split);
+                m_prog[split].x = split + 1;
+                if (!Emit(kid))
+                    return false;
+                Add(Op::Jmp, split);
+                m_prog[split].y = unsigned(m_prog.size());
+            }
+            else
+            {
+                std::vector<unsigned> splits;
+                for (unsigned ii = node.min; ii < node.max; ++ii)
+                {
+                    const unsigned split = Add(Op::Split);
+                    m_prog[split].x = split + 1;
+                    splits.push_back(split);
+                    if (!Emit(kid))
+                        return false;
+                }
+                for (unsigned split : splits)
+                    m_prog[split].y = unsigned(m_prog.size());
+            }
+        }
+        break;
+    }
+
+    return m_prog.size() <= c_max_program;
+}
+
+}; // namespace
+
+/*
+ * RegExp.
+ */
+
+RegExp::RegExp()
+{
+}
+
+RegExp::~RegExp()
+{
+}
+
+size_t RegExp::PcsHash::operator()(const std::vector<unsigned>& pcs) const
+{
+    size_t hash = 0;
+    for (unsigned pc : pcs)
+        hash = hash * 31 + pc;
+    return hash;
+}
+
+bool RegExp::Compile(const WCHAR* pattern, Error& e)
+{
+    assert(!m_regex);
+    m_prog.clear();
+    m_classes.clear();
+    ResetCache();
+
+    RegExpParser parser(m_classes);
+    unsigned root;
+    if (parser.Parse(pattern, root) && RegExpCompiler(parser, m_prog).Compile(root))
+    {
+        // Find the literals the pattern requires.  Only a top level sequence
+        // is simple enough to analyze.
+        std::vector<unsigned> seq;
+        const Node& top = parser.GetNode(root);
+        if (top.type == Node::Concat)
+            seq = top.kids;
+        else
+            seq.push_back(root);
+
+        const bool begin = (!seq.empty() && parser.GetNode(seq.front()).type == Node::Begin);
+        const bool end = (seq.size() > size_t(begin) && parser.GetNode(seq.back()).type == Node::End);
+        size_t first = begin ? 1 : 0;
+        size_t last = seq.size() - (end ? 1 : 0);
+
+        if (begin)
+        {
+            for (size_t ii = first; ii < last && parser.GetNode(seq[ii]).type == Node::Char; ++ii)
+                m_prefix.Append(Fold(parser.GetNode(seq[ii]).ch));
+        }
+        if (end)
+        {
+            size_t ii = last;
+            while (ii > first + m_prefix.Length() && parser.GetNode(seq[ii - 1]).type == Node::Char)
+                --ii;
+            for (; ii < last; ++ii)
+                m_suffix.Append(Fold(parser.GetNode(seq[ii]).ch));
+        }
+        if (m_prefix.Empty() && m_suffix.Empty())
+        {
+            // The longest run of literal characters.
+            size_t best = 0;
+            size_t best_len = 0;
+            for (size_t ii = first; ii < last;)
+            {
+                size_t jj = ii;
+                while (jj < last && parser.GetNode(seq[jj]).type == Node::Char)
+                    ++jj;
+                if (jj - ii > best_len)
+                {
+                    best = ii;
+                    best_len = jj - ii;
+                }
+                ii = max(jj, ii + 1);
+            }
+            for (size_t ii = best; ii < best + best_len; ++ii)
+                m_substring.Append(Fold(parser.GetNode(seq[ii]).ch));
+        }
+
+        m_exact = (m_prefix.Length() + m_suffix.Length() + m_substring.Length() == last - first);
+        m_whole = (begin && end && m_exact);
+
+        if (g_debug)
+            Printf(L"debug: regex '%s' compiled to %zu instructions\n", pattern, m_prog.size());
+        return true;
+    }
+
+    m_prog.clear();
+    m_classes.clear();
+
+    std::regex_constants::syntax_option_type syntax = std::regex_constants::ECMAScript;
+    syntax |= std::regex_constants::icase;
+    syntax |= std::regex_constants::optimize;
+
+    try
+    {
+        m_regex = std::make_unique<std::wregex>(pattern, syntax);
+    }
+    catch (std::regex_error ex)
+    {
+        StrW s;
+        s.SetA(ex.what());
+        e.Set(s.Text());
+        return false;
+    }
+
+    if (g_debug)
+        Printf(L"debug: regex '%s' uses std::regex\n", pattern);
+    return true;
+}
+
+bool RegExp::Prefilter(const WCHAR* s, unsigned len) const
+{
+    if (m_prefix.Length())
+    {
+        if (len < m_prefix.Length())
+            return false;
+        for (unsigned ii = 0; ii < m_prefix.Length(); ++ii)
+        {
+            if (Fold(s[ii]) != m_prefix.Text()[ii])
+                return false;
+        }
+    }
+
+    if (m_suffix.Length())
+    {
+        if (len < m_suffix.Length() + m_prefix.Length())
+            return false;
+        const WCHAR* tail = s + len - m_suffix.Length();
+        for (unsigned ii = 0; ii < m_suffix.Length(); ++ii)
+        {
+            if (Fold(tail[ii]) != m_suffix.Text()[ii])
+                return false;
+        }
+    }
+
+    if (m_substring.Length())
+    {
+        const unsigned n = m_substring.Length();
+        const WCHAR* const sub = m_substring.Text();
+        if (len < n)
+            return false;
+        bool found = false;
+        for (unsigned ii = 0; ii + n <= len && !found; ++ii)
+        {
+            if (Fold(s[ii]) != sub[0])
+                continue;
+            unsigned jj = 1;
+            while (jj < n && Fold(s[ii + jj]) == sub[jj])
+                ++jj;
+            found = (jj == n);
+        }
+        if (!found)
+            return false;
+    }
+
+    return true;
+}
+
+void RegExp::ResetCache() const
+{
+    m_states.clear();
+    m_state_map.clear();
+}
+
+void RegExp::AddThread(std::vector<unsigned>& out, unsigned pc, bool at_start) const
+{
+    // Follows the epsilon transitions, collecting the instructions that
+    // consume a character or that can only be resolved later.  Callers bump
+    // m_mark first, so each instruction is added at most once per step.
+    m_stack.clear();
+    m_stack.push_back(pc);
+    while (!m_stack.empty())
+    {
+        pc = m_stack.back();
+        m_stack.pop_back();
+        if (m_marks[pc] == m_mark)
+            continue;
+        m_marks[pc] = m_mark;
+
+        const Inst& inst = m_prog[pc];
+        switch (inst.op)
+        {
+        case Op::Split:
+            m_stack.push_back(inst.y);
+            m_stack.push_back(inst.x);
+            break;
+        case Op::Jmp:
+            m_stack.push_back(inst.x);
+            break;
+        case Op::Begin:
+            if (at_start)
+                m_stack.push_back(pc + 1);
+            break;
+        default:
+            out.push_back(pc);
+            break;
+        }
+    }
+}
+
+bool RegExp::IsMatchAtEnd(const std::vector<unsigned>& pcs, bool at_start) const
+{
+    // At the end of the input, $ is satisfied; follow it to see whether a
+    // match is reachable.
+    ++m_mark;
+    std::vector<unsigned> out;
+    for (unsigned pc : pcs)
+    {
+        if (m_prog[pc].op == Op::End)
+            AddThread(out, pc + 1, at_start);
+    }
+    for (size_t ii = 0; ii < out.size(); ++ii)
+    {
+        const unsigned pc = out[ii];
+        if (m_prog[pc].op == Op::Match)
+            return true;
+        if (m_prog[pc].op == Op::End)
+            AddThread(out, pc + 1, at_start);
+    }
+    return false;
+}
+
+unsigned RegExp::AddState(std::vector<unsigned>&& pcs, bool at_start) const
+{
+    std::unique_ptr<DState> state = std::make_unique<DState>();
+    state->match = false;
+    for (unsigned pc : pcs)
+    {
+        if (m_prog[pc].op == Op::Match)
+        {
+            state->match = true;
+            break;
+        }
+    }
+    state->match_at_end = state->match || IsMatchAtEnd(pcs, at_start);
+    ZeroMemory(state->next, sizeof(state->next));
+    state->pcs = std::move(pcs);
+
+    const unsigned index = unsigned(m_states.size());
+    m_states.emplace_back(std::move(state));
+    // The start state is never the result of a step, since it's the only
+    // state where ^ is satisfied.
+    if (index)
+        m_state_map.emplace(m_states.back()->pcs, index);
+    return index;
+}
+
+unsigned RegExp::Step(unsigned state, WCHAR c) const
+{
+    const DState* d = m_states[state].get();
+    if (c < 128)
+    {
+        if (d->next[c])
+            return d->next[c];
+    }
+    else
+    {
+        const auto& iter = d->next_other.find(c);
+        if (iter != d->next_other.end())
+            return iter->second;
+    }
+
+    const WCHAR folded = Fold(c);
+    std::vector<unsigned> pcs;
+    ++m_mark;
+    for (unsigned pc : d->pcs)
+    {
+        const Inst& inst = m_prog[pc];
+        bool advance = false;
+        switch (inst.op)
+        {
+        case Op::Char:  advance = (inst.ch == folded); break;
+        case Op::Class: advance = m_classes[inst.x].Matches(c); break;
+        case Op::Any:   advance = !IsLineTerminator(c); break;
+        }
+        if (advance)
+            AddThread(pcs, pc + 1, false);
+    }
+    // The search is unanchored, so a match can also begin at the next
+    // position.
+    AddThread(pcs, 0, false);
+    std::sort(pcs.begin(), pcs.end());
+
+    unsigned next;
+    const auto& iter = m_state_map.find(pcs);
+    if (iter != m_state_map.end())
+    {
+        next = iter->second;
+    }
+    else
+    {
+        if (m_states.size() >= c_max_states)
+        {
+            // Start over rather than let the cache grow without bound.
+            std::vector<unsigned> start = m_states[0]->pcs;
+            ResetCache();
+            AddState(std::move(start), true);
+            state = 0;
+            d = nullptr;
+        }
+        next = AddState(std::move(pcs), false);
+        if (!d)
+            return next;
+    }
+
+    if (c < 128)
+        m_states[state]->next[c] = next;
+    else
+        m_states[state]->next_other.emplace(c, next);
+    return next;
+}
+
+bool RegExp::Match(const WCHAR* s, unsigned len) const
+{
+    if (m_regex)
+    {
+        try
+        {
+            return std::regex_search(s, s + len, *m_regex, std::regex_constants::match_default);
+        }
+        catch (std::regex_error ex)
+        {
+            return false;
+        }
+    }
+
+    if (m_whole && len != m_prefix.Length())
+        return false;
+    if (!Prefilter(s, len))
+        return false;
+    if (m_exact)
+        return true;
+
+    if (m_states.empty())
+    {
+        m_marks.resize(m_prog.size());
+        ++m_mark;
+        std::vector<unsigned> start;
+        AddThread(start, 0, true);
+        std::sort(start.begin(), start.end());
+        AddState(std::move(start), true);
+    }
+
+    unsigned state = 0;
+    for (unsigned ii = 0; ii < len; ++ii)
+    {
+        const DState& d = *m_states[state];
+        if (d.match)
+            return true;
+        if (d.pcs.empty())
+            return false;
+        state = Step(state, s[ii]);
+    }
+
+    return m_states[state]->match_at_end;
+}
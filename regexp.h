@@ -0,0 +1,73 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+
+#include <memory>
+#include <regex>
+#include <unordered_map>
+#include <vector>
+
+class Error;
+
+// RegExp matches file names against a :: pattern:  an ECMAScript regular
+// expression, case insensitive, which may match anywhere in the name.
+//
+// Patterns are compiled once into an NFA, and matched by a DFA that's built
+// lazily as names are matched, so matching takes linear time and never
+// backtracks.  A literal prefix, suffix, or substring required by the
+// pattern is checked first, which rejects most names without running the
+// automaton at all.  Patterns that use anything the automaton doesn't
+// support (such as backreferences, lookahead, or word boundaries) fall back
+// to std::wregex.
+//
+// Match() adds to the DFA cache, so a RegExp must only be used by one thread
+// at a time.
+class RegExp
+{
+public:
+                        RegExp();
+                        ~RegExp();
+
+    bool                Compile(const WCHAR* pattern, Error& e);
+    bool                Match(const WCHAR* s, unsigned len) const;
+
+    bool                IsAutomaton() const { return !m_regex; }
+
+    struct Inst;
+    struct CharClass;
+
+private:
+    struct DState;
+    struct PcsHash { size_t operator()(const std::vector<unsigned>& pcs) const; };
+
+    bool                Prefilter(const WCHAR* s, unsigned len) const;
+    void                AddThread(std::vector<unsigned>& out, unsigned pc, bool at_start) const;
+    bool                IsMatchAtEnd(const std::vector<unsigned>& pcs, bool at_start) const;
+    unsigned            AddState(std::vector<unsigned>&& pcs, bool at_start) const;
+    unsigned            Step(unsigned state, WCHAR c) const;
+    void                ResetCache() const;
+
+    std::unique_ptr<std::wregex> m_regex;
+
+    std::vector<Inst>   m_prog;
+    std::vector<CharClass> m_classes;
+
+    StrW                m_prefix;       // Folded to lower case.
+    StrW                m_suffix;       // Folded to lower case.
+    StrW                m_substring;    // Folded to lower case.
+    bool                m_exact = false;    // The literals are the whole pattern.
+    bool                m_whole = false;    // Anchored at both ends, so the name must be the prefix.
+
+    // The lazily built DFA.  State 0 is the start state.
+    mutable std::vector<std::unique_ptr<DState>> m_states;
+    mutable std::unordered_map<std::vector<unsigned>, unsigned, PcsHash> m_state_map;
+    mutable std::vector<unsigned> m_marks;
+    mutable unsigned    m_mark = 0;
+    mutable std::vector<unsigned> m_stack;
+};
@@ -7,91 +7,68 @@
 #include "scan.h"
 #include "flags.h"
 #include "filesys.h"
+#include "volume.h"
+#include "enumdir.h"
+#include "scanpool.h"
+#include "scanindex.h"
 #include "patterns.h"
+#include "regexp.h"
 #include "output.h"
-
-#include <regex>
+#include "git.h"
 
 /*
- * RegExpHelper.
+ * Scan directories and files.
  */
 
-class RegExpHelper
+// The DirPattern's patterns compiled into FindPatterns, so that a listing of
+// a whole directory can be filtered the same way FindFirstFile would filter
+// each pattern.  Patterns beginning with :: are regular expressions, and are
+// compiled once here rather than for each directory.
+struct FindPatterns
 {
-public:
-    RegExpHelper() {}
-    ~RegExpHelper() { delete m_regex; }
-
-    bool                Init(const WCHAR* pattern, Error& e);
-    bool                Match(const WCHAR* s);
+    bool                Init(const DirPattern* pattern, Error& e);
 
-    bool                IsRegex() const { return !!m_regex; }
-
-private:
-    std::regex_constants::syntax_option_type m_syntax;
-    std::wregex*        m_regex = nullptr;
+    std::vector<FindPattern> m_patterns;
+    std::vector<std::unique_ptr<RegExp>> m_regexes;     // Null unless :: pattern.
+    bool                m_all_literal = true;
+    bool                m_need_short_names = false;
 };
 
-/**
- * Initialize the regexp helper class.  Patterns beginning with :: are treated
- * as a regular expression.
- *
- * @return bool         Indicates success/failure, but does NOT indicate
- *                      whether the pattern was a regular expression.
- */
-bool RegExpHelper::Init(const WCHAR* pattern, Error& e)
+bool FindPatterns::Init(const DirPattern* pattern, Error& e)
 {
-    assert(!m_regex);
+    m_patterns.clear();
+    m_regexes.clear();
+    m_all_literal = true;
+    m_need_short_names = false;
 
-    if (pattern[0] != ':' || pattern[1] != ':')
-        return true;
-
-    std::regex_constants::syntax_option_type syntax = std::regex_constants::ECMAScript;
-    syntax |= std::regex_constants::icase;
-    syntax |= std::regex_constants::optimize;
-
-    try
-    {
-        m_regex = new std::wregex(pattern + 2, syntax);
-    }
-    catch (std::regex_error ex)
+    for (const auto& name : pattern->m_patterns)
     {
-        StrW s;
-        s.SetA(ex.what());
-        e.Set(s.Text());
-        return false;
+        m_patterns.emplace_back(name.Text());
+        const FindPattern& find = m_patterns.back();
+        m_all_literal &= find.IsLiteral();
+        // FindFirstFile also matches patterns against short names.
+        m_need_short_names |= !find.IsMatchAll();
+
+        m_regexes.emplace_back();
+        const WCHAR* text = name.Text();
+        if (text[0] == ':' && text[1] == ':')
+        {
+            m_regexes.back() = std::make_unique<RegExp>();
+            if (!m_regexes.back()->Compile(text + 2, e))
+                return false;
+        }
     }
 
     return true;
 }
 
-bool RegExpHelper::Match(const WCHAR* s)
-{
-    assert(m_regex);
-
-    std::wcmatch matches;
-    try
-    {
-        std::regex_search(s, s + wcslen(s), matches, *m_regex, std::regex_constants::match_default);
-    }
-    catch (std::regex_error ex)
-    {
-        return false;
-    }
-
-    return !!matches.size();
-}
-
-/*
- * Scan directories and files.
- */
-
 static bool ScanFiles(DirScanCallbacks& callbacks, const WCHAR* dir, const WCHAR* dir_rel,
                       unsigned depth, const DirPattern* pattern,
+                      const FindPatterns& find_patterns,
                       const bool top, unsigned limit_depth,
                       const std::shared_ptr<const GlobPatterns>& git_ignore,
-                      const std::shared_ptr<const RepoStatus>& repo,
-                      Error& e)
+                      std::shared_ptr<const RepoStatus>& repo,
+                      DirEnumerator& enumerator, ScanPool* pool, ScanIndex* index, Error& e)
 {
     if (depth > limit_depth)
         return true;
@@ -107,17 +84,62 @@ static bool ScanFiles(DirScanCallbacks& callbacks, const WCHAR* dir, const WCHAR
 
     callbacks.OnPatterns(pattern->m_patterns.size() > 1);
 
+    const bool subdirs = callbacks.Settings().IsSet(FMT_SUBDIRECTORIES);
+    const bool implicit = pattern->m_implicit;
+    const bool filter_dirs = (usage && !implicit && top);
+    const bool dirs_pass = ((subdirs || filter_dirs) && depth + 1 < limit_depth);
+    size_t passes = usage ? size_t(implicit || !top) : pattern->m_patterns.size();
+    passes += dirs_pass;
+
+    // Usually each directory is enumerated only once, and each pass below
+    // filters the listing through its pattern.  But when only one pass is
+    // needed, or the patterns are all literal names, it's cheaper to let the
+    // OS look up just what's needed.  With an index, the whole directory is
+    // always listed, so that it can be replayed next time.
+    const bool short_names = callbacks.Settings().m_need_short_filenames || find_patterns.m_need_short_names;
+    std::unique_ptr<DirListing> listing;
+    bool replayed = false;
+    if (index)
+    {
+        listing = index->Replay(dir, short_names);
+        replayed = !!listing;
+    }
+    if (!listing && pool)
+        listing = pool->Take(dir, enumerator);
+    if (!listing && (index || (passes > 1 && !(find_patterns.m_all_literal && !dirs_pass))))
+    {
+        listing = std::make_unique<DirListing>();
+        listing->spec.Set(dir);
+        EnsureTrailingSlash(listing->spec);
+        listing->spec.Append('*');
+        listing->Enumerate(enumerator, short_names);
+    }
+    if (index && !replayed)
+        index->Record(dir, *listing);
+    ListingEnumerator listed(enumerator, listing.get());
+
+    // Repo roots are found from the listings that are enumerated anyway,
+    // instead of by probing each directory for .git.
+    if (callbacks.Settings().IsSet(FMT_GIT|FMT_GITREPOS))
+    {
+        if (pool)
+        {
+            std::vector<StrW> roots;
+            pool->TakeRepoRoots(roots);
+            for (const auto& root : roots)
+                callbacks.OnRepoRoot(root.Text());
+        }
+        callbacks.OnListing(dir, listing.get(), repo);
+    }
+
     StrW s2;
     bool any_files_found = false;
     bool any_headers_displayed = false;
     bool call_OnDirectoryEnd = false;
-    const bool subdirs = callbacks.Settings().IsSet(FMT_SUBDIRECTORIES);
     bool displayed_header = false;
     for (size_t ii = 0; ii < pattern->m_patterns.size(); ii++)
     {
-        RegExpHelper reh;
-        if (!reh.Init(pattern->m_patterns[ii].Text(), e))
-            return false;
+        const RegExp* re = find_patterns.m_regexes[ii].get();
 
         StrW s;
         StrW rel_parent;
@@ -126,14 +148,12 @@ static bool ScanFiles(DirScanCallbacks& callbacks, const WCHAR* dir, const WCHAR
         EnsureTrailingSlash(s);
         if (rel_parent.Length() && rel_parent.Text()[rel_parent.Length() - 1] != ':')
             EnsureTrailingSlash(rel_parent);
-        if (usage || reh.IsRegex())
+        if (usage || re)
             s.Append(callbacks.Settings().IsSet(FMT_FAT) ? L"*.*" : L"*");
         else
             s.Append(pattern->m_patterns[ii]);
 
-        const bool implicit = pattern->m_implicit;
-        WIN32_FIND_DATA fd;
-        SHFind shFind;
+        const DirEntry* batch;
 
         callbacks.OnScanFiles(dir, implicit, top);
 
@@ -153,8 +173,8 @@ static bool ScanFiles(DirScanCallbacks& callbacks, const WCHAR* dir, const WCHAR
             if (g_debug)
                 Printf(L"debug: scan '%s' for files\n", s.Text());
 
-            shFind = __FindFirstFile(s, callbacks.Settings().m_need_short_filenames, &fd);
-            if (shFind.Empty())
+            listed.SetFilter(usage ? nullptr : &find_patterns.m_patterns[ii]);
+            if (!listed.Open(s, callbacks.Settings().m_need_short_filenames))
             {
                 const DWORD dwErr = GetLastError();
                 if (dwErr == ERROR_FILE_NOT_FOUND ||
@@ -169,39 +189,43 @@ static bool ScanFiles(DirScanCallbacks& callbacks, const WCHAR* dir, const WCHAR
             }
             else if (!(!limit_depth && !depth && callbacks.Settings().IsSet(FMT_TREE)))
             {
-                do
+                while (const unsigned count = listed.Next(batch))
                 {
-                    if (fd.dwFileAttributes & callbacks.Settings().m_dwAttrExcludeAny)
-                        continue;
-                    if (callbacks.Settings().m_dwAttrIncludeAny && !(fd.dwFileAttributes & callbacks.Settings().m_dwAttrIncludeAny))
-                        continue;
-                    if (callbacks.Settings().m_dwAttrMatch && (fd.dwFileAttributes & callbacks.Settings().m_dwAttrMatch) != callbacks.Settings().m_dwAttrMatch)
-                        continue;
-                    if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
-                        ((callbacks.Settings().IsSet(FMT_HIDEPSEUDODIRS) && IsPseudoDirectory(fd.cFileName)) ||
-                         (callbacks.Settings().IsSet(FMT_TREE) && subdirs && depth + 1 < limit_depth)))
-                        continue;
-                    if (IsHiddenName(fd.cFileName))
-                        continue;
-
-                    if (reh.IsRegex() && !reh.Match(fd.cFileName))
-                        continue;
-                    if (pattern->IsIgnore(dir, fd.cFileName))
-                        continue;
-                    if (git_ignore && git_ignore.get()->IsMatch(dir, fd.cFileName))
-                        continue;
-
-                    if (!displayed_header)
+                    for (const DirEntry* pe = batch; pe < batch + count; ++pe)
                     {
-                        callbacks.OnDirectoryBegin(dir, dir_rel, repo);
-                        displayed_header = true;
-                        any_headers_displayed = true;
-                    }
+                        const DirEntry& entry = *pe;
+
+                        if (entry.attributes & callbacks.Settings().m_dwAttrExcludeAny)
+                            continue;
+                        if (callbacks.Settings().m_dwAttrIncludeAny && !(entry.attributes & callbacks.Settings().m_dwAttrIncludeAny))
+                            continue;
+                        if (callbacks.Settings().m_dwAttrMatch && (entry.attributes & callbacks.Settings().m_dwAttrMatch) != callbacks.Settings().m_dwAttrMatch)
+                            continue;
+                        if ((entry.attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                            ((callbacks.Settings().IsSet(FMT_HIDEPSEUDODIRS) && IsPseudoDirectory(entry.name)) ||
+                             (callbacks.Settings().IsSet(FMT_TREE) && subdirs && depth + 1 < limit_depth)))
+                            continue;
+                        if (IsHiddenName(entry.name))
+                            continue;
+
+                        if (re && !re->Match(entry.name, entry.name_len))
+                            continue;
+                        if (pattern->IsIgnore(dir, entry.name, !!(entry.attributes & FILE_ATTRIBUTE_DIRECTORY)))
+                            continue;
+                        if (git_ignore && git_ignore.get()->IsMatch(dir, entry.name, !!(entry.attributes & FILE_ATTRIBUTE_DIRECTORY)))
+                            continue;
+
+                        if (!displayed_header)
+                        {
+                            callbacks.OnDirectoryBegin(dir, dir_rel, repo);
+                            displayed_header = true;
+                            any_headers_displayed = true;
+                        }
 
-                    callbacks.OnFile(dir, &fd);
-                    any_files_found = true;
+                        callbacks.OnFile(dir, pe);
+                        any_files_found = true;
+                    }
                 }
-                while (FindNextFile(shFind, &fd));
 
                 const DWORD dwErr = GetLastError();
                 if (dwErr && dwErr != ERROR_NO_MORE_FILES)
@@ -212,16 +236,13 @@ static bool ScanFiles(DirScanCallbacks& callbacks, const WCHAR* dir, const WCHAR
             }
         }
 
-        const bool filter_dirs = (usage &&
-                                  !implicit &&
-                                  callbacks.IsRootSubDir());
         if (((subdirs && !ii) || filter_dirs) && depth + 1 < limit_depth)
         {
             const WCHAR* strip;
 
             strip = FindName(s.Text());
             s.SetEnd(strip);
-            if (filter_dirs && !reh.IsRegex())
+            if (filter_dirs && !re)
             {
                 s.Append(pattern->m_patterns[ii]);
             }
@@ -235,9 +256,8 @@ static bool ScanFiles(DirScanCallbacks& callbacks, const WCHAR* dir, const WCHAR
             if (g_debug)
                 Printf(L"debug: scan '%s' for directories\n", s.Text());
 
-            shFind.Close();
-            shFind = __FindFirstFile(s, callbacks.Settings().m_need_short_filenames, &fd);
-            if (shFind.Empty())
+            listed.SetFilter((filter_dirs && !re) ? &find_patterns.m_patterns[ii] : nullptr);
+            if (!listed.Open(s, callbacks.Settings().m_need_short_filenames))
             {
                 const DWORD dwErr = GetLastError();
                 if (dwErr == ERROR_FILE_NOT_FOUND ||
@@ -256,50 +276,64 @@ static bool ScanFiles(DirScanCallbacks& callbacks, const WCHAR* dir, const WCHAR
 
                 const unsigned new_depth = depth + 1;
                 assert(new_depth <= limit_depth);
-                do
+                std::vector<StrW> prefetch;
+                while (const unsigned count = listed.Next(batch))
                 {
-                    if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-                        continue;
-                    if (IsHidden(fd) && callbacks.Settings().IsSet(FMT_SKIPHIDDENDIRS))
-                        continue;
-                    if (IsTraversableReparse(fd) && callbacks.Settings().IsSet(FMT_SKIPJUNCTIONS))
-                        continue;
-                    if (IsPseudoDirectory(fd.cFileName))
-                        continue;
-
-                    if (filter_dirs && reh.IsRegex() && !reh.Match(fd.cFileName))
-                        continue;
-                    if (pattern->IsIgnore(dir, fd.cFileName))
-                        continue;
-                    if (git_ignore && git_ignore.get()->IsMatch(dir, fd.cFileName))
-                        continue;
-
-                    if (callbacks.Settings().IsSet(FMT_TREE))
+                    for (const DirEntry* pe = batch; pe < batch + count; ++pe)
                     {
-                        if (!displayed_header)
+                        const DirEntry& entry = *pe;
+
+                        if (!(entry.attributes & FILE_ATTRIBUTE_DIRECTORY))
+                            continue;
+                        if (IsHidden(entry) && callbacks.Settings().IsSet(FMT_SKIPHIDDENDIRS))
+                            continue;
+                        if (IsTraversableReparse(entry) && callbacks.Settings().IsSet(FMT_SKIPJUNCTIONS))
+                            continue;
+                        if (IsPseudoDirectory(entry.name))
+                            continue;
+
+                        if (filter_dirs && re && !re->Match(entry.name, entry.name_len))
+                            continue;
+                        if (pattern->IsIgnore(dir, entry.name, true))
+                            continue;
+                        if (git_ignore && git_ignore.get()->IsMatch(dir, entry.name, true))
+                            continue;
+
+                        if (callbacks.Settings().IsSet(FMT_TREE))
                         {
-                            callbacks.OnDirectoryBegin(dir, dir_rel, repo);
-                            displayed_header = true;
-                            any_headers_displayed = true;
+                            if (!displayed_header)
+                            {
+                                callbacks.OnDirectoryBegin(dir, dir_rel, repo);
+                                displayed_header = true;
+                                any_headers_displayed = true;
+                            }
+                            callbacks.OnFile(dir, pe);
+                            any_files_found = true;
                         }
-                        callbacks.OnFile(dir, &fd);
-                        any_files_found = true;
-                    }
 
-                    strip = FindName(s.Text());
-                    s.SetEnd(strip);
-                    s.Append(fd.cFileName);
-                    s2.Set(rel_parent);
-                    if (s2.Length() && s2.Text()[s2.Length() - 1] != ':')
-                        EnsureTrailingSlash(s2);
-                    s2.Append(fd.cFileName);
-                    callbacks.AddSubDir(s, s2, new_depth, git_ignore, repo);
+                        strip = FindName(s.Text());
+                        s.SetEnd(strip);
+                        s.Append(entry.name, entry.name_len);
+                        s2.Set(rel_parent);
+                        if (s2.Length() && s2.Text()[s2.Length() - 1] != ':')
+                            EnsureTrailingSlash(s2);
+                        s2.Append(entry.name, entry.name_len);
+                        callbacks.AddSubDir(s, s2, new_depth, git_ignore, repo);
+
+                        // Stamping the directory before it's prefetched lets
+                        // the index tell next time whether it changed after
+                        // it was enumerated.
+                        if (pool && !(index && index->IsCurrent(s.Text(), short_names)))
+                            prefetch.emplace_back(s);
+                    }
                 }
-                while (FindNextFile(shFind, &fd));
+
+                const DWORD dwErr = GetLastError();
 
                 callbacks.SortSubDirs();
+                if (pool)
+                    pool->Submit(std::move(prefetch));
 
-                const DWORD dwErr = GetLastError();
                 if (dwErr && dwErr != ERROR_NO_MORE_FILES)
                 {
                     e.Set(dwErr);
@@ -332,7 +366,33 @@ int ScanDir(DirScanCallbacks& callbacks, const DirPattern* patterns, unsigned li
     bool prev_drive_implicit;
     bool in_volume = false;
     bool any_files_found = false;
+    std::unique_ptr<DirEnumerator> enumerator = MakeDirEnumerator(callbacks.Settings().m_enum_buffer_kb);
+    std::vector<FindPatterns> find_patterns;
+    bool short_names = callbacks.Settings().m_need_short_filenames;
     for (const DirPattern* p = patterns; p; p = p->m_next)
+    {
+        find_patterns.emplace_back();
+        if (!find_patterns.back().Init(p, e))
+            return 1;
+        short_names |= find_patterns.back().m_need_short_names;
+    }
+    std::unique_ptr<ScanPool> pool;
+    if (callbacks.Settings().m_threads && callbacks.Settings().IsSet(FMT_SUBDIRECTORIES) && limit_depth > 1)
+        pool = std::make_unique<ScanPool>(callbacks.Settings().m_threads, callbacks.Settings().m_enum_buffer_kb, short_names, callbacks.Settings().IsSet(FMT_GIT|FMT_GITREPOS));
+    std::unique_ptr<ScanIndex> scan_index;
+    if (!callbacks.Settings().m_index_path.Empty())
+    {
+        scan_index = std::make_unique<ScanIndex>();
+        if (!scan_index->Open(callbacks.Settings().m_index_path.Text(), e))
+        {
+            // Continue without the index.
+            callbacks.ReportError(e);
+            e.Clear();
+            scan_index.reset();
+        }
+    }
+    size_t index = 0;
+    for (const DirPattern* p = patterns; p; p = p->m_next, ++index)
     {
         std::shared_ptr<const GlobPatterns> git_ignore; // p->IsIgnore() internally handles the DirPattern's own git_ignore.
         std::shared_ptr<const RepoStatus> repo(p->m_repo);
@@ -352,9 +412,10 @@ int ScanDir(DirScanCallbacks& callbacks, const DirPattern* patterns, unsigned li
         bool top = true;
         while (true)
         {
-            GetDrive(dir.Text(), drive, e);
+            const VolumeInfo* volume = GetVolumeInfo(dir.Text(), e);
             if (e.Test())
                 return 1;
+            drive.Set(volume ? volume->drive.Text() : L"");
 
             if (!prev_drive.EqualI(drive))
             {
@@ -399,7 +460,7 @@ int ScanDir(DirScanCallbacks& callbacks, const DirPattern* patterns, unsigned li
             if (!dir.Length())
                 break;
 
-            if (ScanFiles(callbacks, dir.Text(), dir_rel.Text(), depth, p, top, limit_depth, git_ignore, repo, e))
+            if (ScanFiles(callbacks, dir.Text(), dir_rel.Text(), depth, p, find_patterns[index], top, limit_depth, git_ignore, repo, *enumerator, pool.get(), scan_index.get(), e))
             {
                 any_files_found = true;
                 rc = 0;
@@ -459,6 +520,23 @@ int ScanDir(DirScanCallbacks& callbacks, const DirPattern* patterns, unsigned li
         callbacks.Settings().m_flags = flagsRestore;
     }
 
+    pool.reset();
+
+    if (scan_index && !scan_index->Save(e))
+    {
+        callbacks.ReportError(e);
+        e.Clear();
+    }
+
+    if (g_debug)
+    {
+        const DirEnumCounters counters = GetDirEnumCounters();
+        Printf(L"debug: enumeration: %u directory opens, %u reads\n", counters.opens, counters.reads);
+        Printf(L"debug: metadata: %u file type queries\n", GetFileTypeCount());
+    }
+    DebugPrintVolumeCacheCounters();
+    DebugPrintRepoRootCounters();
+
     return rc;
 }
 
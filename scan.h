@@ -11,6 +11,8 @@
 
 #include <memory>
 
+struct DirEntry;
+struct DirListing;
 struct DirPattern;
 class Error;
 
@@ -22,8 +24,10 @@ public:
     virtual bool        OnVolumeBegin(const WCHAR* dir, Error& e) = 0;
     virtual void        OnPatterns(bool grouped) = 0;
     virtual void        OnScanFiles(const WCHAR* dir, bool implicit, bool top) = 0;
+    virtual void        OnRepoRoot(const WCHAR* dir) = 0;
+    virtual void        OnListing(const WCHAR* dir, const DirListing* listing, std::shared_ptr<const RepoStatus>& repo) = 0;
     virtual void        OnDirectoryBegin(const WCHAR* dir, const WCHAR* dir_rel, const std::shared_ptr<const RepoStatus>& repo) = 0;
-    virtual void        OnFile(const WCHAR* dir, const WIN32_FIND_DATA* pfd) = 0;
+    virtual void        OnFile(const WCHAR* dir, const DirEntry* pe) = 0;
     virtual void        OnDirectoryEnd(const WCHAR* dir, bool next_is_different) = 0;
     virtual void        OnPatternEnd(const DirPattern* pattern) = 0;
     virtual void        OnVolumeEnd(const WCHAR* dir) = 0;
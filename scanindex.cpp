@@ -0,0 +1,390 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "scanindex.h"
+#include "output.h"
+
+static const DWORD c_index_magic = 0x58495844;     // "DXIX"
+static const DWORD c_index_version = 1;
+static const size_t c_io_bytes = 256 * 1024;
+
+static const DWORD c_record_short_names = 0x0001;
+
+// Each record is a RecordHeader, followed by the directory name (with a NUL
+// terminator), followed by the entries.  Each entry is an EntryHeader,
+// followed by the name and short name (each with a NUL terminator).  Every
+// part is a multiple of sizeof(WCHAR), so the names in the mapped view are
+// always aligned and NUL terminated, and can be used in place.
+
+struct IndexHeader
+{
+    DWORD               magic;
+    DWORD               version;
+};
+
+struct RecordHeader
+{
+    DWORD               len;            // Bytes after the len field.
+    DWORD               flags;
+    FILETIME            modified;
+    ULONGLONG           size;
+    DWORD               dir_len;
+    DWORD               count;
+};
+
+struct EntryHeader
+{
+    DWORD               attributes;
+    DWORD               reparse_tag;
+    ULONGLONG           size;
+    FILETIME            created;
+    FILETIME            accessed;
+    FILETIME            modified;
+    DWORD               name_len;
+    DWORD               short_name_len;
+};
+
+static bool IsNameTerminated(const BYTE* p, size_t len, const BYTE* end)
+{
+    const size_t cb = (len + 1) * sizeof(WCHAR);
+    if (size_t(end - p) < cb)
+        return false;
+    WCHAR nul;
+    memcpy(&nul, p + len * sizeof(WCHAR), sizeof(nul));
+    return !nul;
+}
+
+ScanIndex::ScanIndex()
+{
+}
+
+ScanIndex::~ScanIndex()
+{
+    Unmap();
+    if (!m_out.Empty())
+    {
+        m_out.Close();
+        DeleteFile(m_temp_path.Text());
+    }
+}
+
+bool ScanIndex::Open(const WCHAR* path, Error& e)
+{
+    m_path.Set(path);
+    m_temp_path.Set(path);
+    m_temp_path.Append(L".tmp");
+
+    if (!Load())
+    {
+        Unmap();
+        m_cached.clear();
+        if (g_debug)
+            Printf(L"debug: scan index: ignoring '%s'; missing or not valid\n", path);
+    }
+
+    m_out = CreateFile(m_temp_path.Text(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (m_out.Empty())
+    {
+        e.Sys();
+        return false;
+    }
+
+    IndexHeader header;
+    header.magic = c_index_magic;
+    header.version = c_index_version;
+    m_buffer.reserve(c_io_bytes);
+    Write(&header, sizeof(header));
+    return true;
+}
+
+bool ScanIndex::Load()
+{
+    m_file = CreateFile(m_path.Text(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (m_file.Empty())
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart < LONGLONG(sizeof(IndexHeader)) || ULONGLONG(size.QuadPart) > SIZE_MAX)
+        return false;
+
+    m_mapping = CreateFileMapping(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping.Empty())
+        return false;
+    m_view = static_cast<const BYTE*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_view)
+        return false;
+    m_view_size = size_t(size.QuadPart);
+
+    IndexHeader header;
+    memcpy(&header, m_view, sizeof(header));
+    if (header.magic != c_index_magic || header.version != c_index_version)
+        return false;
+
+    // Index the records by directory.  The entries are only validated when
+    // a record is replayed.
+    const BYTE* p = m_view + sizeof(header);
+    const BYTE* const end = m_view + m_view_size;
+    while (p < end)
+    {
+        RecordHeader rec;
+        if (size_t(end - p) < sizeof(rec))
+            return false;
+        memcpy(&rec, p, sizeof(rec));
+        if (rec.len > size_t(end - p) - sizeof(rec.len) ||
+            rec.len < sizeof(rec) - sizeof(rec.len) ||
+            (rec.len % sizeof(WCHAR)))
+            return false;
+
+        const BYTE* const record_end = p + sizeof(rec.len) + rec.len;
+        const BYTE* const dir = p + sizeof(rec);
+        if (!IsNameTerminated(dir, rec.dir_len, record_end))
+            return false;
+
+        Cached cached;
+        cached.record = p;
+        cached.len = sizeof(rec.len) + rec.len;
+        m_cached[reinterpret_cast<const WCHAR*>(dir)] = cached;
+
+        p = record_end;
+    }
+
+    return true;
+}
+
+void ScanIndex::Unmap()
+{
+    if (m_view)
+    {
+        UnmapViewOfFile(m_view);
+        m_view = nullptr;
+        m_view_size = 0;
+    }
+    m_mapping.Close();
+    m_file.Close();
+}
+
+const ScanIndex::Stamp& ScanIndex::GetStamp(const WCHAR* dir)
+{
+    const auto& iter = m_stamps.find(dir);
+    if (iter != m_stamps.end())
+        return *iter->second;
+
+    std::unique_ptr<Stamp> stamp = std::make_unique<Stamp>();
+    stamp->dir.Set(dir);
+
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    stamp->valid = (GetFileAttributesEx(dir, GetFileExInfoStandard, &fad) &&
+                    (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY));
+    if (stamp->valid)
+    {
+        stamp->modified = fad.ftLastWriteTime;
+        stamp->size = (ULONGLONG(fad.nFileSizeHigh) << 32) | fad.nFileSizeLow;
+    }
+
+    const WCHAR* const key = stamp->dir.Text();
+    return *m_stamps.emplace(key, std::move(stamp)).first->second;
+}
+
+const ScanIndex::Cached* ScanIndex::FindCurrent(const WCHAR* dir, bool short_names)
+{
+    // Always take the stamp, even when there's no cached listing, so that a
+    // listing enumerated afterwards can be recorded.
+    const Stamp& stamp = GetStamp(dir);
+    if (!stamp.valid)
+        return nullptr;
+
+    const auto& iter = m_cached.find(dir);
+    if (iter == m_cached.end())
+        return nullptr;
+
+    RecordHeader rec;
+    memcpy(&rec, iter->second.record, sizeof(rec));
+    if (short_names && !(rec.flags & c_record_short_names))
+        return nullptr;
+    if (CompareFileTime(&rec.modified, &stamp.modified) || rec.size != stamp.size)
+        return nullptr;
+
+    return &iter->second;
+}
+
+bool ScanIndex::IsCurrent(const WCHAR* dir, bool short_names)
+{
+    return !!FindCurrent(dir, short_names);
+}
+
+std::unique_ptr<DirListing> ScanIndex::Replay(const WCHAR* dir, bool short_names)
+{
+    const Cached* const cached = FindCurrent(dir, short_names);
+    if (!cached)
+        return nullptr;
+
+    RecordHeader rec;
+    memcpy(&rec, cached->record, sizeof(rec));
+
+    std::unique_ptr<DirListing> listing = std::make_unique<DirListing>();
+    listing->spec.Set(dir);
+    EnsureTrailingSlash(listing->spec);
+    listing->spec.Append('*');
+    listing->short_names = !!(rec.flags & c_record_short_names);
+
+    // The names are used in place, so the listing is only valid until Save().
+    const BYTE* const end = cached->record + cached->len;
+    const BYTE* p = cached->record + sizeof(rec) + (rec.dir_len + 1) * sizeof(WCHAR);
+    listing->entries.reserve(min<size_t>(rec.count, size_t(end - p) / sizeof(EntryHeader)));
+    for (DWORD ii = 0; ii < rec.count; ++ii)
+    {
+        EntryHeader eh;
+        if (size_t(end - p) < sizeof(eh))
+            return nullptr;
+        memcpy(&eh, p, sizeof(eh));
+        p += sizeof(eh);
+
+        const BYTE* const name = p;
+        if (!IsNameTerminated(name, eh.name_len, end))
+            return nullptr;
+        p += (eh.name_len + 1) * sizeof(WCHAR);
+        const BYTE* const short_name = p;
+        if (!IsNameTerminated(short_name, eh.short_name_len, end))
+            return nullptr;
+        p += (eh.short_name_len + 1) * sizeof(WCHAR);
+
+        listing->entries.emplace_back();
+        DirEntry& entry = listing->entries.back();
+        entry.name = reinterpret_cast<const WCHAR*>(name);
+        entry.short_name = reinterpret_cast<const WCHAR*>(short_name);
+        entry.name_len = eh.name_len;
+        entry.short_name_len = eh.short_name_len;
+        entry.attributes = eh.attributes;
+        entry.reparse_tag = eh.reparse_tag;
+        entry.size = eh.size;
+        entry.created = eh.created;
+        entry.accessed = eh.accessed;
+        entry.modified = eh.modified;
+    }
+
+    Write(cached->record, cached->len);
+    if (m_buffer.size() >= c_io_bytes)
+        Flush();
+    m_cached.erase(dir);
+    m_stamps.erase(dir);
+    ++m_count_replayed;
+    return listing;
+}
+
+void ScanIndex::Record(const WCHAR* dir, const DirListing& listing)
+{
+    const auto& iter = m_stamps.find(dir);
+    const bool valid = (iter != m_stamps.end() && iter->second->valid);
+
+    // Only complete listings can be replayed.  Without a stamp from before
+    // the enumeration there's no way to tell later whether it's current.
+    if (valid && !listing.open_err && listing.end_err == ERROR_NO_MORE_FILES)
+    {
+        const Stamp& stamp = *iter->second;
+        const size_t begin = m_buffer.size();
+
+        RecordHeader rec = {};
+        rec.flags = listing.short_names ? c_record_short_names : 0;
+        rec.modified = stamp.modified;
+        rec.size = stamp.size;
+        rec.dir_len = DWORD(wcslen(dir));
+        rec.count = DWORD(listing.entries.size());
+        Write(&rec, sizeof(rec));
+        Write(dir, (rec.dir_len + 1) * sizeof(WCHAR));
+
+        for (const auto& entry : listing.entries)
+        {
+            EntryHeader eh;
+            eh.attributes = entry.attributes;
+            eh.reparse_tag = entry.reparse_tag;
+            eh.size = entry.size;
+            eh.created = entry.created;
+            eh.accessed = entry.accessed;
+            eh.modified = entry.modified;
+            eh.name_len = entry.name_len;
+            eh.short_name_len = entry.short_name_len;
+            Write(&eh, sizeof(eh));
+            Write(entry.name, (entry.name_len + 1) * sizeof(WCHAR));
+            Write(entry.short_name, (entry.short_name_len + 1) * sizeof(WCHAR));
+        }
+
+        // Write() only appends, so the whole record is in the buffer.
+        const DWORD len = DWORD(m_buffer.size() - begin - sizeof(rec.len));
+        memcpy(m_buffer.data() + begin, &len, sizeof(len));
+        if (m_buffer.size() >= c_io_bytes)
+            Flush();
+
+        ++m_count_recorded;
+    }
+
+    // Whether or not it was recorded, the old listing is out of date.
+    m_cached.erase(dir);
+    if (iter != m_stamps.end())
+        m_stamps.erase(iter);
+}
+
+void ScanIndex::Write(const void* p, size_t len)
+{
+    const BYTE* const bytes = static_cast<const BYTE*>(p);
+    m_buffer.insert(m_buffer.end(), bytes, bytes + len);
+}
+
+bool ScanIndex::Flush()
+{
+    const BYTE* p = m_buffer.data();
+    size_t remaining = m_buffer.size();
+    while (remaining && !m_write_err)
+    {
+        DWORD written;
+        if (!WriteFile(m_out, p, DWORD(min(remaining, c_io_bytes)), &written, nullptr))
+        {
+            m_write_err = GetLastError();
+            break;
+        }
+        p += written;
+        remaining -= written;
+    }
+    m_buffer.clear();
+    return !m_write_err;
+}
+
+bool ScanIndex::Save(Error& e)
+{
+    if (m_out.Empty())
+        return true;
+
+    // Carry over the listings for directories that weren't scanned.
+    const unsigned carried = unsigned(m_cached.size());
+    for (const auto& cached : m_cached)
+    {
+        Write(cached.second.record, cached.second.len);
+        if (m_buffer.size() >= c_io_bytes)
+            Flush();
+    }
+    m_cached.clear();
+
+    Flush();
+    m_out.Close();
+    Unmap();
+
+    if (m_write_err)
+    {
+        e.Sys(m_write_err);
+        DeleteFile(m_temp_path.Text());
+        return false;
+    }
+
+    if (!MoveFileEx(m_temp_path.Text(), m_path.Text(), MOVEFILE_REPLACE_EXISTING))
+    {
+        e.Sys();
+        DeleteFile(m_temp_path.Text());
+        return false;
+    }
+
+    if (g_debug)
+        Printf(L"debug: scan index: %u replayed, %u recorded, %u carried over\n", m_count_replayed, m_count_recorded, carried);
+    return true;
+}
@@ -0,0 +1,82 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+#include "enumdir.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// ScanIndex is an on-disk cache of directory listings (--index=PATH), so
+// that repeated scans of mostly unchanged trees only enumerate directories
+// that have changed.  A cached listing is replayed while the directory's
+// last write time and size are the same as when it was enumerated.
+//
+// Creating, deleting, or renaming entries in a directory updates its last
+// write time, but modifying an existing file does not.  So replayed entries
+// can have stale sizes and timestamps for files modified in place.
+//
+// The old index is memory mapped, and the new index is written to a
+// temporary file as directories are scanned.  Save() carries over listings
+// for directories that weren't scanned, and then replaces the old index.
+class ScanIndex
+{
+public:
+                        ScanIndex();
+                        ~ScanIndex();
+
+    bool                Open(const WCHAR* path, Error& e);
+    bool                Save(Error& e);
+
+    bool                IsCurrent(const WCHAR* dir, bool short_names);
+    std::unique_ptr<DirListing> Replay(const WCHAR* dir, bool short_names);
+    void                Record(const WCHAR* dir, const DirListing& listing);
+
+private:
+    struct Stamp
+    {
+        StrW            dir;
+        FILETIME        modified;
+        ULONGLONG       size;
+        bool            valid;
+    };
+
+    struct Cached
+    {
+        const BYTE*     record;
+        size_t          len;
+    };
+
+    const Stamp&        GetStamp(const WCHAR* dir);
+    const Cached*       FindCurrent(const WCHAR* dir, bool short_names);
+    bool                Load();
+    void                Unmap();
+    void                Write(const void* p, size_t len);
+    bool                Flush();
+
+    StrW                m_path;
+    StrW                m_temp_path;
+    SHFile              m_file;
+    SHBasic             m_mapping;
+    const BYTE*         m_view = nullptr;
+    size_t              m_view_size = 0;
+    SHFile              m_out;
+    std::vector<BYTE>   m_buffer;
+    DWORD               m_write_err = 0;
+
+    // Keys point into the mapped view.  Listings are removed as they're
+    // replayed or re-recorded, so what's left at the end gets carried over.
+    std::unordered_map<const WCHAR*, Cached, HashCaseless, EqualCaseless> m_cached;
+    // Stamps are taken before enumerating, so that a change during the
+    // enumeration makes the listing look stale on the next run.
+    std::unordered_map<const WCHAR*, std::unique_ptr<Stamp>, HashCaseless, EqualCaseless> m_stamps;
+
+    unsigned            m_count_replayed = 0;
+    unsigned            m_count_recorded = 0;
+};
@@ -0,0 +1,243 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "scanpool.h"
+#include "output.h"
+
+// Limits how many directories can be enumerated ahead of the traversal, so
+// that very wide directory trees don't buffer unbounded numbers of listings.
+static const unsigned c_max_in_flight_per_thread = 64;
+
+/*
+ * ScanPool.
+ */
+
+ScanPool::ScanPool(unsigned threads, unsigned buffer_kb, bool short_names, bool find_repos)
+: m_buffer_kb(buffer_kb)
+, m_short_names(short_names)
+, m_find_repos(find_repos)
+, m_queued(0)
+, m_stop(false)
+, m_count_stolen(0)
+{
+    assert(threads);
+    for (unsigned ii = 0; ii < threads; ++ii)
+        m_workers.emplace_back(std::make_unique<Worker>());
+    for (unsigned ii = 0; ii < threads; ++ii)
+        m_workers[ii]->thread = std::thread(&ScanPool::WorkerMain, this, ii);
+}
+
+ScanPool::~ScanPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (auto& worker : m_workers)
+        worker->thread.join();
+
+    if (g_debug)
+    {
+        Printf(L"debug: scan pool: %u thread(s), %u dir(s) prefetched, %u stolen, %u waited, %u inline\n",
+               unsigned(m_workers.size()), m_count_prefetched, m_count_stolen.load(), m_count_waited, m_count_inline);
+    }
+}
+
+void ScanPool::Submit(std::vector<StrW>&& dirs)
+{
+    if (dirs.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The traversal consumes the batch front to back, and usually before it
+    // consumes anything submitted earlier.  Workers pop from the back of
+    // their deques (newest first) and steal from the front (oldest first),
+    // so dispatch in reverse to put the first directory on top.
+    std::vector<std::shared_ptr<Task>> tasks;
+    tasks.reserve(dirs.size());
+    for (auto& dir : dirs)
+    {
+        std::shared_ptr<Task> task = std::make_shared<Task>();
+        task->dir = std::move(dir);
+        if (!m_tasks.emplace(task->dir.Text(), task).second)
+            continue;
+        tasks.emplace_back(std::move(task));
+    }
+
+    for (size_t ii = tasks.size(); ii--;)
+    {
+        if (m_in_flight < m_workers.size() * c_max_in_flight_per_thread)
+            Dispatch(tasks[ii]);
+        else
+            m_overflow.emplace_front(std::move(tasks[ii]));
+    }
+}
+
+std::unique_ptr<DirListing> ScanPool::Take(const WCHAR* dir, DirEnumerator& enumerator)
+{
+    std::shared_ptr<Task> task;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        const auto& iter = m_tasks.find(dir);
+        if (iter == m_tasks.end())
+            return nullptr;
+
+        task = std::move(iter->second);
+        m_tasks.erase(iter);
+
+        if (task->dispatched)
+        {
+            assert(m_in_flight);
+            --m_in_flight;
+            DispatchOverflow();
+        }
+
+        if (task->state == State::Queued)
+        {
+            // No worker has started it yet, so enumerate it here instead
+            // of waiting for a worker to get to it.
+            task->state = State::Running;
+            ++m_count_inline;
+        }
+        else
+        {
+            if (task->state != State::Done)
+                ++m_count_waited;
+            m_done.wait(lock, [&task]{ return task->state == State::Done; });
+            ++m_count_prefetched;
+            return std::move(task->result);
+        }
+    }
+
+    Run(*task, enumerator);
+    return std::move(task->result);
+}
+
+void ScanPool::TakeRepoRoots(std::vector<StrW>& roots)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    roots = std::move(m_repo_roots);
+    m_repo_roots.clear();
+}
+
+void ScanPool::Dispatch(const std::shared_ptr<Task>& task)
+{
+    // Caller must hold m_mutex.
+    assert(!task->dispatched);
+    task->dispatched = true;
+    ++m_in_flight;
+
+    Worker& worker = *m_workers[m_next_worker];
+    m_next_worker = (m_next_worker + 1) % m_workers.size();
+    {
+        // m_queued changes under the same lock as the deque, so it never
+        // counts a task that a worker can't find.
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.emplace_back(task);
+        ++m_queued;
+    }
+
+    m_wake.notify_one();
+}
+
+void ScanPool::DispatchOverflow()
+{
+    // Caller must hold m_mutex.
+    while (!m_overflow.empty() && m_in_flight < m_workers.size() * c_max_in_flight_per_thread)
+    {
+        std::shared_ptr<Task> task = std::move(m_overflow.front());
+        m_overflow.pop_front();
+        if (task->state == State::Queued)
+            Dispatch(task);
+    }
+}
+
+std::shared_ptr<ScanPool::Task> ScanPool::PopOrSteal(unsigned index)
+{
+    std::shared_ptr<Task> task;
+
+    {
+        Worker& worker = *m_workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.tasks.empty())
+        {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            --m_queued;
+            return task;
+        }
+    }
+
+    for (size_t ii = 1; ii < m_workers.size(); ++ii)
+    {
+        Worker& victim = *m_workers[(index + ii) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --m_queued;
+            ++m_count_stolen;
+            return task;
+        }
+    }
+
+    return task;
+}
+
+void ScanPool::Run(Task& task, DirEnumerator& enumerator)
+{
+    std::unique_ptr<DirListing> result = std::make_unique<DirListing>();
+    result->spec.Set(task.dir);
+    EnsureTrailingSlash(result->spec);
+    result->spec.Append('*');
+    result->Enumerate(enumerator, m_short_names);
+    const bool repo_root = (m_find_repos && result->Lookup(L".git"));
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (repo_root)
+            m_repo_roots.emplace_back(task.dir);
+        task.result = std::move(result);
+        task.state = State::Done;
+    }
+    m_done.notify_all();
+}
+
+void ScanPool::WorkerMain(unsigned index)
+{
+    std::unique_ptr<DirEnumerator> enumerator = MakeDirEnumerator(m_buffer_kb);
+
+    // Once the pool is stopping, nothing will take the results, so drop
+    // whatever is still queued instead of enumerating it.
+    while (!m_stop)
+    {
+        std::shared_ptr<Task> task = PopOrSteal(index);
+        if (!task)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this]{ return m_stop || m_queued > 0; });
+            if (m_stop)
+                break;
+            continue;
+        }
+
+        {
+            // The traversal may have claimed it already.
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stop || task->state != State::Queued)
+                continue;
+            task->state = State::Running;
+        }
+
+        Run(*task, *enumerator);
+    }
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+#include "enumdir.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// ScanPool enumerates directories concurrently on a work-stealing thread
+// pool, ahead of the (single threaded) traversal that consumes the results.
+//
+// The traversal submits each batch of subdirectories as it discovers them,
+// and takes each directory's listing when it reaches that directory.  So
+// the callbacks still happen on the main thread in the usual sorted order;
+// only the enumeration I/O happens in parallel.  If the traversal reaches a
+// directory before any worker has started on it, the traversal simply
+// enumerates it inline.
+//
+// With find_repos, the pool also notes which listings contain a .git entry,
+// so the traversal can start getting the status of repos before it reaches
+// them, without probing each directory for .git.
+class ScanPool
+{
+public:
+                        ScanPool(unsigned threads, unsigned buffer_kb, bool short_names, bool find_repos=false);
+                        ~ScanPool();
+
+    void                Submit(std::vector<StrW>&& dirs);
+    std::unique_ptr<DirListing> Take(const WCHAR* dir, DirEnumerator& enumerator);
+    void                TakeRepoRoots(std::vector<StrW>& roots);
+
+private:
+    enum class State { Queued, Running, Done };
+
+    struct Task
+    {
+        StrW            dir;
+        State           state = State::Queued;
+        bool            dispatched = false;
+        std::unique_ptr<DirListing> result;
+    };
+
+    struct Worker
+    {
+        std::mutex      mutex;
+        std::deque<std::shared_ptr<Task>> tasks;
+        std::thread     thread;
+    };
+
+    void                Dispatch(const std::shared_ptr<Task>& task);
+    void                DispatchOverflow();
+    std::shared_ptr<Task> PopOrSteal(unsigned index);
+    void                Run(Task& task, DirEnumerator& enumerator);
+    void                WorkerMain(unsigned index);
+
+    const unsigned      m_buffer_kb;
+    const bool          m_short_names;
+    const bool          m_find_repos;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    unsigned            m_next_worker = 0;
+
+    std::mutex          m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::atomic<unsigned> m_queued;         // Tasks in the workers' deques.
+    std::atomic<bool>   m_stop;
+    std::unordered_map<const WCHAR*, std::shared_ptr<Task>, HashCase, EqualCase> m_tasks; // Keys point into Task::dir.
+    std::deque<std::shared_ptr<Task>> m_overflow;
+    unsigned            m_in_flight = 0;
+    std::vector<StrW>   m_repo_roots;
+
+    unsigned            m_count_prefetched = 0;
+    unsigned            m_count_inline = 0;
+    unsigned            m_count_waited = 0;
+    std::atomic<unsigned> m_count_stolen;
+};
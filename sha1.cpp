@@ -0,0 +1,126 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// A straightforward SHA-1 (FIPS 180-1).  It only needs to verify the index
+// checksum and the handful of objects that status reads, so it favors
+// simplicity over speed.
+
+#include "pch.h"
+#include "sha1.h"
+
+static inline DWORD Rotl(DWORD x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+Sha1::Sha1()
+{
+    m_state[0] = 0x67452301;
+    m_state[1] = 0xefcdab89;
+    m_state[2] = 0x98badcfe;
+    m_state[3] = 0x10325476;
+    m_state[4] = 0xc3d2e1f0;
+}
+
+void Sha1::Transform(const BYTE* block)
+{
+    DWORD w[80];
+    for (int ii = 0; ii < 16; ++ii)
+        w[ii] = (DWORD(block[ii * 4]) << 24) | (DWORD(block[ii * 4 + 1]) << 16) | (DWORD(block[ii * 4 + 2]) << 8) | DWORD(block[ii * 4 + 3]);
+    for (int ii = 16; ii < 80; ++ii)
+        w[ii] = Rotl(w[ii - 3] ^ w[ii - 8] ^ w[ii - 14] ^ w[ii - 16], 1);
+
+    DWORD a = m_state[0];
+    DWORD b = m_state[1];
+    DWORD c = m_state[2];
+    DWORD d = m_state[3];
+    DWORD e = m_state[4];
+    for (int ii = 0; ii < 80; ++ii)
+    {
+        DWORD f;
+        DWORD k;
+        if (ii < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (ii < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (ii < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        const DWORD temp = Rotl(a, 5) + f + e + k + w[ii];
+        e = d;
+        d = c;
+        c = Rotl(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+}
+
+void Sha1::Update(const void* data, size_t len)
+{
+    const BYTE* p = static_cast<const BYTE*>(data);
+    m_len += len;
+
+    if (m_used)
+    {
+        const size_t n = min(len, sizeof(m_block) - m_used);
+        memcpy(m_block + m_used, p, n);
+        m_used += n;
+        p += n;
+        len -= n;
+        if (m_used < sizeof(m_block))
+            return;
+        Transform(m_block);
+        m_used = 0;
+    }
+
+    for (; len >= sizeof(m_block); p += sizeof(m_block), len -= sizeof(m_block))
+        Transform(p);
+
+    memcpy(m_block, p, len);
+    m_used = len;
+}
+
+void Sha1::Final(BYTE* digest)
+{
+    // Pad with a 1 bit, then zeros, then the length in bits (big endian),
+    // to a multiple of 64 bytes.
+    const ULONGLONG bits = m_len * 8;
+    static const BYTE c_pad[64] = { 0x80 };
+    Update(c_pad, (m_used < 56) ? 56 - m_used : 120 - m_used);
+
+    BYTE length[8];
+    for (int ii = 0; ii < 8; ++ii)
+        length[ii] = BYTE(bits >> (56 - ii * 8));
+    Update(length, sizeof(length));
+    assert(!m_used);
+
+    for (int ii = 0; ii < 5; ++ii)
+    {
+        digest[ii * 4] = BYTE(m_state[ii] >> 24);
+        digest[ii * 4 + 1] = BYTE(m_state[ii] >> 16);
+        digest[ii * 4 + 2] = BYTE(m_state[ii] >> 8);
+        digest[ii * 4 + 3] = BYTE(m_state[ii]);
+    }
+}
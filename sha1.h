@@ -0,0 +1,28 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+
+// Computes a SHA-1 hash, which is how git checksums the index and names
+// objects.  Call Update() any number of times, and then Final() once.
+class Sha1
+{
+public:
+                        Sha1();
+                        ~Sha1() = default;
+
+    void                Update(const void* data, size_t len);
+    void                Final(BYTE* digest);   // 20 bytes.
+
+private:
+    void                Transform(const BYTE* block);
+
+    DWORD               m_state[5];
+    ULONGLONG           m_len = 0;
+    BYTE                m_block[64];
+    size_t              m_used = 0;
+};
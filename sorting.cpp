@@ -8,6 +8,8 @@
 #include "sorting.h"
 #include "patterns.h"
 
+#include <algorithm>
+
 static bool s_reverse_all = false;
 static bool s_explicit_extension = false;
 static DWORD s_dwCmpStrFlags = 0;
@@ -273,3 +275,316 @@ bool CmpSubDirs(const std::unique_ptr<SubDir>& d1, const std::unique_ptr<SubDir>
     return Sorting::CmpStrI(d1->dir.Text(), d2->dir.Text()) < 0;
 }
 
+/*
+ * Sort keys.
+ */
+
+namespace
+{
+
+// The fields of one file that the sort order uses.  The name and extension
+// are collation keys from LCMapString, which compare with memcmp the same way
+// that CompareString compares the strings themselves.
+struct SortKey
+{
+    size_t              index;
+    unsigned            name;           // Offset of the name's collation key.
+    unsigned            name_len;
+    unsigned            ext;            // Offset of the extension's collation key.
+    unsigned            ext_len;
+    unsigned __int64    size;
+    ULONGLONG           time;
+    float               ratio;
+    bool                is_file;
+};
+
+class SortKeys
+{
+public:
+                        SortKeys() = default;
+                        ~SortKeys() = default;
+
+    bool                Build(const std::vector<std::unique_ptr<FileInfo>>& files);
+    void                Sort();
+    const std::vector<SortKey>& Keys() const { return m_keys; }
+
+private:
+    struct Field
+    {
+        WCHAR           field;
+        bool            reverse;
+    };
+
+    bool                AddCollationKey(const WCHAR* p, unsigned len, unsigned& offset, unsigned& key_len);
+    int                 CmpCollationKeys(unsigned offset1, unsigned len1, unsigned offset2, unsigned len2) const;
+    bool                IsLess(const SortKey& a, const SortKey& b) const;
+
+    std::vector<SortKey> m_keys;
+    std::vector<BYTE>   m_bytes;
+    Field               m_order[_countof(g_sort_order)];
+    unsigned            m_count = 0;
+};
+
+}; // namespace
+
+bool SortKeys::Build(const std::vector<std::unique_ptr<FileInfo>>& files)
+{
+    // Parse the sort order once, the same way CmpFileInfo() does.
+    bool need_name = false;
+    bool need_ext = false;
+    for (const WCHAR* order = g_sort_order; *order; order++)
+    {
+        const bool reverse = (*order == '-');
+        if (reverse)
+        {
+            order++;
+            if (!*order)
+                break;
+        }
+
+        m_order[m_count].field = *order;
+        m_order[m_count].reverse = reverse;
+        ++m_count;
+
+        need_name |= (*order == 'n');
+        need_ext |= (*order == 'e');
+    }
+
+    m_keys.resize(files.size());
+    if (need_name || need_ext)
+        m_bytes.reserve(files.size() * 32);
+
+    for (size_t ii = 0; ii < files.size(); ++ii)
+    {
+        const FileInfo* const pfi = files[ii].get();
+        SortKey& key = m_keys[ii];
+
+        key.index = ii;
+        key.is_file = !(pfi->GetAttributes() & FILE_ATTRIBUTE_DIRECTORY);
+
+        if (need_name || need_ext)
+        {
+            // Like CmpFileInfo(), the name key is the whole name, unless the
+            // sort order has an explicit 'e'; then it's only the part before
+            // the extension.
+            const WCHAR* const name = pfi->GetLongName().Text();
+            const WCHAR* const ext = FindExtension(name);
+            const unsigned len = pfi->GetLongName().Length();
+            const unsigned ext_len = ext ? unsigned(len - (ext - name)) : 0;
+            const unsigned name_len = (ext && s_explicit_extension) ? unsigned(ext - name) : len;
+            if (need_name && !AddCollationKey(name, name_len, key.name, key.name_len))
+                return false;
+            if (need_ext && !AddCollationKey(ext ? ext : L"", ext_len, key.ext, key.ext_len))
+                return false;
+        }
+
+        key.size = pfi->GetFileSize(g_settings->m_whichfilesize);
+        const FILETIME& ft = pfi->GetFileTime(g_settings->m_whichtimestamp);
+        key.time = (ULONGLONG(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+        key.ratio = pfi->GetCompressionRatio();
+    }
+
+    return true;
+}
+
+bool SortKeys::AddCollationKey(const WCHAR* p, unsigned len, unsigned& offset, unsigned& key_len)
+{
+    const DWORD flags = LCMAP_SORTKEY|NORM_IGNORECASE|s_dwCmpStrFlags;
+
+    // LCMapString can't map an empty string by length, but it can map an
+    // empty string that's NUL terminated.
+    const int cch = len ? int(len) : -1;
+    if (!len)
+        p = L"";
+
+    // The key is written as bytes, but to a WCHAR pointer, so keep it
+    // aligned.  Guess at the size first, to avoid calling LCMapString twice
+    // for every string.
+    const size_t start = (m_bytes.size() + 1) & ~size_t(1);
+    int room = int(len) * 4 + 16;
+    m_bytes.resize(start + room);
+    int cb = LCMapStringW(LOCALE_USER_DEFAULT, flags, p, cch, reinterpret_cast<WCHAR*>(m_bytes.data() + start), room);
+    if (!cb && GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+    {
+        room = LCMapStringW(LOCALE_USER_DEFAULT, flags, p, cch, nullptr, 0);
+        if (room > 0)
+        {
+            m_bytes.resize(start + room);
+            cb = LCMapStringW(LOCALE_USER_DEFAULT, flags, p, cch, reinterpret_cast<WCHAR*>(m_bytes.data() + start), room);
+        }
+    }
+    if (cb <= 0 || start + cb > UINT_MAX)
+        return false;
+
+    m_bytes.resize(start + cb);
+    offset = unsigned(start);
+    key_len = unsigned(cb);
+    return true;
+}
+
+int SortKeys::CmpCollationKeys(unsigned offset1, unsigned len1, unsigned offset2, unsigned len2) const
+{
+    const int n = memcmp(m_bytes.data() + offset1, m_bytes.data() + offset2, std::min(len1, len2));
+    if (n)
+        return n;
+    return (len1 < len2) ? -1 : (len1 > len2) ? 1 : 0;
+}
+
+bool SortKeys::IsLess(const SortKey& a, const SortKey& b) const
+{
+    int n = 0;
+    for (unsigned ii = 0; !n && ii < m_count; ++ii)
+    {
+        switch (m_order[ii].field)
+        {
+        case 'g':
+            if (a.is_file != b.is_file)
+                n = a.is_file ? 1 : -1;
+            break;
+        case 'n':
+            n = CmpCollationKeys(a.name, a.name_len, b.name, b.name_len);
+            break;
+        case 'e':
+            n = CmpCollationKeys(a.ext, a.ext_len, b.ext, b.ext_len);
+            break;
+        case 's':
+            if (a.size < b.size)
+                n = -1;
+            else if (a.size > b.size)
+                n = 1;
+            break;
+        case 'd':
+            if (a.time < b.time)
+                n = -1;
+            else if (a.time > b.time)
+                n = 1;
+            break;
+        case 'c':
+            if (a.ratio < b.ratio)
+                n = -1;
+            else if (a.ratio > b.ratio)
+                n = 1;
+            break;
+        }
+
+        if (m_order[ii].reverse)
+            n = -n;
+    }
+
+    return n < 0;
+}
+
+void SortKeys::Sort()
+{
+    std::stable_sort(m_keys.begin(), m_keys.end(), [this](const SortKey& a, const SortKey& b)
+    {
+        return IsLess(a, b);
+    });
+}
+
+void SortFiles(std::vector<std::unique_ptr<FileInfo>>& files)
+{
+    assert(g_settings);
+
+    // If a collation key can't be made, fall back to comparing the names.
+    SortKeys keys;
+    if (!keys.Build(files))
+    {
+        std::stable_sort(files.begin(), files.end(), CmpFileInfo);
+        return;
+    }
+
+    keys.Sort();
+
+    std::vector<std::unique_ptr<FileInfo>> sorted;
+    sorted.reserve(files.size());
+    for (const SortKey& key : keys.Keys())
+        sorted.emplace_back(std::move(files[key.index]));
+    files.swap(sorted);
+}
+
+/*
+ * TopFiles.
+ */
+
+TopFiles::TopFiles(size_t limit, bool unique_names)
+: m_limit(limit)
+, m_unique_names(unique_names)
+{
+    m_heap.reserve(limit);
+}
+
+bool TopFiles::IsLess(const std::unique_ptr<FileInfo>& a, ULONGLONG seq_a, const std::unique_ptr<FileInfo>& b, ULONGLONG seq_b)
+{
+    // A reversed sort reverses the whole list, including the order of files
+    // that compare equal.
+    if (IsReversedSort())
+    {
+        if (CmpFileInfo(b, a))
+            return true;
+        if (CmpFileInfo(a, b))
+            return false;
+        return seq_b < seq_a;
+    }
+
+    if (CmpFileInfo(a, b))
+        return true;
+    if (CmpFileInfo(b, a))
+        return false;
+    return seq_a < seq_b;
+}
+
+bool TopFiles::IsLessEntry(const Entry& a, const Entry& b)
+{
+    return IsLess(a.pfi, a.seq, b.pfi, b.seq);
+}
+
+bool TopFiles::WouldKeep(const std::unique_ptr<FileInfo>& pfi) const
+{
+    if (!m_limit)
+        return false;
+    // Grouped patterns can match the same file more than once.
+    if (m_unique_names && m_names.find(pfi->GetLongName().Text()) != m_names.end())
+        return false;
+    if (m_heap.size() < m_limit)
+        return true;
+    return IsLess(pfi, m_seq, m_heap.front().pfi, m_heap.front().seq);
+}
+
+void TopFiles::Add(std::unique_ptr<FileInfo>&& pfi)
+{
+    if (!WouldKeep(pfi))
+        return;
+
+    if (m_heap.size() >= m_limit)
+    {
+        std::pop_heap(m_heap.begin(), m_heap.end(), IsLessEntry);
+        if (m_unique_names)
+            m_names.erase(m_heap.back().pfi->GetLongName().Text());
+        m_heap.pop_back();
+    }
+
+    if (m_unique_names)
+        m_names.insert(pfi->GetLongName().Text());
+    m_heap.emplace_back();
+    m_heap.back().pfi = std::move(pfi);
+    m_heap.back().seq = m_seq++;
+    std::push_heap(m_heap.begin(), m_heap.end(), IsLessEntry);
+}
+
+void TopFiles::Take(std::vector<std::unique_ptr<FileInfo>>& files)
+{
+    // Return the files in the order they were added, so that a stable sort
+    // produces the same order as sorting all of the files would have.
+    std::sort(m_heap.begin(), m_heap.end(), [](const Entry& a, const Entry& b)
+    {
+        return a.seq < b.seq;
+    });
+
+    files.reserve(files.size() + m_heap.size());
+    for (auto& entry : m_heap)
+        files.emplace_back(std::move(entry.pfi));
+
+    m_heap.clear();
+    m_names.clear();
+}
@@ -9,6 +9,8 @@
 #include "fileinfo.h"
 
 #include <memory>
+#include <unordered_set>
+#include <vector>
 
 struct SubDir;
 
@@ -31,3 +33,37 @@ inline int CmpStrI(const WCHAR* p1, const WCHAR* p2) { return CmpStrNI(p1, -1, p
 bool CmpFileInfo(const std::unique_ptr<FileInfo>& fi1, const std::unique_ptr<FileInfo>& fi2);
 bool CmpSubDirs(const std::unique_ptr<SubDir>& d1, const std::unique_ptr<SubDir>& d2);
 
+// Sorts files in the same order as std::stable_sort with CmpFileInfo, but
+// computes each file's sort fields once up front, instead of in every
+// comparison.
+void SortFiles(std::vector<std::unique_ptr<FileInfo>>& files);
+
+// TopFiles keeps only the first N files in the sort order (honoring reversed
+// sort), out of however many are added.  It's a bounded heap, so memory is
+// O(N) and adding M files takes O(M log N).  Files that compare equal keep
+// the order in which they were added.
+class TopFiles
+{
+public:
+                        TopFiles(size_t limit, bool unique_names);
+
+    bool                WouldKeep(const std::unique_ptr<FileInfo>& pfi) const;
+    void                Add(std::unique_ptr<FileInfo>&& pfi);
+    void                Take(std::vector<std::unique_ptr<FileInfo>>& files);
+
+private:
+    struct Entry
+    {
+        std::unique_ptr<FileInfo> pfi;
+        ULONGLONG       seq;
+    };
+
+    static bool         IsLess(const std::unique_ptr<FileInfo>& a, ULONGLONG seq_a, const std::unique_ptr<FileInfo>& b, ULONGLONG seq_b);
+    static bool         IsLessEntry(const Entry& a, const Entry& b);
+
+    const size_t        m_limit;
+    const bool          m_unique_names;
+    ULONGLONG           m_seq = 0;
+    std::vector<Entry>  m_heap;             // The last file kept is at the front.
+    std::unordered_set<const WCHAR*, HashCase, EqualCase> m_names;
+};
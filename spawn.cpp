@@ -0,0 +1,161 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "spawn.h"
+#include "handle.h"
+
+#include <memory>
+
+static const DWORD c_read_chunk = 64 * 1024;
+
+bool FindOnPath(const WCHAR* name, StrW& full)
+{
+    full.Clear();
+
+    StrW path;
+    const DWORD needed = GetEnvironmentVariable(L"PATH", nullptr, 0);
+    if (!needed)
+        return false;
+    GetEnvironmentVariable(L"PATH", path.Reserve(needed), needed);
+    path.ResyncLength();
+
+    // Search the PATH directories only (SearchPath with a null path would
+    // include the current directory).
+    full.ReserveMaxPath();
+    const DWORD len = SearchPath(path.Text(), name, nullptr, full.Capacity(), full.Reserve(), nullptr);
+    if (!len || len >= full.Capacity())
+    {
+        full.Clear();
+        return false;
+    }
+
+    full.ResyncLength();
+    return true;
+}
+
+// Appends an argument, quoted so that CommandLineToArgvW (and the C runtime)
+// parse it back exactly:  backslashes are only special when they precede a
+// quote.
+static void AppendArg(StrW& command, const WCHAR* arg)
+{
+    if (command.Length())
+        command.Append(' ');
+
+    if (*arg && !wcspbrk(arg, L" \t\n\v\""))
+    {
+        command.Append(arg);
+        return;
+    }
+
+    command.Append('"');
+    while (true)
+    {
+        unsigned backslashes = 0;
+        while (*arg == '\\')
+        {
+            ++arg;
+            ++backslashes;
+        }
+
+        if (!*arg)
+        {
+            for (unsigned ii = backslashes * 2; ii--;)
+                command.Append('\\');
+            break;
+        }
+
+        if (*arg == '"')
+        {
+            for (unsigned ii = backslashes * 2 + 1; ii--;)
+                command.Append('\\');
+        }
+        else
+        {
+            for (unsigned ii = backslashes; ii--;)
+                command.Append('\\');
+        }
+        command.Append(*(arg++));
+    }
+    command.Append('"');
+}
+
+bool RunProcess(const WCHAR* program, const std::vector<const WCHAR*>& args, std::vector<char>& out, DWORD* exit_code)
+{
+    out.clear();
+
+    StrW command;
+    AppendArg(command, program);
+    for (const WCHAR* arg : args)
+        AppendArg(command, arg);
+
+    // The child gets the write end of a pipe for stdout, and the NUL device
+    // for stdin and stderr.  Only those handles are inheritable.
+    SECURITY_ATTRIBUTES sa = { sizeof(sa) };
+    sa.bInheritHandle = true;
+
+    HANDLE read_pipe;
+    HANDLE write_pipe;
+    if (!CreatePipe(&read_pipe, &write_pipe, &sa, c_read_chunk))
+        return false;
+    SHFile read_end = read_pipe;
+    SHFile write_end = write_pipe;
+    SetHandleInformation(read_end, HANDLE_FLAG_INHERIT, 0);
+
+    SHFile nul = CreateFile(L"NUL", GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, 0);
+    if (nul.Empty())
+        return false;
+
+    // Processes may be started from several threads at once, so limit which
+    // handles are inherited; otherwise a child could also inherit the write
+    // end of another child's pipe and hold it open.
+    HANDLE inherit[] = { nul, write_end };
+    SIZE_T attr_size = 0;
+    InitializeProcThreadAttributeList(nullptr, 1, 0, &attr_size);
+    std::unique_ptr<BYTE[]> attr_buffer = std::make_unique<BYTE[]>(attr_size);
+    LPPROC_THREAD_ATTRIBUTE_LIST attrs = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attr_buffer.get());
+    if (!InitializeProcThreadAttributeList(attrs, 1, 0, &attr_size))
+        return false;
+    const bool updated = !!UpdateProcThreadAttribute(attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherit, sizeof(inherit), nullptr, nullptr);
+
+    STARTUPINFOEX si = { sizeof(si) };
+    si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    si.StartupInfo.hStdInput = nul;
+    si.StartupInfo.hStdOutput = write_end;
+    si.StartupInfo.hStdError = nul;
+    si.lpAttributeList = attrs;
+
+    PROCESS_INFORMATION pi;
+    const bool created = (updated &&
+                          CreateProcess(program, command.Reserve(), nullptr, nullptr, true, CREATE_NO_WINDOW|EXTENDED_STARTUPINFO_PRESENT, nullptr, nullptr, &si.StartupInfo, &pi));
+    DeleteProcThreadAttributeList(attrs);
+    if (!created)
+        return false;
+
+    SHBasic process = pi.hProcess;
+    SHBasic thread = pi.hThread;
+
+    // Close the parent's copy of the write end, so that reading reaches the
+    // end of the pipe once the child exits.
+    write_end.Close();
+    nul.Close();
+
+    size_t used = 0;
+    while (true)
+    {
+        out.resize(used + c_read_chunk);
+
+        DWORD bytes;
+        if (!ReadFile(read_end, out.data() + used, c_read_chunk, &bytes, nullptr) || !bytes)
+            break;
+        used += bytes;
+    }
+    out.resize(used);
+
+    WaitForSingleObject(process, INFINITE);
+    if (exit_code && !GetExitCodeProcess(process, exit_code))
+        *exit_code = DWORD(-1);
+    return true;
+}
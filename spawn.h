@@ -0,0 +1,22 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+
+#include <vector>
+
+// Finds a program on the PATH.  Unlike CreateProcess, this doesn't search the
+// current directory, so a program in the directory being listed can't be run
+// by accident.
+bool FindOnPath(const WCHAR* name, StrW& full);
+
+// Runs a program directly (not through a command interpreter) with the given
+// arguments, and captures its standard output in out.  Standard input and
+// standard error are the NUL device.  Returns false if the program couldn't
+// be started; otherwise exit_code (if provided) receives its exit code.
+bool RunProcess(const WCHAR* program, const std::vector<const WCHAR*>& args, std::vector<char>& out, DWORD* exit_code=nullptr);
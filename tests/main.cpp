@@ -0,0 +1,125 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "tests.h"
+
+#include <vector>
+
+int g_debug = 0;
+int g_nix_defaults = 0;
+
+namespace
+{
+
+struct Test
+{
+    const char*         name;
+    TestFunc            func;
+    bool                bench;
+};
+
+}; // namespace
+
+static unsigned s_failures = 0;
+static const char* s_skipped = nullptr;
+
+// Tests register themselves from static constructors in other translation
+// units, so the list has to be constructed on first use.
+static std::vector<Test>& GetTests()
+{
+    static std::vector<Test> s_tests;
+    return s_tests;
+}
+
+TestRegistration::TestRegistration(const char* name, TestFunc func, bool bench)
+{
+    GetTests().push_back({ name, func, bench });
+}
+
+void TestFailed(const char* file, int line, const char* expr)
+{
+    printf("    %s(%d): CHECK(%s) failed\n", file, line, expr);
+    ++s_failures;
+}
+
+void TestSkipped(const char* reason)
+{
+    s_skipped = reason;
+}
+
+void BenchTimer::Start()
+{
+    QueryPerformanceCounter(&m_start);
+}
+
+double BenchTimer::Milliseconds() const
+{
+    LARGE_INTEGER now;
+    LARGE_INTEGER freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return double(now.QuadPart - m_start.QuadPart) * 1000.0 / double(freq.QuadPart);
+}
+
+void BenchResult(const char* label, unsigned iterations, double ms)
+{
+    printf("    %-40s %10.2f ms", label, ms);
+    if (iterations > 1)
+        printf("  (%.3f ms each)", ms / iterations);
+    printf("\n");
+}
+
+// Usage:  dirx_tests [--debug] [--bench] [substring]
+// Runs the tests whose names contain substring, or all of them.  With
+// --bench, runs the benchmarks instead.
+int __cdecl main(int argc, const char** argv)
+{
+    const char* filter = nullptr;
+    bool bench = false;
+    for (int ii = 1; ii < argc; ++ii)
+    {
+        if (strcmp(argv[ii], "--debug") == 0)
+            g_debug = 1;
+        else if (strcmp(argv[ii], "--bench") == 0)
+            bench = true;
+        else
+            filter = argv[ii];
+    }
+
+    unsigned run = 0;
+    unsigned failed = 0;
+    unsigned skipped = 0;
+    for (const auto& test : GetTests())
+    {
+        if (test.bench != bench)
+            continue;
+        if (filter && !strstr(test.name, filter))
+            continue;
+
+        s_failures = 0;
+        s_skipped = nullptr;
+        test.func();
+        ++run;
+
+        if (s_failures)
+        {
+            printf("FAILED   %s\n", test.name);
+            ++failed;
+        }
+        else if (s_skipped)
+        {
+            printf("skipped  %s (%s)\n", test.name, s_skipped);
+            ++skipped;
+        }
+        else
+        {
+            printf("ok       %s\n", test.name);
+        }
+    }
+
+    printf("%u run, %u failed, %u skipped\n", run, failed, skipped);
+    return failed ? 1 : 0;
+}
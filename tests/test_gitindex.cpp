@@ -0,0 +1,811 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// Tests for the native git index reader.  Each test builds a scratch repo by
+// running git, so the fixtures are whatever the installed git writes; the
+// tests are skipped if git isn't on the PATH.
+
+#include "pch.h"
+#include "tests.h"
+#include "gitindex.h"
+#include "git.h"
+#include "inflate.h"
+#include "filesys.h"
+#include "handle.h"
+#include "spawn.h"
+
+#include <algorithm>
+#include <vector>
+
+// One hour, in FILETIME units.
+static const ULONGLONG c_hour = 60ull * 60 * 10000000;
+
+namespace
+{
+
+// GitFixture is a scratch repo in a temporary directory, which is deleted
+// when the fixture is destroyed.
+class GitFixture
+{
+public:
+                        GitFixture() = default;
+                        ~GitFixture();
+
+    bool                Init();
+    bool                Git(const std::vector<const WCHAR*>& args, StrA* out=nullptr) const;
+    bool                Commit() const;
+    bool                Write(const WCHAR* rel, const char* text) const;
+    bool                ReadBytes(const WCHAR* rel, std::vector<BYTE>& out) const;
+    bool                WriteBytes(const WCHAR* rel, const std::vector<BYTE>& bytes) const;
+    bool                IndexVersion(DWORD& version) const;
+    bool                ObjectPath(const WCHAR* rev, StrW& rel) const;
+    void                InitStatus(RepoStatus& status) const;
+
+    void                Path(const WCHAR* rel, StrW& out) const { PathJoin(out, m_root.Text(), rel); }
+
+private:
+    static void         RemoveTree(const WCHAR* dir);
+
+    StrW                m_git;
+    StrW                m_root;
+};
+
+}; // namespace
+
+GitFixture::~GitFixture()
+{
+    if (!m_root.Empty())
+        RemoveTree(m_root.Text());
+}
+
+bool GitFixture::Init()
+{
+    if (!FindOnPath(L"git.exe", m_git))
+        return false;
+
+    WCHAR temp[MAX_PATH];
+    if (!GetTempPath(_countof(temp), temp))
+        return false;
+
+    static unsigned s_count = 0;
+    StrW name;
+    name.Printf(L"dirx_tests_%u_%u", GetCurrentProcessId(), ++s_count);
+    PathJoin(m_root, temp, name);
+    if (!CreateDirectory(m_root.Text(), nullptr))
+    {
+        m_root.Clear();
+        return false;
+    }
+
+    // Keep the user's and the system's git config from affecting what git
+    // writes (for example core.autocrlf, or core.untrackedCache).
+    SetEnvironmentVariable(L"HOME", m_root.Text());
+    SetEnvironmentVariable(L"GIT_CONFIG_NOSYSTEM", L"1");
+
+    return (Git({ L"init", L"-q" }) &&
+            Git({ L"symbolic-ref", L"HEAD", L"refs/heads/main" }) &&
+            Git({ L"config", L"user.name", L"dirx" }) &&
+            Git({ L"config", L"user.email", L"dirx@example.com" }) &&
+            Git({ L"config", L"core.autocrlf", L"false" }));
+}
+
+bool GitFixture::Git(const std::vector<const WCHAR*>& args, StrA* out) const
+{
+    std::vector<const WCHAR*> all = { L"-C", m_root.Text() };
+    all.insert(all.end(), args.begin(), args.end());
+
+    DWORD exit_code;
+    std::vector<char> output;
+    if (!RunProcess(m_git.Text(), all, output, &exit_code) || exit_code != 0)
+        return false;
+
+    if (out)
+    {
+        out->Set(output.data(), output.size());
+        out->TrimRight();
+    }
+    return true;
+}
+
+bool GitFixture::Commit() const
+{
+    return Git({ L"add", L"-A" }) && Git({ L"commit", L"-q", L"-m", L"test" });
+}
+
+// Writes a file, creating its directories as needed.  The file's timestamp
+// is set an hour in the past, so that the index git writes afterwards isn't
+// racy (which would make the reader defer to git).
+bool GitFixture::Write(const WCHAR* rel, const char* text) const
+{
+    StrW path;
+    Path(rel, path);
+    for (const WCHAR* slash = wcschr(rel, '\\'); slash; slash = wcschr(slash + 1, '\\'))
+    {
+        StrW sub;
+        StrW dir;
+        sub.Set(rel, slash - rel);
+        Path(sub.Text(), dir);
+        CreateDirectory(dir.Text(), nullptr);
+    }
+
+    SHFile h = CreateFile(path.Text(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (h.Empty())
+        return false;
+
+    DWORD written;
+    const DWORD len = DWORD(strlen(text));
+    if (!WriteFile(h, text, len, &written, nullptr) || written != len)
+        return false;
+
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    const ULONGLONG past = ((ULONGLONG(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) - c_hour;
+    ft.dwLowDateTime = DWORD(past);
+    ft.dwHighDateTime = DWORD(past >> 32);
+    return !!SetFileTime(h, nullptr, nullptr, &ft);
+}
+
+bool GitFixture::ReadBytes(const WCHAR* rel, std::vector<BYTE>& out) const
+{
+    StrW path;
+    Path(rel, path);
+    SHFile h = CreateFile(path.Text(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, 0);
+    if (h.Empty())
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(h, &size))
+        return false;
+
+    DWORD bytes;
+    out.resize(size_t(size.QuadPart));
+    return ReadFile(h, out.data(), DWORD(out.size()), &bytes, nullptr) && bytes == out.size();
+}
+
+// Overwrites a file; git makes objects read-only, so that's cleared first.
+bool GitFixture::WriteBytes(const WCHAR* rel, const std::vector<BYTE>& bytes) const
+{
+    StrW path;
+    Path(rel, path);
+    SetFileAttributes(path.Text(), FILE_ATTRIBUTE_NORMAL);
+    SHFile h = CreateFile(path.Text(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (h.Empty())
+        return false;
+
+    DWORD written;
+    return WriteFile(h, bytes.data(), DWORD(bytes.size()), &written, nullptr) && written == bytes.size();
+}
+
+bool GitFixture::IndexVersion(DWORD& version) const
+{
+    std::vector<BYTE> index;
+    if (!ReadBytes(L".git\\index", index) || index.size() < 8)
+        return false;
+    version = (DWORD(index[4]) << 24) | (DWORD(index[5]) << 16) | (DWORD(index[6]) << 8) | DWORD(index[7]);
+    return true;
+}
+
+// Gets the path of a loose object, relative to the root.
+bool GitFixture::ObjectPath(const WCHAR* rev, StrW& rel) const
+{
+    StrA hex;
+    if (!Git({ L"rev-parse", rev }, &hex) || hex.Length() != 40)
+        return false;
+
+    StrW wide;
+    for (const char* p = hex.Text(); *p; ++p)
+        wide.Append(WCHAR(*p));
+    rel.Set(L".git\\objects\\");
+    rel.Append(wide.Text(), 2);
+    rel.Append('\\');
+    rel.Append(wide.Text() + 2);
+    return true;
+}
+
+void GitFixture::InitStatus(RepoStatus& status) const
+{
+    status.repo = true;
+    status.root.Set(m_root);
+    PathJoin(status.git_dir, m_root.Text(), L".git");
+}
+
+void GitFixture::RemoveTree(const WCHAR* dir)
+{
+    StrW spec;
+    PathJoin(spec, dir, L"*");
+
+    WIN32_FIND_DATA fd;
+    SHFind shFind = FindFirstFile(spec.Text(), &fd);
+    if (!shFind.Empty())
+    {
+        do
+        {
+            if (IsPseudoDirectory(fd.cFileName))
+                continue;
+
+            StrW path;
+            PathJoin(path, dir, fd.cFileName);
+            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                RemoveTree(path.Text());
+            }
+            else
+            {
+                SetFileAttributes(path.Text(), FILE_ATTRIBUTE_NORMAL);
+                DeleteFile(path.Text());
+            }
+        }
+        while (FindNextFile(shFind, &fd));
+    }
+
+    RemoveDirectory(dir);
+}
+
+static bool LoadIndex(const GitFixture& repo, const WCHAR* rel, GitIndex& index)
+{
+    StrW file;
+    repo.Path(rel, file);
+    return index.Load(file.Text());
+}
+
+static FileStatus FindStatus(const GitFixture& repo, const RepoStatus& status, const WCHAR* rel)
+{
+    StrW full;
+    repo.Path(rel, full);
+    for (const auto& entry : status.status)
+    {
+        if (_wcsicmp(entry.path, full.Text()) == 0)
+            return entry.status;
+    }
+    return FileStatus { GitFileState::NONE, GitFileState::NONE };
+}
+
+static bool MakeRepo(GitFixture& repo)
+{
+    return (repo.Write(L"a.txt", "a\n") &&
+            repo.Write(L"dir\\b.txt", "bb\n") &&
+            repo.Write(L"dir\\sub\\c.txt", "ccc\n") &&
+            repo.Write(L"dir2\\d.txt", "dddd\n") &&
+            repo.Commit());
+}
+
+/*
+ * Index versions.
+ */
+
+TEST(gitindex_versions)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(MakeRepo(repo));
+
+    static const WCHAR* const c_paths[] = { L"a.txt", L"dir\\b.txt", L"dir\\sub\\c.txt", L"dir2\\d.txt" };
+
+    // Version 4 prefix-compresses the paths.
+    for (DWORD version = 2; version <= 4; version += 2)
+    {
+        StrW arg;
+        arg.Printf(L"%u", version);
+        CHECK(repo.Git({ L"update-index", L"--index-version", arg.Text() }));
+
+        DWORD actual = 0;
+        CHECK(repo.IndexVersion(actual) && actual == version);
+
+        GitIndex index;
+        CHECK(LoadIndex(repo, L".git\\index", index));
+        CHECK(index.Entries().size() == _countof(c_paths));
+        for (size_t ii = 0; ii < index.Entries().size() && ii < _countof(c_paths); ++ii)
+        {
+            CHECK(wcscmp(index.Entries()[ii].path, c_paths[ii]) == 0);
+            CHECK(index.Entries()[ii].size == ii + 2);
+        }
+        CHECK(index.RootTree() != nullptr);
+
+        RepoStatus status;
+        repo.InitStatus(status);
+        CHECK(ReadIndexStatus(status));
+        CHECK(status.status.empty());
+        CHECK(status.branch.Equal(L"main"));
+    }
+
+    // Git only writes version 3 when an entry has extended flags, such as
+    // skip-worktree.  Those entries are loaded, but status defers to git.
+    CHECK(repo.Git({ L"update-index", L"--index-version", L"2" }));
+    CHECK(repo.Git({ L"update-index", L"--skip-worktree", L"a.txt" }));
+
+    DWORD actual = 0;
+    CHECK(repo.IndexVersion(actual) && actual == 3);
+
+    GitIndex index;
+    CHECK(LoadIndex(repo, L".git\\index", index));
+    CHECK(index.Entries().size() == _countof(c_paths));
+    CHECK(!index.Entries().empty() && (index.Entries()[0].ext_flags & 0x4000));
+
+    RepoStatus status;
+    repo.InitStatus(status);
+    CHECK(!ReadIndexStatus(status));
+    CHECK(status.status.empty());
+}
+
+TEST(gitindex_changes)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(MakeRepo(repo));
+    CHECK(repo.Git({ L"update-index", L"--index-version", L"4" }));
+
+    CHECK(repo.Write(L"dir\\b.txt", "changed\n"));
+    CHECK(repo.Write(L"new.txt", "new\n"));
+    CHECK(repo.Git({ L"add", L"new.txt" }));
+    CHECK(repo.Write(L"untracked.txt", "untracked\n"));
+    StrW path;
+    repo.Path(L"dir2\\d.txt", path);
+    CHECK(DeleteFile(path.Text()));
+
+    RepoStatus status;
+    repo.InitStatus(status);
+    CHECK(ReadIndexStatus(status));
+    CHECK(status.status.size() == 4);
+    CHECK(FindStatus(repo, status, L"dir\\b.txt").working == GitFileState::MODIFIED);
+    CHECK(FindStatus(repo, status, L"new.txt").staged == GitFileState::NEW);
+    CHECK(FindStatus(repo, status, L"untracked.txt").working == GitFileState::NEW);
+    CHECK(FindStatus(repo, status, L"dir2\\d.txt").working == GitFileState::DELETED);
+
+    RepoStatus summary;
+    repo.InitStatus(summary);
+    CHECK(ReadIndexSummary(summary));
+    CHECK(!summary.clean);
+}
+
+/*
+ * Ignored files.
+ */
+
+TEST(gitindex_ignored_clean)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(repo.Write(L".gitignore", "*.log\nbuild/\n"));
+    CHECK(MakeRepo(repo));
+
+    CHECK(repo.Write(L"debug.log", "log\n"));
+    CHECK(repo.Write(L"dir\\trace.log", "log\n"));
+    CHECK(repo.Write(L"build\\out.o", "obj\n"));
+
+    // Ignored files aren't changes, so a repo with only ignored files is
+    // clean.
+    RepoStatus status;
+    repo.InitStatus(status);
+    CHECK(ReadIndexStatus(status));
+    CHECK(status.status.empty());
+
+    RepoStatus summary;
+    repo.InitStatus(summary);
+    CHECK(ReadIndexSummary(summary));
+    CHECK(summary.clean);
+
+    std::shared_ptr<RepoStatus> full = GitStatus(status.root.Text());
+    CHECK(full->repo && full->clean);
+    std::shared_ptr<RepoStatus> repo_summary = GitRepoSummary(status.root.Text());
+    CHECK(repo_summary->repo && repo_summary->clean);
+}
+
+TEST(gitindex_tracked_not_ignored)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(repo.Write(L".gitignore", "*.log\nbuild/\n"));
+    CHECK(repo.Write(L"a.txt", "a\n"));
+    CHECK(repo.Write(L"keep.log", "keep\n"));
+    CHECK(repo.Write(L"build\\keep.txt", "keep\n"));
+    CHECK(repo.Git({ L"add", L"-f", L"keep.log", L"build/keep.txt" }));
+    CHECK(repo.Commit());
+    CHECK(repo.Write(L"other.log", "other\n"));
+    CHECK(repo.Write(L"build\\other.o", "other\n"));
+
+    RepoStatus status;
+    repo.InitStatus(status);
+    CHECK(ReadIndexStatus(status));
+    CHECK(status.status.empty());
+
+    const StrW& root = status.root;
+    StrW build;
+    repo.Path(L"build", build);
+
+    // The patterns match tracked files too; the index says which ones git
+    // doesn't report as ignored.
+    CHECK(status.IsIgnored(root.Text(), L"keep.log", false));
+    CHECK(status.IsTracked(root.Text(), L"keep.log"));
+    CHECK(status.IsIgnored(root.Text(), L"other.log", false));
+    CHECK(!status.IsTracked(root.Text(), L"other.log"));
+    CHECK(!status.IsIgnored(root.Text(), L"a.txt", false));
+    CHECK(status.IsTracked(root.Text(), L"a.txt"));
+
+    // An ignored directory that contains tracked files isn't ignored itself,
+    // but its untracked files are.
+    CHECK(status.IsIgnored(root.Text(), L"build", true));
+    CHECK(status.IsTracked(root.Text(), L"build"));
+    CHECK(status.IsTracked(build.Text(), L"keep.txt"));
+    CHECK(status.IsIgnored(build.Text(), L"other.o", false));
+    CHECK(!status.IsTracked(build.Text(), L"other.o"));
+
+    // With a split index, git lists the tracked files instead.
+    CHECK(repo.Git({ L"update-index", L"--split-index" }));
+    RepoStatus split;
+    repo.InitStatus(split);
+    CHECK(split.IsTracked(root.Text(), L"keep.log"));
+    CHECK(split.IsTracked(root.Text(), L"build"));
+    CHECK(split.IsTracked(build.Text(), L"keep.txt"));
+    CHECK(!split.IsTracked(root.Text(), L"other.log"));
+    CHECK(!split.IsTracked(build.Text(), L"other.o"));
+}
+
+// Compares "git status --ignored" (which dirx used to run to find ignored
+// files) with reading the index and classifying files against the ignore
+// patterns, in a repo with 100k ignored files.  Listing the root only
+// classifies its own entries; listing every file classifies all of them.
+BENCHMARK(gitindex_ignored_100k)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(repo.Write(L".gitignore", "*.o\n"));
+    CHECK(repo.Write(L"src\\main.c", "int main() { return 0; }\n"));
+    CHECK(repo.Commit());
+
+    const unsigned c_dirs = 100;
+    const unsigned c_files = 1000;
+    for (unsigned ii = 0; ii < c_dirs; ++ii)
+    {
+        for (unsigned jj = 0; jj < c_files; ++jj)
+        {
+            StrW rel;
+            rel.Printf(L"obj%u\\file%u.o", ii, jj);
+            CHECK(repo.Write(rel.Text(), ""));
+        }
+    }
+
+    BenchTimer timer;
+    StrA out;
+    CHECK(repo.Git({ L"status", L"--porcelain=v2", L"-z", L"--ignored", L"-unormal", L"--branch" }, &out));
+    BenchResult("git status --ignored", 1, timer.Milliseconds());
+
+    for (bool all : { false, true })
+    {
+        timer.Start();
+        RepoStatus status;
+        repo.InitStatus(status);
+        CHECK(ReadIndexStatus(status));
+        CHECK(status.status.empty());
+
+        unsigned ignored = 0;
+        for (unsigned ii = 0; ii < c_dirs; ++ii)
+        {
+            StrW name;
+            name.Printf(L"obj%u", ii);
+            if (!all)
+            {
+                // The directories aren't ignored, only the files in them.
+                if (status.IsIgnored(status.root.Text(), name.Text(), true))
+                    ++ignored;
+                continue;
+            }
+
+            StrW dir;
+            repo.Path(name.Text(), dir);
+            for (unsigned jj = 0; jj < c_files; ++jj)
+            {
+                name.Clear();
+                name.Printf(L"file%u.o", jj);
+                if (status.IsIgnored(dir.Text(), name.Text(), false) && !status.IsTracked(dir.Text(), name.Text()))
+                    ++ignored;
+            }
+        }
+        CHECK(ignored == (all ? c_dirs * c_files : 0));
+        BenchResult(all ? "index status, classify every file" : "index status, classify the root", 1, timer.Milliseconds());
+    }
+}
+
+/*
+ * Extensions.
+ */
+
+TEST(gitindex_split_index)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(MakeRepo(repo));
+
+    // A split index has the required "link" extension, and the reader
+    // defers to git.
+    CHECK(repo.Git({ L"update-index", L"--split-index" }));
+
+    GitIndex index;
+    CHECK(!LoadIndex(repo, L".git\\index", index));
+
+    RepoStatus status;
+    repo.InitStatus(status);
+    CHECK(!ReadIndexStatus(status));
+
+    RepoStatus summary;
+    repo.InitStatus(summary);
+    CHECK(!ReadIndexSummary(summary));
+}
+
+TEST(gitindex_optional_extension)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(MakeRepo(repo));
+
+    // The untracked cache ("UNTR") is optional, so it's skipped.
+    CHECK(repo.Git({ L"config", L"core.untrackedCache", L"true" }));
+    CHECK(repo.Git({ L"update-index", L"--untracked-cache" }));
+    CHECK(repo.Git({ L"status", L"--porcelain" }));
+
+    std::vector<BYTE> bytes;
+    CHECK(repo.ReadBytes(L".git\\index", bytes));
+    static const BYTE c_untr[] = { 'U', 'N', 'T', 'R' };
+    CHECK(std::search(bytes.begin(), bytes.end(), c_untr, c_untr + 4) != bytes.end());
+
+    GitIndex index;
+    CHECK(LoadIndex(repo, L".git\\index", index));
+    CHECK(index.Entries().size() == 4);
+
+    RepoStatus status;
+    repo.InitStatus(status);
+    CHECK(ReadIndexStatus(status));
+    CHECK(status.status.empty());
+}
+
+/*
+ * Refs and objects.
+ */
+
+TEST(gitindex_packed_refs)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(MakeRepo(repo));
+
+    StrA head;
+    CHECK(repo.Git({ L"rev-parse", L"HEAD" }, &head));
+    CHECK(repo.Git({ L"pack-refs", L"--all" }));
+
+    StrW loose;
+    repo.Path(L".git\\refs\\heads\\main", loose);
+    CHECK(GetFileType(loose.Text()) == FileType::Invalid);
+
+    StrW git_dir;
+    StrW branch;
+    BYTE oid[20];
+    bool unborn = true;
+    repo.Path(L".git", git_dir);
+    CHECK(ReadHead(git_dir.Text(), branch, oid, unborn));
+    CHECK(branch.Equal(L"main"));
+    CHECK(!unborn);
+
+    StrA hex;
+    for (BYTE b : oid)
+    {
+        hex.Append("0123456789abcdef"[b >> 4]);
+        hex.Append("0123456789abcdef"[b & 0xf]);
+    }
+    CHECK(hex.Equal(head.Text()));
+
+    // After gc, the commit and trees are only in a pack.
+    CHECK(repo.Write(L"dir\\b.txt", "bb and more\n"));
+    CHECK(repo.Commit());
+    CHECK(repo.Git({ L"gc", L"-q" }));
+
+    RepoStatus status;
+    repo.InitStatus(status);
+    CHECK(ReadIndexStatus(status));
+    CHECK(status.status.empty());
+}
+
+/*
+ * Corrupt input.
+ */
+
+TEST(gitindex_truncated_index)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(MakeRepo(repo));
+
+    std::vector<BYTE> bytes;
+    CHECK(repo.ReadBytes(L".git\\index", bytes));
+
+    unsigned loaded = 0;
+    for (size_t len = 0; len < bytes.size(); ++len)
+    {
+        GitIndex index;
+        CHECK(repo.WriteBytes(L"truncated", std::vector<BYTE>(bytes.begin(), bytes.begin() + len)));
+        if (LoadIndex(repo, L"truncated", index))
+            ++loaded;
+    }
+    CHECK(!loaded);
+}
+
+TEST(gitindex_corrupt_index)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(MakeRepo(repo));
+    CHECK(repo.Git({ L"update-index", L"--index-version", L"4" }));
+
+    std::vector<BYTE> bytes;
+    CHECK(repo.ReadBytes(L".git\\index", bytes));
+
+    // Changing any byte anywhere fails the checksum (or the header check).
+    unsigned loaded = 0;
+    for (size_t ii = 0; ii < bytes.size(); ++ii)
+    {
+        GitIndex index;
+        std::vector<BYTE> corrupt(bytes);
+        corrupt[ii] ^= 0x01;
+        CHECK(repo.WriteBytes(L"corrupt", corrupt));
+        if (LoadIndex(repo, L"corrupt", index))
+            ++loaded;
+    }
+    CHECK(!loaded);
+
+    // An entry count that's too large can't be trusted to reserve memory.
+    std::vector<BYTE> huge(bytes);
+    huge[8] = huge[9] = huge[10] = huge[11] = 0xff;
+    CHECK(repo.WriteBytes(L"huge", huge));
+    GitIndex index;
+    CHECK(!LoadIndex(repo, L"huge", index));
+}
+
+TEST(gitindex_corrupt_objects)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+    CHECK(MakeRepo(repo));
+
+    // Staging a change invalidates the cached trees for dir and the root, so
+    // those trees have to be read from the object store.
+    CHECK(repo.Write(L"dir\\b.txt", "staged\n"));
+    CHECK(repo.Git({ L"add", L"dir\\b.txt" }));
+
+    // A truncated or modified loose object fails cleanly, whether it's the
+    // commit or a tree.
+    for (const WCHAR* rev : { L"HEAD", L"HEAD^{tree}", L"HEAD:dir" })
+    {
+        StrW rel;
+        std::vector<BYTE> bytes;
+        CHECK(repo.ObjectPath(rev, rel));
+        CHECK(repo.ReadBytes(rel.Text(), bytes));
+
+        std::vector<BYTE> truncated(bytes.begin(), bytes.begin() + bytes.size() / 2);
+        CHECK(repo.WriteBytes(rel.Text(), truncated));
+        RepoStatus status;
+        repo.InitStatus(status);
+        CHECK(!ReadIndexStatus(status));
+
+        std::vector<BYTE> corrupt(bytes);
+        corrupt[corrupt.size() / 2] ^= 0x01;
+        CHECK(repo.WriteBytes(rel.Text(), corrupt));
+        RepoStatus status2;
+        repo.InitStatus(status2);
+        CHECK(!ReadIndexStatus(status2));
+
+        CHECK(repo.WriteBytes(rel.Text(), bytes));
+        RepoStatus status3;
+        repo.InitStatus(status3);
+        CHECK(ReadIndexStatus(status3));
+        CHECK(status3.status.size() == 1);
+    }
+
+    // Likewise for a truncated pack (git puts the commits and trees first,
+    // so cut into the first object).
+    CHECK(repo.Git({ L"gc", L"-q" }));
+
+    StrW spec;
+    repo.Path(L".git\\objects\\pack\\pack-*.pack", spec);
+    WIN32_FIND_DATA fd;
+    SHFind shFind = FindFirstFile(spec.Text(), &fd);
+    CHECK(!shFind.Empty());
+    if (!shFind.Empty())
+    {
+        StrW rel;
+        std::vector<BYTE> bytes;
+        PathJoin(rel, L".git\\objects\\pack", fd.cFileName);
+        CHECK(repo.ReadBytes(rel.Text(), bytes));
+        bytes.resize(32);
+        CHECK(repo.WriteBytes(rel.Text(), bytes));
+
+        RepoStatus status;
+        repo.InitStatus(status);
+        CHECK(!ReadIndexStatus(status));
+    }
+}
+
+/*
+ * Inflate.
+ */
+
+TEST(inflate_loose_object)
+{
+    GitFixture repo;
+    if (!repo.Init())
+        SKIP("git not found");
+
+    // Repetitive text, so the stream uses back references.
+    StrA text;
+    for (int ii = 0; ii < 200; ++ii)
+        text.Append("the quick brown fox jumps over the lazy dog\n");
+    CHECK(repo.Write(L"fox.txt", text.Text()));
+
+    StrA hex;
+    CHECK(repo.Git({ L"hash-object", L"-w", L"fox.txt" }, &hex));
+
+    StrW rel;
+    std::vector<BYTE> bytes;
+    rel.Set(L".git\\objects\\");
+    for (unsigned ii = 0; ii < hex.Length(); ++ii)
+    {
+        if (ii == 2)
+            rel.Append('\\');
+        rel.Append(WCHAR(hex.Text()[ii]));
+    }
+    CHECK(repo.ReadBytes(rel.Text(), bytes));
+
+    StrA expected;
+    expected.Printf("blob %u", text.Length());
+    std::vector<BYTE> out;
+    CHECK(InflateZlib(bytes.data(), bytes.size(), out));
+    CHECK(out.size() == expected.Length() + 1 + text.Length());
+    CHECK(out.size() > expected.Length() && memcmp(out.data(), expected.Text(), expected.Length() + 1) == 0);
+    CHECK(out.size() == expected.Length() + 1 + text.Length() && memcmp(out.data() + expected.Length() + 1, text.Text(), text.Length()) == 0);
+
+    // Decoding stops early at max_out.
+    std::vector<BYTE> partial;
+    CHECK(InflateZlib(bytes.data(), bytes.size(), partial, 10));
+    CHECK(partial.size() >= 10 && partial.size() < text.Length());
+
+    // Anything short of the end of the deflate stream (everything but the
+    // 4 byte checksum) is truncated.
+    unsigned decoded = 0;
+    for (size_t len = 0; len + 4 < bytes.size(); ++len)
+    {
+        std::vector<BYTE> truncated;
+        if (InflateZlib(bytes.data(), len, truncated))
+            ++decoded;
+    }
+    CHECK(!decoded);
+}
+
+TEST(inflate_garbage)
+{
+    // Random input must fail or succeed cleanly, without crashing or
+    // reading past the end of the input.
+    DWORD seed = 12345;
+    for (int ii = 0; ii < 10000; ++ii)
+    {
+        std::vector<BYTE> in(ii % 300);
+        for (auto& b : in)
+        {
+            seed = seed * 1103515245 + 12345;
+            b = BYTE(seed >> 16);
+        }
+
+        std::vector<BYTE> out;
+        Inflate(in.data(), in.size(), out, 1 << 20);
+        InflateZlib(in.data(), in.size(), out, 1 << 20);
+    }
+}
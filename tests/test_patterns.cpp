@@ -0,0 +1,56 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "tests.h"
+#include "patterns.h"
+
+static const WCHAR c_root[] = L"c:\\repo";
+static const WCHAR c_dir[] = L"c:\\repo\\src";
+
+// A negated pattern un-ignores a file that an earlier pattern ignored, and
+// the last matching pattern decides.  Before, negations were only applied
+// after SetPattern() had added one, so for patterns added any other way
+// (Insert, Append, or Load from a .gitignore file) keep.log was ignored.
+TEST(patterns_negation)
+{
+    GlobPatterns patterns;
+    patterns.SetRoot(c_root);
+    patterns.Append(L"*.log");
+    patterns.Append(L"!keep.log");
+
+    CHECK(patterns.IsMatch(c_dir, L"build.log", false));
+    CHECK(!patterns.IsMatch(c_dir, L"keep.log", false));
+    CHECK(!patterns.IsMatch(c_dir, L"keep.txt", false));
+
+    // A later pattern can ignore the file again.
+    patterns.Append(L"keep.*");
+    CHECK(patterns.IsMatch(c_dir, L"keep.log", false));
+}
+
+// Negations are applied the same way whether the candidates come from the
+// name bucket, the extension bucket, or the residual list.
+TEST(patterns_negation_buckets)
+{
+    GlobPatterns patterns;
+    patterns.SetRoot(c_root);
+    patterns.Append(L"tmp*");
+    patterns.Append(L"!tmp.txt");
+    patterns.Append(L"!*.c");
+    patterns.Append(L"generated.c");
+
+    CHECK(patterns.IsMatch(c_dir, L"tmp1", false));
+    CHECK(!patterns.IsMatch(c_dir, L"tmp.txt", false));
+    CHECK(!patterns.IsMatch(c_dir, L"tmp.c", false));
+    CHECK(patterns.IsMatch(c_dir, L"generated.c", false));
+    CHECK(!patterns.IsMatch(c_dir, L"main.c", false));
+
+    // Changing a pattern reindexes the list.
+    patterns.SetPattern(3, L"!tmp1");
+    CHECK(!patterns.IsMatch(c_dir, L"tmp1", false));
+    CHECK(!patterns.IsMatch(c_dir, L"generated.c", false));
+    patterns.SwapWithNext(0);
+    CHECK(patterns.IsMatch(c_dir, L"tmp.txt", false));
+}
@@ -0,0 +1,133 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// Tests and benchmarks for RegExp, the matcher for :: patterns.  std::wregex
+// is the reference:  RegExp must match exactly the same names.
+
+#include "pch.h"
+#include "tests.h"
+#include "regexp.h"
+
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+static const std::regex_constants::syntax_option_type c_syntax =
+    std::regex_constants::ECMAScript | std::regex_constants::icase | std::regex_constants::optimize;
+
+static bool SearchStd(const std::wregex& re, const WCHAR* s)
+{
+    std::wcmatch matches;
+    return std::regex_search(s, s + wcslen(s), matches, re, std::regex_constants::match_default);
+}
+
+TEST(regexp_matches_wregex)
+{
+    static const WCHAR* const c_patterns[] =
+    {
+        L"abc", L"^abc", L"abc$", L"^abc$", L"a.c", L"a*b", L"^(foo|bar)\\.txt$",
+        L"[a-c]+x", L"[^a-c]x$", L"\\d{2,3}", L"x(yz)?w", L"^$", L"", L"a|b|^c",
+        L"(a|ab)(c|bcd)(d*)", L"\\.(cpp|h)$", L"^[\\w]+\\s", L"a{3}", L"a{2,}b",
+        L"(?:ab)+$", L"$x", L"a^b", L"(a$|b)c", L"a[ab]{11}$", L"b.{10}a",
+        L"\\.(log|tmp)$", L"^ABC", L"\\bab",
+    };
+    static const WCHAR* const c_names[] =
+    {
+        L"abc", L"ABC", L"foo.txt", L"Bar.TXT", L"x.cpp", L"aab", L"build.log",
+        L"notes.tmp", L"12", L"xyzw", L"xw", L"",
+    };
+    static const char c_alphabet[] = "abcx.1";
+
+    std::mt19937 rng(1);
+    for (const WCHAR* pattern : c_patterns)
+    {
+        RegExp re;
+        Error e;
+        CHECK(re.Compile(pattern, e));
+        const std::wregex std_re(pattern, c_syntax);
+
+        std::vector<std::wstring> names(std::begin(c_names), std::end(c_names));
+        for (unsigned ii = 0; ii < 2000; ++ii)
+        {
+            std::wstring name;
+            for (unsigned len = rng() % 30; len--;)
+                name += WCHAR(c_alphabet[rng() % (_countof(c_alphabet) - 1)]);
+            names.push_back(std::move(name));
+        }
+
+        for (const auto& name : names)
+            CHECK(re.Match(name.c_str(), unsigned(name.length())) == SearchStd(std_re, name.c_str()));
+    }
+
+    // Only constructs the automaton can't handle fall back to std::wregex.
+    {
+        RegExp re;
+        Error e;
+        CHECK(re.Compile(L"\\.(log|tmp)$", e));
+        CHECK(re.IsAutomaton());
+        RegExp fallback;
+        CHECK(fallback.Compile(L"(a)\\1", e));
+        CHECK(!fallback.IsAutomaton());
+        RegExp bad;
+        CHECK(!bad.Compile(L"(a", e));
+    }
+}
+
+// Compares a recursive listing filtered by :: patterns (for example
+// "dirx -s ::\.(log|tmp)$") before and after RegExp:  it used to compile a
+// std::wregex for each directory, and run std::regex_search on each name.
+BENCHMARK(regexp_vs_wregex)
+{
+    static const WCHAR* const c_patterns[] =
+    {
+        L"\\.(log|tmp)$", L"^test.*\\.cpp$", L"a.*b.*c",
+    };
+
+    const unsigned c_dirs = 3000;
+    const unsigned c_files = 100;
+
+    std::vector<StrW> names(c_files);
+    for (unsigned ii = 0; ii < c_files; ++ii)
+    {
+        static const WCHAR* const c_exts[] = { L"txt", L"log", L"cpp", L"tmp", L"h", L"md" };
+        names[ii].Printf(L"%s_file%u.%s", (ii % 7) ? L"src" : L"test", ii, c_exts[ii % _countof(c_exts)]);
+    }
+
+    for (const WCHAR* pattern : c_patterns)
+    {
+        StrA text;
+        StrA label;
+        text.SetW(pattern);
+        unsigned matches_std = 0;
+        unsigned matches_re = 0;
+
+        BenchTimer timer;
+        for (unsigned dir = 0; dir < c_dirs; ++dir)
+        {
+            const std::wregex std_re(pattern, c_syntax);
+            for (const auto& name : names)
+                matches_std += SearchStd(std_re, name.Text());
+        }
+        label.Set("std::wregex ");
+        label.Append(text);
+        BenchResult(label.Text(), c_dirs, timer.Milliseconds());
+
+        timer.Start();
+        RegExp re;
+        Error e;
+        CHECK(re.Compile(pattern, e));
+        for (unsigned dir = 0; dir < c_dirs; ++dir)
+        {
+            for (const auto& name : names)
+                matches_re += re.Match(name.Text(), name.Length());
+        }
+        label.Set("RegExp ");
+        label.Append(text);
+        BenchResult(label.Text(), c_dirs, timer.Milliseconds());
+
+        CHECK(matches_re == matches_std);
+    }
+}
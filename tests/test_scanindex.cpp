@@ -0,0 +1,336 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// Tests and benchmarks for the scan index (--index).  Each one builds a
+// scratch directory tree in the temporary directory.
+
+#include "pch.h"
+#include "tests.h"
+#include "scanindex.h"
+#include "enumdir.h"
+#include "filesys.h"
+
+#include <memory>
+#include <vector>
+
+// One hour, in FILETIME units.
+static const ULONGLONG c_hour = 60ull * 60 * 10000000;
+
+namespace
+{
+
+// ScratchDir is a temporary directory, which is deleted (with everything in
+// it) when the fixture is destroyed.
+class ScratchDir
+{
+public:
+                        ScratchDir() = default;
+                        ~ScratchDir();
+
+    bool                Init();
+    bool                MakeDir(const WCHAR* rel) const;
+    bool                Write(const WCHAR* rel) const;
+    bool                Backdate(const WCHAR* rel) const;
+
+    void                Path(const WCHAR* rel, StrW& out) const { PathJoin(out, m_root.Text(), rel); }
+
+private:
+    static void         RemoveTree(const WCHAR* dir);
+
+    StrW                m_root;
+};
+
+}; // namespace
+
+ScratchDir::~ScratchDir()
+{
+    if (!m_root.Empty())
+        RemoveTree(m_root.Text());
+}
+
+bool ScratchDir::Init()
+{
+    WCHAR temp[MAX_PATH];
+    if (!GetTempPath(_countof(temp), temp))
+        return false;
+
+    static unsigned s_count = 0;
+    StrW name;
+    name.Printf(L"dirx_tests_index_%u_%u", GetCurrentProcessId(), ++s_count);
+    PathJoin(m_root, temp, name);
+    if (!CreateDirectory(m_root.Text(), nullptr))
+    {
+        m_root.Clear();
+        return false;
+    }
+    return true;
+}
+
+bool ScratchDir::MakeDir(const WCHAR* rel) const
+{
+    StrW dir;
+    Path(rel, dir);
+    return !!CreateDirectory(dir.Text(), nullptr);
+}
+
+// Creates an empty file.
+bool ScratchDir::Write(const WCHAR* rel) const
+{
+    StrW path;
+    Path(rel, path);
+    SHFile h = CreateFile(path.Text(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    return !h.Empty();
+}
+
+// Sets a directory's last write time an hour in the past, so that creating a
+// file in it afterwards is sure to change the time, however coarse the file
+// system's timestamps are.
+bool ScratchDir::Backdate(const WCHAR* rel) const
+{
+    StrW dir;
+    Path(rel, dir);
+    SHFile h = CreateFile(dir.Text(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    if (h.Empty())
+        return false;
+
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    ULARGE_INTEGER time;
+    time.LowPart = ft.dwLowDateTime;
+    time.HighPart = ft.dwHighDateTime;
+    time.QuadPart -= c_hour;
+    ft.dwLowDateTime = time.LowPart;
+    ft.dwHighDateTime = time.HighPart;
+    return !!SetFileTime(h, nullptr, nullptr, &ft);
+}
+
+void ScratchDir::RemoveTree(const WCHAR* dir)
+{
+    StrW spec;
+    PathJoin(spec, dir, L"*");
+
+    WIN32_FIND_DATA fd;
+    SHFind shFind = FindFirstFile(spec.Text(), &fd);
+    if (!shFind.Empty())
+    {
+        do
+        {
+            if (IsPseudoDirectory(fd.cFileName))
+                continue;
+
+            StrW path;
+            PathJoin(path, dir, fd.cFileName);
+            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                RemoveTree(path.Text());
+            }
+            else
+            {
+                SetFileAttributes(path.Text(), FILE_ATTRIBUTE_NORMAL);
+                DeleteFile(path.Text());
+            }
+        }
+        while (FindNextFile(shFind, &fd));
+    }
+
+    RemoveDirectory(dir);
+}
+
+static std::unique_ptr<DirListing> Enumerate(DirEnumerator& enumerator, const WCHAR* dir)
+{
+    std::unique_ptr<DirListing> listing = std::make_unique<DirListing>();
+    listing->spec.Set(dir);
+    EnsureTrailingSlash(listing->spec);
+    listing->spec.Append('*');
+    listing->Enumerate(enumerator, false);
+    return listing;
+}
+
+// Gets the listing for dir the way ScanFiles() does with an index:  replays
+// it if it's current, and otherwise enumerates and records it.
+static std::unique_ptr<DirListing> ListDir(ScanIndex& index, DirEnumerator& enumerator, const WCHAR* dir, bool* replayed=nullptr)
+{
+    std::unique_ptr<DirListing> listing = index.Replay(dir, false);
+    if (replayed)
+        *replayed = !!listing;
+    if (!listing)
+    {
+        listing = Enumerate(enumerator, dir);
+        index.Record(dir, *listing);
+    }
+    return listing;
+}
+
+static bool SameEntries(const DirListing& a, const DirListing& b)
+{
+    if (a.entries.size() != b.entries.size())
+        return false;
+
+    for (size_t ii = 0; ii < a.entries.size(); ++ii)
+    {
+        const DirEntry& x = a.entries[ii];
+        const DirEntry& y = b.entries[ii];
+        if (x.name_len != y.name_len || wcscmp(x.name, y.name) ||
+            x.attributes != y.attributes || x.size != y.size ||
+            CompareFileTime(&x.modified, &y.modified))
+            return false;
+    }
+    return true;
+}
+
+TEST(scanindex_replay)
+{
+    ScratchDir scratch;
+    CHECK(scratch.Init());
+    CHECK(scratch.MakeDir(L"tree"));
+    CHECK(scratch.Write(L"tree\\a.txt"));
+    CHECK(scratch.Write(L"tree\\b.txt"));
+    CHECK(scratch.MakeDir(L"tree\\sub"));
+    CHECK(scratch.Backdate(L"tree"));
+
+    // The index is outside the tree, so that writing it doesn't change the
+    // tree's timestamps.
+    StrW tree;
+    StrW path;
+    scratch.Path(L"tree", tree);
+    scratch.Path(L"index", path);
+
+    std::unique_ptr<DirEnumerator> enumerator = MakeDirEnumerator();
+    bool replayed;
+    Error e;
+
+    // A missing index is empty.
+    {
+        ScanIndex index;
+        CHECK(index.Open(path.Text(), e));
+        ListDir(index, *enumerator, tree.Text(), &replayed);
+        CHECK(!replayed);
+        CHECK(index.Save(e));
+    }
+
+    // An unchanged directory is replayed, with the same entries as a fresh
+    // enumeration.
+    {
+        ScanIndex index;
+        CHECK(index.Open(path.Text(), e));
+        CHECK(index.IsCurrent(tree.Text(), false));
+        CHECK(!index.IsCurrent(tree.Text(), true));
+        std::unique_ptr<DirListing> listing = ListDir(index, *enumerator, tree.Text(), &replayed);
+        CHECK(replayed);
+        CHECK(SameEntries(*listing, *Enumerate(*enumerator, tree.Text())));
+        CHECK(index.Save(e));
+    }
+
+    // Listings for directories that weren't scanned are carried over.
+    {
+        ScanIndex index;
+        CHECK(index.Open(path.Text(), e));
+        CHECK(index.Save(e));
+    }
+
+    // Creating a file changes the directory's timestamp, so it's enumerated
+    // again, and the new listing is what gets replayed next time.
+    CHECK(scratch.Write(L"tree\\c.txt"));
+    for (bool again : { false, true })
+    {
+        ScanIndex index;
+        CHECK(index.Open(path.Text(), e));
+        std::unique_ptr<DirListing> listing = ListDir(index, *enumerator, tree.Text(), &replayed);
+        CHECK(replayed == again);
+        CHECK(listing->Lookup(L"c.txt"));
+        CHECK(SameEntries(*listing, *Enumerate(*enumerator, tree.Text())));
+        CHECK(index.Save(e));
+    }
+
+    // An index that isn't valid is treated as empty.
+    {
+        SHFile h = CreateFile(path.Text(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+        CHECK(!h.Empty());
+        DWORD written;
+        CHECK(WriteFile(h, "not an index", 12, &written, nullptr));
+    }
+    {
+        ScanIndex index;
+        CHECK(index.Open(path.Text(), e));
+        ListDir(index, *enumerator, tree.Text(), &replayed);
+        CHECK(!replayed);
+        CHECK(index.Save(e));
+    }
+}
+
+// Compares warm and cold runs over a tree of 1M files (1000 directories with
+// 1000 files each).  Creating and deleting the tree takes a while, and isn't
+// timed.  The OS caches the directories during the first pass, so "cold" here
+// means an empty index, not a cold file system cache.
+BENCHMARK(scanindex_1m)
+{
+    ScratchDir scratch;
+    CHECK(scratch.Init());
+    CHECK(scratch.MakeDir(L"tree"));
+
+    const unsigned c_dirs = 1000;
+    const unsigned c_files = 1000;
+    std::vector<StrW> dirs(c_dirs);
+    for (unsigned ii = 0; ii < c_dirs; ++ii)
+    {
+        StrW rel;
+        rel.Printf(L"tree\\dir%u", ii);
+        CHECK(scratch.MakeDir(rel.Text()));
+        for (unsigned jj = 0; jj < c_files; ++jj)
+        {
+            StrW file;
+            file.Printf(L"%s\\file%u.txt", rel.Text(), jj);
+            CHECK(scratch.Write(file.Text()));
+        }
+        CHECK(scratch.Backdate(rel.Text()));
+        scratch.Path(rel.Text(), dirs[ii]);
+    }
+
+    StrW path;
+    scratch.Path(L"index", path);
+    std::unique_ptr<DirEnumerator> enumerator = MakeDirEnumerator();
+    Error e;
+
+    BenchTimer timer;
+    for (const auto& dir : dirs)
+        Enumerate(*enumerator, dir.Text());
+    BenchResult("enumerate, no index", 1, timer.Milliseconds());
+
+    // Runs a scan of the tree with the index, and returns how many of the
+    // directories were replayed.
+    const auto scan = [&]()
+    {
+        unsigned replayed_count = 0;
+        ScanIndex index;
+        CHECK(index.Open(path.Text(), e));
+        for (const auto& dir : dirs)
+        {
+            bool replayed;
+            ListDir(index, *enumerator, dir.Text(), &replayed);
+            replayed_count += replayed;
+        }
+        CHECK(index.Save(e));
+        return replayed_count;
+    };
+
+    timer.Start();
+    CHECK(scan() == 0);
+    BenchResult("cold index", 1, timer.Milliseconds());
+
+    timer.Start();
+    CHECK(scan() == c_dirs);
+    BenchResult("warm index, nothing changed", 1, timer.Milliseconds());
+
+    for (unsigned ii = 0; ii < c_dirs; ii += 100)
+    {
+        StrW rel;
+        rel.Printf(L"tree\\dir%u\\new.txt", ii);
+        CHECK(scratch.Write(rel.Text()));
+    }
+
+    timer.Start();
+    CHECK(scan() == c_dirs - c_dirs / 100);
+    BenchResult("warm index, 1% of directories changed", 1, timer.Milliseconds());
+}
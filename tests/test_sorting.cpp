@@ -0,0 +1,205 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "tests.h"
+#include "sorting.h"
+#include "fileinfo.h"
+#include "direntry.h"
+#include "flags.h"
+#include "error.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Names with several dots (and without any), so that the name and extension
+// split differently than the whole name sorts.
+static const WCHAR* const c_names[] =
+{
+    L"ab.c.d", L"ab.e", L"a.b.c", L"ab", L"AB.c.D", L"ab.c", L"a.b", L"a",
+    L"b.a", L"abc.a.z", L"ab-c.d", L"ab.d.c", L"a.bc", L".hidden", L"x.",
+    L"file10.txt", L"file9.txt", L"FILE9.TXT.bak", L"readme", L"README.md",
+};
+
+static const WCHAR* const c_dirs[] =
+{
+    L"ab.c", L"dir.x.y", L"Dir", L"a.b.c.d",
+};
+
+static void MakeFiles(std::vector<std::unique_ptr<FileInfo>>& files, const DirFormatSettings& settings)
+{
+    files.clear();
+
+    unsigned ii = 0;
+    auto add = [&](const WCHAR* name, DWORD attributes)
+    {
+        DirEntry entry = {};
+        entry.name = name;
+        entry.short_name = L"";
+        entry.name_len = unsigned(wcslen(name));
+        entry.attributes = attributes;
+        entry.size = (ii * 7) % 5;
+        entry.modified.dwLowDateTime = (ii * 3) % 4;
+
+        std::unique_ptr<FileInfo> pfi = std::make_unique<FileInfo>();
+        pfi->Init(L"c:\\", 0, &entry, settings);
+        files.emplace_back(std::move(pfi));
+        ++ii;
+    };
+
+    for (const WCHAR* name : c_names)
+        add(name, FILE_ATTRIBUTE_NORMAL);
+    for (const WCHAR* name : c_dirs)
+        add(name, FILE_ATTRIBUTE_DIRECTORY);
+}
+
+// SortFiles() must order the files exactly like std::stable_sort with
+// CmpFileInfo(), for each sort order.
+TEST(sorting_matches_cmpfileinfo)
+{
+    DirFormatSettings settings;
+    g_settings = &settings;
+
+    static const WCHAR* const c_orders[] =
+    {
+        L"n", L"ne", L"en", L"-n", L"e-n", L"gne", L"gen", L"sn", L"sne", L"dn", L"dne",
+    };
+
+    for (const WCHAR* order : c_orders)
+    {
+        Error e;
+        SetSortOrder(order, e);
+        CHECK(!e.Test());
+
+        std::vector<std::unique_ptr<FileInfo>> expected;
+        std::vector<std::unique_ptr<FileInfo>> actual;
+        MakeFiles(expected, settings);
+        MakeFiles(actual, settings);
+
+        std::stable_sort(expected.begin(), expected.end(), CmpFileInfo);
+        SortFiles(actual);
+
+        bool same = (expected.size() == actual.size());
+        for (size_t ii = 0; same && ii < expected.size(); ++ii)
+        {
+            same = (expected[ii]->GetLongName().Equal(actual[ii]->GetLongName()) &&
+                    expected[ii]->GetAttributes() == actual[ii]->GetAttributes());
+        }
+        if (!same)
+            printf("    sort order '%ls'\n", order);
+        CHECK(same);
+    }
+
+    Error e;
+    SetSortOrder(L"", e);
+    g_settings = nullptr;
+}
+
+// With an explicit 'e', the name sorts without its extension:  "ab.e" has
+// name "ab" and "ab.c.d" has name "ab.c", so "ab.e" comes first.
+TEST(sorting_explicit_extension)
+{
+    DirFormatSettings settings;
+    g_settings = &settings;
+
+    std::vector<std::unique_ptr<FileInfo>> files;
+    auto names = [&files]()
+    {
+        StrW s;
+        for (const auto& pfi : files)
+        {
+            if (s.Length())
+                s.Append(' ');
+            s.Append(pfi->GetLongName());
+        }
+        return s;
+    };
+
+    Error e;
+    SetSortOrder(L"n", e);
+    MakeFiles(files, settings);
+    files.resize(2);
+    SortFiles(files);
+    CHECK(names().Equal(L"ab.c.d ab.e"));
+
+    SetSortOrder(L"ne", e);
+    MakeFiles(files, settings);
+    files.resize(2);
+    SortFiles(files);
+    CHECK(names().Equal(L"ab.e ab.c.d"));
+
+    SetSortOrder(L"", e);
+    g_settings = nullptr;
+}
+
+// Times SortFiles() against std::stable_sort with CmpFileInfo() on large
+// directories of pseudo-random names.
+BENCHMARK(sorting_large)
+{
+    DirFormatSettings settings;
+    g_settings = &settings;
+
+    static const WCHAR* const c_exts[] = { L"txt", L"cpp", L"h", L"tar.gz", L"", L"JPG", L"md" };
+
+    auto make = [&settings](std::vector<std::unique_ptr<FileInfo>>& files, unsigned count)
+    {
+        files.clear();
+        files.reserve(count);
+
+        DWORD seed = 12345;
+        StrW name;
+        for (unsigned ii = 0; ii < count; ++ii)
+        {
+            seed = seed * 1103515245 + 12345;
+            const WCHAR* ext = c_exts[(seed >> 8) % _countof(c_exts)];
+            name.Clear();
+            name.Printf(L"File_%u%s%s", seed >> 12, *ext ? L"." : L"", ext);
+
+            DirEntry entry = {};
+            entry.name = name.Text();
+            entry.short_name = L"";
+            entry.name_len = name.Length();
+            entry.attributes = FILE_ATTRIBUTE_NORMAL;
+            entry.size = seed % 100000;
+            entry.modified.dwLowDateTime = seed >> 4;
+
+            std::unique_ptr<FileInfo> pfi = std::make_unique<FileInfo>();
+            pfi->Init(L"c:\\", 0, &entry, settings);
+            files.emplace_back(std::move(pfi));
+        }
+    };
+
+    for (const WCHAR* order : { L"n", L"ne", L"sn" })
+    {
+        Error e;
+        SetSortOrder(order, e);
+        CHECK(!e.Test());
+
+        for (unsigned count : { 10000u, 100000u, 1000000u })
+        {
+            std::vector<std::unique_ptr<FileInfo>> files;
+            StrA label;
+
+            make(files, count);
+            BenchTimer timer;
+            SortFiles(files);
+            label.Clear();
+            label.Printf("SortFiles /o%ls, %u files", order, count);
+            BenchResult(label.Text(), 1, timer.Milliseconds());
+
+            make(files, count);
+            timer.Start();
+            std::stable_sort(files.begin(), files.end(), CmpFileInfo);
+            label.Clear();
+            label.Printf("CmpFileInfo /o%ls, %u files", order, count);
+            BenchResult(label.Text(), 1, timer.Milliseconds());
+        }
+    }
+
+    Error e;
+    SetSortOrder(L"", e);
+    g_settings = nullptr;
+}
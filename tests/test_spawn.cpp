@@ -0,0 +1,71 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+// Tests and benchmarks for running programs.  They use git as the child
+// program, and are skipped if git isn't on the PATH.
+
+#include "pch.h"
+#include "tests.h"
+#include "spawn.h"
+
+#include <vector>
+
+TEST(spawn_args)
+{
+    StrW git;
+    if (!FindOnPath(L"git.exe", git))
+        SKIP("git not found");
+
+    // "git rev-parse --sq-quote" echoes its arguments, so they can be
+    // compared after the round trip through the command line.
+    DWORD exit_code;
+    std::vector<char> out;
+    CHECK(RunProcess(git.Text(), { L"rev-parse", L"--sq-quote", L"a b", L"c\"d", L"e\\", L"f\\\"g", L"" }, out, &exit_code));
+    CHECK(exit_code == 0);
+
+    StrA text;
+    text.Set(out.data(), out.size());
+    text.TrimRight();
+    CHECK(text.Equal(" 'a b' 'c\"d' 'e\\' 'f\\\"g' ''"));
+
+    // The exit code is reported.
+    CHECK(RunProcess(git.Text(), { L"rev-parse", L"--verify", L"-q", L"no-such-rev" }, out, &exit_code));
+    CHECK(exit_code != 0);
+}
+
+// Compares RunProcess with _wpopen, which is what RunGitStatus() used before.
+// _wpopen starts cmd.exe, which then starts git.
+BENCHMARK(spawn_git_version)
+{
+    StrW git;
+    if (!FindOnPath(L"git.exe", git))
+        SKIP("git not found");
+
+    const unsigned c_iterations = 50;
+
+    BenchTimer timer;
+    for (unsigned ii = 0; ii < c_iterations; ++ii)
+    {
+        std::vector<char> out;
+        CHECK(RunProcess(git.Text(), { L"--version" }, out));
+    }
+    BenchResult("RunProcess git --version", c_iterations, timer.Milliseconds());
+
+    timer.Start();
+    for (unsigned ii = 0; ii < c_iterations; ++ii)
+    {
+        FILE* pipe = _wpopen(L"2>nul git.exe --version", L"rt");
+        CHECK(pipe);
+        if (pipe)
+        {
+            char buffer[256];
+            while (fgets(buffer, _countof(buffer), pipe))
+            {
+            }
+            _pclose(pipe);
+        }
+    }
+    BenchResult("_wpopen git --version", c_iterations, timer.Milliseconds());
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+// A minimal test harness.  TEST(name) defines a test and registers it,
+// CHECK(expr) records a failure and keeps going, and SKIP(reason) ends a test
+// that can't run here (for example, when git isn't on the PATH).
+//
+// BENCHMARK(name) defines a benchmark, which only runs with --bench.  It
+// times its own loops with BenchTimer and prints them with BenchResult().
+
+typedef void (*TestFunc)();
+
+struct TestRegistration
+{
+                        TestRegistration(const char* name, TestFunc func, bool bench=false);
+};
+
+void TestFailed(const char* file, int line, const char* expr);
+void TestSkipped(const char* reason);
+
+class BenchTimer
+{
+public:
+                        BenchTimer() { Start(); }
+    void                Start();
+    double              Milliseconds() const;
+private:
+    LARGE_INTEGER       m_start;
+};
+
+void BenchResult(const char* label, unsigned iterations, double ms);
+
+#define TEST(name) \
+    static void test_##name(); \
+    static TestRegistration s_register_##name(#name, test_##name); \
+    static void test_##name()
+
+#define BENCHMARK(name) \
+    static void bench_##name(); \
+    static TestRegistration s_register_##name(#name, bench_##name, true); \
+    static void bench_##name()
+
+#define CHECK(expr) \
+    do { if (!(expr)) TestFailed(__FILE__, __LINE__, #expr); } while (0)
+
+#define SKIP(reason) \
+    do { TestSkipped(reason); return; } while (0)
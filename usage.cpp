@@ -19,6 +19,7 @@ enum FlagSection
     FILTER,
     FIELD,
     FORMAT,
+    PERF,
     MAX
 };
 
@@ -94,6 +95,9 @@ static const FlagUsageInfo c_usage_info[] =
                                             "  fixed, gradient (default)\n" },
     { DISPLAY,  "--hyperlinks",             "Display entries as hyperlinks.\n" },
     { DISPLAY,  "--tree",                   "Tree mode; recursively display files and directories in a tree layout.\n" },
+    { DISPLAY,  "--flat",                   "Flat mode; recursively display files from all subdirectories as one "
+                                            "list, sorted together, with full paths.  Subdirectories are included (use "
+                                            "-a-d to list only files).\n" },
 
     // FILTERING AND SORTING OPTIONS -----------------------------------------
     { FILTER,   "-a[...]",                  "Display files with the specified attributes.  If attributes are combined, "
@@ -144,6 +148,9 @@ static const FlagUsageInfo c_usage_info[] =
     { FILTER,   "--numeric-sort",           "Sort in numeric order (\"2\" before \"10\") (default).\n" },
     { FILTER,   "--reverse",                "Reverse the selected sort order.\n" },
     { FILTER,   "--string-sort",            "Sort punctuation as symbols.\n" },
+    { FILTER,   "--top=N",                  "Display only the first N files in the sort order (for example, "
+                                            "'-os- --top=50' shows the 50 largest files).  With -s this finds the "
+                                            "first N files across all subdirectories, and lists them like --flat.\n" },
     { FILTER,   "--word-sort",              "Sort punctuation as part of the word (default).\n" },
 
     // FIELD OPTIONS ---------------------------------------------------------
@@ -219,6 +226,24 @@ static const FlagUsageInfo c_usage_info[] =
                                             "002e to use .. (two periods).\n" },
     { FORMAT,   "--utf8",                   "When output is redirected, produce UTF8 output instead of using the system "
                                             "codepage.\n" },
+
+    // PERFORMANCE OPTIONS ---------------------------------------------------
+    { PERF,     "--enum-buffer=KB",         "Size of the buffer for reading directory entries, from 64 to 1024 KB "
+                                            "(default is 64).  Larger buffers need fewer calls into the OS for large "
+                                            "directories, especially on network volumes.\n" },
+    { PERF,     "--threads=N",              "Number of threads to use for reading directories ahead of the "
+                                            "traversal when listing subdirectories recursively, up to 64 (default is 0, "
+                                            "which reads each directory when the traversal reaches it).  The output is "
+                                            "the same regardless.\n" },
+    { PERF,     "--index=PATH",             "Keep an index of directory listings in PATH, and reuse the listings "
+                                            "for directories whose modified time hasn't changed since the previous "
+                                            "run.  Changes to the contents of existing files don't update their "
+                                            "directory's modified time, so sizes and times of such files can be "
+                                            "out of date.\n" },
+    { PERF,     "--git-cache",              "Save git status in a file in each repo's .git directory, and reuse it "
+                                            "while the repo's index, HEAD, and directory listings haven't changed.\n" },
+    { PERF,     "--max-memory=MB",          "Memory to use for sorting files in --flat mode before spilling sorted "
+                                            "runs to temporary files (default is 256).\n" },
 };
 
 static const char c_usage_prolog[] =
@@ -415,6 +440,7 @@ StrA MakeUsageString(bool alphabetical, unsigned flag_col_width)
                 case FILTER:    u.Append("\nFILTERING AND SORTING OPTIONS:\n"); break;
                 case FIELD:     u.Append("\nFIELD OPTIONS:\n"); break;
                 case FORMAT:    u.Append("\nFORMATTING OPTIONS:\n"); break;
+                case PERF:      u.Append("\nPERFORMANCE OPTIONS:\n"); break;
                 }
             }
 
@@ -0,0 +1,75 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#include "pch.h"
+#include "volume.h"
+#include "filesys.h"
+#include "output.h"
+
+#include <memory>
+#include <unordered_map>
+
+static std::unordered_map<const WCHAR*, std::unique_ptr<VolumeInfo>, HashCaseless, EqualCaseless> s_volumes; // Keys point into VolumeInfo::drive.
+static unsigned s_count_hits = 0;
+static unsigned s_count_misses = 0;
+
+static void QueryVolume(VolumeInfo& info)
+{
+    StrW root;
+    root.Set(info.drive);
+    EnsureTrailingSlash(root);
+
+    DWORD cbComponentMax;
+    WCHAR volume_name[MAX_PATH + 1];
+    WCHAR fs_name[MAX_PATH + 1];
+    if (GetVolumeInformation(root.Text(), volume_name, _countof(volume_name), &info.serial_number, &cbComponentMax, 0, fs_name, _countof(fs_name)))
+    {
+        info.volume_name.Set(volume_name);
+        info.fat = (!wcsicmp(fs_name, L"FAT") && cbComponentMax == 12); // 12 == 8.3
+    }
+    else
+    {
+        info.info_err = GetLastError();
+    }
+
+    DWORD dwSectorsPerCluster;
+    DWORD dwBytesPerSector;
+    DWORD dwFreeClusters;
+    DWORD dwTotalClusters;
+    if (GetDiskFreeSpace(root.Text(), &dwSectorsPerCluster, &dwBytesPerSector, &dwFreeClusters, &dwTotalClusters))
+        info.granularity = dwSectorsPerCluster * dwBytesPerSector;
+
+    info.have_free_space = !!SHGetDiskFreeSpace(root.Text(), &info.free_to_caller, &info.total_size, &info.total_free);
+}
+
+const VolumeInfo* GetVolumeInfo(const WCHAR* path, Error& e)
+{
+    StrW drive;
+    if (!GetDrive(path, drive, e))
+        return nullptr;
+
+    const auto& iter = s_volumes.find(drive.Text());
+    if (iter != s_volumes.end())
+    {
+        ++s_count_hits;
+        return iter->second.get();
+    }
+
+    ++s_count_misses;
+
+    std::unique_ptr<VolumeInfo> info = std::make_unique<VolumeInfo>();
+    info->drive = std::move(drive);
+    QueryVolume(*info);
+
+    const VolumeInfo* volume = info.get();
+    s_volumes.emplace(volume->drive.Text(), std::move(info));
+    return volume;
+}
+
+void DebugPrintVolumeCacheCounters()
+{
+    if (g_debug)
+        Printf(L"debug: volume cache: %u hit(s), %u miss(es)\n", s_count_hits, s_count_misses);
+}
@@ -0,0 +1,35 @@
+// Copyright (c) 2024 by Christopher Antos
+// License: http://opensource.org/licenses/MIT
+
+// vim: set et ts=4 sw=4 cino={0s:
+
+#pragma once
+
+#include <windows.h>
+#include "str.h"
+
+class Error;
+
+// VolumeInfo holds the volume metadata needed while listing directories.
+// It is queried once per volume per run, rather than once per directory.
+//
+// The cache is keyed by the drive string from GetDrive(), so a volume that
+// is mounted in a folder shares the metadata of the drive containing it.
+struct VolumeInfo
+{
+    StrW                drive;              // As returned by GetDrive().
+    DWORD               info_err = 0;       // Why GetVolumeInformation failed, if it did.
+    StrW                volume_name;
+    DWORD               serial_number = 0;
+    bool                fat = false;
+    DWORD               granularity = 0;    // Cluster size, or 0 if unknown.
+    bool                have_free_space = false;
+    ULARGE_INTEGER      free_to_caller;
+    ULARGE_INTEGER      total_size;
+    ULARGE_INTEGER      total_free;
+};
+
+// Returns nullptr (and sets e if appropriate) if GetDrive() fails.
+// Only for use on the main thread.
+const VolumeInfo* GetVolumeInfo(const WCHAR* path, Error& e);
+void DebugPrintVolumeCacheCounters();
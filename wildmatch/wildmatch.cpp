@@ -17,3 +17,131 @@ bool match(const std::wstring& pattern, const std::wstring& string, int flags)
 }
 
 }
+
+/* begin_dirx_change */
+namespace wild {
+
+static inline WCHAR fold(WCHAR ch)
+{
+    if (ch < 128)
+        return (ch >= 'A' && ch <= 'Z') ? WCHAR(ch + ('a' - 'A')) : ch;
+    return WCHAR(towlower(ch));
+}
+
+void program::compile(const WCHAR *pattern, int flags)
+{
+    compile(pattern, wcslen(pattern), flags);
+}
+
+void program::compile(const WCHAR *pattern, size_t len, int flags)
+{
+    /* WILDSTAR implies PATHNAME. */
+    if (flags & WILDSTAR)
+        flags |= PATHNAME;
+
+    m_pattern.assign(pattern, len);
+    pattern = m_pattern.c_str();
+    m_literal.clear();
+    m_flags = flags;
+    m_shape = shape::general;
+
+    /* Backslash is left to wildmatch() whether it's an escape or not. */
+    const WCHAR *special = wcspbrk(pattern, L"*?[\\");
+    if (!special) {
+        m_shape = shape::literal;
+        m_literal = pattern;
+    } else if (*special == '*' && !wcspbrk(special + 1, L"*?[\\") &&
+               !(flags & PERIOD)) {
+        if (!special[1]) {
+            m_shape = shape::prefix;
+            m_literal.assign(pattern, special - pattern);
+        } else if (special == pattern && !wcschr(special + 1, '/') &&
+                   ((flags & PATHNAME) || !(flags & LEADING_DIR))) {
+            m_shape = shape::suffix;
+            m_literal = special + 1;
+        }
+    }
+
+    if (flags & CASEFOLD) {
+        for (auto& ch : m_literal)
+            ch = fold(ch);
+    }
+}
+
+inline bool program::is_slash(WCHAR ch) const
+{
+    return (ch == '/') || ((m_flags & SLASHFOLD) && ch == '\\');
+}
+
+/*
+ * Compares the start of string with m_literal.  A slash in the literal matches
+ * either slash if SLASHFOLD.  The literal contains no NUL, so a mismatch stops
+ * before reading past the end of string.
+ */
+bool program::equal_literal(const WCHAR *string) const
+{
+    const WCHAR *lit = m_literal.c_str();
+    const size_t len = m_literal.length();
+
+    if (!(m_flags & (CASEFOLD|SLASHFOLD)))
+        return wcsncmp(string, lit, len) == 0;
+
+    const bool casefold = !!(m_flags & CASEFOLD);
+    const bool slashfold = !!(m_flags & SLASHFOLD);
+    for (size_t i = 0; i < len; ++i) {
+        WCHAR ch = string[i];
+        if (ch == lit[i])
+            continue;
+        if (slashfold && ch == '\\')
+            ch = '/';
+        else if (casefold)
+            ch = fold(ch);
+        if (ch != lit[i])
+            return false;
+    }
+    return true;
+}
+
+bool program::match(const WCHAR *string) const
+{
+    switch (m_shape) {
+    case shape::literal:
+        if (!equal_literal(string))
+            return false;
+        string += m_literal.length();
+        return !*string || ((m_flags & LEADING_DIR) && is_slash(*string));
+
+    case shape::prefix:
+        if (!equal_literal(string))
+            return false;
+        /* The star matches the rest, unless it has a slash. */
+        if (!(m_flags & PATHNAME) || (m_flags & LEADING_DIR))
+            return true;
+        for (string += m_literal.length(); *string; ++string) {
+            if (is_slash(*string))
+                return false;
+        }
+        return true;
+
+    case shape::suffix:
+        {
+            /* The literal has no slash and the star can't match a slash, so
+             * only the first path component can match. */
+            const bool pathname = !!(m_flags & PATHNAME);
+            const WCHAR *end = string;
+            while (*end && !(pathname && is_slash(*end)))
+                ++end;
+            if (*end && !(m_flags & LEADING_DIR))
+                return false;
+            if (size_t(end - string) < m_literal.length())
+                return false;
+            return equal_literal(end - m_literal.length());
+        }
+
+    default:
+        return wildmatch(m_pattern.c_str(), string, m_flags) == WM_MATCH;
+    }
+}
+
+}
+/* end_dirx_change */
@@ -12,6 +12,9 @@ constexpr int PERIOD = 0x04; /* Period must be matched by period. */
 constexpr int LEADING_DIR = 0x08; /* Ignore /<tail> after Imatch. */
 constexpr int CASEFOLD = 0x10; /* Case insensitive search. */
 constexpr int WILDSTAR = 0x40; /* Double-asterisks "**" matches slash too. */
+/* begin_dirx_change */
+constexpr int SLASHFOLD = 0x80; /* Slash and backslash are equivalent in string. */
+/* end_dirx_change */
 /* WILDSTAR implies PATHNAME so that single-asterisks "*" can be used for
  * matching within path components.
  */
@@ -31,4 +34,43 @@ constexpr int WILDSTAR = 0x40; /* Double-asterisks "**" matches slash too. */
 bool match(const WCHAR *pattern, const WCHAR *string, int flags=WILDSTAR);
 bool match(const std::wstring& pattern, const std::wstring& string, int flags=WILDSTAR);
 
+/* begin_dirx_change */
+/*
+ * wild::program compiles a pattern and flags once, for matching against many
+ * strings.  Patterns that are a plain literal ("foo"), a star followed by a
+ * literal ("*.ext"), or a literal followed by a star ("prefix*") are matched
+ * by direct comparisons against a pre-folded copy of the literal.  All other
+ * patterns are matched by wildmatch().
+ *
+ *  wild::program prog(L"*.obj", wild::WILDSTAR | wild::CASEFOLD);
+ *  if (prog.match(str)) {
+ *      // matched
+ *  }
+ */
+class program {
+public:
+    program() = default;
+    program(const WCHAR *pattern, int flags=WILDSTAR) { compile(pattern, flags); }
+
+    void compile(const WCHAR *pattern, int flags=WILDSTAR);
+    void compile(const WCHAR *pattern, size_t len, int flags);
+    bool match(const WCHAR *string) const;
+
+    const std::wstring& pattern() const { return m_pattern; }
+    bool is_literal() const { return m_shape == shape::literal; }
+    bool is_suffix() const { return m_shape == shape::suffix; }
+
+private:
+    enum class shape { general, literal, suffix, prefix };
+
+    bool is_slash(WCHAR ch) const;
+    bool equal_literal(const WCHAR *string) const;
+
+    std::wstring m_pattern;
+    std::wstring m_literal;     /* Folded to lower case if CASEFOLD. */
+    int m_flags = WILDSTAR;
+    shape m_shape = shape::general;
+};
+/* end_dirx_change */
+
 } /* wild namespace */